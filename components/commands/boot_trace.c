@@ -0,0 +1,50 @@
+#include <stdio.h>
+#include <pthread.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_lit * json;
+    struct arg_end * end;
+} args;
+
+static void
+write_json(const char * data, size_t size)
+{
+  fwrite(data, 1, size, GM.log_file_pointer);
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.json->count > 0 ) {
+    pthread_mutex_lock(&GM.console_print_mutex);
+    gm_boot_trace_json(write_json);
+    fflush(GM.log_file_pointer);
+    pthread_mutex_unlock(&GM.console_print_mutex);
+  }
+  else
+    gm_boot_trace_report();
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.json = arg_lit0("j", "json", "Write Chrome trace-event JSON, for chrome://tracing or ui.perfetto.dev.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "boot_trace",
+    .help = "Display when each phase of startup began and how long it took.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
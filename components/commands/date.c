@@ -21,17 +21,11 @@ static struct {
 static void timezone_set(void)
 {
   char buffer[128];
-  size_t buffer_size = sizeof(buffer);
-  esp_err_t err = nvs_get_str(GM.nvs, "timezone", buffer, &buffer_size);
 
-  if (err) {
+  if (gm_nonvolatile_get("timezone", buffer, sizeof(buffer)) == GM_NOT_SET)
     unsetenv("TZ");
-    if (err != ESP_ERR_NVS_NOT_FOUND)
-      GM_FAIL("Error getting timezone: %s\n", esp_err_to_name(err));
-  }
-  else {
+  else
     setenv("TZ", buffer, 1);
-  }
 
   tzset();
 }
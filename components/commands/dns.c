@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_lit * ipv4;
+    struct arg_lit * ipv6;
+    struct arg_lit * cache;
+    struct arg_lit * flush;
+    struct arg_str * server;
+    struct arg_str * name;
+    struct arg_end * end;
+} args;
+
+// The resolver is only used in the select task, so the command's work is done there.
+static struct {
+  char	name[64];
+  char	server[INET6_ADDRSTRLEN];
+  int	family;
+  bool	flush;
+  bool	set_server;
+} request;
+
+static void
+resolved(const struct sockaddr_storage * addresses, size_t count, void * context)
+{
+  if ( count == 0 ) {
+    gm_printf("No addresses.\n");
+    return;
+  }
+  for ( size_t i = 0; i < count; i++ ) {
+    char buffer[INET6_ADDRSTRLEN];
+
+    if ( addresses[i].ss_family == AF_INET6 )
+      inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)&addresses[i])->sin6_addr, buffer, sizeof(buffer));
+    else
+      inet_ntop(AF_INET, &((const struct sockaddr_in *)&addresses[i])->sin_addr, buffer, sizeof(buffer));
+    gm_printf("%s\n", buffer);
+  }
+}
+
+static void
+start(void * data)
+{
+  if ( request.flush )
+    gm_dns_flush();
+
+  if ( request.set_server ) {
+    if ( gm_dns_server(request.server[0] ? request.server : NULL) != 0 )
+      gm_printf("%s isn't an IP address.\n", request.server);
+  }
+
+  if ( request.name[0] != '\0' ) {
+    if ( gm_dns_resolve(request.name, 0, request.family, resolved, 0) != 0 )
+      gm_printf("Out of memory.\n");
+  }
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.cache->count > 0 ) {
+    gm_dns_report();
+    return 0;
+  }
+
+  memset(&request, '\0', sizeof(request));
+  if ( args.ipv4->count > 0 )
+    request.family = AF_INET;
+  else if ( args.ipv6->count > 0 )
+    request.family = AF_INET6;
+  else
+    request.family = AF_UNSPEC;
+  request.flush = args.flush->count > 0;
+  if ( args.server->count > 0 ) {
+    request.set_server = true;
+    strlcpy(request.server, args.server->sval[0], sizeof(request.server));
+  }
+  if ( args.name->count > 0 )
+    strlcpy(request.name, args.name->sval[0], sizeof(request.name));
+
+  // The addresses are printed by the select task, after this returns.
+  gm_run(start, 0, GM_FAST);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.ipv4 = arg_lit0("4", NULL, "Only look up IPv4 addresses.");
+  args.ipv6 = arg_lit0("6", NULL, "Only look up IPv6 addresses.");
+  args.cache = arg_lit0("c", "cache", "List the cached answers.");
+  args.flush = arg_lit0("f", "flush", "Forget the cached answers.");
+  args.server = arg_str0("s", "server", "address", "Use this name server, or the network's if the address is \"\".");
+  args.name = arg_str0(NULL, NULL, "name", "Host name to look up.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "dns",
+    .help = "Look up a host name with the asynchronous resolver.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
@@ -68,6 +68,9 @@ static int nonvolatile(int argc, char * * argv)
     case GM_NOT_IN_PARAMETER_TABLE:
       gm_printf("Error: not in nonvolatileeter table: %s\n",  nonvolatile_args.name->sval[0]);
       return -1;
+    case GM_INVALID:
+      gm_printf("Error: not a valid value for %s: %s\n",  nonvolatile_args.name->sval[0], nonvolatile_args.value->sval[0]);
+      return -1;
     default:
       break;
     }
@@ -8,6 +8,7 @@
 
 static struct {
     struct arg_lit * ipv6;
+    struct arg_lit * list;
     struct arg_end * end;
 } args;
 
@@ -22,6 +23,10 @@ static int run(int argc, char * * argv)
     arg_print_errors(stderr, args.end, argv[0]);
       return 1;
   }
+  if ( args.list->count > 0 ) {
+    gm_port_control_protocol_report();
+    return 0;
+  }
   printf("\n"); 
   if ( args.ipv6->count > 0 )
     result = gm_port_control_protocol_request_mapping_ipv6();
@@ -32,12 +37,14 @@ static int run(int argc, char * * argv)
     inet_ntop(AF_INET6, m.external_address.s6_addr, buffer, sizeof(buffer));
     return 0;
   }
+  printf("The HTTPS port isn't forwarded unless the public_https parameter is 1.\n");
   return -1;
 }
 
 CONSTRUCTOR install(void)
 {
   args.ipv6 =  arg_lit0("6", NULL, "Use IPv6 (default IPv4)");
+  args.list =  arg_lit0("l", "list", "List the mappings and when they will be renewed.");
   args.end = arg_end(10);
   static const esp_console_cmd_t command = {
     .command = "pcp",
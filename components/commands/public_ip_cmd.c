@@ -7,12 +7,24 @@
 #include "generic_main.h"
 
 static struct {
+    struct arg_lit * statistics;
     struct arg_end * end;
 } args;
 
 int run(int argc, char * * argv)
 {
   char	data[128];
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+  if ( args.statistics->count > 0 ) {
+    gm_public_ipv4_report();
+    return 0;
+  }
+
   if ( gm_public_ipv4(data, sizeof(data)) == 0 ) {
     gm_printf("%s\n", data);
     return 0;
@@ -22,6 +34,7 @@ int run(int argc, char * * argv)
 
 CONSTRUCTOR install(void)
 {
+  args.statistics = arg_lit0("s", "statistics", "Show the success and latency of each site.");
   args.end = arg_end(10);
   static const esp_console_cmd_t command = {
     .command = "public_ip",
@@ -10,6 +10,7 @@
 
 static struct {
     struct arg_lit * ipv6;
+    struct arg_lit * statistics;
     struct arg_end * end;
 } args;
 
@@ -26,6 +27,11 @@ static int run(int argc, char * * argv)
       return 1;
   }
 
+  if ( args.statistics->count > 0 ) {
+    gm_stun_report();
+    return 0;
+  }
+
   result = gm_stun(args.ipv6->count > 0, (struct sockaddr *)&sock, 0);
   if ( result != 0 )
     return 1;
@@ -36,6 +42,7 @@ static int run(int argc, char * * argv)
 CONSTRUCTOR install(void)
 {
   args.ipv6 =  arg_lit0("6", NULL, "Use IPv6 (default IPv4)");
+  args.statistics = arg_lit0("s", "statistics", "Show the round-trip time of each server, and the NAT mapping.");
   args.end = arg_end(10);
   static const esp_console_cmd_t command = {
     .command = "stun",
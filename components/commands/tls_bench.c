@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <esp_console.h>
+#include <esp_timer.h>
+#include <esp_tls.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+// Measure the TLS handshake latency of the local HTTPS server. The first
+// connection makes a full handshake, and gets a session ticket. The rest resume
+// the session with the ticket, unless --full is given, in which case every one
+// of them makes a full handshake.
+
+static struct {
+    struct arg_lit * full;
+    struct arg_int * count;
+    struct arg_end * end;
+} args;
+
+typedef struct _latency {
+  int		count;
+  int64_t	minimum;
+  int64_t	maximum;
+  int64_t	total;
+} latency_t;
+
+static void
+record(latency_t * l, int64_t t)
+{
+  if ( l->count == 0 || t < l->minimum )
+    l->minimum = t;
+  if ( t > l->maximum )
+    l->maximum = t;
+  l->total += t;
+  l->count++;
+}
+
+static void
+report(const char * name, const latency_t * l)
+{
+  if ( l->count == 0 )
+    return;
+  gm_printf(
+   "%s handshakes: %d, microseconds: minimum %" PRId64 ", average %" PRId64 ", maximum %" PRId64 ".\n",
+   name,
+   l->count,
+   l->minimum,
+   l->total / l->count,
+   l->maximum);
+}
+
+static int run(int argc, char * * argv)
+{
+  const char *			certificate;
+  const char *			private_key;
+  int				count = 10;
+  esp_tls_client_session_t *	session = NULL;
+  latency_t			full = {};
+  latency_t			resumed = {};
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+  if ( args.count->count > 0 )
+    count = args.count->ival[0];
+
+  if ( gm_tls_server_certificate(&certificate, &private_key) != 0 ) {
+    gm_printf("There is no server certificate.\n");
+    return 1;
+  }
+
+  for ( int i = 0; i < count; i++ ) {
+    // The server's certificate is self-signed, so it's its own authority.
+    esp_tls_cfg_t cfg = {
+      .cacert_buf = (const unsigned char *)certificate,
+      .cacert_bytes = strlen(certificate) + 1,
+      .skip_common_name = true,
+      .timeout_ms = 10000,
+      .client_session = args.full->count > 0 ? NULL : session
+    };
+    esp_tls_t * tls = esp_tls_init();
+
+    if ( tls == NULL ) {
+      gm_printf("Out of memory.\n");
+      break;
+    }
+
+    const int64_t start = esp_timer_get_time();
+    const int result = esp_tls_conn_new_sync("127.0.0.1", 9, GM_HTTPS_PORT, &cfg, tls);
+    const int64_t latency = esp_timer_get_time() - start;
+
+    if ( result != 1 ) {
+      gm_printf("Connection %d failed.\n", i);
+      esp_tls_conn_destroy(tls);
+      continue;
+    }
+    record(cfg.client_session ? &resumed : &full, latency);
+
+    if ( session == NULL )
+      session = esp_tls_get_client_session(tls);
+
+    esp_tls_conn_destroy(tls);
+  }
+  if ( session )
+    esp_tls_free_client_session(session);
+
+  report("Full", &full);
+  report("Resumed", &resumed);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.full = arg_lit0(NULL, "full", "Don't resume sessions, make a full handshake every time.");
+  args.count = arg_int0("n", "count", "<n>", "Number of connections (default 10).");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "tls_bench",
+    .help = "Measure the HTTPS server's TLS handshake latency, full and resumed.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
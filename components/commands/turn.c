@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_lit * release;
+    struct arg_lit * statistics;
+    struct arg_str * username;
+    struct arg_str * password;
+    struct arg_str * peer;
+    struct arg_str * send;
+    struct arg_str * server;
+    struct arg_end * end;
+} args;
+
+// Peers and data are handled in the select task, so the command's work is done there.
+static struct {
+  struct sockaddr_storage	peer;
+  char				data[128];
+} request;
+
+static void
+allocated(bool success, const struct sockaddr * relayed, void * context)
+{
+  if ( !success )
+    gm_printf("TURN allocation failed.\n");
+}
+
+static void
+received(const struct sockaddr * peer, uint8_t * data, size_t size, void * context)
+{
+  gm_printf("TURN: %u bytes from a peer: %.*s\n", (unsigned int)size, (int)size, (const char *)data);
+}
+
+static void
+start(void * data)
+{
+  if ( gm_turn_peer((struct sockaddr *)&request.peer) != 0 ) {
+    gm_printf("There's no TURN allocation, or there are too many peers.\n");
+    return;
+  }
+  if ( request.data[0] != '\0' ) {
+    if ( gm_turn_send((struct sockaddr *)&request.peer, request.data, strlen(request.data)) != 0 )
+      gm_printf("The channel to the peer isn't bound yet.\n");
+  }
+}
+
+// Parse address:port, or [address]:port for IPv6.
+static int
+parse_address(const char * s, struct sockaddr_storage * address)
+{
+  char		host[INET6_ADDRSTRLEN];
+  const char *	colon = strrchr(s, ':');
+  size_t	length;
+
+  if ( colon == NULL )
+    return -1;
+  length = colon - s;
+  if ( s[0] == '[' && length > 2 && s[length - 1] == ']' ) {
+    s++;
+    length -= 2;
+  }
+  if ( length >= sizeof(host) )
+    return -1;
+  memcpy(host, s, length);
+  host[length] = '\0';
+
+  memset(address, '\0', sizeof(*address));
+  if ( inet_pton(AF_INET, host, &((struct sockaddr_in *)address)->sin_addr) == 1 ) {
+    address->ss_family = AF_INET;
+    ((struct sockaddr_in *)address)->sin_port = htons(atoi(colon + 1));
+  }
+  else if ( inet_pton(AF_INET6, host, &((struct sockaddr_in6 *)address)->sin6_addr) == 1 ) {
+    address->ss_family = AF_INET6;
+    ((struct sockaddr_in6 *)address)->sin6_port = htons(atoi(colon + 1));
+  }
+  else
+    return -1;
+  return 0;
+}
+
+static int run(int argc, char * * argv)
+{
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  if ( args.statistics->count > 0 ) {
+    gm_turn_report();
+    return 0;
+  }
+
+  if ( args.release->count > 0 ) {
+    gm_turn_release();
+    return 0;
+  }
+
+  if ( args.server->count > 0 ) {
+    char		server[64];
+    unsigned int	port = 3478;
+    char *		colon;
+
+    strlcpy(server, args.server->sval[0], sizeof(server));
+    if ( (colon = strchr(server, ':')) != NULL ) {
+      *colon = '\0';
+      port = atoi(colon + 1);
+    }
+    if ( gm_turn_allocate(
+     server,
+     port,
+     args.username->count > 0 ? args.username->sval[0] : "",
+     args.password->count > 0 ? args.password->sval[0] : "",
+     allocated,
+     received,
+     0) != 0 )
+      return 1;
+  }
+
+  if ( args.peer->count > 0 ) {
+    memset(&request, '\0', sizeof(request));
+    if ( parse_address(args.peer->sval[0], &request.peer) != 0 ) {
+      gm_printf("%s isn't address:port.\n", args.peer->sval[0]);
+      return 1;
+    }
+    if ( args.send->count > 0 )
+      strlcpy(request.data, args.send->sval[0], sizeof(request.data));
+    gm_run(start, 0, GM_FAST);
+  }
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.release = arg_lit0("r", "release", "Release the allocation.");
+  args.statistics = arg_lit0("s", "statistics", "Show the allocation, its channels, and the relayed traffic.");
+  args.username = arg_str0("u", "username", "name", "User name on the TURN server.");
+  args.password = arg_str0("p", "password", "password", "Password on the TURN server.");
+  args.peer = arg_str0(NULL, "peer", "address:port", "Bind a channel to this peer.");
+  args.send = arg_str0(NULL, "send", "text", "Send this text to the peer.");
+  args.server = arg_str0(NULL, NULL, "server[:port]", "Allocate a relayed address on this TURN server.");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "turn",
+    .help = "Relay packets through a TURN server.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
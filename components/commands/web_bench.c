@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_console.h>
+#include <esp_timer.h>
+#include <esp_http_server.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+// Measure whether static files keep flowing from the web server while a slow
+// handler is in flight. A slow request is started in another task, and then the
+// latency of fetching a static file is measured while it runs. With --sync, the
+// slow handler runs in the HTTP server task, for comparison.
+//
+// The slow handlers only answer while the command runs, and for no longer than
+// MAX_MILLISECONDS, so that they can't be used to tie up the web server.
+
+#define MAX_MILLISECONDS	10000
+
+static struct {
+    struct arg_lit * sync;
+    struct arg_int * count;
+    struct arg_int * milliseconds;
+    struct arg_end * end;
+} args;
+
+static volatile int64_t	slow_finished = 0;
+static volatile bool	running = false;
+static char		slow_url[64];
+
+static int
+slow(httpd_req_t * req, const gm_uri * uri)
+{
+  const char *	ms = gm_param(uri->params, COUNTOF(uri->params), "ms");
+  int		milliseconds = ms ? atoi(ms) : 2000;
+
+  if ( !running ) {
+    httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "Only while web_bench runs.");
+    return 0;
+  }
+  if ( milliseconds < 0 )
+    milliseconds = 0;
+  if ( milliseconds > MAX_MILLISECONDS )
+    milliseconds = MAX_MILLISECONDS;
+
+  vTaskDelay(pdMS_TO_TICKS(milliseconds));
+  httpd_resp_sendstr(req, "done");
+  return 0;
+}
+
+static void
+slow_request_task(void * parameter)
+{
+  char	buffer[16];
+
+  gm_web_get(slow_url, buffer, sizeof(buffer));
+  slow_finished = esp_timer_get_time();
+  vTaskDelete(NULL);
+}
+
+static int run(int argc, char * * argv)
+{
+  char		buffer[512];
+  int		count = 20;
+  int		milliseconds = 2000;
+  int		during = 0;
+  int		successes = 0;
+  int64_t	minimum = INT64_MAX;
+  int64_t	maximum = 0;
+  int64_t	total = 0;
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+  if ( args.count->count > 0 )
+    count = args.count->ival[0];
+  if ( args.milliseconds->count > 0 )
+    milliseconds = args.milliseconds->ival[0];
+  if ( milliseconds < 0 || milliseconds > MAX_MILLISECONDS ) {
+    gm_printf("The time must be from 0 to %d milliseconds.\n", MAX_MILLISECONDS);
+    return 1;
+  }
+  if ( running ) {
+    gm_printf("web_bench is already running.\n");
+    return 1;
+  }
+
+  snprintf(
+   slow_url,
+   sizeof(slow_url),
+   "http://127.0.0.1/%s?ms=%d",
+   args.sync->count > 0 ? "bench_slow_sync" : "bench_slow",
+   milliseconds);
+
+  slow_finished = 0;
+  running = true;
+  xTaskCreate(slow_request_task, "web_bench slow request", 8192, NULL, 3, NULL);
+  // Give the slow request time to reach its handler.
+  vTaskDelay(pdMS_TO_TICKS(100));
+
+  for ( int i = 0; i < count; i++ ) {
+    const int64_t start = esp_timer_get_time();
+    const int status = gm_web_get("http://127.0.0.1/index.html", buffer, sizeof(buffer));
+    const int64_t end = esp_timer_get_time();
+    const int64_t latency = end - start;
+
+    if ( status != 200 ) {
+      gm_printf("Fetch %d failed with status %d.\n", i, status);
+      continue;
+    }
+    if ( slow_finished == 0 || slow_finished > end )
+      during++;
+    if ( latency < minimum )
+      minimum = latency;
+    if ( latency > maximum )
+      maximum = latency;
+    total += latency;
+    successes++;
+  }
+  while ( slow_finished == 0 )
+    vTaskDelay(pdMS_TO_TICKS(10));
+  running = false;
+
+  gm_printf(
+   "%s slow handler: %d of %d static fetches finished while it was in flight.\n",
+   args.sync->count > 0 ? "Synchronous" : "Asynchronous",
+   during,
+   count);
+  if ( successes > 0 )
+    gm_printf(
+     "Static fetch latency of %d successful fetches, microseconds: minimum %" PRId64 ", average %" PRId64 ", maximum %" PRId64 ".\n",
+     successes,
+     minimum,
+     total / successes,
+     maximum);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t slow_handler = {
+    .name = "bench_slow",
+    .handler = slow,
+    .asynchronous = true
+  };
+  static gm_web_handler_t slow_sync_handler = {
+    .name = "bench_slow_sync",
+    .handler = slow
+  };
+
+  gm_web_handler_register(&slow_handler, GET);
+  gm_web_handler_register(&slow_sync_handler, GET);
+
+  args.sync = arg_lit0(NULL, "sync", "Run the slow handler synchronously, for comparison.");
+  args.count = arg_int0("n", "count", "<n>", "Number of static fetches (default 20).");
+  args.milliseconds = arg_int0("t", "time", "<ms>", "Duration of the slow handler (default 2000, at most 10000).");
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "web_bench",
+    .help = "Measure static file latency while a slow web handler is in flight.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
@@ -0,0 +1,40 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <esp_console.h>
+#include <argtable3/argtable3.h>
+#include "generic_main.h"
+
+static struct {
+    struct arg_end * end;
+} args;
+
+static int run(int argc, char * * argv)
+{
+  const gm_web_writer_statistics_t * s = &gm_web_writer_statistics;
+
+  int nerrors = arg_parse(argc, argv, (void **) &args);
+  if (nerrors) {
+    arg_print_errors(stderr, args.end, argv[0]);
+      return 1;
+  }
+
+  gm_printf("responses: %" PRIu32 ", sends: %" PRIu32 ", bytes: %" PRIu64 "\n", s->responses, s->sends, s->bytes);
+  if ( s->responses > 0 && s->sends > 0 )
+    gm_printf("sends per response: %" PRIu32 ", bytes per send: %" PRIu64 "\n", s->sends / s->responses, s->bytes / s->sends);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  args.end = arg_end(10);
+  static const esp_console_cmd_t command = {
+    .command = "web_stats",
+    .help = "Display the number of sends and bytes used by the web server's responses.",
+    .hint = NULL,
+    .func = &run,
+    .argtable = &args
+  };
+
+  gm_command_register(&command);
+}
@@ -5,6 +5,7 @@
 #include "generic_main.h"
 
 static struct {
+    struct arg_lit * async;
     struct arg_str * url;
     struct arg_end * end;
 } args;
@@ -14,6 +15,17 @@ static void web_data_coroutine(const char * data, size_t size)
   gm_printf("%s", data);
 }
 
+static ssize_t async_body(gm_http_request_t * request, const char * data, size_t size, void * context)
+{
+  gm_printf("%.*s", (int)size, data);
+  return size;
+}
+
+static void async_done(gm_http_request_t * request, int status, void * context)
+{
+  gm_printf("\nStatus: %d\n", status);
+}
+
 static int run(int argc, char * * argv)
 {
   int nerrors = arg_parse(argc, argv, (void **) &args);
@@ -22,7 +34,13 @@ static int run(int argc, char * * argv)
       return 1;
   }
 
-  gm_web_get_with_coroutine(args.url->sval[0], web_data_coroutine);
+  if ( args.async->count > 0 ) {
+    // The page is printed by the select task, after this returns.
+    if ( gm_http_get(args.url->sval[0], async_body, async_done, 0) == NULL )
+      gm_printf("Can't fetch that URL.\n");
+  }
+  else
+    gm_web_get_with_coroutine(args.url->sval[0], web_data_coroutine);
 
   return 0;
 }
@@ -31,6 +49,7 @@ static int run(int argc, char * * argv)
 CONSTRUCTOR install()
 {
 
+  args.async = arg_lit0(NULL, "async", "Use the asynchronous client in the select task.");
   args.url  = arg_str1(NULL, NULL, "url", "URL to retrieve.");
   args.end = arg_end(10);
   static const esp_console_cmd_t command = {
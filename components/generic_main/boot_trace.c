@@ -0,0 +1,197 @@
+// Boot tracer.
+//
+// Records when each phase of startup begins and ends, in esp_timer_get_time()
+// microseconds since boot, so that it can be seen where the time to come up goes.
+// The phases of initialize() in generic_main.c and the steps of connecting in
+// wifi.c are recorded, and so is each command and web handler that's registered
+// by a CONSTRUCTOR function before main(). A constructor's time is taken to be
+// from the end of the one before it, so that each gets its share.
+//
+// Events are kept in a fixed buffer. When it's full, later ones are dropped, which
+// only loses what happens long after boot. Recording takes a slot with an atomic
+// increment and needs no lock, so it works from any task, and from constructors
+// before the scheduler runs. A slot is marked filled, with release ordering, only
+// after its contents are written, and readers skip slots that aren't filled yet.
+//
+// gm_boot_trace_json() writes the timeline as Chrome trace-event JSON, which
+// chrome://tracing and ui.perfetto.dev display. The names must be string constants
+// that need no JSON escaping.
+//
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+#define NUMBER_OF_EVENTS	96
+#define NUMBER_OF_THREADS	16
+
+typedef struct _boot_event {
+  const char *	category;
+  const char *	name;
+  const char *	task;
+  int64_t	start;
+  int64_t	duration;	// -1 for an instant.
+  bool		filled;
+} boot_event_t;
+
+static boot_event_t	events[NUMBER_OF_EVENTS];
+static int		number_of_events = 0;
+static int64_t		last_constructor = 0;
+
+static void
+record(const char * category, const char * name, int64_t start, int64_t duration)
+{
+  const int	n = __atomic_fetch_add(&number_of_events, 1, __ATOMIC_RELAXED);
+
+  if ( n >= NUMBER_OF_EVENTS ) {
+    __atomic_store_n(&number_of_events, NUMBER_OF_EVENTS, __ATOMIC_RELAXED);
+    return;
+  }
+  boot_event_t * const e = &events[n];
+
+  e->category = category;
+  e->name = name;
+  // Constructors run before the scheduler, when there's no current task.
+  if ( xTaskGetSchedulerState() == taskSCHEDULER_NOT_STARTED )
+    e->task = "startup";
+  else
+    e->task = pcTaskGetName(NULL);
+  e->start = start;
+  e->duration = duration;
+  __atomic_store_n(&e->filled, true, __ATOMIC_RELEASE);
+}
+
+// The event in slot i, or NULL if it's still being recorded.
+static const boot_event_t *
+filled_event(int i)
+{
+  const boot_event_t * const e = &events[i];
+
+  return __atomic_load_n(&e->filled, __ATOMIC_ACQUIRE) ? e : NULL;
+}
+
+static int
+event_count(void)
+{
+  const int n = __atomic_load_n(&number_of_events, __ATOMIC_RELAXED);
+
+  return n < NUMBER_OF_EVENTS ? n : NUMBER_OF_EVENTS;
+}
+
+// A phase that began at start and has just ended.
+void
+gm_boot_trace_phase(const char * name, int64_t start)
+{
+  record("phase", name, start, esp_timer_get_time() - start);
+}
+
+// Something that happened just now.
+void
+gm_boot_trace_event(const char * category, const char * name)
+{
+  record(category, name, esp_timer_get_time(), -1);
+}
+
+// A CONSTRUCTOR function registered something. Call from the registration function.
+void
+gm_boot_trace_constructor(const char * category, const char * name)
+{
+  const int64_t now = esp_timer_get_time();
+
+  record(category, name, last_constructor ? last_constructor : now, last_constructor ? now - last_constructor : 0);
+  last_constructor = now;
+}
+
+// Write the timeline as Chrome trace-event JSON.
+void
+gm_boot_trace_json(gm_boot_trace_write_t write)
+{
+  static const char	header[] = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+  static const char	trailer[] = "]}\n";
+  const char *	threads[NUMBER_OF_THREADS] = {};
+  int		number_of_threads = 0;
+  const int	count = event_count();
+  bool		first = true;
+  char		buffer[192];
+  int		length;
+
+  (*write)(header, sizeof(header) - 1);
+
+  for ( int i = 0; i < count; i++ ) {
+    const boot_event_t * const	e = filled_event(i);
+    int				tid;
+
+    if ( e == NULL )
+      continue;
+
+    if ( !first )
+      (*write)(",\n", 2);
+    first = false;
+
+    // Each task is a thread of the trace, named by a metadata event.
+    for ( tid = 0; tid < number_of_threads; tid++ ) {
+      if ( strcmp(threads[tid], e->task) == 0 )
+        break;
+    }
+    if ( tid == number_of_threads && number_of_threads < NUMBER_OF_THREADS ) {
+      threads[number_of_threads++] = e->task;
+      length = snprintf(
+       buffer,
+       sizeof(buffer),
+       "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+       tid,
+       e->task);
+      (*write)(buffer, length);
+    }
+
+    if ( e->duration < 0 )
+      length = snprintf(
+       buffer,
+       sizeof(buffer),
+       "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"ts\":%" PRId64 ",\"pid\":1,\"tid\":%d}",
+       e->name,
+       e->category,
+       e->start,
+       tid);
+    else
+      length = snprintf(
+       buffer,
+       sizeof(buffer),
+       "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%" PRId64 ",\"dur\":%" PRId64 ",\"pid\":1,\"tid\":%d}",
+       e->name,
+       e->category,
+       e->start,
+       e->duration,
+       tid);
+    if ( length >= sizeof(buffer) )
+      length = sizeof(buffer) - 1;
+    (*write)(buffer, length);
+  }
+  (*write)(trailer, sizeof(trailer) - 1);
+}
+
+void
+gm_boot_trace_report(void)
+{
+  const int count = event_count();
+
+  gm_printf("   Start(ms) Length(ms) Category     Task             Name\n");
+  for ( int i = 0; i < count; i++ ) {
+    const boot_event_t * const e = filled_event(i);
+
+    if ( e == NULL )
+      continue;
+
+    gm_printf("%12.3f ", e->start / 1000.0);
+    if ( e->duration < 0 )
+      gm_printf("%10s ", "");
+    else
+      gm_printf("%10.3f ", e->duration / 1000.0);
+    gm_printf("%-12s %-16s %s\n", e->category, e->task, e->name);
+  }
+  if ( event_count() >= NUMBER_OF_EVENTS )
+    gm_printf("The trace buffer is full. Later events weren't recorded.\n");
+}
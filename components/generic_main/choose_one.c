@@ -9,3 +9,60 @@ size_t gm_choose_one(size_t number_of_entries)
   
   return random % number_of_entries;
 }
+
+// Success rate over expected latency. Those that haven't been tried do well, so
+// that they will be.
+static uint32_t
+score(const gm_choice_statistics_t * s, uint32_t untried_latency, uint32_t latency_offset)
+{
+  const uint32_t latency = s->average_latency ? s->average_latency : untried_latency;
+
+  return ((s->successes + 1) * 100000) / ((s->attempts + 1) * (latency + latency_offset));
+}
+
+static bool
+was_chosen(const int * chosen, size_t number_chosen, int i)
+{
+  for ( size_t n = 0; n < number_chosen; n++ ) {
+    if ( chosen[n] == i )
+      return true;
+  }
+  return false;
+}
+
+// Choose up to number_to_choose of the count servers or sites whose statistics
+// are given: the best-scoring ones, and then one more at random, so that the
+// others are tried now and then. untried_latency is assumed for those with no
+// average latency yet, and latency_offset is added to every latency, so that a
+// small difference between fast ones doesn't outweigh their success rates.
+// Returns the number chosen.
+size_t
+gm_choose_best(const gm_choice_statistics_t * statistics, size_t count, uint32_t untried_latency, uint32_t latency_offset, int * chosen, size_t number_to_choose)
+{
+  size_t n = 0;
+
+  for ( ; n + 1 < number_to_choose && n < count; n++ ) {
+    int best = -1;
+
+    for ( int j = 0; j < count; j++ ) {
+      if ( was_chosen(chosen, n, j) )
+        continue;
+      if ( best < 0
+       || score(&statistics[j], untried_latency, latency_offset) > score(&statistics[best], untried_latency, latency_offset) )
+        best = j;
+    }
+    chosen[n] = best;
+  }
+
+  if ( n < number_to_choose && n < count ) {
+    size_t r = gm_choose_one(count - n);
+
+    for ( int j = 0; j < count; j++ ) {
+      if ( !was_chosen(chosen, n, j) && r-- == 0 ) {
+        chosen[n++] = j;
+        break;
+      }
+    }
+  }
+  return n;
+}
@@ -15,6 +15,7 @@ gm_command_register(const esp_console_cmd_t * command)
     array = gm_array_create();
   }
   gm_array_add(array, (const void *)command);
+  gm_boot_trace_constructor("command", command->command);
 }
 
 static int
@@ -5,8 +5,6 @@
 #include "generic_main.h"
 #include "compressed_fs.h"
 
-static const uint32_t	maximum_chunk_size = 4096;
-
 // The embedded filesystem.
 extern const unsigned int	fs_length;
 extern const char fs[];
@@ -22,26 +20,20 @@ http_root_handler(httpd_req_t *req)
   return ESP_OK;
 }
 
-static void
-send_chunks(httpd_req_t * req, const char * data, uint32_t size)
-{
-  while ( size > 0 ) {
-    uint32_t chunk_size = size;
-
-    if ( chunk_size > maximum_chunk_size )
-      chunk_size = maximum_chunk_size;
-
-    httpd_resp_send_chunk(req, data, chunk_size);
-    size -= chunk_size;
-    data += chunk_size;
-  }
-  httpd_resp_send_chunk(req, "", 0);
-}
+// Files are sent with the web response writer. The data of uncompressed files and
+// of files sent compressed is pointed to in FLASH, and goes out with the headers in
+// a single writev(), with a Content-Length rather than chunk framing. The HTTP
+// server task runs one handler at a time, so one writer is enough.
+static gm_web_writer_t	writer;
 
 static int
 process_decompressed_data(const void * data, int length, void * context)
 {
-  send_chunks((httpd_req_t *)context, data, length);
+  gm_web_writer_t * const w = (gm_web_writer_t *)context;
+
+  // The decompressor reuses its buffer after this returns, so send it now.
+  if ( gm_web_writer_constant(w, data, length) != 0 || gm_web_writer_flush(w) != 0 )
+    return 0; // Failure code, stop decompressing.
   return 1; // Success code.
 }
 
@@ -50,8 +42,17 @@ send_uncompressed_file(httpd_req_t * req, const char * fs, const struct compress
 {
   size_t	size = e->compressed_size;
 
-  tinfl_decompress_mem_to_callback(fs + e->data_offset, &size, process_decompressed_data, req, TINFL_FLAG_PARSE_ZLIB_HEADER);
-  httpd_resp_send_chunk(req, "", 0);
+  gm_web_writer_begin(&writer, req, 0, 0, -1);
+  tinfl_decompress_mem_to_callback(fs + e->data_offset, &size, process_decompressed_data, &writer, TINFL_FLAG_PARSE_ZLIB_HEADER);
+  gm_web_writer_finish(&writer);
+}
+
+static void
+send_file_data(httpd_req_t * req, const char * data, uint32_t size, const char * encoding)
+{
+  gm_web_writer_begin(&writer, req, 0, encoding, size);
+  gm_web_writer_constant(&writer, data, size);
+  gm_web_writer_finish(&writer);
 }
 
 static void
@@ -62,11 +63,10 @@ read_file(httpd_req_t * req, const char * fs, const struct compressed_fs_entry *
 
   switch ( e->method ) {
   case ZERO_LENGTH:
-    httpd_resp_send_chunk(req, "", 0);
+    send_file_data(req, "", 0, 0);
     break;
   case NONE:
-    send_chunks(req, fs + e->data_offset, e->size);
-    httpd_resp_send_chunk(req, "", 0);
+    send_file_data(req, fs + e->data_offset, e->size, 0);
     break;
   case ZLIB:
 
@@ -82,15 +82,12 @@ read_file(httpd_req_t * req, const char * fs, const struct compressed_fs_entry *
           break;
         default:
           send_uncompressed_file(req, fs, e);
-          httpd_resp_send_chunk(req, "", 0);
           return;
         }
       }
     }
     // Send the data compressed, and allow the browser to decompress it.
-    httpd_resp_set_hdr(req, "Content-Encoding", "deflate");
-    send_chunks(req, fs + e->data_offset, e->compressed_size);
-    httpd_resp_send_chunk(req, "", 0);
+    send_file_data(req, fs + e->data_offset, e->compressed_size, "deflate");
     break;
   }
 }
@@ -0,0 +1,727 @@
+// Asynchronous DNS stub resolver.
+//
+// getaddrinfo() blocks the task that calls it until the name server answers, or
+// until it gives up, which can be many seconds. That's not acceptable in the select
+// task, which runs everything else. gm_dns_resolve() sends the queries on a
+// non-blocking UDP socket that's watched by the select task with gm_fd_register(),
+// and calls back when the answers arrive.
+//
+// When both IPv4 and IPv6 addresses are wanted, the A and AAAA queries are sent
+// at the same time, on the same socket, rather than one after the other.
+//
+// Answers are cached for their time-to-live, so that repeated lookups of the same
+// name, like those of the STUN servers and public IP sites, don't go to the network
+// at all. Names that don't exist, or that don't have an address of the requested
+// type, are cached too, for the time the zone's SOA record says to, so that an
+// IPv4-only site doesn't cost an AAAA query every time.
+//
+// The name servers are the ones lwIP got from DHCP, then the ones from the IPv6
+// router advertisement. If one doesn't answer, the next is tried. gm_dns_server()
+// overrides them, which is for testing with host/dns_server.c.
+//
+// Everything here runs in the select task, and so needs no locking.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <lwip/sockets.h>
+#include <lwip/dns.h>
+#include <esp_random.h>
+#include <esp_timer.h>
+#include "generic_main.h"
+
+#define CACHE_SIZE		16
+#define MAX_ADDRESSES		4	// Of each type, for each name.
+#define NAME_SIZE		64
+#define PACKET_SIZE		512	// The largest UDP DNS message without EDNS.
+#define TRY_TIMEOUT		2	// Seconds to wait for a server before trying the next.
+#define TRIES			3
+#define MIN_TTL			5	// Seconds.
+#define MAX_TTL			(24 * 60 * 60)
+#define NEGATIVE_TTL		60	// For a negative answer without an SOA record.
+#define MAX_NEGATIVE_TTL	(5 * 60)
+#define DNS_PORT		53
+
+enum dns_type {
+  TYPE_A = 1,
+  TYPE_SOA = 6,
+  TYPE_AAAA = 28
+};
+
+enum dns_class {
+  CLASS_IN = 1
+};
+
+enum dns_rcode {
+  RCODE_NOERROR = 0,
+  RCODE_NXDOMAIN = 3
+};
+
+// Flags in the header, in host byte order.
+enum dns_flags {
+  FLAG_RESPONSE = 0x8000,
+  FLAG_RECURSION_DESIRED = 0x0100,
+  FLAG_RCODE = 0x000f
+};
+
+typedef struct _dns_header {
+  uint16_t	id;
+  uint16_t	flags;
+  uint16_t	question_count;
+  uint16_t	answer_count;
+  uint16_t	authority_count;
+  uint16_t	additional_count;
+} dns_header_t;
+
+// Addresses are kept as 16 bytes, with IPv4 addresses in the first 4.
+typedef struct _answer {
+  uint8_t	count;
+  uint8_t	addresses[MAX_ADDRESSES][16];
+} answer_t;
+
+typedef struct _cache_entry {
+  char		name[NAME_SIZE];
+  uint16_t	type;
+  int64_t	expires; // esp_timer_get_time() microseconds. Zero if the entry is empty.
+  int64_t	last_used;
+  answer_t	answer; // A count of zero is a negative answer.
+} cache_entry_t;
+
+typedef struct _question {
+  uint16_t	type;
+  uint16_t	id;
+  bool		wanted;
+  bool		answered;
+  answer_t	answer;
+} question_t;
+
+typedef struct _query {
+  char				name[NAME_SIZE];
+  uint16_t			port;
+  int				fd;
+  int				server; // Index of the server that was asked last.
+  int				tries;
+  struct sockaddr_storage	server_address;
+  question_t			questions[2]; // A, then AAAA.
+  gm_dns_after_t		after;
+  void *			context;
+} query_t;
+
+static cache_entry_t		cache[CACHE_SIZE] = {};
+static struct sockaddr_storage	server_override = {};
+
+static void	receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
+static void	send_queries(query_t * q);
+
+static cache_entry_t *
+cache_find(const char * name, uint16_t type)
+{
+  const int64_t	now = esp_timer_get_time();
+
+  for ( int i = 0; i < CACHE_SIZE; i++ ) {
+    cache_entry_t * const e = &cache[i];
+
+    if ( e->expires > now && e->type == type && strcasecmp(e->name, name) == 0 ) {
+      e->last_used = now;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+static void
+cache_add(const char * name, uint16_t type, const answer_t * answer, uint32_t ttl)
+{
+  const int64_t		now = esp_timer_get_time();
+  cache_entry_t *	e = NULL;
+
+  // Replace the same name and type, or an expired entry, or the least-recently used.
+  for ( int i = 0; i < CACHE_SIZE; i++ ) {
+    cache_entry_t * const candidate = &cache[i];
+
+    if ( candidate->type == type && strcasecmp(candidate->name, name) == 0 ) {
+      e = candidate;
+      break;
+    }
+    if ( e == NULL || (e->expires > now && (candidate->expires <= now || candidate->last_used < e->last_used)) )
+      e = candidate;
+  }
+  strcpy(e->name, name);
+  e->type = type;
+  e->answer = *answer;
+  e->expires = now + ttl * 1000000LL;
+  e->last_used = now;
+}
+
+// Get the name servers to ask. Returns the number of them.
+static int
+servers(struct sockaddr_storage * s, int size)
+{
+  int	count = 0;
+
+  if ( server_override.ss_family != AF_UNSPEC ) {
+    s[0] = server_override;
+    return 1;
+  }
+
+  for ( int i = 0; i < DNS_MAX_SERVERS && count < size; i++ ) {
+    const ip_addr_t * const	a = dns_getserver(i);
+
+    if ( a == NULL || ip_addr_isany(a) )
+      continue;
+
+    memset(&s[count], '\0', sizeof(s[count]));
+    if ( IP_IS_V6(a) ) {
+      struct sockaddr_in6 * const in6 = (struct sockaddr_in6 *)&s[count];
+
+      in6->sin6_family = AF_INET6;
+      in6->sin6_port = htons(DNS_PORT);
+      memcpy(&in6->sin6_addr, ip_2_ip6(a)->addr, sizeof(in6->sin6_addr));
+      in6->sin6_scope_id = ip6_addr_zone(ip_2_ip6(a));
+    }
+    else {
+      struct sockaddr_in * const in = (struct sockaddr_in *)&s[count];
+
+      in->sin_family = AF_INET;
+      in->sin_port = htons(DNS_PORT);
+      in->sin_addr.s_addr = ip_2_ip4(a)->addr;
+    }
+    count++;
+  }
+
+  // Then the ones from the router advertisement, which lwIP only takes when it's
+  // built with LWIP_ND6_RDNSS_MAX_DNS_SERVERS.
+  if ( GM.sta.ip6.ra.dns_lifetime == 0 )
+    return count;
+  for ( int i = 0; i < (int)(sizeof(GM.sta.ip6.ra.dns) / sizeof(*GM.sta.ip6.ra.dns)) && count < size; i++ ) {
+    const struct in6_addr * const	a = &GM.sta.ip6.ra.dns[i];
+    struct sockaddr_in6 * const		in6 = (struct sockaddr_in6 *)&s[count];
+    bool				duplicate = false;
+
+    if ( gm_all_zeroes(a->s6_addr, sizeof(a->s6_addr)) )
+      continue;
+    for ( int j = 0; j < count; j++ ) {
+      if ( s[j].ss_family == AF_INET6
+       && memcmp(&((struct sockaddr_in6 *)&s[j])->sin6_addr, a, sizeof(*a)) == 0 )
+        duplicate = true;
+    }
+    if ( duplicate )
+      continue;
+
+    memset(&s[count], '\0', sizeof(s[count]));
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(DNS_PORT);
+    memcpy(&in6->sin6_addr, a, sizeof(in6->sin6_addr));
+    if ( a->s6_addr[0] == 0xfe && (a->s6_addr[1] & 0xc0) == 0x80 )
+      in6->sin6_scope_id = esp_netif_get_netif_impl_index(GM.sta.esp_netif);
+    count++;
+  }
+  return count;
+}
+
+static bool
+same_address(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
+{
+  if ( a->ss_family != b->ss_family )
+    return false;
+
+  if ( a->ss_family == AF_INET6 ) {
+    const struct sockaddr_in6 * const a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 * const b6 = (const struct sockaddr_in6 *)b;
+
+    return a6->sin6_port == b6->sin6_port
+     && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+  }
+  else {
+    const struct sockaddr_in * const a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in * const b4 = (const struct sockaddr_in *)b;
+
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+}
+
+// Write the name as DNS labels. Returns the length, or -1 if it isn't a valid name.
+static int
+encode_name(const char * name, uint8_t * buffer, size_t size)
+{
+  size_t	length = 0;
+
+  while ( *name != '\0' ) {
+    const size_t label = strcspn(name, ".");
+
+    if ( label == 0 || label > 63 || length + 1 + label + 1 > size )
+      return -1;
+
+    buffer[length++] = label;
+    memcpy(&buffer[length], name, label);
+    length += label;
+    name += label;
+    if ( *name == '.' )
+      name++;
+  }
+  if ( length == 0 )
+    return -1;
+
+  buffer[length++] = 0;
+  return length;
+}
+
+// Skip a name in a message, following compression pointers. Returns the offset
+// after the name, or -1 if it's malformed. If match isn't NULL, it's compared with
+// the name, and *matched is set.
+static int
+skip_name(const uint8_t * packet, size_t size, size_t offset, const char * match, bool * matched)
+{
+  int		end = -1;
+  int		jumps = 0;
+
+  if ( matched )
+    *matched = true;
+
+  for ( ; ; ) {
+    if ( offset >= size )
+      return -1;
+
+    const uint8_t length = packet[offset];
+
+    if ( length == 0 ) {
+      if ( end < 0 )
+        end = offset + 1;
+      if ( match && *match != '\0' )
+        *matched = false;
+      return end;
+    }
+    if ( (length & 0xc0) == 0xc0 ) {
+      if ( offset + 1 >= size || ++jumps > 16 )
+        return -1;
+      if ( end < 0 )
+        end = offset + 2;
+      offset = ((length & 0x3f) << 8) | packet[offset + 1];
+      continue;
+    }
+    if ( (length & 0xc0) != 0 || offset + 1 + length > size )
+      return -1;
+
+    if ( match && *matched ) {
+      const size_t label = strcspn(match, ".");
+
+      if ( label != length || strncasecmp(match, (const char *)&packet[offset + 1], length) != 0 )
+        *matched = false;
+      else {
+        match += label;
+        if ( *match == '.' )
+          match++;
+      }
+    }
+    offset += 1 + length;
+  }
+}
+
+static inline uint16_t
+get16(const uint8_t * p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+get32(const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t
+clamp(uint32_t ttl, uint32_t low, uint32_t high)
+{
+  if ( ttl < low )
+    return low;
+  if ( ttl > high )
+    return high;
+  return ttl;
+}
+
+// Parse a response to one of the questions. Returns -1 if it isn't a usable
+// response, so the next server should be asked.
+static int
+parse_response(query_t * q, const uint8_t * packet, size_t size)
+{
+  const dns_header_t * const	h = (const dns_header_t *)packet;
+  question_t *			question = NULL;
+  size_t			offset = sizeof(*h);
+  uint16_t			flags;
+  uint32_t			ttl = MAX_TTL;
+  uint32_t			negative_ttl = NEGATIVE_TTL;
+  bool				matched;
+  int				next;
+
+  if ( size < sizeof(*h) )
+    return -1;
+
+  for ( int i = 0; i < 2; i++ ) {
+    if ( q->questions[i].wanted && !q->questions[i].answered && q->questions[i].id == h->id )
+      question = &q->questions[i];
+  }
+  flags = ntohs(h->flags);
+  if ( question == NULL || !(flags & FLAG_RESPONSE) || ntohs(h->question_count) != 1 )
+    return 0; // Not ours. Ignore it, and keep waiting.
+
+  // The question has to be the one that was asked.
+  if ( (next = skip_name(packet, size, offset, q->name, &matched)) < 0 || !matched || next + 4 > size )
+    return 0;
+  if ( get16(&packet[next]) != question->type || get16(&packet[next + 2]) != CLASS_IN )
+    return 0;
+  offset = next + 4;
+
+  switch ( flags & FLAG_RCODE ) {
+  case RCODE_NOERROR:
+  case RCODE_NXDOMAIN:
+    break;
+  default:
+    // The server failed, or refused. Another server might do better.
+    return -1;
+  }
+
+  const int answers = ntohs(h->answer_count);
+  const int authorities = ntohs(h->authority_count);
+
+  for ( int i = 0; i < answers + authorities; i++ ) {
+    uint16_t	type;
+    uint16_t	class;
+    uint32_t	record_ttl;
+    uint16_t	length;
+
+    if ( (next = skip_name(packet, size, offset, NULL, NULL)) < 0 || next + 10 > size )
+      return -1;
+    type = get16(&packet[next]);
+    class = get16(&packet[next + 2]);
+    record_ttl = get32(&packet[next + 4]);
+    length = get16(&packet[next + 8]);
+    offset = next + 10;
+    if ( offset + length > size )
+      return -1;
+
+    if ( i < answers ) {
+      // CNAME records are skipped. The recursive server has already followed them,
+      // and put the addresses they lead to in the answer too.
+      if ( class == CLASS_IN
+       && type == question->type
+       && length == (type == TYPE_A ? 4 : 16)
+       && question->answer.count < MAX_ADDRESSES ) {
+        memcpy(question->answer.addresses[question->answer.count++], &packet[offset], length);
+        if ( record_ttl < ttl )
+          ttl = record_ttl;
+      }
+    }
+    else if ( type == TYPE_SOA ) {
+      // The negative-caching time is the lesser of the SOA record's TTL and its
+      // MINIMUM field, which is last (RFC 2308).
+      if ( length >= 20 ) {
+        const uint32_t minimum = get32(&packet[offset + length - 4]);
+
+        negative_ttl = minimum < record_ttl ? minimum : record_ttl;
+      }
+    }
+    offset += length;
+  }
+
+  question->answered = true;
+  if ( question->answer.count > 0 ) {
+    // A TTL of zero means "don't cache", and is respected.
+    if ( ttl > 0 )
+      cache_add(q->name, question->type, &question->answer, clamp(ttl, MIN_TTL, MAX_TTL));
+  }
+  else
+    cache_add(q->name, question->type, &question->answer, clamp(negative_ttl, MIN_TTL, MAX_NEGATIVE_TTL));
+
+  return 0;
+}
+
+static void
+close_socket(query_t * q)
+{
+  if ( q->fd >= 0 ) {
+    gm_fd_unregister(q->fd);
+    close(q->fd);
+    q->fd = -1;
+  }
+}
+
+// Runs in the select task. Give the addresses to the caller, IPv4 first, and free the query.
+static void
+deliver(void * data)
+{
+  query_t * const		q = (query_t *)data;
+  struct sockaddr_storage	addresses[MAX_ADDRESSES * 2];
+  size_t			count = 0;
+
+  close_socket(q);
+
+  memset(addresses, '\0', sizeof(addresses));
+  for ( int i = 0; i < 2; i++ ) {
+    const question_t * const question = &q->questions[i];
+
+    for ( int j = 0; j < question->answer.count; j++ ) {
+      if ( question->type == TYPE_A ) {
+        struct sockaddr_in * const in = (struct sockaddr_in *)&addresses[count++];
+
+        in->sin_family = AF_INET;
+        in->sin_port = htons(q->port);
+        memcpy(&in->sin_addr.s_addr, question->answer.addresses[j], 4);
+      }
+      else {
+        struct sockaddr_in6 * const in6 = (struct sockaddr_in6 *)&addresses[count++];
+
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(q->port);
+        memcpy(&in6->sin6_addr, question->answer.addresses[j], 16);
+      }
+    }
+  }
+
+  (*q->after)(addresses, count, q->context);
+  free(q);
+}
+
+static bool
+all_answered(const query_t * q)
+{
+  for ( int i = 0; i < 2; i++ ) {
+    if ( q->questions[i].wanted && !q->questions[i].answered )
+      return false;
+  }
+  return true;
+}
+
+// Ask the next server, or give up if they've all been tried enough.
+static void
+next_server(query_t * q)
+{
+  close_socket(q);
+  q->server++;
+  if ( ++q->tries >= TRIES )
+    deliver(q);
+  else
+    send_queries(q);
+}
+
+static void
+send_queries(query_t * q)
+{
+  struct sockaddr_storage	s[DNS_MAX_SERVERS];
+  const int			count = servers(s, DNS_MAX_SERVERS);
+  uint8_t			packet[sizeof(dns_header_t) + NAME_SIZE + 2 + 4];
+  dns_header_t * const		h = (dns_header_t *)packet;
+  int				length;
+
+  if ( count == 0 ) {
+    GM_WARN_ONCE("DNS: There are no name servers.\n");
+    gm_run(deliver, q, GM_FAST);
+    return;
+  }
+  q->server_address = s[q->server % count];
+
+  // A new socket for each server, so that it gets a new random port, and late
+  // answers from the last server aren't mistaken for answers from this one.
+  if ( (q->fd = socket(q->server_address.ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0 ) {
+    GM_FAIL("DNS: Can't get socket: %s\n", strerror(errno));
+    gm_run(deliver, q, GM_FAST);
+    return;
+  }
+  fcntl(q->fd, F_SETFL, fcntl(q->fd, F_GETFL, 0) | O_NONBLOCK);
+
+  memset(packet, '\0', sizeof(packet));
+  if ( (length = encode_name(q->name, &packet[sizeof(*h)], NAME_SIZE + 2)) < 0 ) {
+    gm_run(deliver, q, GM_FAST);
+    return;
+  }
+  length += sizeof(*h);
+  h->flags = htons(FLAG_RECURSION_DESIRED);
+  h->question_count = htons(1);
+  // The type, before the class, is filled in for each question.
+  packet[length + 3] = CLASS_IN;
+  length += 4;
+
+  for ( int i = 0; i < 2; i++ ) {
+    question_t * const question = &q->questions[i];
+
+    if ( !question->wanted || question->answered )
+      continue;
+
+    question->id = esp_random() & 0xffff;
+    h->id = question->id;
+    packet[length - 4] = question->type >> 8;
+    packet[length - 3] = question->type & 0xff;
+
+    sendto(
+     q->fd,
+     packet,
+     length,
+     0,
+     (const struct sockaddr *)&q->server_address,
+     q->server_address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+  }
+  // If a send failed, the server is asked again after the timeout.
+  gm_fd_register(q->fd, receive, q, true, false, false, TRY_TIMEOUT);
+}
+
+static void
+receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  query_t * const	q = (query_t *)data;
+
+  if ( timeout ) {
+    // The select task has already unregistered the file descriptor.
+    close(q->fd);
+    q->fd = -1;
+    next_server(q);
+    return;
+  }
+
+  for ( ; ; ) {
+    uint32_t			packet[PACKET_SIZE / sizeof(uint32_t)];
+    struct sockaddr_storage	from = {};
+    socklen_t			from_size = sizeof(from);
+    const ssize_t		size = recvfrom(fd, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&from, &from_size);
+
+    if ( size < 0 )
+      return; // Nothing more to read. Wait for the rest of the answers.
+
+    if ( !same_address(&from, &q->server_address) )
+      continue;
+
+    if ( parse_response(q, (const uint8_t *)packet, size) != 0 ) {
+      next_server(q);
+      return;
+    }
+    if ( all_answered(q) ) {
+      deliver(q);
+      return;
+    }
+  }
+}
+
+// Look up the addresses of a name. family is AF_INET, AF_INET6, or AF_UNSPEC for
+// both. The addresses are given to after() with their port set to port, IPv4 first.
+// If the name couldn't be resolved, the count is zero. after() is always called
+// later, from the select task, never from within this function.
+//
+// This must be called from the select task. Returns -1 if it can't allocate memory,
+// in which case after() won't be called.
+int
+gm_dns_resolve(const char * name, uint16_t port, int family, gm_dns_after_t after, void * context)
+{
+  query_t * const	q = calloc(1, sizeof(*q));
+  bool			cached = true;
+
+  if ( q == NULL )
+    return -1;
+
+  q->fd = -1;
+  q->port = port;
+  q->after = after;
+  q->context = context;
+  q->questions[0].type = TYPE_A;
+  q->questions[0].wanted = family != AF_INET6;
+  q->questions[1].type = TYPE_AAAA;
+  q->questions[1].wanted = family != AF_INET;
+
+  if ( strlen(name) >= sizeof(q->name) ) {
+    gm_run(deliver, q, GM_FAST);
+    return 0;
+  }
+  strcpy(q->name, name);
+
+  // An address literal doesn't need to be looked up.
+  if ( inet_pton(AF_INET, name, q->questions[0].answer.addresses[0]) == 1 ) {
+    q->questions[0].answer.count = q->questions[0].wanted;
+    gm_run(deliver, q, GM_FAST);
+    return 0;
+  }
+  if ( inet_pton(AF_INET6, name, q->questions[1].answer.addresses[0]) == 1 ) {
+    q->questions[1].answer.count = q->questions[1].wanted;
+    gm_run(deliver, q, GM_FAST);
+    return 0;
+  }
+
+  for ( int i = 0; i < 2; i++ ) {
+    question_t * const		question = &q->questions[i];
+    const cache_entry_t *	e;
+
+    if ( !question->wanted )
+      continue;
+
+    if ( (e = cache_find(name, question->type)) != NULL ) {
+      question->answer = e->answer;
+      question->answered = true;
+    }
+    else
+      cached = false;
+  }
+
+  if ( cached )
+    gm_run(deliver, q, GM_FAST);
+  else
+    send_queries(q);
+  return 0;
+}
+
+// Use this name server rather than the ones from the network, or go back to those
+// if address is NULL. Returns -1 if the address isn't valid. Call from the select task.
+int
+gm_dns_server(const char * address)
+{
+  struct sockaddr_storage	s = {};
+  struct sockaddr_in * const	in = (struct sockaddr_in *)&s;
+  struct sockaddr_in6 * const	in6 = (struct sockaddr_in6 *)&s;
+
+  if ( address == NULL ) {
+    server_override.ss_family = AF_UNSPEC;
+    return 0;
+  }
+  if ( inet_pton(AF_INET, address, &in->sin_addr) == 1 ) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(DNS_PORT);
+  }
+  else if ( inet_pton(AF_INET6, address, &in6->sin6_addr) == 1 ) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(DNS_PORT);
+  }
+  else
+    return -1;
+
+  server_override = s;
+  return 0;
+}
+
+// Forget all cached answers. Call from the select task.
+void
+gm_dns_flush(void)
+{
+  memset(cache, '\0', sizeof(cache));
+}
+
+void
+gm_dns_report(void)
+{
+  const int64_t	now = esp_timer_get_time();
+
+  gm_printf("Type TTL(s) Name: Addresses\n");
+  for ( int i = 0; i < CACHE_SIZE; i++ ) {
+    const cache_entry_t * const e = &cache[i];
+
+    if ( e->expires <= now )
+      continue;
+
+    gm_printf("%-4s %6u %s:", e->type == TYPE_A ? "A" : "AAAA", (unsigned int)((e->expires - now) / 1000000), e->name);
+    if ( e->answer.count == 0 )
+      gm_printf(" none");
+    for ( int j = 0; j < e->answer.count; j++ ) {
+      char buffer[INET6_ADDRSTRLEN];
+
+      inet_ntop(e->type == TYPE_A ? AF_INET : AF_INET6, e->answer.addresses[j], buffer, sizeof(buffer));
+      gm_printf(" %s", buffer);
+    }
+    gm_printf("\n");
+  }
+}
@@ -120,9 +120,15 @@ int gm_ddns(void)
 
   while ( p->name ) {
     if ( strcmp(p->name, ddns_provider) == 0 ) {
-      send_ddns(p->url);
+      if ( send_ddns(p->url) == 0 ) {
+        gm_warm_boot_ddns_published(false);
+        // Without a URL for IPv6, this one did both.
+        if ( p->url_ipv6 == NULL )
+          gm_warm_boot_ddns_published(true);
+      }
       if (p->url_ipv6 && !gm_all_zeroes(&GM.sta.ip6.pub.sin6_addr.s6_addr, sizeof(GM.sta.ip6.pub.sin6_addr.s6_addr))) {
-        send_ddns(p->url_ipv6);
+        if ( send_ddns(p->url_ipv6) == 0 )
+          gm_warm_boot_ddns_published(true);
       }
       return 0;
     }
@@ -153,7 +153,8 @@ gm_select_wakeup(void)
 }
 
 // Run a procedure in the context of the select task. It must not block.
-void
+// Returns -1 if it couldn't be queued.
+int
 gm_run(gm_run_t procedure, void * data, gm_run_speed_t speed)
 {
   gm_event_t		event = {};
@@ -170,8 +171,10 @@ gm_run(gm_run_t procedure, void * data, gm_run_speed_t speed)
     event.size = sizeof(event.data.run);
     event.data.run.procedure = procedure;
     event.data.run.data = data;
-    if ( write(client, &event, sizeof(event)) != sizeof(event) )
+    if ( write(client, &event, sizeof(event)) != sizeof(event) ) {
       GM_FAIL("gm_run(GM_FAST) write failed: %s\n", strerror(errno));
+      return -1;
+    }
     break;
   case GM_MEDIUM:
     run.procedure = procedure;
@@ -184,4 +187,5 @@ gm_run(gm_run_t procedure, void * data, gm_run_speed_t speed)
     ESP_ERROR_CHECK(esp_event_post_to(&GM.slow_event_loop, GM_EVENT, GM_RUN, &run, sizeof(run), 0));
     break;
   }
+  return 0;
 }
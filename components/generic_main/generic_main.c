@@ -22,6 +22,7 @@
 #include <esp_random.h>
 #include <esp_console.h>
 #include <esp_mac.h>
+#include <esp_timer.h>
 #include "generic_main.h"
 
 static void initialize(void);
@@ -31,6 +32,7 @@ static const char TASK_NAME[] = "main";
 void app_main(void)
 {
   GM.log_file_pointer = stderr;
+  gm_boot_trace_event("phase", "app_main");
   initialize();
 }
 
@@ -44,24 +46,33 @@ static void initialize(void)
   // This can't be used for non-tasks.
   pthread_mutex_init(&GM.console_print_mutex, 0);
 
+  int64_t start = esp_timer_get_time();
   gm_wifi_events_initialize();
+  gm_boot_trace_phase("WiFi events", start);
 
 
   // gm_improv_wifi(0);
 
+  start = esp_timer_get_time();
   gm_user_initialize_early();
+  gm_boot_trace_phase("user early initialization", start);
 
   // Initialize the TCP/IP stack. gm_select_task uses sockets.
+  start = esp_timer_get_time();
   esp_netif_init();
   int fd = socket(AF_INET, SOCK_STREAM, 0);
   close(fd);
   printf("Socket number was %d\n", fd);
+  gm_boot_trace_phase("TCP/IP stack", start);
 
   // The global event loop is required for all event handling to work.
+  start = esp_timer_get_time();
   ESP_ERROR_CHECK(esp_event_loop_create_default());
+  gm_boot_trace_phase("event loop", start);
 
   // Connect the non-volatile-storage FLASH partition. Initialize it if
   // necessary.
+  start = esp_timer_get_time();
   esp_err_t err = nvs_flash_init();
   if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
     ESP_LOGW(TASK_NAME, "Erasing and initializing non-volatile parameter storage.");
@@ -69,6 +80,7 @@ static void initialize(void)
     ESP_ERROR_CHECK(nvs_flash_init());
   }
   ESP_ERROR_CHECK(nvs_open(GM.nvs_index, NVS_READWRITE, &GM.nvs));
+  gm_boot_trace_phase("NVS", start);
 
   // Get the factory-set MAC address, which is a permanent unique number programmed
   // into e-fuse bits of this CPU, and thus is useful for identifying the device.
@@ -90,10 +102,16 @@ static void initialize(void)
 
   gm_printf("Device name: %s\n", GM.unique_name);
 
+  start = esp_timer_get_time();
   gm_select_task();
+  gm_boot_trace_phase("select task", start);
 
   // Start WiFi, if it's already configured.
+  start = esp_timer_get_time();
   gm_wifi_start();
+  gm_boot_trace_phase("WiFi start", start);
 
+  start = esp_timer_get_time();
   gm_command_interpreter_start();
+  gm_boot_trace_phase("command interpreter", start);
 }
@@ -0,0 +1,256 @@
+// A stand-in DNS server for testing the asynchronous resolver in dns_resolver.c.
+// It answers A and AAAA queries from the names and addresses on its command line,
+// and can be told to misbehave, so that the resolver's retries, negative caching,
+// and handling of failed servers can be seen. Point the device at it with the
+// "dns --server address" command.
+//
+// Usage: dns_server [-p port] [-t ttl] [-n negative-ttl] [-d drop-count]
+//                   [-f servfail-count] [-w delay-ms] name=address ...
+//
+//   -p	Port to listen on. The device asks port 53, which needs root here.
+//   -t	TTL of the answers, in seconds.
+//   -n	MINIMUM of the SOA record sent with negative answers, in seconds.
+//   -d	Don't answer this many queries at first, to make the resolver retry.
+//   -f	Answer this many queries at first with SERVFAIL.
+//   -w	Wait this long before answering each query.
+//
+// A name may be given more than once, and with both IPv4 and IPv6 addresses.
+// Names that aren't given get NXDOMAIN. Names that don't have an address of the
+// type asked for get an empty answer. Both of those include an SOA record, as
+// a real server would, for negative caching.
+//
+// Build it with: cc -O2 -o dns_server dns_server.c
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define MAX_RECORDS	32
+#define PACKET_SIZE	512
+
+enum {
+  TYPE_A = 1,
+  TYPE_SOA = 6,
+  TYPE_AAAA = 28,
+  CLASS_IN = 1,
+  RCODE_SERVFAIL = 2,
+  RCODE_NXDOMAIN = 3
+};
+
+typedef struct _record {
+  const char *	name;
+  uint16_t	type;
+  uint8_t	address[16];
+} record_t;
+
+static record_t	records[MAX_RECORDS];
+static int	number_of_records = 0;
+
+static void
+put16(uint8_t * p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static void
+put32(uint8_t * p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(&p[2], v & 0xffff);
+}
+
+// Read the question name as text. Returns the offset after it, or -1.
+static int
+read_name(const uint8_t * packet, size_t size, size_t offset, char * name, size_t name_size)
+{
+  size_t	length = 0;
+
+  while ( offset < size && packet[offset] != 0 ) {
+    const uint8_t label = packet[offset];
+
+    if ( (label & 0xc0) != 0 || offset + 1 + label > size || length + label + 2 > name_size )
+      return -1;
+    if ( length > 0 )
+      name[length++] = '.';
+    memcpy(&name[length], &packet[offset + 1], label);
+    length += label;
+    offset += 1 + label;
+  }
+  if ( offset >= size )
+    return -1;
+  name[length] = '\0';
+  return offset + 1;
+}
+
+// Add the SOA record for negative caching. Its owner is the question name.
+static size_t
+add_soa(uint8_t * packet, size_t length, uint32_t ttl, uint32_t minimum)
+{
+  static const uint8_t	names[] = {
+    2, 'n', 's', 4, 't', 'e', 's', 't', 0,	// MNAME
+    4, 'r', 'o', 'o', 't', 4, 't', 'e', 's', 't', 0	// RNAME
+  };
+  uint8_t * const	p = &packet[length];
+
+  put16(p, 0xc00c); // Pointer to the question name.
+  put16(&p[2], TYPE_SOA);
+  put16(&p[4], CLASS_IN);
+  put32(&p[6], ttl);
+  put16(&p[10], sizeof(names) + 20);
+  memcpy(&p[12], names, sizeof(names));
+  put32(&p[12 + sizeof(names)], 1);		// SERIAL
+  put32(&p[16 + sizeof(names)], 3600);		// REFRESH
+  put32(&p[20 + sizeof(names)], 600);		// RETRY
+  put32(&p[24 + sizeof(names)], 86400);		// EXPIRE
+  put32(&p[28 + sizeof(names)], minimum);	// MINIMUM
+  return length + 32 + sizeof(names);
+}
+
+int
+main(int argc, char * * argv)
+{
+  int			port = 53;
+  uint32_t		ttl = 300;
+  uint32_t		negative_ttl = 60;
+  int			drop = 0;
+  int			servfail = 0;
+  int			delay = 0;
+  int			option;
+  int			sock;
+  struct sockaddr_in6	address = {};
+  const int		off = 0;
+
+  while ( (option = getopt(argc, argv, "p:t:n:d:f:w:")) != -1 ) {
+    switch ( option ) {
+    case 'p': port = atoi(optarg); break;
+    case 't': ttl = atoi(optarg); break;
+    case 'n': negative_ttl = atoi(optarg); break;
+    case 'd': drop = atoi(optarg); break;
+    case 'f': servfail = atoi(optarg); break;
+    case 'w': delay = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-p port] [-t ttl] [-n negative-ttl] [-d drop-count] [-f servfail-count] [-w delay-ms] name=address ...\n", argv[0]);
+      return 1;
+    }
+  }
+
+  for ( int i = optind; i < argc && number_of_records < MAX_RECORDS; i++ ) {
+    char * const	equals = strchr(argv[i], '=');
+    record_t * const	r = &records[number_of_records];
+
+    if ( equals == NULL ) {
+      fprintf(stderr, "%s: expected name=address.\n", argv[i]);
+      return 1;
+    }
+    *equals = '\0';
+    r->name = argv[i];
+    if ( inet_pton(AF_INET, equals + 1, r->address) == 1 )
+      r->type = TYPE_A;
+    else if ( inet_pton(AF_INET6, equals + 1, r->address) == 1 )
+      r->type = TYPE_AAAA;
+    else {
+      fprintf(stderr, "%s isn't an IP address.\n", equals + 1);
+      return 1;
+    }
+    number_of_records++;
+  }
+
+  // One socket for IPv4 and IPv6.
+  if ( (sock = socket(AF_INET6, SOCK_DGRAM, 0)) < 0 ) {
+    perror("socket");
+    return 1;
+  }
+  setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+  address.sin6_family = AF_INET6;
+  address.sin6_port = htons(port);
+  if ( bind(sock, (struct sockaddr *)&address, sizeof(address)) != 0 ) {
+    perror("bind");
+    return 1;
+  }
+  fprintf(stderr, "Listening on port %d.\n", port);
+
+  for ( ; ; ) {
+    uint8_t			packet[PACKET_SIZE];
+    struct sockaddr_storage	from;
+    socklen_t			from_size = sizeof(from);
+    char			name[256];
+    ssize_t			size;
+    int				offset;
+    uint16_t			type;
+    size_t			length;
+    int				answers = 0;
+    bool			exists = false;
+
+    if ( (size = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *)&from, &from_size)) < 12 )
+      continue;
+    if ( (packet[2] & 0x80) || packet[4] != 0 || packet[5] != 1 )
+      continue;
+    if ( (offset = read_name(packet, size, 12, name, sizeof(name))) < 0 || offset + 4 > size )
+      continue;
+    type = (packet[offset] << 8) | packet[offset + 1];
+    length = offset + 4;
+
+    printf("%s %s", type == TYPE_A ? "A" : type == TYPE_AAAA ? "AAAA" : "?", name);
+
+    if ( drop > 0 ) {
+      drop--;
+      printf(": dropped.\n");
+      fflush(stdout);
+      continue;
+    }
+
+    // Make the query into the response: set QR and RA, keep the ID, RD, and question.
+    packet[2] |= 0x80;
+    packet[3] = 0x80;
+    memset(&packet[6], '\0', 6);
+
+    if ( servfail > 0 ) {
+      servfail--;
+      packet[3] |= RCODE_SERVFAIL;
+      printf(": SERVFAIL.\n");
+    }
+    else {
+      for ( int i = 0; i < number_of_records; i++ ) {
+        const record_t * const	r = &records[i];
+        const size_t		address_size = r->type == TYPE_A ? 4 : 16;
+
+        if ( strcasecmp(r->name, name) != 0 )
+          continue;
+        exists = true;
+        if ( r->type != type || length + 12 + address_size > sizeof(packet) )
+          continue;
+
+        put16(&packet[length], 0xc00c);
+        put16(&packet[length + 2], type);
+        put16(&packet[length + 4], CLASS_IN);
+        put32(&packet[length + 6], ttl);
+        put16(&packet[length + 10], address_size);
+        memcpy(&packet[length + 12], r->address, address_size);
+        length += 12 + address_size;
+        answers++;
+      }
+      put16(&packet[6], answers);
+
+      if ( answers == 0 ) {
+        if ( !exists )
+          packet[3] |= RCODE_NXDOMAIN;
+        length = add_soa(packet, length, ttl, negative_ttl);
+        put16(&packet[8], 1);
+      }
+      printf(": %d answers%s.\n", answers, exists ? "" : ", NXDOMAIN");
+    }
+    fflush(stdout);
+
+    if ( delay > 0 )
+      usleep(delay * 1000);
+    sendto(sock, packet, length, 0, (struct sockaddr *)&from, from_size);
+  }
+}
@@ -0,0 +1,7 @@
+// Host stand-in for esp_random.h.
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+extern uint32_t	esp_random(void);
+extern void	esp_fill_random(void * buffer, size_t size);
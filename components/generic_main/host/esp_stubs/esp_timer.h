@@ -0,0 +1,13 @@
+// Host stand-in for esp_timer.h.
+#pragma once
+#include <stdint.h>
+#include <time.h>
+
+static inline int64_t
+esp_timer_get_time(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
@@ -0,0 +1,9 @@
+// Host stand-in for esp_wifi.h. The access point's MAC address is all that's used.
+#pragma once
+#include <stdint.h>
+
+typedef struct {
+  uint8_t	bssid[6];
+} wifi_ap_record_t;
+
+extern int	esp_wifi_sta_get_ap_info(wifi_ap_record_t * record);
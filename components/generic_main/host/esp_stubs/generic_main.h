@@ -0,0 +1,112 @@
+// Host stand-in for generic_main.h, with just enough of it for
+// port_control_protocol.c to build on the host, for pcp_bench.c. What's declared
+// here is implemented in pcp_bench.c.
+#pragma once
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define GM_HTTPS_PORT 443
+#define ESP_OK 0
+
+#define gm_printf printf
+#define GM_FAIL(args...) gm_fail(__PRETTY_FUNCTION__, __FILE__, __LINE__, args)
+#define GM_WARN_ONCE(args...) { static bool i_told_you_once = false; if ( !i_told_you_once ) { gm_printf(args); i_told_you_once = true; } }
+
+typedef enum _gm_run_speed {
+  GM_SLOW,
+  GM_MEDIUM,
+  GM_FAST
+} gm_run_speed_t;
+
+typedef int nvs_handle_t;
+typedef struct _gm_http_request gm_http_request_t;
+typedef void (*gm_fd_handler_t)(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
+typedef void (*gm_run_t)(void *);
+typedef ssize_t (*gm_http_body_t)(gm_http_request_t * request, const char * data, size_t size, void * context);
+typedef void (*gm_http_done_t)(gm_http_request_t * request, int status, void * context);
+
+typedef struct {
+  uint32_t	addr[4];
+  uint8_t	zone;
+} esp_ip6_addr_t;
+
+typedef enum {
+  ESP_IP6_ADDR_IS_UNKNOWN,
+  ESP_IP6_ADDR_IS_GLOBAL,
+  ESP_IP6_ADDR_IS_LINK_LOCAL
+} esp_ip6_addr_type_t;
+
+typedef enum _gm_nonvolatile_result {
+  GM_INVALID = -3,
+  GM_ERROR = -2,
+  GM_NOT_IN_PARAMETER_TABLE = -1,
+  GM_NORMAL = 0,
+  GM_SECRET = 1,
+  GM_NOT_SET = 2
+} gm_nonvolatile_result_t;
+
+typedef struct _gm_port_mapping {
+  struct timeval granted_time;
+  uint32_t nonce[3];
+  uint32_t epoch;
+  uint32_t lifetime;
+  uint16_t internal_port;
+  uint16_t external_port;
+  struct in6_addr external_address;
+  bool ipv6;
+  bool tcp;
+  struct _gm_port_mapping * next;
+} gm_port_mapping_t;
+
+typedef struct _gm_netif {
+  void *		esp_netif;
+  struct gm_netif_ip4 {
+    struct sockaddr_in	address;
+    struct sockaddr_in	router;
+    gm_port_mapping_t *	port_mappings;
+  } ip4;
+  struct gm_netif_ip6 {
+    struct sockaddr_in6	link_local;
+    struct sockaddr_in6	router;
+    gm_port_mapping_t *	port_mappings;
+  } ip6;
+} gm_netif_t;
+
+typedef struct _generic_main {
+  nvs_handle_t	nvs;
+  gm_netif_t	sta;
+  const char *	application_name;
+} generic_main_t;
+
+extern generic_main_t		GM;
+
+extern bool			gm_all_zeroes(const void * data, size_t size);
+extern void			gm_fail(const char * function, const char * file, int line, const char * pattern, ...);
+extern void			gm_fd_register(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t seconds);
+extern void			gm_fd_unregister(int fd);
+extern void			gm_http_cancel(gm_http_request_t * request);
+extern gm_nonvolatile_result_t	gm_nonvolatile_get_int(const char * name, int32_t * value);
+extern int			gm_port_control_protocol_map(bool ipv6, bool tcp, uint16_t internal_port, uint16_t external_port);
+extern void			gm_port_control_protocol_report(void);
+extern void			gm_port_control_protocol_start_listener_ipv4(void);
+extern void			gm_port_control_protocol_stop_listener_ipv4(void);
+extern int			gm_run(gm_run_t function, void * data, gm_run_speed_t speed);
+extern int			gm_timer_add(gm_run_t procedure, void * data, uint32_t milliseconds);
+extern void			gm_timer_cancel(gm_run_t procedure, void * data);
+extern void			gm_warm_boot_changed(void);
+extern void			gm_web_socket_publish(const char * name, const char * format, ...);
+extern int			esp_netif_get_netif_impl_index(void * netif);
+extern esp_ip6_addr_type_t	esp_netif_ip6_get_addr_type(esp_ip6_addr_t * address);
+extern int			nvs_commit(nvs_handle_t handle);
+extern int			nvs_get_u8(nvs_handle_t handle, const char * key, uint8_t * value);
+extern int			nvs_set_u8(nvs_handle_t handle, const char * key, uint8_t value);
@@ -0,0 +1,9 @@
+// Host stand-in for lwIP's sockets: the host's own, with sendto() diverted to
+// pcp_bench.c, which counts what the client sends.
+#pragma once
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+extern ssize_t	pcp_bench_sendto(int fd, const void * data, size_t size, int flags, const struct sockaddr * to, socklen_t to_size);
+
+#define sendto pcp_bench_sendto
@@ -0,0 +1,122 @@
+// Host benchmark of the streaming JSON extractor against cJSON, for the responses
+// of the public IP sites. Build it with the command in ../CMakeLists.txt, and run
+// it with no arguments.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <cJSON.h>
+#include "json_extract.h"
+
+#define ITERATIONS	200000
+#define PIECE_SIZE	64 // About what arrives in each callback of the HTTP client.
+
+static const char * const documents[] = {
+  "{\"ip\":\"203.0.113.45\",\"country\":\"United States\",\"cc\":\"US\"}",
+  "{\"ip\": \"2001:db8:85a3::8a2e:370:7334\"}",
+  "{\"country\":\"United States\",\"region\":\"California\",\"city\":\"Berkeley\","
+  "\"location\":{\"latitude\":37.8716,\"longitude\":-122.2727},"
+  "\"asn\":{\"number\":64496,\"name\":\"Example Networks\"},"
+  "\"tags\":[\"residential\",\"ipv4\",\"nat\"],\"ip\":\"198.51.100.7\"}",
+};
+
+static unsigned long	allocations = 0;
+
+static void *
+counting_malloc(size_t size)
+{
+  allocations++;
+  return malloc(size);
+}
+
+static double
+now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+with_cjson(const char * document, char * ip, size_t size)
+{
+  cJSON *	json = cJSON_Parse(document);
+  int		result = -1;
+
+  if ( json ) {
+    cJSON * ip_json = cJSON_GetObjectItemCaseSensitive(json, "ip");
+    if ( cJSON_IsString(ip_json) && ip_json->valuestring ) {
+      strncpy(ip, ip_json->valuestring, size - 1);
+      ip[size - 1] = '\0';
+      result = 0;
+    }
+    cJSON_Delete(json);
+  }
+  return result;
+}
+
+static int
+with_extractor(const char * document, char * ip, size_t size)
+{
+  gm_json_extractor_t	x;
+  gm_json_field_t	field = { "ip", ip, size };
+  const size_t		length = strlen(document);
+
+  gm_json_extract_begin(&x, &field, 1);
+  for ( size_t i = 0; i < length; i += PIECE_SIZE ) {
+    const size_t piece = length - i < PIECE_SIZE ? length - i : PIECE_SIZE;
+
+    if ( gm_json_extract(&x, &document[i], piece) != 0 )
+      return -1;
+  }
+  return gm_json_extract_end(&x) == 1 ? 0 : -1;
+}
+
+int
+main(int argc, char * * argv)
+{
+  cJSON_Hooks hooks = { counting_malloc, free };
+
+  cJSON_InitHooks(&hooks);
+
+  for ( size_t d = 0; d < sizeof(documents) / sizeof(*documents); d++ ) {
+    char		a[64];
+    char		b[64];
+    double		start;
+    double		cjson_time;
+    double		extractor_time;
+    unsigned long	cjson_allocations;
+
+    if ( with_cjson(documents[d], a, sizeof(a)) != 0
+     ||  with_extractor(documents[d], b, sizeof(b)) != 0
+     ||  strcmp(a, b) != 0 ) {
+      fprintf(stderr, "Document %zu: the results differ: \"%s\" \"%s\".\n", d, a, b);
+      return 1;
+    }
+
+    allocations = 0;
+    start = now();
+    for ( int i = 0; i < ITERATIONS; i++ )
+      with_cjson(documents[d], a, sizeof(a));
+    cjson_time = now() - start;
+    cjson_allocations = allocations;
+
+    allocations = 0;
+    start = now();
+    for ( int i = 0; i < ITERATIONS; i++ )
+      with_extractor(documents[d], b, sizeof(b));
+    extractor_time = now() - start;
+
+    printf(
+     "Document %zu, %zu bytes: cJSON %.0f ns, %.1f allocations; extractor %.0f ns, %.1f allocations.\n",
+     d,
+     strlen(documents[d]),
+     cjson_time / ITERATIONS * 1e9,
+     (double)cjson_allocations / ITERATIONS,
+     extractor_time / ITERATIONS * 1e9,
+     (double)allocations / ITERATIONS);
+  }
+  return 0;
+}
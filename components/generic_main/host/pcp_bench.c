@@ -0,0 +1,466 @@
+// Runs port_control_protocol.c on the host against pcp_server.c, or a router, to
+// measure how long mappings take to be granted and what it costs to keep them.
+// Use it to tune the retransmission and renewal strategy without a lab router.
+//
+// Usage: pcp_bench [-a address] [-r router] [-t trials] [-d seconds] [-p ports] [-c]
+//
+//   -a	This host's address. The client binds port 5351 on it.
+//   -r	The router's address.
+//   -t	Number of times to start the listener and measure the time until the
+//	ports are mapped.
+//   -d	Then keep the ports mapped for this many seconds, and count the requests
+//	made, and the time that a port wasn't mapped.
+//   -p	Number of ports to map, UDP from 8000 up.
+//   -c	Remember the protocol between trials, as NVS does for an access point.
+//	Otherwise, every trial tries all of the protocols.
+//
+// For example, with a lossy router that restarts every 30 seconds and grants
+// 10-second lifetimes:
+//
+//   pcp_server -q -x 20 -w 50 -j 100 -r 30 -l 10 -n 10 &
+//   pcp_bench -t 20 -d 120
+//
+// The select task is simulated by a loop here, in real time, so the times are the
+// ones a device would see. UPnP isn't simulated: the router never has it.
+//
+// Build it with the command in ../CMakeLists.txt, or:
+//
+//   cc -O2 -I esp_stubs -I .. -o pcp_bench pcp_bench.c ../port_control_protocol.c
+//
+#include <stdarg.h>
+#include <poll.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <esp_wifi.h>
+#include "generic_main.h"
+#include "upnp_igd.h"
+
+#define MAX_EVENTS	32
+#define MAX_FDS		8
+#define MAX_TRIALS	1000
+#define FIRST_PORT	8000
+#define TRIAL_TIMEOUT	(120 * 1000000LL)	// Microseconds before a trial is abandoned.
+
+typedef struct _event {
+  gm_run_t	procedure;
+  void *	data;
+  int64_t	when;
+} event_t;
+
+typedef struct _watch {
+  int			fd;
+  gm_fd_handler_t	handler;
+  void *		data;
+} watch_t;
+
+generic_main_t		GM = {};
+
+static event_t		events[MAX_EVENTS];
+static watch_t		watches[MAX_FDS];
+static bool		remember = false;
+static uint8_t		remembered = 0;
+static bool		have_remembered = false;
+static int		ports = 2;
+static unsigned long	sent_pcp = 0;
+static unsigned long	sent_nat_pmp = 0;
+
+// The stand-ins for generic_main.
+int
+gm_run(gm_run_t procedure, void * data, gm_run_speed_t speed)
+{
+  return gm_timer_add(procedure, data, 0);
+}
+
+int
+gm_timer_add(gm_run_t procedure, void * data, uint32_t milliseconds)
+{
+  for ( int i = 0; i < MAX_EVENTS; i++ ) {
+    if ( events[i].procedure == NULL ) {
+      events[i].procedure = procedure;
+      events[i].data = data;
+      events[i].when = esp_timer_get_time() + milliseconds * 1000LL;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void
+gm_timer_cancel(gm_run_t procedure, void * data)
+{
+  for ( int i = 0; i < MAX_EVENTS; i++ ) {
+    if ( events[i].procedure == procedure && events[i].data == data )
+      events[i].procedure = NULL;
+  }
+}
+
+void
+gm_fd_register(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t seconds)
+{
+  for ( int i = 0; i < MAX_FDS; i++ ) {
+    if ( watches[i].handler == NULL || watches[i].fd == fd ) {
+      watches[i].fd = fd;
+      watches[i].handler = handler;
+      watches[i].data = data;
+      return;
+    }
+  }
+}
+
+void
+gm_fd_unregister(int fd)
+{
+  for ( int i = 0; i < MAX_FDS; i++ ) {
+    if ( watches[i].fd == fd )
+      watches[i].handler = NULL;
+  }
+}
+
+void
+gm_fail(const char * function, const char * file, int line, const char * pattern, ...)
+{
+  // The bench expects failures, like wrong nonces. It doesn't print them.
+}
+
+bool
+gm_all_zeroes(const void * data, size_t size)
+{
+  for ( size_t i = 0; i < size; i++ ) {
+    if ( ((const uint8_t *)data)[i] != 0 )
+      return false;
+  }
+  return true;
+}
+
+void
+gm_warm_boot_changed(void)
+{
+}
+
+void
+gm_web_socket_publish(const char * name, const char * format, ...)
+{
+}
+
+// The benchmark maps its own ports, not the HTTPS one.
+gm_nonvolatile_result_t
+gm_nonvolatile_get_int(const char * name, int32_t * value)
+{
+  return GM_NOT_SET;
+}
+
+void
+gm_http_cancel(gm_http_request_t * request)
+{
+}
+
+uint32_t
+esp_random(void)
+{
+  return (uint32_t)random();
+}
+
+void
+esp_fill_random(void * buffer, size_t size)
+{
+  for ( size_t i = 0; i < size; i++ )
+    ((uint8_t *)buffer)[i] = random();
+}
+
+int
+esp_netif_get_netif_impl_index(void * netif)
+{
+  return 0;
+}
+
+esp_ip6_addr_type_t
+esp_netif_ip6_get_addr_type(esp_ip6_addr_t * address)
+{
+  return ESP_IP6_ADDR_IS_GLOBAL;
+}
+
+int
+esp_wifi_sta_get_ap_info(wifi_ap_record_t * record)
+{
+  static const uint8_t bssid[6] = { 0x02, 0, 0, 0, 0, 1 };
+
+  memcpy(record->bssid, bssid, sizeof(bssid));
+  return ESP_OK;
+}
+
+// NVS holds one protocol, for the one access point, and only with -c.
+int
+nvs_get_u8(nvs_handle_t handle, const char * key, uint8_t * value)
+{
+  if ( !remember || !have_remembered )
+    return -1;
+  *value = remembered;
+  return ESP_OK;
+}
+
+int
+nvs_set_u8(nvs_handle_t handle, const char * key, uint8_t value)
+{
+  remembered = value;
+  have_remembered = true;
+  return ESP_OK;
+}
+
+int
+nvs_commit(nvs_handle_t handle)
+{
+  return ESP_OK;
+}
+
+// The router never has UPnP.
+void
+upnp_igd_discover(void)
+{
+}
+
+gm_http_request_t *
+upnp_igd_map(const gm_port_mapping_t * m, uint32_t lease, void * context)
+{
+  return NULL;
+}
+
+bool
+upnp_igd_ready(void)
+{
+  return false;
+}
+
+void
+upnp_igd_stop(void)
+{
+}
+
+ssize_t
+pcp_bench_sendto(int fd, const void * data, size_t size, int flags, const struct sockaddr * to, socklen_t to_size)
+{
+  if ( size > 0 && ((const uint8_t *)data)[0] == 0 )
+    sent_nat_pmp++;
+  else
+    sent_pcp++;
+  return sendto(fd, data, size, flags, to, to_size);
+}
+
+// Run the simulated select task until the time, or until done() returns true.
+static void
+run_until(int64_t until, bool (*done)(void))
+{
+  while ( esp_timer_get_time() < until && (done == NULL || !done()) ) {
+    const int64_t	now = esp_timer_get_time();
+    int64_t		next = until;
+    struct pollfd	fds[MAX_FDS];
+    watch_t *		w[MAX_FDS];
+    int			count = 0;
+    bool		ran = false;
+
+    for ( int i = 0; i < MAX_EVENTS; i++ ) {
+      event_t * const e = &events[i];
+
+      if ( e->procedure && e->when <= now ) {
+        const gm_run_t procedure = e->procedure;
+
+        e->procedure = NULL;
+        (*procedure)(e->data);
+        ran = true;
+        break;
+      }
+      if ( e->procedure && e->when < next )
+        next = e->when;
+    }
+    if ( ran )
+      continue;
+
+    for ( int i = 0; i < MAX_FDS; i++ ) {
+      if ( watches[i].handler ) {
+        fds[count].fd = watches[i].fd;
+        fds[count].events = POLLIN;
+        w[count++] = &watches[i];
+      }
+    }
+    // Wake at least every 10 ms, to check done().
+    if ( next > now + 10000 )
+      next = now + 10000;
+    if ( poll(fds, count, (int)((next - now + 999) / 1000)) > 0 ) {
+      for ( int i = 0; i < count; i++ ) {
+        if ( (fds[i].revents & POLLIN) && w[i]->handler )
+          (*w[i]->handler)(fds[i].fd, w[i]->data, true, false, false, false);
+      }
+    }
+  }
+}
+
+static int
+mapped(void)
+{
+  int count = 0;
+
+  for ( const gm_port_mapping_t * m = GM.sta.ip4.port_mappings; m; m = m->next )
+    count++;
+  return count;
+}
+
+static bool
+first_mapped(void)
+{
+  return mapped() > 0;
+}
+
+static bool
+all_mapped(void)
+{
+  return mapped() >= ports;
+}
+
+static int
+compare(const void * a, const void * b)
+{
+  const double x = *(const double *)a;
+  const double y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void
+summary(const char * name, double * values, int count)
+{
+  double sum = 0;
+
+  if ( count == 0 ) {
+    printf("%s: no samples.\n", name);
+    return;
+  }
+  qsort(values, count, sizeof(*values), compare);
+  for ( int i = 0; i < count; i++ )
+    sum += values[i];
+  printf(
+   "%s: min %.0f, median %.0f, mean %.0f, 90%% %.0f, max %.0f ms.\n",
+   name,
+   values[0],
+   values[count / 2],
+   sum / count,
+   values[count * 9 / 10],
+   values[count - 1]);
+}
+
+int
+main(int argc, char * * argv)
+{
+  const char *	address = "127.0.0.1";
+  const char *	router = "127.0.0.2";
+  int		trials = 10;
+  int		duration = 60;
+  int		option;
+  static double	first[MAX_TRIALS];
+  static double	all[MAX_TRIALS];
+  double	packets = 0;
+  int		completed = 0;
+
+  while ( (option = getopt(argc, argv, "a:r:t:d:p:c")) != -1 ) {
+    switch ( option ) {
+    case 'a': address = optarg; break;
+    case 'r': router = optarg; break;
+    case 't': trials = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 'p': ports = atoi(optarg); break;
+    case 'c': remember = true; break;
+    default:
+      fprintf(stderr, "Usage: %s [-a address] [-r router] [-t trials] [-d seconds] [-p ports] [-c]\n", argv[0]);
+      return 1;
+    }
+  }
+  if ( trials > MAX_TRIALS )
+    trials = MAX_TRIALS;
+  if ( ports < 1 || ports > 8 ) {
+    fprintf(stderr, "From 1 to 8 ports, the size of the client's pool.\n");
+    return 1;
+  }
+
+  GM.application_name = "pcp_bench";
+  GM.sta.ip4.address.sin_family = AF_INET;
+  GM.sta.ip4.router.sin_family = AF_INET;
+  if ( inet_pton(AF_INET, address, &GM.sta.ip4.address.sin_addr) != 1
+   ||  inet_pton(AF_INET, router, &GM.sta.ip4.router.sin_addr) != 1 ) {
+    fprintf(stderr, "Expected IPv4 addresses.\n");
+    return 1;
+  }
+  for ( int i = 0; i < MAX_FDS; i++ )
+    watches[i].fd = -1;
+  srandom(getpid());
+
+  // The mappings are made once. Each start of the listener requests them again.
+  for ( int i = 0; i < ports; i++ )
+    gm_port_control_protocol_map(false, false, FIRST_PORT + i, 0);
+
+  // Time to mapping.
+  for ( int t = 0; t < trials; t++ ) {
+    const int64_t	start = esp_timer_get_time();
+    const unsigned long	before = sent_pcp + sent_nat_pmp;
+
+    gm_port_control_protocol_start_listener_ipv4();
+    run_until(start + TRIAL_TIMEOUT, first_mapped);
+    first[completed] = (esp_timer_get_time() - start) / 1000.0;
+    run_until(start + TRIAL_TIMEOUT, all_mapped);
+    all[completed] = (esp_timer_get_time() - start) / 1000.0;
+    if ( all_mapped() ) {
+      packets += sent_pcp + sent_nat_pmp - before;
+      completed++;
+    }
+    else
+      printf("Trial %d: not mapped after %lld seconds.\n", t + 1, TRIAL_TIMEOUT / 1000000);
+
+    gm_port_control_protocol_stop_listener_ipv4();
+    run_until(esp_timer_get_time() + 10000, NULL);
+  }
+  printf("%d of %d trials mapped %d ports.\n", completed, trials, ports);
+  summary("Time to the first mapping", first, completed);
+  summary("Time to all mappings", all, completed);
+  if ( completed > 0 )
+    printf("Requests sent per trial: %.1f.\n", packets / completed);
+
+  // Renewal overhead, and availability.
+  if ( duration > 0 ) {
+    int64_t		unmapped = 0;
+    int64_t		last;
+    int64_t		end;
+    unsigned long	sent;
+    int			losses = 0;
+    bool		was_mapped;
+
+    gm_port_control_protocol_start_listener_ipv4();
+    run_until(esp_timer_get_time() + TRIAL_TIMEOUT, all_mapped);
+    sent = sent_pcp + sent_nat_pmp;
+    last = esp_timer_get_time();
+    end = last + duration * 1000000LL;
+    was_mapped = all_mapped();
+
+    while ( last < end ) {
+      int64_t now;
+
+      run_until(last + 10000, NULL);
+      now = esp_timer_get_time();
+      if ( !all_mapped() )
+        unmapped += now - last;
+      if ( was_mapped && !all_mapped() )
+        losses++;
+      was_mapped = all_mapped();
+      last = now;
+    }
+    sent = sent_pcp + sent_nat_pmp - sent;
+    printf(
+     "Over %d seconds: %lu requests, %.1f per port per hour. Not mapped %.2f%% of the time, lost a mapping %d times.\n",
+     duration,
+     sent,
+     sent * 3600.0 / duration / ports,
+     100.0 * unmapped / (duration * 1000000.0),
+     losses);
+    gm_port_control_protocol_report();
+    gm_port_control_protocol_stop_listener_ipv4();
+    run_until(esp_timer_get_time() + 10000, NULL);
+  }
+  printf("Sent %lu PCP and %lu NAT-PMP datagrams in all.\n", sent_pcp, sent_nat_pmp);
+  return 0;
+}
@@ -0,0 +1,565 @@
+// A stand-in router for testing port_control_protocol.c. It answers PCP MAP and
+// ANNOUNCE requests, and NAT-PMP mapping and address requests, and can be told to
+// misbehave as routers and networks do, so that the client's retransmission,
+// renewal, and epoch handling can be seen and measured. pcp_bench.c runs the
+// client against it on the host.
+//
+// Usage: pcp_server [-a address] [-m pcp|nat-pmp|both] [-l lifetime] [-e external]
+//                   [-x loss-percent] [-w delay-ms] [-j jitter-ms] [-r reset-seconds]
+//                   [-n wrong-nonce-percent] [-s seed] [-q]
+//
+//   -a	Address to listen on, port 5351. The client binds 5351 too, so this must
+//	differ from its address. 127.0.0.2 works on Linux without configuration.
+//   -m	Protocols to speak. Requests in the other get UNSUPP_VERSION.
+//   -l	Longest lifetime granted, in seconds. Short ones make renewals frequent.
+//   -e	External address to report.
+//   -x	Drop this percentage of requests, as a lossy network would.
+//   -w	Wait this long before answering each request.
+//   -j	And up to this much longer, at random, so that answers can be reordered.
+//   -r	Lose every mapping, and restart the epoch, this often, as a router that
+//	restarts does. An ANNOUNCE is multicast to 224.0.0.1 then.
+//   -n	Send this percentage of PCP answers twice, first with a wrong nonce, as an
+//	off-path attacker might.
+//   -s	Seed for the random numbers, so that a run can be repeated.
+//   -q	Don't print each request.
+//
+// Totals are printed on SIGINT or SIGTERM.
+//
+// Build it with: cc -O2 -o pcp_server pcp_server.c
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+
+#define PCP_PORT		5351
+#define ANNOUNCE_PORT		5350
+#define MAX_MAPPINGS		64
+#define MAX_PENDING		64
+#define PACKET_SIZE		1100
+#define PCP_HEADER_SIZE		24
+#define PCP_MAP_SIZE		(PCP_HEADER_SIZE + 36)
+
+enum {
+  NAT_PMP = 0,
+  PCP = 2
+};
+
+enum {
+  SPEAK_PCP = 1,
+  SPEAK_NAT_PMP = 2
+};
+
+enum {
+  SUCCESS = 0,
+  UNSUPP_VERSION = 1,
+  MALFORMED_REQUEST = 3,
+  UNSUPP_OPCODE = 4,
+  NO_RESOURCES = 8
+};
+
+typedef struct _mapping {
+  bool			in_use;
+  int			version;
+  uint8_t		protocol;	// PCP's numbering: 6 for TCP, 17 for UDP.
+  struct sockaddr_in	client;
+  uint16_t		internal_port;
+  uint16_t		external_port;
+  double		expires;
+} mapping_t;
+
+// An answer that's waiting for its delay.
+typedef struct _pending {
+  bool			in_use;
+  double		when;
+  struct sockaddr_in	to;
+  size_t		size;
+  uint8_t		packet[PACKET_SIZE];
+} pending_t;
+
+static mapping_t	mappings[MAX_MAPPINGS];
+static pending_t	pending[MAX_PENDING];
+static int		sock;
+static int		speaks = SPEAK_PCP | SPEAK_NAT_PMP;
+static uint32_t		max_lifetime = 3600;
+static struct in_addr	external;
+static int		loss = 0;
+static int		delay = 0;
+static int		jitter = 0;
+static int		wrong_nonce = 0;
+static bool		quiet = false;
+static double		epoch_start;
+static volatile bool	done = false;
+
+static struct {
+  unsigned long	requests;
+  unsigned long	dropped;
+  unsigned long	created;
+  unsigned long	renewed;
+  unsigned long	deleted;
+  unsigned long	refused;
+  unsigned long	wrong_nonces;
+  unsigned long	resets;
+} totals;
+
+static double
+now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+put16(uint8_t * p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+static void
+put32(uint8_t * p, uint32_t v)
+{
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+static uint16_t
+get16(const uint8_t * p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+get32(const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static uint32_t
+epoch(void)
+{
+  return (uint32_t)(now() - epoch_start);
+}
+
+static bool
+chance(int percent)
+{
+  return percent > 0 && random() % 100 < percent;
+}
+
+static void
+stop(int signal)
+{
+  done = true;
+}
+
+// Queue an answer, to be sent after the delay.
+static void
+answer(const uint8_t * packet, size_t size, const struct sockaddr_in * to)
+{
+  const double wait = (delay + (jitter > 0 ? random() % jitter : 0)) / 1000.0;
+
+  if ( wait <= 0 ) {
+    sendto(sock, packet, size, 0, (const struct sockaddr *)to, sizeof(*to));
+    return;
+  }
+  for ( int i = 0; i < MAX_PENDING; i++ ) {
+    pending_t * const p = &pending[i];
+
+    if ( !p->in_use ) {
+      p->in_use = true;
+      p->when = now() + wait;
+      p->to = *to;
+      p->size = size;
+      memcpy(p->packet, packet, size);
+      return;
+    }
+  }
+  printf("Too many answers waiting, dropped one.\n");
+}
+
+static void
+send_pending(void)
+{
+  const double t = now();
+
+  for ( int i = 0; i < MAX_PENDING; i++ ) {
+    pending_t * const p = &pending[i];
+
+    if ( p->in_use && p->when <= t ) {
+      sendto(sock, p->packet, p->size, 0, (const struct sockaddr *)&p->to, sizeof(p->to));
+      p->in_use = false;
+    }
+  }
+}
+
+// The time until the next answer is due, for select().
+static bool
+next_pending(struct timeval * tv)
+{
+  double next = 0;
+
+  for ( int i = 0; i < MAX_PENDING; i++ ) {
+    if ( pending[i].in_use && (next == 0 || pending[i].when < next) )
+      next = pending[i].when;
+  }
+  if ( next == 0 )
+    return false;
+
+  next -= now();
+  if ( next < 0 )
+    next = 0;
+  tv->tv_sec = (time_t)next;
+  tv->tv_usec = (suseconds_t)((next - tv->tv_sec) * 1e6);
+  return true;
+}
+
+// Find the client's mapping, or make one. The suggested external port is given
+// if no other mapping has it. Returns NULL if the table is full.
+static mapping_t *
+map(int version, uint8_t protocol, const struct sockaddr_in * client, uint16_t internal_port, uint16_t suggested, bool * created)
+{
+  mapping_t *	free_mapping = NULL;
+  bool		taken = suggested == 0;
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    mapping_t * const m = &mappings[i];
+
+    if ( m->in_use && m->expires <= now() )
+      m->in_use = false;
+    if ( !m->in_use ) {
+      if ( free_mapping == NULL )
+        free_mapping = m;
+      continue;
+    }
+    if ( m->protocol == protocol && m->internal_port == internal_port
+     && m->client.sin_addr.s_addr == client->sin_addr.s_addr ) {
+      *created = false;
+      return m;
+    }
+    if ( m->protocol == protocol && m->external_port == suggested )
+      taken = true;
+  }
+  if ( free_mapping == NULL )
+    return NULL;
+
+  free_mapping->in_use = true;
+  free_mapping->version = version;
+  free_mapping->protocol = protocol;
+  free_mapping->client = *client;
+  free_mapping->internal_port = internal_port;
+  free_mapping->external_port = taken ? 40000 + (free_mapping - mappings) : suggested;
+  *created = true;
+  return free_mapping;
+}
+
+// Grant, renew, or delete a mapping, for either protocol. Returns the lifetime
+// granted, or -1 if there's no room.
+static int64_t
+grant(mapping_t * * result, int version, uint8_t protocol, const struct sockaddr_in * client, uint16_t internal_port, uint16_t suggested, uint32_t lifetime)
+{
+  bool		created;
+  mapping_t *	m = map(version, protocol, client, internal_port, suggested, &created);
+
+  *result = m;
+  if ( m == NULL )
+    return -1;
+
+  if ( lifetime == 0 ) {
+    m->in_use = false;
+    totals.deleted++;
+    return 0;
+  }
+  if ( lifetime > max_lifetime )
+    lifetime = max_lifetime;
+  m->expires = now() + lifetime;
+  if ( created )
+    totals.created++;
+  else
+    totals.renewed++;
+  return lifetime;
+}
+
+static void
+pcp_request(const uint8_t * request, size_t size, const struct sockaddr_in * client)
+{
+  uint8_t	response[PCP_MAP_SIZE] = {};
+  size_t	response_size = PCP_HEADER_SIZE;
+  const uint8_t	opcode = request[1] & 0x7f;
+
+  response[0] = PCP;
+  response[1] = request[1] | 0x80;
+  put32(&response[8], epoch());
+
+  if ( !(speaks & SPEAK_PCP) ) {
+    // A NAT-PMP server says so in its own format.
+    response[0] = NAT_PMP;
+    put16(&response[2], UNSUPP_VERSION);
+    put32(&response[4], epoch());
+    totals.refused++;
+    answer(response, 8, client);
+    return;
+  }
+
+  if ( opcode == 0 ) {
+    // ANNOUNCE.
+    answer(response, PCP_HEADER_SIZE, client);
+    return;
+  }
+  if ( opcode != 1 ) {
+    response[3] = UNSUPP_OPCODE;
+    totals.refused++;
+    answer(response, PCP_HEADER_SIZE, client);
+    return;
+  }
+  if ( size < PCP_MAP_SIZE ) {
+    response[3] = MALFORMED_REQUEST;
+    totals.refused++;
+    answer(response, PCP_HEADER_SIZE, client);
+    return;
+  }
+
+  mapping_t *		m;
+  const int64_t		lifetime = grant(&m, PCP, request[36], client, get16(&request[40]), get16(&request[42]), get32(&request[4]));
+
+  memcpy(&response[24], &request[24], 36);
+  response_size = PCP_MAP_SIZE;
+  if ( lifetime < 0 ) {
+    response[3] = NO_RESOURCES;
+    put32(&response[4], 30);
+    totals.refused++;
+  }
+  else {
+    put32(&response[4], lifetime);
+    if ( m )
+      put16(&response[42], m->external_port);
+    memset(&response[44], 0, 10);
+    response[54] = 0xff;
+    response[55] = 0xff;
+    memcpy(&response[56], &external.s_addr, 4);
+  }
+
+  if ( chance(wrong_nonce) ) {
+    uint8_t wrong[PCP_MAP_SIZE];
+
+    memcpy(wrong, response, sizeof(wrong));
+    wrong[24] ^= 0x5a;
+    totals.wrong_nonces++;
+    answer(wrong, response_size, client);
+  }
+  if ( !quiet )
+    printf(
+     "PCP MAP %s port %u, lifetime %d, epoch %u.\n",
+     request[36] == 6 ? "TCP" : "UDP",
+     get16(&request[40]),
+     (int)lifetime,
+     epoch());
+  answer(response, response_size, client);
+}
+
+static void
+nat_pmp_request(const uint8_t * request, size_t size, const struct sockaddr_in * client)
+{
+  uint8_t	response[16] = {};
+  const uint8_t	opcode = request[1];
+
+  response[0] = NAT_PMP;
+  response[1] = opcode | 0x80;
+  put32(&response[4], epoch());
+
+  if ( !(speaks & SPEAK_NAT_PMP) ) {
+    // A PCP server that doesn't do NAT-PMP answers in NAT-PMP's format.
+    put16(&response[2], UNSUPP_VERSION);
+    totals.refused++;
+    answer(response, 8, client);
+    return;
+  }
+
+  switch ( opcode ) {
+  case 0:
+    memcpy(&response[8], &external.s_addr, 4);
+    if ( !quiet )
+      printf("NAT-PMP address, epoch %u.\n", epoch());
+    answer(response, 12, client);
+    return;
+  case 1:
+  case 2:
+    if ( size >= 12 ) {
+      mapping_t *	m;
+      const int64_t	lifetime = grant(&m, NAT_PMP, opcode == 2 ? 6 : 17, client, get16(&request[4]), get16(&request[6]), get32(&request[8]));
+
+      put16(&response[8], get16(&request[4]));
+      if ( lifetime < 0 ) {
+        put16(&response[2], 4);	// Out of resources.
+        totals.refused++;
+      }
+      else {
+        if ( m )
+          put16(&response[10], m->external_port);
+        put32(&response[12], lifetime);
+      }
+      if ( !quiet )
+        printf("NAT-PMP MAP %s port %u, lifetime %d, epoch %u.\n", opcode == 2 ? "TCP" : "UDP", get16(&request[4]), (int)lifetime, epoch());
+      answer(response, 16, client);
+      return;
+    }
+    break;
+  }
+  put16(&response[2], 5);	// Unsupported opcode.
+  totals.refused++;
+  answer(response, 8, client);
+}
+
+// The router restarted. Its mappings are gone, and it tells the network.
+static void
+reset(void)
+{
+  struct sockaddr_in	to = {};
+  uint8_t		announce[PCP_HEADER_SIZE] = {};
+  uint8_t		address[12] = {};
+
+  memset(mappings, 0, sizeof(mappings));
+  epoch_start = now();
+  totals.resets++;
+  printf("Reset: the mappings are gone, and the epoch starts again.\n");
+
+  to.sin_family = AF_INET;
+  to.sin_port = htons(ANNOUNCE_PORT);
+  inet_pton(AF_INET, "224.0.0.1", &to.sin_addr);
+  if ( speaks & SPEAK_PCP ) {
+    announce[0] = PCP;
+    announce[1] = 0x80;
+    sendto(sock, announce, sizeof(announce), 0, (struct sockaddr *)&to, sizeof(to));
+  }
+  if ( speaks & SPEAK_NAT_PMP ) {
+    address[0] = NAT_PMP;
+    address[1] = 0x80;
+    memcpy(&address[8], &external.s_addr, 4);
+    sendto(sock, address, sizeof(address), 0, (struct sockaddr *)&to, sizeof(to));
+  }
+}
+
+int
+main(int argc, char * * argv)
+{
+  const char *		listen_address = "127.0.0.2";
+  int			reset_interval = 0;
+  unsigned int		seed = (unsigned int)time(NULL);
+  int			option;
+  struct sockaddr_in	address = {};
+  double		next_reset = 0;
+
+  inet_pton(AF_INET, "203.0.113.9", &external);
+
+  while ( (option = getopt(argc, argv, "a:m:l:e:x:w:j:r:n:s:q")) != -1 ) {
+    switch ( option ) {
+    case 'a': listen_address = optarg; break;
+    case 'm':
+      if ( strcmp(optarg, "pcp") == 0 )
+        speaks = SPEAK_PCP;
+      else if ( strcmp(optarg, "nat-pmp") == 0 )
+        speaks = SPEAK_NAT_PMP;
+      else
+        speaks = SPEAK_PCP | SPEAK_NAT_PMP;
+      break;
+    case 'l': max_lifetime = atoi(optarg); break;
+    case 'e': inet_pton(AF_INET, optarg, &external); break;
+    case 'x': loss = atoi(optarg); break;
+    case 'w': delay = atoi(optarg); break;
+    case 'j': jitter = atoi(optarg); break;
+    case 'r': reset_interval = atoi(optarg); break;
+    case 'n': wrong_nonce = atoi(optarg); break;
+    case 's': seed = atoi(optarg); break;
+    case 'q': quiet = true; break;
+    default:
+      fprintf(stderr, "Usage: %s [-a address] [-m pcp|nat-pmp|both] [-l lifetime] [-e external] [-x loss-percent] [-w delay-ms] [-j jitter-ms] [-r reset-seconds] [-n wrong-nonce-percent] [-s seed] [-q]\n", argv[0]);
+      return 1;
+    }
+  }
+  srandom(seed);
+
+  if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+    perror("socket");
+    return 1;
+  }
+  address.sin_family = AF_INET;
+  address.sin_port = htons(PCP_PORT);
+  if ( inet_pton(AF_INET, listen_address, &address.sin_addr) != 1 ) {
+    fprintf(stderr, "%s isn't an IPv4 address.\n", listen_address);
+    return 1;
+  }
+  if ( bind(sock, (struct sockaddr *)&address, sizeof(address)) != 0 ) {
+    perror("bind");
+    return 1;
+  }
+  setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &address.sin_addr, sizeof(address.sin_addr));
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  epoch_start = now();
+  if ( reset_interval > 0 )
+    next_reset = now() + reset_interval;
+  fprintf(stderr, "Listening on %s port %d.\n", listen_address, PCP_PORT);
+
+  while ( !done ) {
+    fd_set		fds;
+    struct timeval	tv = { 1, 0 };
+
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    if ( !next_pending(&tv) )
+      tv = (struct timeval){ 1, 0 };
+    if ( tv.tv_sec >= 1 )
+      tv = (struct timeval){ 1, 0 };	// To notice resets and signals.
+
+    if ( select(sock + 1, &fds, NULL, NULL, &tv) > 0 && FD_ISSET(sock, &fds) ) {
+      uint8_t		packet[PACKET_SIZE];
+      struct sockaddr_in	client;
+      socklen_t		client_size = sizeof(client);
+      const ssize_t	size = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *)&client, &client_size);
+
+      if ( size >= 2 && (packet[1] & 0x80) == 0 ) {
+        totals.requests++;
+        if ( chance(loss) ) {
+          totals.dropped++;
+          if ( !quiet )
+            printf("Dropped a request.\n");
+        }
+        else if ( packet[0] == PCP && size >= PCP_HEADER_SIZE )
+          pcp_request(packet, size, &client);
+        else if ( packet[0] == NAT_PMP )
+          nat_pmp_request(packet, size, &client);
+      }
+    }
+    send_pending();
+    if ( next_reset > 0 && now() >= next_reset ) {
+      reset();
+      next_reset += reset_interval;
+    }
+    fflush(stdout);
+  }
+
+  printf(
+   "%lu requests, %lu dropped, %lu mappings made, %lu renewed, %lu deleted, %lu refused, %lu wrong nonces, %lu resets.\n",
+   totals.requests,
+   totals.dropped,
+   totals.created,
+   totals.renewed,
+   totals.deleted,
+   totals.refused,
+   totals.wrong_nonces,
+   totals.resets);
+  return 0;
+}
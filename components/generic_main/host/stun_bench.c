@@ -0,0 +1,209 @@
+// Host benchmark of the STUN codec, for the messages that the STUN and TURN clients
+// receive and send. Build it with the command in ../CMakeLists.txt, and run it with
+// no arguments.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "stun.h"
+
+#define ITERATIONS	1000000
+
+struct sample {
+  const char *	name;
+  uint8_t	message[512];
+  int		size;
+};
+
+static const uint32_t	transaction_id[3] = { 0x01020304, 0x05060708, 0x090a0b0c };
+
+static double
+now(void)
+{
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static void
+address(struct sockaddr_storage * s, const char * text, uint16_t port)
+{
+  memset(s, '\0', sizeof(*s));
+  if ( inet_pton(AF_INET, text, &((struct sockaddr_in *)s)->sin_addr) == 1 ) {
+    s->ss_family = AF_INET;
+    ((struct sockaddr_in *)s)->sin_port = htons(port);
+  }
+  else {
+    s->ss_family = AF_INET6;
+    inet_pton(AF_INET6, text, &((struct sockaddr_in6 *)s)->sin6_addr);
+    ((struct sockaddr_in6 *)s)->sin6_port = htons(port);
+  }
+}
+
+// A binding request, as the STUN client sends it.
+static int
+binding_request(uint8_t * buffer, size_t size)
+{
+  stun_encoder_t e;
+
+  stun_encode_begin(&e, buffer, size, STUN_REQUEST, STUN_BINDING, transaction_id);
+  stun_encode_fingerprint(&e);
+  return stun_encode_end(&e);
+}
+
+// An authenticated ALLOCATE, as the TURN client sends it. The HMAC isn't
+// calculated, it doesn't matter to the codec.
+static int
+allocate_request(uint8_t * buffer, size_t size)
+{
+  static const uint8_t	hash[20] = {};
+  stun_encoder_t	e;
+
+  stun_encode_begin(&e, buffer, size, STUN_REQUEST, TURN_ALLOCATE, transaction_id);
+  stun_encode_u32(&e, REQUESTED_TRANSPORT, 17 << 24);
+  stun_encode_u32(&e, LIFETIME, 600);
+  stun_encode_string(&e, SOFTWARE, "generic_main");
+  stun_encode_string(&e, USERNAME, "user");
+  stun_encode_string(&e, REALM, "example.org");
+  stun_encode_string(&e, NONCE, "f2b6e3a1c4d5e6f7a8b9c0d1e2f3a4b5");
+  stun_encode_integrity_begin(&e);
+  stun_encode_attribute(&e, MESSAGE_INTEGRITY, hash, sizeof(hash));
+  stun_encode_fingerprint(&e);
+  return stun_encode_end(&e);
+}
+
+static void
+make_samples(struct sample * samples)
+{
+  static const uint8_t		hash[20] = {};
+  static const uint8_t		unauthorized[] = { 0, 0, 4, 1, 'U', 'n', 'a', 'u', 't', 'h', 'o', 'r', 'i', 'z', 'e', 'd' };
+  uint8_t			data[160];
+  struct sockaddr_storage	mapped;
+  struct sockaddr_storage	mapped6;
+  struct sockaddr_storage	relayed;
+  stun_encoder_t		e;
+
+  address(&mapped, "203.0.113.45", 49152);
+  address(&mapped6, "2001:db8:85a3::8a2e:370:7334", 49153);
+  address(&relayed, "198.51.100.7", 50000);
+  memset(data, 'x', sizeof(data));
+
+  samples[0].name = "Binding response";
+  stun_encode_begin(&e, samples[0].message, sizeof(samples[0].message), STUN_RESPONSE, STUN_BINDING, transaction_id);
+  stun_encode_xor_address(&e, XOR_MAPPED_ADDRESS, (struct sockaddr *)&mapped);
+  stun_encode_string(&e, SOFTWARE, "Citrix-3.2.4.5 'Marshal West'");
+  stun_encode_fingerprint(&e);
+  samples[0].size = stun_encode_end(&e);
+
+  samples[1].name = "IPv6 binding response";
+  stun_encode_begin(&e, samples[1].message, sizeof(samples[1].message), STUN_RESPONSE, STUN_BINDING, transaction_id);
+  stun_encode_xor_address(&e, XOR_MAPPED_ADDRESS, (struct sockaddr *)&mapped6);
+  stun_encode_fingerprint(&e);
+  samples[1].size = stun_encode_end(&e);
+
+  samples[2].name = "401 response";
+  stun_encode_begin(&e, samples[2].message, sizeof(samples[2].message), STUN_ERROR, TURN_ALLOCATE, transaction_id);
+  stun_encode_attribute(&e, ERROR_CODE, unauthorized, sizeof(unauthorized));
+  stun_encode_string(&e, REALM, "example.org");
+  stun_encode_string(&e, NONCE, "f2b6e3a1c4d5e6f7a8b9c0d1e2f3a4b5");
+  stun_encode_string(&e, SOFTWARE, "coturn-4.6.2");
+  stun_encode_fingerprint(&e);
+  samples[2].size = stun_encode_end(&e);
+
+  samples[3].name = "ALLOCATE response";
+  stun_encode_begin(&e, samples[3].message, sizeof(samples[3].message), STUN_RESPONSE, TURN_ALLOCATE, transaction_id);
+  stun_encode_xor_address(&e, XOR_RELAYED_ADDRESS, (struct sockaddr *)&relayed);
+  stun_encode_xor_address(&e, XOR_MAPPED_ADDRESS, (struct sockaddr *)&mapped);
+  stun_encode_u32(&e, LIFETIME, 600);
+  stun_encode_string(&e, SOFTWARE, "coturn-4.6.2");
+  stun_encode_integrity_begin(&e);
+  stun_encode_attribute(&e, MESSAGE_INTEGRITY, hash, sizeof(hash));
+  stun_encode_fingerprint(&e);
+  samples[3].size = stun_encode_end(&e);
+
+  samples[4].name = "Data indication";
+  stun_encode_begin(&e, samples[4].message, sizeof(samples[4].message), STUN_INDICATION, TURN_DATA, transaction_id);
+  stun_encode_xor_address(&e, XOR_PEER_ADDRESS, (struct sockaddr *)&mapped);
+  stun_encode_attribute(&e, DATA, data, sizeof(data));
+  samples[4].size = stun_encode_end(&e);
+}
+
+// Check that what was encoded decodes to the same thing.
+static int
+check(const stun_decoded_t * d)
+{
+  if ( d->transaction_id[0] != transaction_id[0] || d->transaction_id[2] != transaction_id[2] )
+    return -1;
+
+  switch ( d->method ) {
+  case STUN_BINDING:
+    return stun_has(d, K_XOR_MAPPED_ADDRESS) && stun_has(d, K_FINGERPRINT) ? 0 : -1;
+  case TURN_ALLOCATE:
+    if ( d->message_class == STUN_ERROR )
+      return d->error_code == 401 && d->realm.length == 11 && stun_has(d, K_NONCE) ? 0 : -1;
+    return stun_has(d, K_XOR_RELAYED_ADDRESS) && d->lifetime == 600 && d->message_integrity > 0 ? 0 : -1;
+  case TURN_DATA:
+    return stun_has(d, K_XOR_PEER_ADDRESS) && d->data.length == 160 ? 0 : -1;
+  }
+  return -1;
+}
+
+int
+main(int argc, char * * argv)
+{
+  struct sample		samples[5];
+  stun_decoded_t	d;
+  uint8_t		buffer[512];
+  double		start;
+  double		elapsed;
+  unsigned long		sum = 0;
+
+  // The check value of CRC-32.
+  if ( stun_crc32((const uint8_t *)"123456789", 9) != 0xcbf43926 ) {
+    fprintf(stderr, "CRC-32 is wrong.\n");
+    return 1;
+  }
+
+  make_samples(samples);
+
+  for ( size_t i = 0; i < sizeof(samples) / sizeof(*samples); i++ ) {
+    const struct sample * const s = &samples[i];
+
+    if ( s->size < 0 || stun_decode(s->message, s->size, &d) != 0 || check(&d) != 0 ) {
+      fprintf(stderr, "%s: didn't decode correctly: %s.\n", s->name, d.error ? d.error : "wrong result");
+      return 1;
+    }
+
+    start = now();
+    for ( int j = 0; j < ITERATIONS; j++ ) {
+      stun_decode(s->message, s->size, &d);
+      sum += d.present;
+    }
+    elapsed = now() - start;
+
+    printf(
+     "Decode %s, %d bytes: %.0f ns, %.0f MB/s.\n",
+     s->name,
+     s->size,
+     elapsed / ITERATIONS * 1e9,
+     (double)s->size * ITERATIONS / elapsed / 1e6);
+  }
+
+  start = now();
+  for ( int j = 0; j < ITERATIONS; j++ )
+    sum += binding_request(buffer, sizeof(buffer));
+  elapsed = now() - start;
+  printf("Encode binding request, %d bytes: %.0f ns.\n", binding_request(buffer, sizeof(buffer)), elapsed / ITERATIONS * 1e9);
+
+  start = now();
+  for ( int j = 0; j < ITERATIONS; j++ )
+    sum += allocate_request(buffer, sizeof(buffer));
+  elapsed = now() - start;
+  printf("Encode ALLOCATE request, %d bytes: %.0f ns.\n", allocate_request(buffer, sizeof(buffer)), elapsed / ITERATIONS * 1e9);
+
+  // So that the loops aren't optimized away.
+  return sum == 0;
+}
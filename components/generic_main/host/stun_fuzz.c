@@ -0,0 +1,248 @@
+// libFuzzer target for the STUN codec. Build it with the command in
+// ../CMakeLists.txt, which needs clang, and run it with a corpus directory:
+//
+//   stun_fuzz corpus/
+//
+// Every input is decoded, and what was decoded is checked to lie within the input.
+// The decoded strings and addresses are then encoded again, into a buffer that's
+// too small for some of them, so that the encoder's bounds are tried as well.
+//
+// With -DSTANDALONE, it builds with any compiler, and instead runs the target on
+// random mutations of a few valid messages, or on the files given as arguments.
+// Use -fsanitize=address,undefined with it.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "stun.h"
+
+static void
+fail(const char * why)
+{
+  fprintf(stderr, "%s\n", why);
+  abort();
+}
+
+static void
+check_bytes(const uint8_t * data, size_t size, const stun_bytes_t * b)
+{
+  if ( b->value == NULL ) {
+    if ( b->length != 0 )
+      fail("NULL value has a length.");
+    return;
+  }
+  if ( b->value < data || b->value + b->length > data + size )
+    fail("Value is outside the message.");
+}
+
+static void
+check_address(const struct sockaddr_storage * a)
+{
+  if ( a->ss_family != 0 && a->ss_family != AF_INET && a->ss_family != AF_INET6 )
+    fail("Invalid address family.");
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t * data, size_t size)
+{
+  stun_decoded_t	d;
+  stun_encoder_t	e;
+  uint8_t		buffer[128];
+  static const uint32_t	transaction_id[3] = {};
+
+  if ( stun_decode(data, size, &d) != 0 ) {
+    if ( d.error == NULL )
+      fail("Rejected without a reason.");
+    return 0;
+  }
+
+  if ( size < STUN_HEADER_SIZE || (size & 3) != 0 )
+    fail("Accepted a message with an invalid size.");
+  if ( d.message_class > STUN_ERROR || d.method > 0xfff )
+    fail("Invalid class or method.");
+  if ( d.present >> K_COUNT )
+    fail("Invalid present bits.");
+  if ( d.number_of_unknown < 0 || d.number_of_unknown > STUN_MAX_UNKNOWN )
+    fail("Invalid number of unknown attributes.");
+  if ( stun_has(&d, K_ERROR_CODE) && (d.error_code < 300 || d.error_code > 699) )
+    fail("Invalid error code.");
+  if ( stun_has(&d, K_CHANNEL_NUMBER) && (d.channel_number < 0x4000 || d.channel_number > 0x4fff) )
+    fail("Invalid channel number.");
+  if ( stun_has(&d, K_MESSAGE_INTEGRITY) && d.message_integrity + 24 > size )
+    fail("MESSAGE-INTEGRITY is outside the message.");
+  if ( stun_has(&d, K_MESSAGE_INTEGRITY_SHA256) && d.message_integrity_sha256 + 20 > size )
+    fail("MESSAGE-INTEGRITY-SHA256 is outside the message.");
+
+  check_bytes(data, size, &d.reason);
+  check_bytes(data, size, &d.username);
+  check_bytes(data, size, &d.realm);
+  check_bytes(data, size, &d.nonce);
+  check_bytes(data, size, &d.software);
+  check_bytes(data, size, &d.data);
+  check_address(&d.mapped_address);
+  check_address(&d.relayed_address);
+  check_address(&d.peer_address);
+  check_address(&d.alternate_server);
+
+  stun_encode_begin(&e, buffer, sizeof(buffer), STUN_RESPONSE, d.method, transaction_id);
+  if ( stun_has(&d, K_XOR_MAPPED_ADDRESS) || stun_has(&d, K_MAPPED_ADDRESS) )
+    stun_encode_xor_address(&e, XOR_MAPPED_ADDRESS, (const struct sockaddr *)&d.mapped_address);
+  if ( stun_has(&d, K_XOR_RELAYED_ADDRESS) )
+    stun_encode_xor_address(&e, XOR_RELAYED_ADDRESS, (const struct sockaddr *)&d.relayed_address);
+  if ( stun_has(&d, K_SOFTWARE) )
+    stun_encode_attribute(&e, SOFTWARE, d.software.value, d.software.length);
+  if ( stun_has(&d, K_NONCE) )
+    stun_encode_attribute(&e, NONCE, d.nonce.value, d.nonce.length);
+  if ( stun_has(&d, K_DATA) )
+    stun_encode_attribute(&e, DATA, d.data.value, d.data.length);
+  stun_encode_fingerprint(&e);
+
+  if ( e.length > sizeof(buffer) )
+    fail("Encoded past the end of the buffer.");
+  if ( stun_encode_end(&e) >= 0 ) {
+    stun_decoded_t again;
+
+    if ( stun_decode(buffer, e.length, &again) != 0 )
+      fail("The encoder made a message that doesn't decode.");
+    if ( (stun_has(&d, K_XOR_MAPPED_ADDRESS) || stun_has(&d, K_MAPPED_ADDRESS)) != stun_has(&again, K_XOR_MAPPED_ADDRESS)
+     || memcmp(&again.mapped_address, &d.mapped_address, sizeof(d.mapped_address)) != 0
+     || again.software.length != d.software.length
+     || again.data.length != d.data.length )
+      fail("The message didn't survive encoding and decoding.");
+  }
+  return 0;
+}
+
+#ifdef STANDALONE
+#define ITERATIONS	2000000
+
+static size_t
+seed(uint8_t * buffer, size_t size, int which)
+{
+  static const uint32_t		transaction_id[3] = { 0x01020304, 0x05060708, 0x090a0b0c };
+  static const uint8_t		hash[20] = {};
+  static const uint8_t		stale[] = { 0, 0, 4, 38, 'S', 't', 'a', 'l', 'e' };
+  struct sockaddr_in6		address6 = {};
+  struct sockaddr_in		address = {};
+  stun_encoder_t		e;
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(49152);
+  address.sin_addr.s_addr = htonl(0xcb00712d);
+  address6.sin6_family = AF_INET6;
+  address6.sin6_port = htons(3478);
+  address6.sin6_addr.s6_addr[0] = 0x20;
+  address6.sin6_addr.s6_addr[15] = 1;
+
+  switch ( which ) {
+  case 0:
+    stun_encode_begin(&e, buffer, size, STUN_RESPONSE, STUN_BINDING, transaction_id);
+    stun_encode_xor_address(&e, XOR_MAPPED_ADDRESS, (struct sockaddr *)&address6);
+    stun_encode_string(&e, SOFTWARE, "test");
+    stun_encode_fingerprint(&e);
+    break;
+  case 1:
+    stun_encode_begin(&e, buffer, size, STUN_ERROR, TURN_REFRESH, transaction_id);
+    stun_encode_attribute(&e, ERROR_CODE, stale, sizeof(stale));
+    stun_encode_string(&e, NONCE, "0123456789abcdef");
+    stun_encode_u32(&e, 0x7fff, 0);	// Unknown, comprehension-required.
+    break;
+  default:
+    stun_encode_begin(&e, buffer, size, STUN_RESPONSE, TURN_CHANNEL_BIND, transaction_id);
+    stun_encode_xor_address(&e, XOR_RELAYED_ADDRESS, (struct sockaddr *)&address);
+    stun_encode_u32(&e, CHANNEL_NUMBER, 0x4001 << 16);
+    stun_encode_u32(&e, LIFETIME, 600);
+    stun_encode_string(&e, DATA, "payload");
+    stun_encode_integrity_begin(&e);
+    stun_encode_attribute(&e, MESSAGE_INTEGRITY, hash, sizeof(hash));
+    stun_encode_fingerprint(&e);
+    break;
+  }
+  return stun_encode_end(&e);
+}
+
+static int
+run_file(const char * name)
+{
+  static uint8_t	data[65536 + STUN_HEADER_SIZE];
+  FILE *		f = fopen(name, "rb");
+  size_t		size;
+
+  if ( f == NULL ) {
+    perror(name);
+    return 1;
+  }
+  size = fread(data, 1, sizeof(data), f);
+  fclose(f);
+  LLVMFuzzerTestOneInput(data, size);
+  return 0;
+}
+
+int
+main(int argc, char * * argv)
+{
+  uint8_t	original[256];
+  uint8_t	data[256];
+  unsigned long	accepted = 0;
+
+  if ( argc > 1 ) {
+    for ( int i = 1; i < argc; i++ ) {
+      if ( run_file(argv[i]) != 0 )
+        return 1;
+    }
+    return 0;
+  }
+
+  srandom(1);
+  for ( long i = 0; i < ITERATIONS; i++ ) {
+    size_t		size = seed(original, sizeof(original), i % 3);
+    stun_decoded_t	d;
+    const int		mutations = 1 + random() % 4;
+
+    memcpy(data, original, size);
+    for ( int m = 0; m < mutations && size > 0; m++ ) {
+      switch ( random() % 4 ) {
+      case 0:	// Flip a bit.
+        data[random() % size] ^= 1 << (random() % 8);
+        break;
+      case 1:	// Set a byte.
+        data[random() % size] = random();
+        break;
+      case 2:	// Truncate, or extend with junk.
+        {
+          const size_t new_size = random() % sizeof(data);
+
+          for ( size_t j = size; j < new_size; j++ )
+            data[j] = random();
+          size = new_size;
+        }
+        break;
+      case 3:	// Change an attribute length, the likeliest place for trouble.
+        if ( size > STUN_HEADER_SIZE + 4 ) {
+          const size_t at = STUN_HEADER_SIZE + (random() % ((size - STUN_HEADER_SIZE) / 4)) * 4;
+
+          data[at + 2] = random() % 2;
+          data[at + 3] = random();
+        }
+        break;
+      }
+    }
+    // Make the header length match, so that mutations get past the first check.
+    if ( size >= STUN_HEADER_SIZE && random() % 2 ) {
+      data[2] = (size - STUN_HEADER_SIZE) >> 8;
+      data[3] = (size - STUN_HEADER_SIZE) & 0xff;
+    }
+    // A copy of the exact size, so that the sanitizer sees any read past its end.
+    uint8_t * const copy = malloc(size ? size : 1);
+
+    memcpy(copy, data, size);
+    LLVMFuzzerTestOneInput(copy, size);
+    if ( stun_decode(copy, size, &d) == 0 )
+      accepted++;
+    free(copy);
+  }
+  printf("%d inputs, %lu accepted.\n", ITERATIONS, accepted);
+  return 0;
+}
+#endif
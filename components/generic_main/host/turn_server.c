@@ -0,0 +1,555 @@
+// A stand-in TURN server for testing the TURN client in turn.c. It relays UDP
+// over UDP, with the long-term credential mechanism, and enough of RFC 8656 for
+// the client: ALLOCATE, REFRESH, CREATE_PERMISSION, CHANNEL_BIND, Send and Data
+// indications, and ChannelData. Point the device at it with the
+// "turn -u name -p password address:port" command, and then send to the relayed
+// address it prints from a peer, for example with "nc -u".
+//
+// Usage: turn_server [-p port] [-r realm] [-u name:password] [-l lifetime] [-d drop-count]
+//
+//   -p	Port to listen on.
+//   -r	Realm.
+//   -u	User name and password. The default is "test:test".
+//   -l	Most seconds of allocation lifetime to grant, to make the client refresh sooner.
+//   -d	Don't answer this many requests at first, to make the client retransmit.
+//
+// Permissions and channels don't expire here, and nonces are never stale. Relayed
+// addresses are on the loopback interface, so the peers must be on this host.
+//
+// Build it with: cc -O2 -o turn_server turn_server.c -lcrypto
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#define MAX_ALLOCATIONS	8
+#define MAX_PEERS	16
+#define PACKET_SIZE	1500
+#define MAGIC		0x2112a442
+
+enum {
+  ALLOCATE = 3,
+  REFRESH = 4,
+  SEND = 6,
+  DATA_INDICATION = 7,
+  CREATE_PERMISSION = 8,
+  CHANNEL_BIND = 9
+};
+
+enum {
+  USERNAME = 0x06,
+  MESSAGE_INTEGRITY = 0x08,
+  ERROR_CODE = 0x09,
+  CHANNEL_NUMBER = 0x0c,
+  LIFETIME = 0x0d,
+  XOR_PEER_ADDRESS = 0x12,
+  DATA = 0x13,
+  REALM = 0x14,
+  NONCE = 0x15,
+  XOR_RELAYED_ADDRESS = 0x16,
+  REQUESTED_TRANSPORT = 0x19,
+  XOR_MAPPED_ADDRESS = 0x20
+};
+
+typedef struct _peer {
+  struct sockaddr_in	address;	// Port 0 for a permission without a channel.
+  uint16_t		channel;
+} peer_t;
+
+typedef struct _allocation {
+  bool			in_use;
+  struct sockaddr_in	client;
+  int			relay;
+  struct sockaddr_in	relayed;
+  peer_t		peers[MAX_PEERS];
+  int			number_of_peers;
+} allocation_t;
+
+static allocation_t	allocations[MAX_ALLOCATIONS];
+static const char *	realm = "test";
+static char		username[64] = "test";
+static const char *	password = "test";
+static const char	nonce[] = "0123456789abcdef";
+static uint32_t		max_lifetime = 3600;
+static uint8_t		key[16];
+static int		sock;
+
+static void
+put16(uint8_t * p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static void
+put32(uint8_t * p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(&p[2], v & 0xffff);
+}
+
+static uint16_t
+get16(const uint8_t * p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static bool
+same_client(const struct sockaddr_in * a, const struct sockaddr_in * b)
+{
+  return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+static const char *
+text(const struct sockaddr_in * a)
+{
+  static char	buffer[2][32];
+  static int	which = 0;
+
+  which ^= 1;
+  snprintf(buffer[which], sizeof(buffer[which]), "%s:%u", inet_ntoa(a->sin_addr), ntohs(a->sin_port));
+  return buffer[which];
+}
+
+// A response being built.
+typedef struct _message {
+  uint8_t	data[PACKET_SIZE];
+  size_t	length;
+} message_t;
+
+static void
+begin(message_t * m, uint16_t type, const uint8_t * transaction_id)
+{
+  put16(m->data, type);
+  put16(&m->data[2], 0);
+  put32(&m->data[4], MAGIC);
+  memcpy(&m->data[8], transaction_id, 12);
+  m->length = 20;
+}
+
+static void
+add(message_t * m, uint16_t type, const void * value, size_t length)
+{
+  put16(&m->data[m->length], type);
+  put16(&m->data[m->length + 2], length);
+  memcpy(&m->data[m->length + 4], value, length);
+  memset(&m->data[m->length + 4 + length], '\0', (4 - (length & 3)) & 3);
+  m->length += 4 + ((length + 3) & ~3);
+  put16(&m->data[2], m->length - 20);
+}
+
+static void
+add_xor_address(message_t * m, uint16_t type, const struct sockaddr_in * a)
+{
+  uint8_t value[8] = { 0, 1 };
+
+  put16(&value[2], ntohs(a->sin_port) ^ (MAGIC >> 16));
+  put32(&value[4], ntohl(a->sin_addr.s_addr) ^ MAGIC);
+  add(m, type, value, sizeof(value));
+}
+
+static void
+hmac(const uint8_t * data, size_t length, uint8_t * result)
+{
+  unsigned int result_length = 20;
+
+  HMAC(EVP_sha1(), key, sizeof(key), data, length, result, &result_length);
+}
+
+static void
+add_integrity(message_t * m)
+{
+  uint8_t hash[20];
+
+  put16(&m->data[2], m->length - 20 + 24);
+  hmac(m->data, m->length, hash);
+  add(m, MESSAGE_INTEGRITY, hash, sizeof(hash));
+}
+
+static void
+send_to_client(const message_t * m, const struct sockaddr_in * client)
+{
+  sendto(sock, m->data, m->length, 0, (const struct sockaddr *)client, sizeof(*client));
+}
+
+static void
+error(uint16_t method, const uint8_t * transaction_id, int code, const char * reason, bool challenge, const struct sockaddr_in * client)
+{
+  message_t	m;
+  uint8_t	value[64] = {};
+
+  begin(&m, 0x0110 | method, transaction_id);
+  value[2] = code / 100;
+  value[3] = code % 100;
+  strcpy((char *)&value[4], reason);
+  add(&m, ERROR_CODE, value, 4 + strlen(reason));
+  if ( challenge ) {
+    add(&m, REALM, realm, strlen(realm));
+    add(&m, NONCE, nonce, strlen(nonce));
+  }
+  send_to_client(&m, client);
+  printf(": error %d.\n", code);
+}
+
+static allocation_t *
+find(const struct sockaddr_in * client)
+{
+  for ( int i = 0; i < MAX_ALLOCATIONS; i++ ) {
+    if ( allocations[i].in_use && same_client(&allocations[i].client, client) )
+      return &allocations[i];
+  }
+  return NULL;
+}
+
+static peer_t *
+find_peer(allocation_t * a, const struct sockaddr_in * address, bool exact)
+{
+  for ( int i = 0; i < a->number_of_peers; i++ ) {
+    peer_t * const p = &a->peers[i];
+
+    if ( p->address.sin_addr.s_addr == address->sin_addr.s_addr
+     && (!exact || p->address.sin_port == address->sin_port) )
+      return p;
+  }
+  return NULL;
+}
+
+static peer_t *
+add_peer(allocation_t * a, const struct sockaddr_in * address, bool exact)
+{
+  peer_t * p = find_peer(a, address, exact);
+
+  if ( p == NULL && a->number_of_peers < MAX_PEERS ) {
+    p = &a->peers[a->number_of_peers++];
+    memset(p, '\0', sizeof(*p));
+    p->address = *address;
+    if ( !exact )
+      p->address.sin_port = 0;
+  }
+  return p;
+}
+
+static void
+free_allocation(allocation_t * a)
+{
+  close(a->relay);
+  a->in_use = false;
+}
+
+// Handle a STUN request or indication from a client.
+static void
+request(uint8_t * packet, size_t size, const struct sockaddr_in * client)
+{
+  const uint16_t	type = get16(packet);
+  const uint16_t	method = type & 0x3eef;
+  const uint8_t * const	transaction_id = &packet[8];
+  const bool		indication = (type & 0x0110) == 0x0010;
+  struct sockaddr_in	peer = {};
+  bool			have_peer = false;
+  uint32_t		lifetime = 600;
+  bool			have_lifetime = false;
+  int			channel = -1;
+  const uint8_t *	data = NULL;
+  size_t		data_length = 0;
+  size_t		integrity = 0;
+  bool			have_username = false;
+  allocation_t *	a = find(client);
+  message_t		m;
+
+  for ( size_t offset = 20; offset + 4 <= size; ) {
+    const uint16_t	attribute = get16(&packet[offset]);
+    const size_t	length = get16(&packet[offset + 2]);
+    const uint8_t *	value = &packet[offset + 4];
+
+    if ( offset + 4 + length > size )
+      return;
+    switch ( attribute ) {
+    case USERNAME:
+      have_username = length < sizeof(username) && memcmp(value, username, length) == 0 && username[length] == '\0';
+      break;
+    case MESSAGE_INTEGRITY:
+      if ( integrity == 0 )
+        integrity = offset;
+      break;
+    case CHANNEL_NUMBER:
+      channel = get16(value);
+      break;
+    case LIFETIME:
+      have_lifetime = true;
+      lifetime = ((uint32_t)get16(value) << 16) | get16(&value[2]);
+      break;
+    case XOR_PEER_ADDRESS:
+      if ( value[1] == 1 ) {
+        // A CREATE_PERMISSION with several peers permits them all.
+        if ( have_peer && a && method == CREATE_PERMISSION )
+          add_peer(a, &peer, false);
+        peer.sin_family = AF_INET;
+        peer.sin_port = htons(get16(&value[2]) ^ (MAGIC >> 16));
+        peer.sin_addr.s_addr = htonl((((uint32_t)get16(&value[4]) << 16) | get16(&value[6])) ^ MAGIC);
+        have_peer = true;
+      }
+      break;
+    case DATA:
+      data = value;
+      data_length = length;
+      break;
+    }
+    offset += 4 + ((length + 3) & ~3);
+  }
+
+  if ( indication ) {
+    // Send indications aren't authenticated.
+    if ( method == SEND && a && have_peer && data && find_peer(a, &peer, false) )
+      sendto(a->relay, data, data_length, 0, (struct sockaddr *)&peer, sizeof(peer));
+    return;
+  }
+
+  printf("%s from %s", method == ALLOCATE ? "ALLOCATE" : method == REFRESH ? "REFRESH" : method == CREATE_PERMISSION ? "CREATE_PERMISSION" : method == CHANNEL_BIND ? "CHANNEL_BIND" : "?", text(client));
+
+  if ( integrity == 0 || !have_username ) {
+    error(method, transaction_id, 401, "Unauthorized", true, client);
+    return;
+  }
+  {
+    uint8_t		hash[20];
+    const uint16_t	length = get16(&packet[2]);
+
+    put16(&packet[2], integrity - 20 + 24);
+    hmac(packet, integrity, hash);
+    put16(&packet[2], length);
+    if ( memcmp(hash, &packet[integrity + 4], sizeof(hash)) != 0 ) {
+      error(method, transaction_id, 401, "Unauthorized", true, client);
+      return;
+    }
+  }
+
+  if ( method != ALLOCATE && a == NULL ) {
+    error(method, transaction_id, 437, "Allocation Mismatch", false, client);
+    return;
+  }
+
+  begin(&m, 0x0100 | method, transaction_id);
+  switch ( method ) {
+  case ALLOCATE:
+    if ( a == NULL ) {
+      socklen_t size = sizeof(struct sockaddr_in);
+
+      for ( int i = 0; i < MAX_ALLOCATIONS && a == NULL; i++ ) {
+        if ( !allocations[i].in_use )
+          a = &allocations[i];
+      }
+      if ( a == NULL ) {
+        error(method, transaction_id, 486, "Allocation Quota Reached", false, client);
+        return;
+      }
+      memset(a, '\0', sizeof(*a));
+      a->relay = socket(AF_INET, SOCK_DGRAM, 0);
+      a->relayed.sin_family = AF_INET;
+      a->relayed.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+      bind(a->relay, (struct sockaddr *)&a->relayed, sizeof(a->relayed));
+      getsockname(a->relay, (struct sockaddr *)&a->relayed, &size);
+      a->client = *client;
+      a->in_use = true;
+    }
+    add_xor_address(&m, XOR_RELAYED_ADDRESS, &a->relayed);
+    add_xor_address(&m, XOR_MAPPED_ADDRESS, client);
+    printf(": relayed %s", text(&a->relayed));
+    // Fall through.
+  case REFRESH:
+    {
+      uint8_t value[4];
+
+      if ( lifetime > max_lifetime )
+        lifetime = max_lifetime;
+      put32(value, lifetime);
+      add(&m, LIFETIME, value, sizeof(value));
+      printf(", lifetime %u", lifetime);
+    }
+    break;
+  case CREATE_PERMISSION:
+    if ( have_peer )
+      add_peer(a, &peer, false);
+    printf(": %d peers", a->number_of_peers);
+    break;
+  case CHANNEL_BIND:
+    {
+      peer_t * p;
+
+      if ( !have_peer || channel < 0x4000 || channel > 0x7fff || (p = add_peer(a, &peer, true)) == NULL ) {
+        error(method, transaction_id, 400, "Bad Request", false, client);
+        return;
+      }
+      p->channel = channel;
+      add_peer(a, &peer, false);
+      printf(": channel 0x%x to %s", channel, text(&peer));
+    }
+    break;
+  }
+  add_integrity(&m);
+  send_to_client(&m, client);
+  printf(".\n");
+
+  if ( method == REFRESH && have_lifetime && lifetime == 0 )
+    free_allocation(a);
+}
+
+// Relay ChannelData from a client to its peer.
+static void
+channel_data(const uint8_t * packet, size_t size, const struct sockaddr_in * client)
+{
+  allocation_t * const	a = find(client);
+  const uint16_t	channel = get16(packet);
+  const size_t		length = get16(&packet[2]);
+
+  if ( a == NULL || length + 4 > size )
+    return;
+  for ( int i = 0; i < a->number_of_peers; i++ ) {
+    const peer_t * const p = &a->peers[i];
+
+    if ( p->channel == channel ) {
+      sendto(a->relay, &packet[4], length, 0, (const struct sockaddr *)&p->address, sizeof(p->address));
+      return;
+    }
+  }
+}
+
+// Relay data from a peer to the client, in ChannelData if the peer has a channel,
+// or else in a Data indication.
+static void
+from_peer(allocation_t * a)
+{
+  uint8_t		packet[PACKET_SIZE];
+  struct sockaddr_in	peer;
+  socklen_t		peer_size = sizeof(peer);
+  const ssize_t		size = recvfrom(a->relay, &packet[4], sizeof(packet) - 4, 0, (struct sockaddr *)&peer, &peer_size);
+  const peer_t *	p;
+
+  if ( size < 0 )
+    return;
+
+  // Only from peers that have a permission.
+  if ( find_peer(a, &peer, false) == NULL ) {
+    printf("Dropped %d bytes from %s, which doesn't have a permission.\n", (int)size, text(&peer));
+    return;
+  }
+
+  if ( (p = find_peer(a, &peer, true)) != NULL && p->channel != 0 ) {
+    put16(packet, p->channel);
+    put16(&packet[2], size);
+    sendto(sock, packet, size + 4, 0, (const struct sockaddr *)&a->client, sizeof(a->client));
+  }
+  else {
+    message_t	m;
+    uint8_t	transaction_id[12];
+
+    for ( size_t i = 0; i < sizeof(transaction_id); i++ )
+      transaction_id[i] = random();
+    begin(&m, 0x0010 | DATA_INDICATION, transaction_id);
+    add_xor_address(&m, XOR_PEER_ADDRESS, &peer);
+    add(&m, DATA, &packet[4], size);
+    send_to_client(&m, &a->client);
+  }
+}
+
+int
+main(int argc, char * * argv)
+{
+  int			port = 3478;
+  int			drop = 0;
+  int			option;
+  struct sockaddr_in	address = {};
+  char			credentials[256];
+
+  while ( (option = getopt(argc, argv, "p:r:u:l:d:")) != -1 ) {
+    switch ( option ) {
+    case 'p': port = atoi(optarg); break;
+    case 'r': realm = optarg; break;
+    case 'u':
+      {
+        char * const colon = strchr(optarg, ':');
+
+        if ( colon == NULL || (size_t)(colon - optarg) >= sizeof(username) ) {
+          fprintf(stderr, "Expected name:password.\n");
+          return 1;
+        }
+        *colon = '\0';
+        strcpy(username, optarg);
+        password = colon + 1;
+      }
+      break;
+    case 'l': max_lifetime = atoi(optarg); break;
+    case 'd': drop = atoi(optarg); break;
+    default:
+      fprintf(stderr, "Usage: %s [-p port] [-r realm] [-u name:password] [-l lifetime] [-d drop-count]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // The long-term credential key.
+  snprintf(credentials, sizeof(credentials), "%s:%s:%s", username, realm, password);
+  EVP_Digest(credentials, strlen(credentials), key, NULL, EVP_md5(), NULL);
+
+  if ( (sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0 ) {
+    perror("socket");
+    return 1;
+  }
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  if ( bind(sock, (struct sockaddr *)&address, sizeof(address)) != 0 ) {
+    perror("bind");
+    return 1;
+  }
+  fprintf(stderr, "Listening on port %d.\n", port);
+
+  for ( ; ; ) {
+    fd_set	fds;
+    int		highest = sock;
+
+    FD_ZERO(&fds);
+    FD_SET(sock, &fds);
+    for ( int i = 0; i < MAX_ALLOCATIONS; i++ ) {
+      if ( allocations[i].in_use ) {
+        FD_SET(allocations[i].relay, &fds);
+        if ( allocations[i].relay > highest )
+          highest = allocations[i].relay;
+      }
+    }
+    if ( select(highest + 1, &fds, NULL, NULL, NULL) < 0 ) {
+      perror("select");
+      return 1;
+    }
+
+    for ( int i = 0; i < MAX_ALLOCATIONS; i++ ) {
+      if ( allocations[i].in_use && FD_ISSET(allocations[i].relay, &fds) )
+        from_peer(&allocations[i]);
+    }
+
+    if ( FD_ISSET(sock, &fds) ) {
+      uint8_t		packet[PACKET_SIZE];
+      struct sockaddr_in	client;
+      socklen_t		client_size = sizeof(client);
+      const ssize_t	size = recvfrom(sock, packet, sizeof(packet), 0, (struct sockaddr *)&client, &client_size);
+
+      if ( size >= 4 && (packet[0] & 0xc0) == 0x40 )
+        channel_data(packet, size, &client);
+      else if ( size >= 20 && (packet[0] & 0xc0) == 0 && get16(&packet[4]) == (MAGIC >> 16) && 20 + get16(&packet[2]) <= size ) {
+        if ( drop > 0 && (packet[1] & 0x10) == 0 ) {
+          drop--;
+          printf("Dropped a request from %s.\n", text(&client));
+        }
+        else
+          request(packet, 20 + get16(&packet[2]), &client);
+      }
+      fflush(stdout);
+    }
+  }
+}
@@ -0,0 +1,690 @@
+// Asynchronous HTTP client.
+//
+// gm_http_get() and gm_http_post() start a request and return right away. The
+// connection, the TLS handshake, sending the request, and reading the response are
+// all driven by the select task through gm_fd_register(), with non-blocking
+// sockets, so any number of requests can be in flight without a task and a stack
+// for each of them.
+//
+// The body is handed to a callback as it arrives, de-chunked. The callback
+// returns how much of the data it consumed. If that's less than it was given,
+// the client stops reading from the socket, so that TCP pushes back upon the
+// server, until gm_http_resume() is called. The callback is then given the rest
+// again. When the response is complete, or the request fails, the completion
+// callback is called with the HTTP status, or -1. All of the callbacks are
+// called in the select task, and must not block.
+//
+// Names are looked up with gm_dns_resolve(), which doesn't block either.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <lwip/sockets.h>
+#include <esp_tls.h>
+#include <esp_crt_bundle.h>
+#include <mbedtls/base64.h>
+#include <mbedtls/ssl.h>
+#include "generic_main.h"
+
+#define BUFFER_SIZE	1024
+#define TIMEOUT		30 // Seconds without progress before a request fails.
+
+static const char	request_format[] =
+ "%s %s%.*s HTTP/1.1\r\n"
+ "Host: %.*s\r\n"
+ "%s" // Authorization, if there are credentials in the URL.
+ "User-Agent: %s\r\n"
+ "%s" // The caller's headers, and Content-Length, for a POST.
+ "Connection: close\r\n"
+ "\r\n"
+ "%s";
+
+typedef enum _http_state {
+  RESOLVING,
+  CONNECTING,
+  HANDSHAKING,
+  SENDING,
+  STATUS,
+  HEADERS,
+  BODY,
+  CHUNK_SIZE,
+  CHUNK_DATA,
+  CHUNK_END,
+  TRAILER
+} http_state_t;
+
+typedef enum _process_result {
+  MORE,		// Needs more data from the socket.
+  PAUSED,	// The body callback didn't take all of the data.
+  GONE,		// The request finished, and has been freed.
+  FAILED
+} process_result_t;
+
+struct _gm_http_request {
+  http_state_t			state;
+  int				fd;
+  bool				secure;
+  bool				watching;
+  bool				cancelled;
+  bool				chunked;
+  bool				length_known;
+  int				status;
+  size_t			remaining; // Bytes left in the body or the chunk.
+  uint16_t			port;
+  struct sockaddr_storage	address;
+  socklen_t			address_size;
+  char				address_text[INET6_ADDRSTRLEN];
+  esp_tls_t *			tls;
+  esp_tls_cfg_t			tls_cfg;
+  gm_http_body_t		body;
+  gm_http_done_t		done;
+  void *			context;
+  char *			request;
+  size_t			request_length;
+  size_t			request_sent;
+  size_t			start;
+  size_t			used;
+  char				host[64];
+  char				buffer[BUFFER_SIZE];
+};
+
+static void	fd_handler(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
+static void	receive(gm_http_request_t * r);
+
+static void
+watch(gm_http_request_t * r, bool readable, bool writable)
+{
+  gm_fd_register(r->fd, fd_handler, r, readable, writable, false, TIMEOUT);
+  r->watching = true;
+}
+
+static void
+finish(gm_http_request_t * r, int status)
+{
+  if ( r->watching )
+    gm_fd_unregister(r->fd);
+
+  if ( r->tls )
+    esp_tls_conn_destroy(r->tls); // This closes the socket, too.
+  else if ( r->fd >= 0 )
+    close(r->fd);
+
+  if ( r->done )
+    (*r->done)(r, status, r->context);
+
+  free(r->request);
+  free(r);
+}
+
+static bool
+would_block(gm_http_request_t * r, ssize_t result)
+{
+  if ( r->tls )
+    return result == ESP_TLS_ERR_SSL_WANT_READ || result == ESP_TLS_ERR_SSL_WANT_WRITE;
+  else
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+static void
+send_request(gm_http_request_t * r)
+{
+  r->state = SENDING;
+
+  while ( r->request_sent < r->request_length ) {
+    const char *	data = &r->request[r->request_sent];
+    const size_t	size = r->request_length - r->request_sent;
+    ssize_t		result;
+
+    if ( r->tls )
+      result = esp_tls_conn_write(r->tls, data, size);
+    else
+      result = send(r->fd, data, size, MSG_DONTWAIT);
+
+    if ( result > 0 )
+      r->request_sent += result;
+    else if ( would_block(r, result) ) {
+      watch(r, false, true);
+      return;
+    }
+    else {
+      finish(r, -1);
+      return;
+    }
+  }
+  r->state = STATUS;
+  watch(r, true, false);
+}
+
+// esp-tls returns 0 for both MBEDTLS_ERR_SSL_WANT_READ and WANT_WRITE. mbedtls
+// keeps the part of a record it couldn't send in out_left, so that's what says the
+// handshake is waiting for the socket to become writable.
+static bool
+handshake_wants_write(gm_http_request_t * r)
+{
+  const mbedtls_ssl_context * const ssl = esp_tls_get_ssl_context(r->tls);
+
+  return ssl != NULL && ssl->MBEDTLS_PRIVATE(out_left) > 0;
+}
+
+static void
+handshake(gm_http_request_t * r)
+{
+  esp_tls_conn_state_t	state;
+  const int		result = esp_tls_conn_new_async(
+   r->address_text,
+   strlen(r->address_text),
+   r->port,
+   &r->tls_cfg,
+   r->tls);
+
+  if ( r->fd < 0 )
+    esp_tls_get_conn_sockfd(r->tls, &r->fd);
+
+  switch ( result ) {
+  case 1:
+    send_request(r);
+    break;
+  case 0:
+    // Wait for the connection to complete, and then for the server's handshake
+    // messages, or for room to send ours.
+    if ( esp_tls_get_conn_state(r->tls, &state) == ESP_OK && state == ESP_TLS_CONNECTING )
+      watch(r, false, true);
+    else if ( handshake_wants_write(r) )
+      watch(r, false, true);
+    else
+      watch(r, true, false);
+    break;
+  default:
+    finish(r, -1);
+  }
+}
+
+// Runs in the select task, after the name has been looked up.
+static void
+connect_start(gm_http_request_t * r)
+{
+  if ( r->cancelled ) {
+    finish(r, -1);
+    return;
+  }
+
+  if ( r->secure ) {
+    if ( (r->tls = esp_tls_init()) == NULL ) {
+      finish(r, -1);
+      return;
+    }
+    r->tls_cfg.non_block = true;
+    // esp-tls waits this long in its own select() while connecting. It's only
+    // called when the socket is ready, so the wait is never needed.
+    r->tls_cfg.timeout_ms = 1;
+    r->tls_cfg.crt_bundle_attach = esp_crt_bundle_attach;
+    // Connect to the address that was looked up, but check the certificate, and
+    // send the SNI, for the host name.
+    r->tls_cfg.common_name = r->host;
+    r->state = HANDSHAKING;
+    handshake(r);
+    return;
+  }
+
+  if ( (r->fd = socket(r->address.ss_family, SOCK_STREAM, 0)) < 0 ) {
+    finish(r, -1);
+    return;
+  }
+  fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL, 0) | O_NONBLOCK);
+
+  if ( connect(r->fd, (struct sockaddr *)&r->address, r->address_size) == 0 )
+    send_request(r);
+  else if ( errno == EINPROGRESS ) {
+    r->state = CONNECTING;
+    watch(r, false, true);
+  }
+  else
+    finish(r, -1);
+}
+
+// Runs in the select task, when the name has been looked up.
+static void
+resolved(const struct sockaddr_storage * addresses, size_t count, void * context)
+{
+  gm_http_request_t * const	r = (gm_http_request_t *)context;
+
+  if ( count == 0 ) {
+    finish(r, -1);
+    return;
+  }
+  r->address = addresses[0];
+  if ( r->address.ss_family == AF_INET6 ) {
+    r->address_size = sizeof(struct sockaddr_in6);
+    inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&r->address)->sin6_addr, r->address_text, sizeof(r->address_text));
+  }
+  else {
+    r->address_size = sizeof(struct sockaddr_in);
+    inet_ntop(AF_INET, &((struct sockaddr_in *)&r->address)->sin_addr, r->address_text, sizeof(r->address_text));
+  }
+  connect_start(r);
+}
+
+// Runs in the select task.
+static void
+resolve(void * data)
+{
+  gm_http_request_t * const r = (gm_http_request_t *)data;
+
+  if ( gm_dns_resolve(r->host, r->port, AF_UNSPEC, resolved, r) != 0 )
+    finish(r, -1);
+}
+
+// Get the next line of the response header or chunk framing, or NULL if the line
+// isn't complete yet.
+static char *
+next_line(gm_http_request_t * r)
+{
+  char * const	start = &r->buffer[r->start];
+  char *	end = memchr(start, '\n', r->used - r->start);
+
+  if ( end == NULL )
+    return NULL;
+
+  r->start = end - r->buffer + 1;
+  if ( end > start && end[-1] == '\r' )
+    end--;
+  *end = '\0';
+  return start;
+}
+
+static void
+header(gm_http_request_t * r, const char * line)
+{
+  const char * value = strchr(line, ':');
+
+  if ( value == NULL )
+    return;
+
+  value++;
+  while ( *value == ' ' || *value == '\t' )
+    value++;
+
+  if ( strncasecmp(line, "Content-Length:", 15) == 0 ) {
+    r->length_known = true;
+    r->remaining = strtoul(value, 0, 10);
+  }
+  else if ( strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strncasecmp(value, "chunked", 7) == 0 )
+    r->chunked = true;
+}
+
+// Give body data to the callback. Returns PAUSED if it didn't take all of it.
+static process_result_t
+deliver(gm_http_request_t * r)
+{
+  size_t	size = r->used - r->start;
+  ssize_t	consumed;
+
+  if ( size > r->remaining )
+    size = r->remaining;
+  if ( size == 0 )
+    return MORE;
+
+  if ( r->body ) {
+    if ( (consumed = (*r->body)(r, &r->buffer[r->start], size, r->context)) < 0 )
+      return FAILED;
+    if ( consumed > size )
+      consumed = size;
+  }
+  else
+    consumed = size;
+
+  r->start += consumed;
+  if ( r->length_known || r->chunked )
+    r->remaining -= consumed;
+
+  return consumed < size ? PAUSED : MORE;
+}
+
+// Parse what's in the buffer.
+static process_result_t
+process(gm_http_request_t * r)
+{
+  char *		line;
+  process_result_t	result;
+
+  for ( ; ; ) {
+    switch ( r->state ) {
+    case STATUS:
+      if ( (line = next_line(r)) == NULL )
+        return MORE;
+      if ( strncmp(line, "HTTP/1.", 7) != 0 || strlen(line) < 12 )
+        return FAILED;
+      r->status = atoi(&line[9]);
+      r->state = HEADERS;
+      break;
+    case HEADERS:
+      if ( (line = next_line(r)) == NULL )
+        return MORE;
+      if ( *line != '\0' ) {
+        header(r, line);
+        break;
+      }
+      if ( r->chunked ) {
+        r->length_known = false;
+        r->state = CHUNK_SIZE;
+      }
+      else if ( r->length_known && r->remaining == 0 ) {
+        finish(r, r->status);
+        return GONE;
+      }
+      else {
+        if ( !r->length_known )
+          r->remaining = SIZE_MAX; // The body ends when the server closes the connection.
+        r->state = BODY;
+      }
+      break;
+    case BODY:
+      if ( (result = deliver(r)) != MORE )
+        return result;
+      if ( r->length_known && r->remaining == 0 ) {
+        finish(r, r->status);
+        return GONE;
+      }
+      return MORE;
+    case CHUNK_SIZE:
+      if ( (line = next_line(r)) == NULL )
+        return MORE;
+      r->remaining = strtoul(line, 0, 16);
+      r->state = r->remaining ? CHUNK_DATA : TRAILER;
+      break;
+    case CHUNK_DATA:
+      if ( (result = deliver(r)) != MORE )
+        return result;
+      if ( r->remaining > 0 )
+        return MORE;
+      r->state = CHUNK_END;
+      break;
+    case CHUNK_END:
+      if ( next_line(r) == NULL )
+        return MORE;
+      r->state = CHUNK_SIZE;
+      break;
+    case TRAILER:
+      if ( (line = next_line(r)) == NULL )
+        return MORE;
+      if ( *line == '\0' ) {
+        finish(r, r->status);
+        return GONE;
+      }
+      break;
+    default:
+      return FAILED;
+    }
+  }
+}
+
+static void
+receive(gm_http_request_t * r)
+{
+  for ( ; ; ) {
+    ssize_t	result;
+
+    switch ( process(r) ) {
+    case MORE:
+      break;
+    case PAUSED:
+      if ( r->watching ) {
+        gm_fd_unregister(r->fd);
+        r->watching = false;
+      }
+      return;
+    case GONE:
+      return;
+    case FAILED:
+      finish(r, -1);
+      return;
+    }
+
+    // Make room in the buffer.
+    if ( r->start > 0 ) {
+      memmove(r->buffer, &r->buffer[r->start], r->used - r->start);
+      r->used -= r->start;
+      r->start = 0;
+    }
+    if ( r->used >= sizeof(r->buffer) ) {
+      GM_FAIL("HTTP response line too long.\n");
+      finish(r, -1);
+      return;
+    }
+
+    if ( r->tls )
+      result = esp_tls_conn_read(r->tls, &r->buffer[r->used], sizeof(r->buffer) - r->used);
+    else
+      result = recv(r->fd, &r->buffer[r->used], sizeof(r->buffer) - r->used, MSG_DONTWAIT);
+
+    if ( result > 0 )
+      r->used += result;
+    else if ( would_block(r, result) ) {
+      watch(r, true, false);
+      return;
+    }
+    else if ( result == 0 && r->state == BODY && !r->length_known ) {
+      finish(r, r->status);
+      return;
+    }
+    else {
+      finish(r, -1);
+      return;
+    }
+  }
+}
+
+static void
+fd_handler(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  gm_http_request_t * const	r = (gm_http_request_t *)data;
+  int				error = 0;
+  socklen_t			size = sizeof(error);
+
+  if ( timeout ) {
+    // The select task has already unregistered the file descriptor.
+    r->watching = false;
+    finish(r, -1);
+    return;
+  }
+
+  switch ( r->state ) {
+  case CONNECTING:
+    if ( getsockopt(r->fd, SOL_SOCKET, SO_ERROR, &error, &size) != 0 || error != 0 )
+      finish(r, -1);
+    else
+      send_request(r);
+    break;
+  case HANDSHAKING:
+    handshake(r);
+    break;
+  case SENDING:
+    send_request(r);
+    break;
+  default:
+    receive(r);
+  }
+}
+
+// Build the request from the URL. Returns -1 if the URL can't be used.
+static int
+parse_url(gm_http_request_t * r, const char * method, const char * url, const char * headers, const char * content)
+{
+  const char *	authority;
+  const char *	end;
+  const char *	at;
+  const char *	host;
+  const char *	host_end;
+  const char *	path;
+  size_t	path_length;
+  char		authorization[128] = "";
+  char		extra[256] = "";
+  int		length;
+
+  if ( strncmp(url, "http://", 7) == 0 ) {
+    r->secure = false;
+    r->port = 80;
+    authority = &url[7];
+  }
+  else if ( strncmp(url, "https://", 8) == 0 ) {
+    r->secure = true;
+    r->port = 443;
+    authority = &url[8];
+  }
+  else
+    return -1;
+
+  end = authority + strcspn(authority, "/?#");
+  path = end;
+  path_length = strcspn(path, "#");
+
+  // Credentials for basic authentication, as in "user:password@host".
+  if ( (at = memchr(authority, '@', end - authority)) != NULL ) {
+    char	encoded[sizeof(authorization) - 32];
+    size_t	encoded_length;
+
+    if ( mbedtls_base64_encode(
+     (unsigned char *)encoded,
+     sizeof(encoded),
+     &encoded_length,
+     (const unsigned char *)authority,
+     at - authority) != 0 )
+      return -1;
+    snprintf(authorization, sizeof(authorization), "Authorization: Basic %s\r\n", encoded);
+    authority = at + 1;
+  }
+
+  if ( *authority == '[' ) {
+    // An IPv6 address literal.
+    host = authority + 1;
+    if ( (host_end = memchr(host, ']', end - host)) == NULL )
+      return -1;
+  }
+  else {
+    host = authority;
+    if ( (host_end = memchr(host, ':', end - host)) == NULL )
+      host_end = end;
+  }
+  if ( host_end - host >= sizeof(r->host) || host_end == host )
+    return -1;
+  memcpy(r->host, host, host_end - host);
+  r->host[host_end - host] = '\0';
+
+  const char * colon = memchr(host_end, ':', end - host_end);
+  if ( colon )
+    r->port = atoi(colon + 1);
+
+  if ( content ) {
+    length = snprintf(extra, sizeof(extra), "%sContent-Length: %u\r\n", headers ? headers : "", (unsigned int)strlen(content));
+    if ( length >= sizeof(extra) )
+      return -1;
+  }
+
+  length = snprintf(
+   NULL,
+   0,
+   request_format,
+   method,
+   *path == '/' ? "" : "/",
+   (int)path_length,
+   path,
+   (int)(end - authority),
+   authority,
+   authorization,
+   GM.application_name ? GM.application_name : "generic_main",
+   extra,
+   content ? content : "");
+
+  if ( (r->request = malloc(length + 1)) == NULL )
+    return -1;
+
+  r->request_length = snprintf(
+   r->request,
+   length + 1,
+   request_format,
+   method,
+   *path == '/' ? "" : "/",
+   (int)path_length,
+   path,
+   (int)(end - authority),
+   authority,
+   authorization,
+   GM.application_name ? GM.application_name : "generic_main",
+   extra,
+   content ? content : "");
+  return 0;
+}
+
+static gm_http_request_t *
+start(const char * method, const char * url, const char * headers, const char * content, gm_http_body_t body, gm_http_done_t done, void * context)
+{
+  gm_http_request_t * r = calloc(1, sizeof(*r));
+
+  if ( r == NULL )
+    return NULL;
+
+  r->fd = -1;
+  r->body = body;
+  r->done = done;
+  r->context = context;
+  r->state = RESOLVING;
+
+  if ( parse_url(r, method, url, headers, content) != 0 ) {
+    free(r->request);
+    free(r);
+    return NULL;
+  }
+  if ( gm_run(resolve, r, GM_FAST) != 0 ) {
+    free(r->request);
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+// Start an asynchronous GET of the URL. Returns NULL if it couldn't be started, in
+// which case the done callback won't be called.
+gm_http_request_t *
+gm_http_get(const char * url, gm_http_body_t body, gm_http_done_t done, void * context)
+{
+  return start("GET", url, NULL, NULL, body, done, context);
+}
+
+// Start an asynchronous POST of content to the URL. headers, which may be NULL, are
+// added to the request, each ending with CR LF. Content-Length is added here. The
+// response is handled as for gm_http_get().
+gm_http_request_t *
+gm_http_post(const char * url, const char * headers, const char * content, gm_http_body_t body, gm_http_done_t done, void * context)
+{
+  return start("POST", url, headers, content, body, done, context);
+}
+
+// Abandon a request. Its done callback is called with -1, right away unless the
+// name is still being looked up, in which case it's called when that finishes.
+// This must be called in the select task, before the request's done callback has
+// been called, and not from the request's own body callback, which should return
+// -1 instead.
+void
+gm_http_cancel(gm_http_request_t * r)
+{
+  if ( r->state == RESOLVING )
+    r->cancelled = true;
+  else
+    finish(r, -1);
+}
+
+static void
+resume(void * data)
+{
+  receive((gm_http_request_t *)data);
+}
+
+// Continue a request whose body callback didn't take all of the data it was given.
+// This may be called from any task.
+void
+gm_http_resume(gm_http_request_t * r)
+{
+  gm_run(resume, r, GM_FAST);
+}
@@ -1,10 +1,38 @@
+// IPv6 router discovery, RFC 4861 section 6.3.7.
+//
+// Rather than wait minutes for the router's periodic advertisement, router
+// solicitations are sent as soon as the station associates. The first goes after a
+// random delay of up to a second. Until the link-local address has passed duplicate
+// address detection, lwIP can't send, and that one is tried again shortly. After
+// that, they back off from 4 seconds, doubling with 10% jitter up to an hour, as RFC
+// 7559 says, until a router answers. If the router's lifetime runs out without
+// another advertisement, soliciting starts again.
+//
+// Advertisements are decoded, with their prefix information, MTU and recursive DNS
+// server options, and passed to the function given to
+// gm_icmpv6_start_listener_ipv6(). Everything but starting and stopping runs in
+// the select task.
+//
 #include <stdint.h>
+#include <stddef.h>
 #include <sys/types.h>
 #include <lwip/sockets.h>
 #include <arpa/inet.h>
+#include <esp_random.h>
 #include "generic_main.h"
 
-static int icmpv6_socket = -1;
+#define MAX_RTR_SOLICITATION_DELAY	1000	// Milliseconds, RFC 4861.
+#define RTR_SOLICITATION_INTERVAL	4000
+#define MAX_RTR_SOLICITATION_INTERVAL	(3600 * 1000)	// RFC 7559.
+#define NOT_YET_INTERVAL		250	// Before the link-local address is usable.
+#define MAX_NOT_YET			20
+#define PACKET_SIZE			1280	// The IPv6 minimum MTU.
+
+static int	icmpv6_socket = -1;
+static uint32_t	interval = RTR_SOLICITATION_INTERVAL;
+static int	not_yet = 0;
+
+static void	solicit(void * data);
 
 typedef struct _icmpv6_message {
   struct _ipv6_header {
@@ -25,20 +53,130 @@ typedef struct _icmpv6_message {
     uint32_t	reachable_time;
     uint32_t	retransmit_timer;
   } ra;
+  uint8_t	options[];
 } icmpv6_message_t;
 
+typedef union _icmpv6_packet {
+  icmpv6_message_t	m;
+  uint8_t		bytes[PACKET_SIZE];
+} icmpv6_packet_t;
+
 enum icmpv6_message_types {
+  ICMPV6_ROUTER_SOLICITATION = 133,
   ICMPV6_ROUTER_ADVERTISEMENT = 134,
 };
 
+enum ndp_option_types {
+  NDP_PREFIX_INFORMATION = 3,
+  NDP_MTU = 5,
+  NDP_RECURSIVE_DNS_SERVER = 25
+};
+
+enum ra_flags {
+  RA_MANAGED = 0x80,
+  RA_OTHER = 0x40
+};
+
+enum prefix_flags {
+  PREFIX_ON_LINK = 0x80,
+  PREFIX_AUTONOMOUS = 0x40
+};
+
+static uint32_t
+get32(const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void
+decode_prefix_information(const uint8_t * o, gm_ipv6_router_advertisement_t * ra, int * prefixes)
+{
+  const int		count = sizeof(ra->prefixes) / sizeof(*ra->prefixes);
+  gm_ipv6_prefix_t *	p;
+
+  // Link-local prefixes are ignored, RFC 4862 section 5.5.3.
+  if ( *prefixes >= count || o[2] == 0 || o[2] > 128 || (o[16] == 0xfe && (o[17] & 0xc0) == 0x80) )
+    return;
+
+  p = &ra->prefixes[(*prefixes)++];
+  p->length = o[2];
+  p->on_link = (o[3] & PREFIX_ON_LINK) != 0;
+  p->autonomous = (o[3] & PREFIX_AUTONOMOUS) != 0;
+  p->valid_lifetime = get32(&o[4]);
+  p->preferred_lifetime = get32(&o[8]);
+  memcpy(p->prefix.s6_addr, &o[16], sizeof(p->prefix.s6_addr));
+}
+
+static void
+decode_recursive_dns_server(const uint8_t * o, size_t size, gm_ipv6_router_advertisement_t * ra)
+{
+  const size_t	count = sizeof(ra->dns) / sizeof(*ra->dns);
+  size_t	i;
+
+  ra->dns_lifetime = get32(&o[4]);
+  for ( i = 0; i < count && 8 + (i + 1) * 16 <= size; i++ )
+    memcpy(ra->dns[i].s6_addr, &o[8 + i * 16], sizeof(ra->dns[i].s6_addr));
+}
+
 static void
 decode_router_advertisement(icmpv6_message_t * m, ssize_t message_size, void * data, struct sockaddr_in6 * address)
 {
-  if ( !gm_all_zeroes(m->ipv6.source_address, sizeof(m->ipv6.source_address))
-   && m->ra.router_lifetime > 0 ) {
-    gm_ipv6_router_advertisement_after_t after = (gm_ipv6_router_advertisement_after_t)data;
-    (*after)(address, m->ra.router_lifetime);
+  const uint8_t *			o = m->options;
+  const uint8_t *			end = (const uint8_t *)m + message_size;
+  gm_ipv6_router_advertisement_t	ra = {};
+  int					prefixes = 0;
+
+  // The validity checks of RFC 4861 section 6.1.2: from a link-local address, not
+  // forwarded by another router.
+  if ( message_size < (ssize_t)sizeof(*m)
+   || m->ipv6.hop_limit != 255
+   || m->code != 0
+   || m->ipv6.source_address[0] != 0xfe
+   || (m->ipv6.source_address[1] & 0xc0) != 0x80 )
+    return;
+
+  if ( end > (const uint8_t *)m + sizeof(m->ipv6) + ntohs(m->ipv6.payload_length) )
+    end = (const uint8_t *)m + sizeof(m->ipv6) + ntohs(m->ipv6.payload_length);
+
+  ra.router_lifetime = ntohs(m->ra.router_lifetime);
+  ra.managed = (m->ra.flags & RA_MANAGED) != 0;
+  ra.other = (m->ra.flags & RA_OTHER) != 0;
+
+  while ( o + 2 <= end ) {
+    const size_t size = o[1] * 8;
+
+    // An option of zero length makes the whole advertisement invalid.
+    if ( size == 0 || o + size > end )
+      return;
+
+    switch ( o[0] ) {
+    case NDP_PREFIX_INFORMATION:
+      if ( size >= 32 )
+        decode_prefix_information(o, &ra, &prefixes);
+      break;
+    case NDP_MTU:
+      // Smaller than the IPv6 minimum is a mistake.
+      if ( size >= 8 && get32(&o[4]) >= PACKET_SIZE )
+        ra.mtu = get32(&o[4]);
+      break;
+    case NDP_RECURSIVE_DNS_SERVER:
+      if ( size >= 24 )
+        decode_recursive_dns_server(o, size, &ra);
+      break;
+    }
+    o += size;
+  }
+
+  // A router answered. Solicit again if its lifetime runs out without another
+  // advertisement.
+  if ( ra.router_lifetime > 0 ) {
+    gm_timer_cancel(solicit, NULL);
+    interval = RTR_SOLICITATION_INTERVAL;
+    not_yet = 0;
+    gm_timer_add(solicit, NULL, ra.router_lifetime * 1000);
   }
+
+  (*(gm_ipv6_router_advertisement_after_t)data)(address, &ra);
 }
 
 static void
@@ -54,33 +192,82 @@ static void
 incoming_packet(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
 {
   if ( readable ) {
-    icmpv6_message_t		packet;
-    struct sockaddr_storage	address;
-    socklen_t			address_size;
+    static icmpv6_packet_t	packet;
+    struct sockaddr_storage	address = {};
+    socklen_t			address_size = sizeof(address);
     ssize_t			message_size;
 
     message_size = recvfrom(fd, &packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr *)&address, &address_size);
+    if ( message_size < (ssize_t)offsetof(icmpv6_message_t, ra) )
+      return;
     if ( address.ss_family != AF_INET6 ) // We get ICMPv4 packets.
       return;
 
-    decode_packet(&packet, message_size, data, (struct sockaddr_in6 *)&address);
+    decode_packet(&packet.m, message_size, data, (struct sockaddr_in6 *)&address);
   }
 }
 
+// Send a router solicitation to all routers, and schedule the next.
+static void
+solicit(void * data)
+{
+  static const uint8_t	solicitation[8] = { ICMPV6_ROUTER_SOLICITATION };
+  struct sockaddr_in6	address = {};
+  uint32_t		jitter;
+
+  if ( icmpv6_socket < 0 )
+    return;
+
+  address.sin6_family = AF_INET6;
+  address.sin6_scope_id = esp_netif_get_netif_impl_index(GM.sta.esp_netif);
+  inet_pton(AF_INET6, "ff02::2", &address.sin6_addr);
+
+  if ( sendto(icmpv6_socket, solicitation, sizeof(solicitation), 0, (struct sockaddr *)&address, sizeof(address)) < 0
+   && not_yet++ < MAX_NOT_YET ) {
+    gm_timer_add(solicit, NULL, NOT_YET_INTERVAL);
+    return;
+  }
+  not_yet = MAX_NOT_YET;
+
+  jitter = esp_random() % (interval / 5 + 1);
+  gm_timer_add(solicit, NULL, interval - interval / 10 + jitter);
+  interval *= 2;
+  if ( interval > MAX_RTR_SOLICITATION_INTERVAL )
+    interval = MAX_RTR_SOLICITATION_INTERVAL;
+}
+
 void
 gm_icmpv6_start_listener_ipv6 (gm_ipv6_router_advertisement_after_t after)
 {
+  const int hops = 255; // Routers ignore solicitations with any other hop limit.
+
+  if ( icmpv6_socket >= 0 )
+    return;
+
   icmpv6_socket = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
   if ( icmpv6_socket < 0 ) {
     GM_FAIL("Socket creation failed: %s.\n", strerror(errno));
+    return;
   }
+#ifdef IPV6_MULTICAST_HOPS
+  if ( setsockopt(icmpv6_socket, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops)) < 0 )
+    GM_WARN_ONCE("ICMPv6: Can't set the hop limit of router solicitations: %s.\n", strerror(errno));
+#else
+  (void)hops;
+  GM_WARN_ONCE("ICMPv6: lwIP can't set the hop limit of router solicitations.\n");
+#endif
 
   gm_fd_register(icmpv6_socket, incoming_packet, after, after, false, true, 0);
+
+  interval = RTR_SOLICITATION_INTERVAL;
+  not_yet = 0;
+  gm_timer_add(solicit, NULL, esp_random() % MAX_RTR_SOLICITATION_DELAY);
 }
 
 void
 gm_icmpv6_stop_listener_ipv6(void)
 {
+  gm_timer_cancel(solicit, NULL);
   if ( icmpv6_socket >= 0 ) {
     gm_fd_unregister(icmpv6_socket);
     close(icmpv6_socket);
@@ -307,22 +307,25 @@ improv_set_wifi(int fd, const uint8_t * data, uint8_t length)
 {
   uint8_t	ssid[33]; 
   char		old_ssid[33]; 
-  size_t	old_ssid_size = sizeof(old_ssid);
   
   uint8_t	password[65]; 
   char		old_password[65]; 
-  size_t	old_password_size = sizeof(old_password);
   uint8_t	ssid_length;
+  size_t	failed;
+  const gm_param_t settings[] = {
+    { "ssid", (const char *)ssid },
+    { "wifi_password", (const char *)password }
+  };
 
   ssid_length = improv_decode_string(data, ssid);
   improv_decode_string(&data[ssid_length], password);
 
-  esp_err_t ssid_err = nvs_get_str(GM.nvs, "ssid", old_ssid, &old_ssid_size);
-  esp_err_t password_err = nvs_get_str(GM.nvs, "wifi_password", old_password, &old_password_size);
+  gm_nonvolatile_result_t ssid_result = gm_nonvolatile_get("ssid", old_ssid, sizeof(old_ssid));
+  gm_nonvolatile_result_t password_result = gm_nonvolatile_get("wifi_password", old_password, sizeof(old_password));
 
   if ( gm_wifi_is_connected()
-   && ssid_err == ESP_OK
-   && password_err == ESP_OK
+   && ssid_result != GM_NOT_SET
+   && password_result != GM_NOT_SET
    && strcmp((const char *)ssid, old_ssid) == 0
    && strcmp((const char *)password, old_password) == 0 ) {
     improv_state = Provisioned;
@@ -352,8 +355,9 @@ improv_set_wifi(int fd, const uint8_t * data, uint8_t length)
    (void *)fd,
    &handler_wifi_event_sta_disconnected));
 
-  gm_nonvolatile_set("ssid", (const char *)ssid);
-  gm_nonvolatile_set("wifi_password", (const char *)password);
+  // Together, so that WiFi restarts once. It restarts a moment later, from the
+  // slow event loop, after the state sent above.
+  gm_nonvolatile_set_batch(settings, COUNTOF(settings), &failed);
 }
 
 static void
@@ -13,12 +13,16 @@
 #include <../lwip/esp_netif_lwip_internal.h>
 #include <pthread.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <esp_debug_helpers.h>
 
 #define CONSTRUCTOR static void __attribute__ ((constructor))
 
 #define COUNTOF(a) (sizeof((a)) / sizeof(*(a)))
+
+// The HTTPS server's port, which is also the one mapped through the router with PCP.
+#define GM_HTTPS_PORT 443
 /* Self-allocating vsnprintf(). This relies on GCC-specific extensions to C */
 #define GM_VSPRINTF(pattern) \
 ( \
@@ -39,6 +43,7 @@ extern void gm_fail(const char *, const char *, int, const char *, ...);
 ESP_EVENT_DECLARE_BASE(GM_EVENT);
 
 typedef enum _gm_nonvolatile_result {
+  GM_INVALID = -3, // The value doesn't fit the type of the parameter.
   GM_ERROR = -2,
   GM_NOT_IN_PARAMETER_TABLE = -1,
   GM_NORMAL = 0,
@@ -68,13 +73,35 @@ typedef enum _gm_run_speed {
 } gm_run_speed_t;
 
 typedef enum _gm_event_id {
-  GM_RUN
+  GM_RUN,
+  GM_PUBLIC_ADDRESS_CHANGED	// Posted to the default event loop, with gm_public_address_event_t.
 } gm_event_id_t;
 
+typedef struct _gm_public_address_event {
+  bool				ipv6;
+  struct sockaddr_storage	address;
+} gm_public_address_event_t;
+
+struct _gm_http_request;
+typedef struct _gm_http_request gm_http_request_t;
+typedef struct _gm_ipv6_router_advertisement gm_ipv6_router_advertisement_t;
+
+typedef void (*gm_dns_after_t)(const struct sockaddr_storage * addresses, size_t count, void * context);
 typedef void (*gm_fd_handler_t)(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
 typedef void (*gm_run_t)(void *);
+typedef ssize_t (*gm_http_body_t)(gm_http_request_t * request, const char * data, size_t size, void * context);
+typedef void (*gm_http_done_t)(gm_http_request_t * request, int status, void * context);
 typedef void (*gm_stun_after_t)(bool success, bool ipv6, struct sockaddr * address);
-typedef void (*gm_ipv6_router_advertisement_after_t)(struct sockaddr_in6 * address, uint16_t lifetime);
+typedef void (*gm_turn_after_t)(bool success, const struct sockaddr * relayed, void * context);
+typedef void (*gm_turn_receive_t)(const struct sockaddr * peer, uint8_t * data, size_t size, void * context);
+typedef void (*gm_ipv6_router_advertisement_after_t)(const struct sockaddr_in6 * address, const gm_ipv6_router_advertisement_t * ra);
+
+// Statistics of a server or site, for gm_choose_best().
+typedef struct _gm_choice_statistics {
+  uint32_t	attempts;
+  uint32_t	successes;
+  uint32_t	average_latency; // Milliseconds, of successful attempts.
+} gm_choice_statistics_t;
 
 typedef struct _gm_run_data {
   gm_run_t	procedure;
@@ -94,6 +121,26 @@ typedef struct _gm_port_mapping {
   struct _gm_port_mapping * next;
 } gm_port_mapping_t;
 
+typedef struct _gm_ipv6_prefix {
+  struct in6_addr	prefix;
+  uint8_t		length;		// 0 if this entry is unused.
+  bool			on_link;
+  bool			autonomous;	// Addresses are made from it with SLAAC.
+  uint32_t		valid_lifetime;
+  uint32_t		preferred_lifetime;
+} gm_ipv6_prefix_t;
+
+// A router advertisement, decoded by icmpv6.c. Lifetimes are in seconds.
+struct _gm_ipv6_router_advertisement {
+  uint16_t		router_lifetime;
+  bool			managed;	// Addresses are from DHCPv6.
+  bool			other;		// Other configuration is from DHCPv6.
+  uint32_t		mtu;		// 0 if the router didn't say.
+  gm_ipv6_prefix_t	prefixes[3];
+  struct in6_addr	dns[3];		// Recursive name servers, RFC 8106.
+  uint32_t		dns_lifetime;
+};
+
 typedef struct _gm_netif {
   esp_netif_t *		esp_netif;
   // lwip_netif is esp_netif->lwip_netif
@@ -111,6 +158,7 @@ typedef struct _gm_netif {
     struct sockaddr_in6	site_unique;
     struct sockaddr_in6	global[3];
     struct sockaddr_in6 router;
+    gm_ipv6_router_advertisement_t ra; // From the router above, prefixes merged.
     struct sockaddr_in6	pub;
     gm_port_mapping_t *	port_mappings;
     bool pat66; // True if there is prefix-address-translation. Ugh.
@@ -151,17 +199,53 @@ typedef struct _gm_uri {
 typedef struct gm_web_handler {
   const char *	name;
   int		(*handler)(httpd_req_t * request, const gm_uri * uri);
+  bool		asynchronous; // Run in a worker task rather than the HTTP server task.
   struct gm_web_handler * next;
 } gm_web_handler_t;
 
+// The web response writer. See web_writer.c.
+typedef struct _gm_web_writer {
+  httpd_req_t *	request;
+  int		fd;
+  const char *	status;
+  const char *	content_type;
+  const char *	content_encoding;
+  size_t	length;
+  size_t	count;
+  size_t	pending;
+  size_t	scratch_used;
+  bool		chunked;
+  bool		headers_sent;
+  bool		failed;
+  bool		secure; // The session is TLS, so the socket can't be written directly.
+  struct iovec	iov[24];
+  char		prefix[192];
+  char		scratch[2048];
+} gm_web_writer_t;
+
+// The state of the web page being generated by a task. See web_handlers.c.
+typedef struct _gm_web_context {
+  httpd_req_t *		request;
+  void *		template_current;
+  gm_web_writer_t	writer;
+} gm_web_context_t;
+
+typedef struct _gm_web_writer_statistics {
+  uint32_t	responses;
+  uint32_t	sends;
+  uint64_t	bytes;
+} gm_web_writer_statistics_t;
+
 struct _GM_Array;
 
 typedef struct _GM_Array GM_Array;
+typedef void (*gm_boot_trace_write_t)(const char * data, size_t size);
 typedef void (*gm_nonvolatile_list_coroutine_t)(const char *, const char *, const char *, gm_nonvolatile_result_t);
 typedef int (*gm_pattern_coroutine_t)(const char * name, char * result, size_t result_size);
 typedef void (*gm_web_get_coroutine_t)(const char * data, size_t size);
 
 extern generic_main_t		GM;
+extern gm_web_writer_statistics_t gm_web_writer_statistics;
 
 extern bool			gm_all_zeroes(const void *, size_t);
 extern const void *		gm_array_add(GM_Array * array, const void * data);
@@ -170,20 +254,35 @@ extern const void * *		gm_array_data(GM_Array * array);
 extern void			gm_array_destroy(GM_Array * array);
 extern const void *		gm_array_get(GM_Array * array, size_t index);
 extern size_t			gm_array_size(GM_Array * array);
+extern void			gm_boot_trace_constructor(const char * category, const char * name);
+extern void			gm_boot_trace_event(const char * category, const char * name);
+extern void			gm_boot_trace_json(gm_boot_trace_write_t write);
+extern void			gm_boot_trace_phase(const char * name, int64_t start);
+extern void			gm_boot_trace_report(void);
 
+extern size_t			gm_choose_best(const gm_choice_statistics_t * statistics, size_t count, uint32_t untried_latency, uint32_t latency_offset, int * chosen, size_t number_to_choose);
 extern size_t			gm_choose_one(size_t number_of_entries);
 extern void			gm_command_add_registered_to_console(void);
 extern void			gm_command_interpreter_start(void);
 extern void			gm_command_register(const esp_console_cmd_t * command);
 extern void			gm_compressed_fs_web_handlers(httpd_handle_t server);
 extern int			gm_ddns(void);
+extern void			gm_dns_flush(void);
+extern void			gm_dns_report(void);
+extern int			gm_dns_resolve(const char * name, uint16_t port, int family, gm_dns_after_t after, void * context);
+extern int			gm_dns_server(const char * address);
 
 extern void			gm_event_server(void);
 
-extern void			gm_run(gm_run_t function, void * data, gm_run_speed_t speed);
+extern int			gm_run(gm_run_t function, void * data, gm_run_speed_t speed);
 extern void			gm_fd_register(int fd, gm_fd_handler_t handler, void * data, bool readable, bool writable, bool exception, uint32_t seconds);
 extern void			gm_fd_unregister(int fd);
 
+extern void			gm_http_cancel(gm_http_request_t * request);
+extern gm_http_request_t *	gm_http_get(const char * url, gm_http_body_t body, gm_http_done_t done, void * context);
+extern gm_http_request_t *	gm_http_post(const char * url, const char * headers, const char * content, gm_http_body_t body, gm_http_done_t done, void * context);
+extern void			gm_http_resume(gm_http_request_t * request);
+
 extern void			gm_icmpv6_start_listener_ipv6(gm_ipv6_router_advertisement_after_t after);
 extern void			gm_icmpv6_stop_listener_ipv6(void);
 
@@ -191,31 +290,59 @@ extern void			gm_improv_wifi(int fd);
 
 extern void			gm_log_server_start(void);
 extern void			gm_log_server_stop(void);
+extern void			gm_log_stream_install(httpd_handle_t server);
+extern void			gm_log_stream_metric(const char * name, const char * pattern, ...);
+extern bool			gm_log_stream_session_closing(int fd);
+extern void			gm_log_stream_write(const char * data, size_t size);
 
 extern gm_nonvolatile_result_t	gm_nonvolatile_erase(const char * name);
 extern gm_nonvolatile_result_t	gm_nonvolatile_get(const char * name, char * buffer, size_t size);
+extern gm_nonvolatile_result_t	gm_nonvolatile_get_float(const char * name, float * value);
+extern gm_nonvolatile_result_t	gm_nonvolatile_get_int(const char * name, int32_t * value);
 extern void			gm_nonvolatile_list(gm_nonvolatile_list_coroutine_t coroutine);
+extern const char *		gm_nonvolatile_name(size_t index);
+extern void *			gm_nonvolatile_open(const void * sealed, size_t sealed_size, size_t * plain_size);
+extern void *			gm_nonvolatile_seal(const void * plain, size_t plain_size, size_t * sealed_size);
 extern gm_nonvolatile_result_t	gm_nonvolatile_set(const char * name, const char * value);
+extern gm_nonvolatile_result_t	gm_nonvolatile_set_batch(const gm_param_t * params, size_t count, size_t * failed);
+extern gm_nonvolatile_result_t	gm_nonvolatile_set_float(const char * name, float value);
+extern gm_nonvolatile_result_t	gm_nonvolatile_set_int(const char * name, int32_t value);
+extern gm_nonvolatile_result_t	gm_nonvolatile_store(const char * name, const char * value);
 
 extern const char *		gm_param(const gm_param_t * p, int count, const char * name);
 extern int			gm_param_parse(const char * s, gm_param_t * p, int count);
 extern int			gm_pattern_string(const char * string, gm_pattern_coroutine_t coroutine, char * buffer, size_t buffer_size);
+extern int			gm_port_control_protocol_map(bool ipv6, bool tcp, uint16_t internal_port, uint16_t external_port);
+extern int			gm_port_control_protocol_mappings(gm_port_mapping_t * m, int size);
+extern void			gm_port_control_protocol_report(void);
 extern int			gm_port_control_protocol_request_mapping_ipv4(void);
 extern int			gm_port_control_protocol_request_mapping_ipv6(void);
+extern void			gm_port_control_protocol_restore(const gm_port_mapping_t * m, uint32_t remaining);
 extern void			gm_port_control_protocol_start_listener_ipv4(void);
 extern void			gm_port_control_protocol_start_listener_ipv6(void);
 extern void			gm_port_control_protocol_stop_listener_ipv4(void);
 extern void			gm_port_control_protocol_stop_listener_ipv6(void);
 extern int			gm_printf(const char * format, ...);
 extern int			gm_public_ipv4(char * data, size_t size);
+extern void			gm_public_ipv4_report(void);
 
 extern int			gm_stun(bool ipv6, struct sockaddr * address, gm_stun_after_t after);
+extern void			gm_stun_keepalive(bool ipv6, const struct sockaddr * address);
+extern void			gm_stun_report(void);
 extern void			gm_stun_stop();
 
 extern void			gm_select_task(void);
 extern void			gm_select_wakeup(void);
 
+extern int			gm_timer_add(gm_run_t procedure, void * data, uint32_t milliseconds);
+extern void			gm_timer_cancel(gm_run_t procedure, void * data);
 extern void			gm_timer_to_human(int64_t, char *, size_t);
+extern int			gm_tls_server_certificate(const char * * certificate, const char * * private_key);
+extern int			gm_turn_allocate(const char * server, uint16_t port, const char * username, const char * password, gm_turn_after_t after, gm_turn_receive_t receive, void * context);
+extern int			gm_turn_peer(const struct sockaddr * peer);
+extern void			gm_turn_release(void);
+extern void			gm_turn_report(void);
+extern int			gm_turn_send(const struct sockaddr * peer, const void * data, size_t size);
 
 extern void			gm_uart_initialize(void);
 extern void			gm_user_initialize_early(void);
@@ -225,14 +352,36 @@ extern int			gm_uri_parse(const char * uri, gm_uri * u) ;
 
 extern int			gm_vprintf(const char * format, va_list args);
 
+extern bool			gm_warm_boot_access_point(const char * ssid, uint8_t bssid[6], uint8_t * channel);
+extern void			gm_warm_boot_changed(void);
+extern void			gm_warm_boot_connected(void);
+extern bool			gm_warm_boot_ddns_current(void);
+extern void			gm_warm_boot_ddns_published(bool ipv6);
+extern void			gm_warm_boot_ddns_settings_changed(void);
+
+extern gm_web_context_t *	gm_web_context(void);
 extern void			gm_web_finish();
 extern int			gm_web_get(const char *url, char *data, size_t size);
 extern int			gm_web_get_with_coroutine(const char *url, gm_web_get_coroutine_t coroutine);
-extern void			gm_web_handler_install(httpd_handle_t server);
+extern void			gm_web_handler_drain(void);
+extern void			gm_web_handler_install(httpd_handle_t server, bool secure);
 extern void			gm_web_handler_register(gm_web_handler_t * handler, gm_web_method method);
 extern int			gm_web_handler_run(httpd_req_t * req, const gm_uri * uri, gm_web_method method);
+extern void			gm_web_handler_uninstall(void);
+extern void			gm_web_send_constant(const char * data, size_t size);
 extern void			gm_web_send_to_client (const char *d, size_t size);
-extern void			gm_web_set_request(void * context);
+extern void			gm_web_set_request(void * request);
+extern void			gm_web_socket_install(httpd_handle_t server);
+extern void			gm_web_socket_publish(const char * name, const char * pattern, ...);
+extern void			gm_web_socket_uninstall(void);
+extern int			gm_web_vprintf(const char * pattern, va_list args);
+extern void			gm_web_writer_begin(gm_web_writer_t * w, httpd_req_t * req, const char * content_type, const char * content_encoding, ssize_t length);
+extern int			gm_web_writer_constant(gm_web_writer_t * w, const void * data, size_t size);
+extern int			gm_web_writer_copy(gm_web_writer_t * w, const void * data, size_t size);
+extern int			gm_web_writer_finish(gm_web_writer_t * w);
+extern int			gm_web_writer_flush(gm_web_writer_t * w);
+extern int			gm_web_writer_printf(gm_web_writer_t * w, const char * pattern, ...);
+extern int			gm_web_writer_vprintf(gm_web_writer_t * w, const char * pattern, va_list args);
 
 extern bool			gm_wifi_is_connected(void);
 extern void			gm_wifi_events_initialize(void);
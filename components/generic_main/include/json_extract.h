@@ -0,0 +1,45 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Streaming JSON field extraction. See json_extract.c.
+// This header doesn't depend upon ESP-IDF, so that it can be used on the host.
+
+#define GM_JSON_DEPTH		8
+#define GM_JSON_PATH_SIZE	64
+
+// A field to extract. The path is the object keys leading to the value, joined with
+// ".", and array elements are "[n]". For example "ip", "result.address", or
+// "addresses[0]". The value is the unescaped content of a string, or the text of a
+// number, true, false, or null.
+typedef struct _gm_json_field {
+  const char *	path;
+  char *	value;
+  size_t	size;
+  bool		found;
+} gm_json_field_t;
+
+typedef struct _gm_json_extractor {
+  gm_json_field_t *	fields;
+  size_t		number_of_fields;
+  uint8_t		state;
+  uint8_t		depth;
+  bool			failed;
+  uint8_t		unicode_digits;
+  uint16_t		unicode;
+  int			capture; // The index of the field being captured, or -1.
+  size_t		capture_length;
+  size_t		unmatched; // Values that weren't captured into a field.
+  size_t		path_length; // This can be longer than the path buffer, which then doesn't match.
+  struct {
+    bool	array;
+    uint16_t	index;
+    size_t	path_length; // The length of the path of the container.
+  } stack[GM_JSON_DEPTH];
+  char			path[GM_JSON_PATH_SIZE];
+} gm_json_extractor_t;
+
+extern void	gm_json_extract_begin(gm_json_extractor_t * x, gm_json_field_t * fields, size_t number_of_fields);
+extern int	gm_json_extract(gm_json_extractor_t * x, const char * data, size_t size);
+extern int	gm_json_extract_end(gm_json_extractor_t * x);
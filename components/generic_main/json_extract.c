@@ -0,0 +1,372 @@
+// Streaming JSON field extraction.
+//
+// Pull a few fields out of a JSON document as it arrives, without building a tree
+// and without allocating memory. The caller lists the paths of the fields it wants,
+// with a buffer for each, and feeds the document in pieces of any size, for example
+// from the coroutine of gm_web_get_with_coroutine() or the body callback of
+// gm_http_get(). Each value is copied into its field's buffer as it's parsed, and
+// everything else is skipped over. The whole state is in gm_json_extractor_t,
+// which is small enough to be on the stack.
+//
+// This isn't a validating parser. It follows the structure of the document well
+// enough to know the path of every value, and reports errors in that structure.
+//
+// This doesn't depend on ESP-IDF, so that it can be benchmarked on the host.
+//
+#include <stdio.h>
+#include <string.h>
+#include "json_extract.h"
+
+enum state {
+  VALUE,
+  OBJECT_START,	// After "{", expecting a key or "}".
+  ARRAY_START,	// After "[", expecting a value or "]".
+  KEY,
+  KEY_ESCAPE,
+  COLON,
+  AFTER_VALUE,	// Expecting "," or the end of the container.
+  STRING,
+  STRING_ESCAPE,
+  STRING_UNICODE,
+  SCALAR,	// A number, true, false, or null.
+  DONE
+};
+
+static inline bool
+is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static void
+append(gm_json_extractor_t * x, char c)
+{
+  if ( x->path_length < GM_JSON_PATH_SIZE - 1 ) {
+    x->path[x->path_length] = c;
+    x->path[x->path_length + 1] = '\0';
+  }
+  x->path_length++;
+}
+
+static void
+truncate_path(gm_json_extractor_t * x, size_t length)
+{
+  x->path_length = length;
+  if ( length < GM_JSON_PATH_SIZE )
+    x->path[length] = '\0';
+}
+
+// Set the path to that of the current array element.
+static void
+array_element(gm_json_extractor_t * x)
+{
+  char	index[8];
+  int	length;
+
+  truncate_path(x, x->stack[x->depth - 1].path_length);
+  length = snprintf(index, sizeof(index), "[%u]", x->stack[x->depth - 1].index);
+  for ( int i = 0; i < length; i++ )
+    append(x, index[i]);
+}
+
+static void
+begin_value(gm_json_extractor_t * x)
+{
+  x->capture = -1;
+  if ( x->path_length < GM_JSON_PATH_SIZE ) {
+    for ( size_t i = 0; i < x->number_of_fields; i++ ) {
+      const gm_json_field_t * const f = &x->fields[i];
+
+      if ( !f->found && strcmp(f->path, x->path) == 0 ) {
+        x->capture = i;
+        x->capture_length = 0;
+        return;
+      }
+    }
+  }
+  x->unmatched++;
+}
+
+static inline void
+capture(gm_json_extractor_t * x, char c)
+{
+  if ( x->capture >= 0 ) {
+    gm_json_field_t * const f = &x->fields[x->capture];
+
+    if ( x->capture_length + 1 < f->size )
+      f->value[x->capture_length++] = c;
+  }
+}
+
+static void
+end_value(gm_json_extractor_t * x)
+{
+  if ( x->capture >= 0 ) {
+    gm_json_field_t * const f = &x->fields[x->capture];
+
+    if ( f->size > 0 )
+      f->value[x->capture_length] = '\0';
+    f->found = true;
+    x->capture = -1;
+  }
+  x->state = x->depth > 0 ? AFTER_VALUE : DONE;
+}
+
+static bool
+push(gm_json_extractor_t * x, bool array)
+{
+  if ( x->depth >= GM_JSON_DEPTH )
+    return false;
+
+  x->stack[x->depth].array = array;
+  x->stack[x->depth].index = 0;
+  x->stack[x->depth].path_length = x->path_length;
+  x->depth++;
+  if ( array )
+    array_element(x);
+  return true;
+}
+
+static bool
+pop(gm_json_extractor_t * x, char c)
+{
+  if ( x->depth == 0 || x->stack[x->depth - 1].array != (c == ']') )
+    return false;
+
+  x->depth--;
+  truncate_path(x, x->stack[x->depth].path_length);
+  x->state = x->depth > 0 ? AFTER_VALUE : DONE;
+  return true;
+}
+
+// Encode a character from a \u escape as UTF-8.
+static void
+capture_unicode(gm_json_extractor_t * x, uint16_t u)
+{
+  if ( u < 0x80 )
+    capture(x, u);
+  else if ( u < 0x800 ) {
+    capture(x, 0xc0 | (u >> 6));
+    capture(x, 0x80 | (u & 0x3f));
+  }
+  else {
+    capture(x, 0xe0 | (u >> 12));
+    capture(x, 0x80 | ((u >> 6) & 0x3f));
+    capture(x, 0x80 | (u & 0x3f));
+  }
+}
+
+void
+gm_json_extract_begin(gm_json_extractor_t * x, gm_json_field_t * fields, size_t number_of_fields)
+{
+  memset(x, '\0', sizeof(*x));
+  x->fields = fields;
+  x->number_of_fields = number_of_fields;
+  x->state = VALUE;
+  x->capture = -1;
+  for ( size_t i = 0; i < number_of_fields; i++ ) {
+    fields[i].found = false;
+    if ( fields[i].size > 0 )
+      fields[i].value[0] = '\0';
+  }
+}
+
+// Feed the next piece of the document. Returns -1 if the document is malformed.
+int
+gm_json_extract(gm_json_extractor_t * x, const char * data, size_t size)
+{
+  if ( x->failed )
+    return -1;
+
+  for ( size_t i = 0; i < size; ) {
+    const char	c = data[i];
+    bool	consumed = true;
+
+    switch ( x->state ) {
+    case VALUE:
+      if ( is_space(c) )
+        break;
+      if ( c == '{' ) {
+        if ( !push(x, false) )
+          x->failed = true;
+        x->state = OBJECT_START;
+      }
+      else if ( c == '[' ) {
+        if ( !push(x, true) )
+          x->failed = true;
+        x->state = ARRAY_START;
+      }
+      else if ( c == '"' ) {
+        begin_value(x);
+        x->state = STRING;
+      }
+      else if ( c == '-' || (c >= '0' && c <= '9') || c == 't' || c == 'f' || c == 'n' ) {
+        begin_value(x);
+        x->state = SCALAR;
+        consumed = false;
+      }
+      else
+        x->failed = true;
+      break;
+    case OBJECT_START:
+      if ( is_space(c) )
+        break;
+      if ( c == '}' ) {
+        if ( !pop(x, c) )
+          x->failed = true;
+      }
+      else if ( c == '"' ) {
+        if ( x->stack[x->depth - 1].path_length > 0 )
+          append(x, '.');
+        x->state = KEY;
+      }
+      else
+        x->failed = true;
+      break;
+    case ARRAY_START:
+      if ( is_space(c) )
+        break;
+      if ( c == ']' ) {
+        if ( !pop(x, c) )
+          x->failed = true;
+      }
+      else {
+        x->state = VALUE;
+        consumed = false;
+      }
+      break;
+    case KEY:
+      if ( c == '"' )
+        x->state = COLON;
+      else if ( c == '\\' )
+        x->state = KEY_ESCAPE;
+      else
+        append(x, c);
+      break;
+    case KEY_ESCAPE:
+      // Keys are compared with the escapes removed, but \u escapes aren't decoded.
+      append(x, c);
+      x->state = KEY;
+      break;
+    case COLON:
+      if ( is_space(c) )
+        break;
+      if ( c == ':' )
+        x->state = VALUE;
+      else
+        x->failed = true;
+      break;
+    case AFTER_VALUE:
+      if ( is_space(c) )
+        break;
+      if ( c == ',' ) {
+        if ( x->stack[x->depth - 1].array ) {
+          x->stack[x->depth - 1].index++;
+          array_element(x);
+          x->state = VALUE;
+        }
+        else {
+          truncate_path(x, x->stack[x->depth - 1].path_length);
+          x->state = OBJECT_START;
+        }
+      }
+      else if ( c == '}' || c == ']' ) {
+        if ( !pop(x, c) )
+          x->failed = true;
+      }
+      else
+        x->failed = true;
+      break;
+    case STRING:
+      if ( c == '"' )
+        end_value(x);
+      else if ( c == '\\' )
+        x->state = STRING_ESCAPE;
+      else
+        capture(x, c);
+      break;
+    case STRING_ESCAPE:
+      x->state = STRING;
+      switch ( c ) {
+      case 'b':
+        capture(x, '\b');
+        break;
+      case 'f':
+        capture(x, '\f');
+        break;
+      case 'n':
+        capture(x, '\n');
+        break;
+      case 'r':
+        capture(x, '\r');
+        break;
+      case 't':
+        capture(x, '\t');
+        break;
+      case 'u':
+        x->unicode = 0;
+        x->unicode_digits = 0;
+        x->state = STRING_UNICODE;
+        break;
+      default:
+        capture(x, c);
+      }
+      break;
+    case STRING_UNICODE:
+      if ( c >= '0' && c <= '9' )
+        x->unicode = (x->unicode << 4) | (c - '0');
+      else if ( c >= 'a' && c <= 'f' )
+        x->unicode = (x->unicode << 4) | (c - 'a' + 10);
+      else if ( c >= 'A' && c <= 'F' )
+        x->unicode = (x->unicode << 4) | (c - 'A' + 10);
+      else {
+        x->failed = true;
+        break;
+      }
+      if ( ++x->unicode_digits == 4 ) {
+        capture_unicode(x, x->unicode);
+        x->state = STRING;
+      }
+      break;
+    case SCALAR:
+      if ( (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '-' || c == '+' || c == '.' )
+        capture(x, c);
+      else {
+        // The delimiter belongs to the container.
+        end_value(x);
+        consumed = false;
+      }
+      break;
+    case DONE:
+      if ( !is_space(c) )
+        x->failed = true;
+      break;
+    }
+    if ( x->failed )
+      return -1;
+    if ( consumed )
+      i++;
+  }
+  return 0;
+}
+
+// Finish the document. Returns the number of fields found, or -1 if the document
+// was malformed or incomplete.
+int
+gm_json_extract_end(gm_json_extractor_t * x)
+{
+  int found = 0;
+
+  // A number at the top level ends with the document.
+  if ( x->state == SCALAR && x->depth == 0 )
+    end_value(x);
+
+  if ( x->failed || x->state != DONE )
+    return -1;
+
+  for ( size_t i = 0; i < x->number_of_fields; i++ ) {
+    if ( x->fields[i].found )
+      found++;
+  }
+  return found;
+}
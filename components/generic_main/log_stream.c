@@ -0,0 +1,366 @@
+// Log and metrics streaming with Server-Sent Events.
+//
+// Everything printed with gm_printf() is also kept in a ring buffer, one
+// Server-Sent Events record per line. Metrics are records of the "metric" event
+// type. While any browser is connected, the free heap, the WiFi signal strength,
+// the uptime and the number of web responses are added every ten seconds. Up to
+// NUMBER_OF_CLIENTS browsers can open /log with an EventSource, and each of them
+// reads the ring from its own cursor.
+//
+// Printing only copies into the ring. The select task does the sending, with
+// non-blocking writes, and waits for a client's socket to become writable if that
+// client can't keep up. If a client falls behind by more than the ring holds, the
+// records it missed are dropped and it's sent a "dropped" event with the number of
+// bytes lost. Nobody who prints waits upon a slow client.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <esp_http_server.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <lwip/sockets.h>
+#include "generic_main.h"
+
+#define RING_SIZE		4096
+#define NUMBER_OF_CLIENTS	4
+#define METRICS_INTERVAL	10000	// Milliseconds.
+
+typedef struct _stream_client {
+  int		fd;
+  uint32_t	cursor; // Absolute offset in the ring of the next byte to send.
+  char		notice[48];
+  size_t	notice_length;
+  bool		waiting; // Registered with the select task to wait for writability.
+  bool		closing; // The HTTP server is closing it. Nothing more is sent.
+} stream_client_t;
+
+static const char	headers[] =
+ "HTTP/1.1 200 OK\r\n"
+ "Content-Type: text/event-stream\r\n"
+ "Cache-Control: no-cache\r\n"
+ "\r\n";
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static char		ring[RING_SIZE];
+static uint32_t		head = 0; // Absolute offset of the next byte to write.
+static uint32_t		tail = 0; // Absolute offset of the oldest complete record.
+static char		line[128];
+static size_t		line_length = 0;
+static stream_client_t	clients[NUMBER_OF_CLIENTS] = {};
+static int		number_of_clients = 0;
+static volatile bool	flush_pending = false;
+static bool		metrics_scheduled = false;
+
+static void		flush_clients(void * data);
+
+// Add a complete record to the ring, dropping the oldest records to make room.
+static void
+ring_add(const char * data, size_t size)
+{
+  if ( size > RING_SIZE / 4 )
+    return;
+
+  while ( head + size - tail > RING_SIZE ) {
+    // Advance the tail past the oldest record, which ends with an empty line.
+    char previous = '\0';
+    while ( tail != head ) {
+      const char c = ring[tail % RING_SIZE];
+      tail++;
+      if ( c == '\n' && previous == '\n' )
+        break;
+      previous = c;
+    }
+  }
+  for ( size_t i = 0; i < size; i++ )
+    ring[(head + i) % RING_SIZE] = data[i];
+  head += size;
+}
+
+// Called with the lock held. Returns true if the caller must call post_flush()
+// once it has released the lock. gm_run() may print, and it mustn't be called with
+// the lock held.
+static bool
+schedule_flush(void)
+{
+  if ( number_of_clients > 0 && !flush_pending ) {
+    flush_pending = true;
+    return true;
+  }
+  return false;
+}
+
+static void
+post_flush(void)
+{
+  if ( gm_run(flush_clients, 0, GM_FAST) != 0 ) {
+    // Otherwise nothing would ever be sent again.
+    pthread_mutex_lock(&lock);
+    flush_pending = false;
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void
+add_line(void)
+{
+  char	record[sizeof(line) + 10];
+  int	length;
+
+  length = snprintf(record, sizeof(record), "data: %.*s\n\n", (int)line_length, line);
+  ring_add(record, length);
+  line_length = 0;
+}
+
+// Add text printed with gm_printf(). Lines are accumulated until the newline,
+// and then each is a record.
+void
+gm_log_stream_write(const char * data, size_t size)
+{
+  bool new_records = false;
+  bool post = false;
+
+  pthread_mutex_lock(&lock);
+  while ( size-- > 0 ) {
+    const char c = *data++;
+
+    if ( c == '\n' ) {
+      if ( line_length > 0 ) {
+        add_line();
+        new_records = true;
+      }
+    }
+    else if ( c != '\r' ) {
+      if ( line_length >= sizeof(line) ) {
+        add_line();
+        new_records = true;
+      }
+      line[line_length++] = c;
+    }
+  }
+  if ( new_records )
+    post = schedule_flush();
+  pthread_mutex_unlock(&lock);
+  if ( post )
+    post_flush();
+}
+
+// Add a metric, which is sent as an event of type "metric" with the data "name value".
+void
+gm_log_stream_metric(const char * name, const char * pattern, ...)
+{
+  char		record[128];
+  int		length;
+  va_list	args;
+  bool		post;
+
+  length = snprintf(record, sizeof(record), "event: metric\ndata: %s ", name);
+  va_start(args, pattern);
+  length += vsnprintf(&record[length], sizeof(record) - length - 2, pattern, args);
+  va_end(args);
+  if ( length > sizeof(record) - 3 )
+    length = sizeof(record) - 3;
+  record[length++] = '\n';
+  record[length++] = '\n';
+
+  pthread_mutex_lock(&lock);
+  ring_add(record, length);
+  post = schedule_flush();
+  pthread_mutex_unlock(&lock);
+  if ( post )
+    post_flush();
+}
+
+// Runs in the select task, every METRICS_INTERVAL while there are clients.
+static void
+send_metrics(void * data)
+{
+  wifi_ap_record_t	ap;
+  bool			again;
+
+  gm_log_stream_metric("free_heap", "%" PRIu32, esp_get_free_heap_size());
+  gm_log_stream_metric("minimum_free_heap", "%" PRIu32, esp_get_minimum_free_heap_size());
+  gm_log_stream_metric("uptime", "%" PRId64, esp_timer_get_time() / 1000000);
+  if ( esp_wifi_sta_get_ap_info(&ap) == ESP_OK )
+    gm_log_stream_metric("rssi", "%d", ap.rssi);
+  gm_log_stream_metric("web_responses", "%" PRIu32, gm_web_writer_statistics.responses);
+
+  pthread_mutex_lock(&lock);
+  again = metrics_scheduled = number_of_clients > 0;
+  pthread_mutex_unlock(&lock);
+  if ( again && gm_timer_add(send_metrics, NULL, METRICS_INTERVAL) != 0 ) {
+    pthread_mutex_lock(&lock);
+    metrics_scheduled = false;
+    pthread_mutex_unlock(&lock);
+  }
+}
+
+static void
+writable_handler(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < number_of_clients; i++ ) {
+    if ( clients[i].fd == fd )
+      clients[i].waiting = false;
+  }
+  pthread_mutex_unlock(&lock);
+  gm_fd_unregister(fd);
+  flush_clients(0);
+}
+
+// Send as much as a client will take without blocking. Returns true if there's
+// more to send. Called with the lock held.
+static bool
+flush_client(stream_client_t * c)
+{
+  if ( c->cursor - tail > head - tail ) {
+    // The client's cursor is older than the tail. The records it would have read
+    // were overwritten. Tell it how much was dropped, and restart it at the tail.
+    // The leading empty lines terminate any record that was partially sent.
+    c->notice_length = snprintf(
+     c->notice,
+     sizeof(c->notice),
+     "\n\nevent: dropped\ndata: %u\n\n",
+     (unsigned int)(tail - c->cursor));
+    c->cursor = tail;
+  }
+
+  while ( c->notice_length > 0 ) {
+    ssize_t result = send(c->fd, c->notice, c->notice_length, MSG_DONTWAIT);
+    if ( result <= 0 )
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    memmove(c->notice, &c->notice[result], c->notice_length - result);
+    c->notice_length -= result;
+  }
+
+  while ( c->cursor != head ) {
+    const size_t	offset = c->cursor % RING_SIZE;
+    size_t		length = head - c->cursor;
+
+    if ( length > RING_SIZE - offset )
+      length = RING_SIZE - offset;
+
+    ssize_t result = send(c->fd, &ring[offset], length, MSG_DONTWAIT);
+    if ( result <= 0 )
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    c->cursor += result;
+  }
+  return false;
+}
+
+// Runs in the select task.
+static void
+flush_clients(void * data)
+{
+  pthread_mutex_lock(&lock);
+  flush_pending = false;
+  for ( int i = 0; i < number_of_clients; i++ ) {
+    stream_client_t * c = &clients[i];
+
+    if ( !c->waiting && !c->closing && flush_client(c) ) {
+      c->waiting = true;
+      gm_fd_register(c->fd, writable_handler, 0, false, true, false, 0);
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// Forget a client and close its socket.
+static void
+remove_client(void * data)
+{
+  const int fd = (int)(intptr_t)data;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < number_of_clients; i++ ) {
+    if ( clients[i].fd == fd ) {
+      if ( clients[i].waiting )
+        gm_fd_unregister(fd);
+      clients[i] = clients[--number_of_clients];
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  close(fd);
+}
+
+// The HTTP server is about to close a session's socket. Call from its close_fn.
+// Returns false if the socket isn't a log client's, and the caller must close it.
+// Otherwise, the select task forgets the client and closes the socket. It isn't
+// closed before then, so that its descriptor can't be given to a new connection
+// while the select task may still write to it or wait upon it.
+bool
+gm_log_stream_session_closing(int fd)
+{
+  bool	found = false;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < number_of_clients; i++ ) {
+    if ( clients[i].fd == fd && !clients[i].closing ) {
+      clients[i].closing = true;
+      found = true;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( found && gm_run(remove_client, (void *)(intptr_t)fd, GM_FAST) != 0 )
+    remove_client((void *)(intptr_t)fd);
+  return found;
+}
+
+static esp_err_t
+log_stream_handler(httpd_req_t * req)
+{
+  const int fd = httpd_req_to_sockfd(req);
+
+  pthread_mutex_lock(&lock);
+  if ( number_of_clients >= NUMBER_OF_CLIENTS ) {
+    pthread_mutex_unlock(&lock);
+    httpd_resp_set_status(req, "503 Service Unavailable");
+    httpd_resp_send(req, "Too many log clients.", HTTPD_RESP_USE_STRLEN);
+    return ESP_OK;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( send(fd, headers, sizeof(headers) - 1, 0) != sizeof(headers) - 1 )
+    return ESP_FAIL;
+
+  pthread_mutex_lock(&lock);
+  stream_client_t * c = &clients[number_of_clients++];
+  memset(c, '\0', sizeof(*c));
+  c->fd = fd;
+  // Start with what's already in the ring.
+  c->cursor = tail;
+  const bool post = schedule_flush();
+  const bool start_metrics = !metrics_scheduled;
+  metrics_scheduled = true;
+  pthread_mutex_unlock(&lock);
+  if ( post )
+    post_flush();
+  if ( start_metrics && gm_run(send_metrics, NULL, GM_FAST) != 0 ) {
+    pthread_mutex_lock(&lock);
+    metrics_scheduled = false;
+    pthread_mutex_unlock(&lock);
+  }
+
+  // The response never ends. The session stays open, and the HTTP server calls
+  // gm_log_stream_session_closing() when the browser goes away.
+  return ESP_OK;
+}
+
+void
+gm_log_stream_install(httpd_handle_t server)
+{
+  static const httpd_uri_t log_stream = {
+      .uri       = "/log",
+      .method    = HTTP_GET,
+      .handler   = log_stream_handler,
+      .user_ctx  = NULL
+  };
+  httpd_register_uri_handler(server, &log_stream);
+}
@@ -1,9 +1,47 @@
+// Non-volatile parameters.
+//
+// All of the parameters in the table below are read from NVS into RAM the first
+// time that any is used, and then read from RAM. Each is found with a perfect hash
+// of its name: a seed is chosen once, when the cache is loaded, so that no two
+// names in the table land in the same slot, and a lookup is then a hash and a
+// single string comparison.
+//
+// Setting a parameter changes the cache at once, and NVS a moment later. Changes
+// that come together, as when several settings are saved from the web interface,
+// are written together with a single commit, which spares the flash. The write is
+// done in the slow event loop, and pending changes are written before a restart.
+//
+// INT and FLOAT parameters are stored in NVS as numbers, and parsed only when they
+// are set, so gm_nonvolatile_get_int() and gm_nonvolatile_get_float() return them
+// from the cache without parsing. URL and DOMAIN parameters are strings that are
+// checked when they are set. Values that don't fit their type aren't set, and
+// GM_INVALID is returned.
+//
+// The parameters marked secret aren't kept in NVS as strings, but together in one
+// encrypted record, which is decrypted once when the cache is loaded and sealed
+// again only when one of them changes. Its key can be found from the flash, so
+// this only hides them from a casual look. See nonvolatile_secrets.c. Secrets that
+// an earlier version left in cleartext are moved into the record.
+//
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <ctype.h>
+#include <math.h>
+#include <limits.h>
+#include <strings.h>
+#include <pthread.h>
+#include <esp_system.h>
+#include <mbedtls/platform_util.h>
 #include "generic_main.h"
 
+#define HASH_SIZE	64	// A power of two, at least 4 times the number of parameters.
+#define MAX_SEED	1024
+#define WRITE_DELAY	500	// Milliseconds to wait for more changes before writing.
+#define AFTER_SET_DELAY	500	// Milliseconds before a batch's after-set functions run.
+#define SECRETS_KEY	"secrets"	// The NVS key of the encrypted record.
+
 typedef struct gm_nonvolatile {
   const char * 		name;
   gm_nonvolatile_type_t	type;
@@ -12,32 +50,494 @@ typedef struct gm_nonvolatile {
   void			(*call_after_set)(void);
 } gm_nonvolatile_t;
 
+typedef union _number {
+  int32_t	i;	// INT.
+  float		f;	// FLOAT.
+} number_t;
+
+typedef struct _cached {
+  char *	value;		// As a string for every type. NULL if not set.
+  number_t	number;		// The parsed value of an INT or FLOAT.
+  bool		dirty;		// Not yet written to NVS.
+  bool		was_string;	// A number that an earlier version stored as a string.
+} cached_t;
+
 extern void gm_wifi_restart(void);
 
 static const gm_nonvolatile_t gm_nonvolatile[] = {
-  { "ddns_basic_auth", STRING, false, "send HTTP basic authentication on the first transaction with the Dynamic DNS server.\n", 0},
-  { "ddns_hostname", STRING, false, "Hostname for this device to set in dynamic DNS.", 0 },
-  { "ddns_password", STRING, true, "Password for secure access to the dynamic DNS host.", 0 },
-  { "ddns_provider", STRING, false, "Name of the Dynamic DNS provider.", 0 },
-  { "ddns_token", STRING, true, "secret token to set in dynamic DNS.", 0 },
-  { "ddns_username", STRING, false, "User name for secure access to the dynamic DNS host.", 0 },
+  { "ddns_basic_auth", STRING, false, "send HTTP basic authentication on the first transaction with the Dynamic DNS server.\n", gm_warm_boot_ddns_settings_changed },
+  { "ddns_hostname", DOMAIN, false, "Hostname for this device to set in dynamic DNS.", gm_warm_boot_ddns_settings_changed },
+  { "ddns_password", STRING, true, "Password for secure access to the dynamic DNS host.", gm_warm_boot_ddns_settings_changed },
+  { "ddns_provider", STRING, false, "Name of the Dynamic DNS provider.", gm_warm_boot_ddns_settings_changed },
+  { "ddns_token", STRING, true, "secret token to set in dynamic DNS.", gm_warm_boot_ddns_settings_changed },
+  { "ddns_username", STRING, false, "User name for secure access to the dynamic DNS host.", gm_warm_boot_ddns_settings_changed },
+  { "public_https", INT, false, "1 to have the router forward the HTTPS port from the Internet. The web interface has no password, so anyone could change the settings. Takes effect when the device restarts.", 0 },
   { "ssid", STRING, false, "Name of the WiFi access point", gm_wifi_restart },
   { "timezone", STRING, false, "Time zone (see https://github.com/nayarsystems/posix_tz_db/blob/master/zones.csv)", 0 },
+  { "tls_private_key", STRING, true, "Private key of the HTTPS certificate, made the first time the device runs.", 0 },
   { "wifi_password", STRING, true, "Password of the WiFi access point", gm_wifi_restart },
   { }
 };
 
+#define NUMBER_OF_PARAMETERS	(COUNTOF(gm_nonvolatile) - 1)
+
+// The distinct after-set functions of a batch, to be called later.
+typedef struct _after_set {
+  size_t	count;
+  void		(*functions[NUMBER_OF_PARAMETERS])(void);
+} after_set_t;
+
+_Static_assert(NUMBER_OF_PARAMETERS * 4 <= HASH_SIZE, "Make HASH_SIZE larger.");
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static cached_t		cache[NUMBER_OF_PARAMETERS];	// Protected by lock.
+static uint8_t		slots[HASH_SIZE];	// Index in the table plus one, or zero.
+static uint32_t		seed = 0;
+static bool		loaded = false;
+
+static void	write_back(void * data);
+static void	write_soon(void * data);
+
+// FNV-1a, starting from the seed.
+static uint32_t
+hash(const char * name, uint32_t s)
+{
+  uint32_t	h = 2166136261U ^ s;
+
+  while ( *name ) {
+    h ^= (uint8_t)*name++;
+    h *= 16777619U;
+  }
+  return h & (HASH_SIZE - 1);
+}
+
+// Find a seed with which every name in the table has a slot of its own.
+static void
+make_perfect_hash(void)
+{
+  for ( seed = 0; seed < MAX_SEED; seed++ ) {
+    size_t	i;
+
+    memset(slots, '\0', sizeof(slots));
+    for ( i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+      uint8_t * const slot = &slots[hash(gm_nonvolatile[i].name, seed)];
+
+      if ( *slot )
+        break;
+      *slot = i + 1;
+    }
+    if ( i == NUMBER_OF_PARAMETERS )
+      return;
+  }
+  GM_FAIL("No perfect hash of the non-volatile parameter names. Make HASH_SIZE larger.\n");
+  abort();
+}
+
+static void
+write_before_restart(void)
+{
+  write_back(NULL);
+}
+
+// Returns the index of a parameter in the table, or -1. Call with the lock held.
+static int
+find(const char * key)
+{
+  const int	i = slots[hash(key, seed)] - 1;
+
+  if ( i < 0 || strcmp(gm_nonvolatile[i].name, key) != 0 )
+    return -1;
+  return i;
+}
+
+// Free a cached value, clearing it first if it's a secret.
+static void
+forget(int i)
+{
+  if ( cache[i].value && gm_nonvolatile[i].secret )
+    mbedtls_platform_zeroize(cache[i].value, strlen(cache[i].value));
+  free(cache[i].value);
+  cache[i].value = NULL;
+}
+
+static bool
+valid_domain(const char * s)
+{
+  size_t	length = strlen(s);
+  size_t	label = 0;
+
+  if ( length > 0 && s[length - 1] == '.' )
+    length--;
+  if ( length == 0 || length > 253 )
+    return false;
+
+  for ( size_t i = 0; i <= length; i++ ) {
+    if ( i == length || s[i] == '.' ) {
+      // Labels are 1 to 63 letters, digits and hyphens, not beginning or ending with
+      // a hyphen.
+      if ( label == 0 || label > 63 || s[i - 1] == '-' || s[i - label] == '-' )
+        return false;
+      label = 0;
+    }
+    else if ( isalnum((unsigned char)s[i]) || s[i] == '-' )
+      label++;
+    else
+      return false;
+  }
+  return true;
+}
+
+static bool
+valid_url(const char * s)
+{
+  const char *	host;
+
+  if ( strncasecmp(s, "http://", 7) == 0 )
+    host = s + 7;
+  else if ( strncasecmp(s, "https://", 8) == 0 )
+    host = s + 8;
+  else
+    return false;
+
+  if ( *host == '\0' || *host == '/' || *host == ':' )
+    return false;
+  for ( ; *s; s++ ) {
+    if ( isspace((unsigned char)*s) || iscntrl((unsigned char)*s) )
+      return false;
+  }
+  return true;
+}
+
+// Check a value against the type of a parameter, and parse a number.
+static bool
+parse(int i, const char * value, number_t * number)
+{
+  char *	end;
+
+  switch ( gm_nonvolatile[i].type ) {
+  case INT: {
+    const long	l = strtol(value, &end, 0);
+
+    if ( end == value || *end != '\0' || l < INT32_MIN || l > INT32_MAX )
+      return false;
+    number->i = l;
+    return true;
+  }
+  case FLOAT:
+    number->f = strtof(value, &end);
+    return end != value && *end == '\0' && isfinite(number->f);
+  case URL:
+    return valid_url(value);
+  case DOMAIN:
+    return valid_domain(value);
+  default:
+    return true;
+  }
+}
+
+// Decrypt the record of secrets into the cache. Its plaintext is pairs of a name
+// and a value, each ending with a null. Call with the lock held.
+static void
+load_secrets(void)
+{
+  size_t	sealed_size = 0;
+  size_t	plain_size = 0;
+  void *	sealed;
+  char *	plain;
+  const char *	p;
+
+  if ( nvs_get_blob(GM.nvs, SECRETS_KEY, NULL, &sealed_size) != ESP_OK || sealed_size == 0 )
+    return;
+  if ( (sealed = malloc(sealed_size)) == NULL )
+    return;
+  if ( nvs_get_blob(GM.nvs, SECRETS_KEY, sealed, &sealed_size) != ESP_OK ) {
+    free(sealed);
+    return;
+  }
+  plain = gm_nonvolatile_open(sealed, sealed_size, &plain_size);
+  free(sealed);
+  if ( plain == NULL ) {
+    GM_FAIL("The secret parameters can't be decrypted. They must be set again.\n");
+    return;
+  }
+
+  // gm_nonvolatile_open() puts a null after the plaintext.
+  p = plain;
+  while ( p < plain + plain_size ) {
+    const char * const	name = p;
+    const char * const	value = name + strlen(name) + 1;
+    int			i;
+
+    if ( value >= plain + plain_size )
+      break;
+    p = value + strlen(value) + 1;
+    if ( (i = find(name)) >= 0 && gm_nonvolatile[i].secret && parse(i, value, &cache[i].number) )
+      cache[i].value = strdup(value);
+  }
+  mbedtls_platform_zeroize(plain, plain_size);
+  free(plain);
+}
+
+// Pack the secrets for sealing. Call with the lock held.
+static char *
+pack_secrets(size_t * size)
+{
+  char *	plain;
+  char *	p;
+
+  *size = 0;
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+    if ( gm_nonvolatile[i].secret && cache[i].value )
+      *size += strlen(gm_nonvolatile[i].name) + 1 + strlen(cache[i].value) + 1;
+  }
+  if ( (p = plain = malloc(*size + 1)) == NULL )
+    return NULL;
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+    if ( gm_nonvolatile[i].secret && cache[i].value ) {
+      p = stpcpy(p, gm_nonvolatile[i].name) + 1;
+      p = stpcpy(p, cache[i].value) + 1;
+    }
+  }
+  return plain;
+}
+
+// Read an INT or FLOAT parameter that is stored as a number. NVS has no floating
+// point type, so a FLOAT is stored as the bits of a uint32_t. Call with the lock
+// held.
+static bool
+load_number(int i)
+{
+  cached_t * const	c = &cache[i];
+  char			buffer[32];
+  uint32_t		bits;
+
+  switch ( gm_nonvolatile[i].type ) {
+  case INT:
+    if ( nvs_get_i32(GM.nvs, gm_nonvolatile[i].name, &c->number.i) != ESP_OK )
+      return false;
+    snprintf(buffer, sizeof(buffer), "%ld", (long)c->number.i);
+    break;
+  case FLOAT:
+    if ( nvs_get_u32(GM.nvs, gm_nonvolatile[i].name, &bits) != ESP_OK )
+      return false;
+    memcpy(&c->number.f, &bits, sizeof(c->number.f));
+    snprintf(buffer, sizeof(buffer), "%.9g", (double)c->number.f);
+    break;
+  default:
+    return false;
+  }
+  c->value = strdup(buffer);
+  return c->value != NULL;
+}
+
+// Call with the lock held.
+static void
+load(void)
+{
+  bool	migrate = false;
+
+  if ( loaded )
+    return;
+  loaded = true;
+
+  make_perfect_hash();
+  load_secrets();
+
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+    cached_t * const	c = &cache[i];
+    size_t		size = 0;
+
+    if ( c->value || (!gm_nonvolatile[i].secret && load_number(i)) )
+      continue;
+    if ( nvs_get_str(GM.nvs, gm_nonvolatile[i].name, NULL, &size) != ESP_OK || size == 0 )
+      continue;
+    if ( (c->value = malloc(size)) == NULL )
+      continue;
+    // URLs and domains are only checked when they're set, so that one stored
+    // before they were isn't lost. A number must parse.
+    if ( nvs_get_str(GM.nvs, gm_nonvolatile[i].name, c->value, &size) != ESP_OK
+     || (!parse(i, c->value, &c->number) && (gm_nonvolatile[i].type == INT || gm_nonvolatile[i].type == FLOAT)) ) {
+      free(c->value);
+      c->value = NULL;
+    }
+    else if ( gm_nonvolatile[i].secret ) {
+      // A secret in cleartext. Move it into the record.
+      c->dirty = true;
+      migrate = true;
+    }
+    else if ( gm_nonvolatile[i].type == INT || gm_nonvolatile[i].type == FLOAT ) {
+      // A number stored as a string. Store it as a number.
+      c->dirty = true;
+      c->was_string = true;
+      migrate = true;
+    }
+  }
+  if ( migrate )
+    gm_timer_add(write_soon, NULL, WRITE_DELAY);
+  esp_register_shutdown_handler(write_before_restart);
+}
+
+// Write one parameter that isn't secret, as its type.
+static esp_err_t
+write_value(int i, const cached_t * c)
+{
+  const char * const	name = gm_nonvolatile[i].name;
+  uint32_t		bits;
+
+  // NVS keeps an entry of each type under a name. Remove the string.
+  if ( c->was_string )
+    nvs_erase_key(GM.nvs, name);
+
+  switch ( gm_nonvolatile[i].type ) {
+  case INT:
+    return nvs_set_i32(GM.nvs, name, c->number.i);
+  case FLOAT:
+    memcpy(&bits, &c->number.f, sizeof(bits));
+    return nvs_set_u32(GM.nvs, name, bits);
+  default:
+    return nvs_set_str(GM.nvs, name, c->value);
+  }
+}
+
+// Write the changed parameters to NVS, with one commit. Runs in the slow event loop,
+// or in the task that restarts the system.
+static void
+write_back(void * data)
+{
+  cached_t	values[NUMBER_OF_PARAMETERS];
+  bool		dirty[NUMBER_OF_PARAMETERS];
+  bool		any = false;
+  bool		secrets = false;
+  char *	plain = NULL;
+  size_t	plain_size = 0;
+  esp_err_t	err = ESP_OK;
+
+  // Copy the changes, so that the lock isn't held while the flash is written.
+  pthread_mutex_lock(&lock);
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+    values[i] = cache[i];
+    values[i].value = NULL;
+    dirty[i] = cache[i].dirty;
+    if ( dirty[i] ) {
+      any = true;
+      if ( gm_nonvolatile[i].secret )
+        secrets = true;
+      else if ( cache[i].value )
+        values[i].value = strdup(cache[i].value);
+      cache[i].dirty = false;
+      cache[i].was_string = false;
+    }
+  }
+  if ( secrets && (plain = pack_secrets(&plain_size)) == NULL ) {
+    GM_FAIL("Out of memory.\n");
+    secrets = false;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( !any )
+    return;
+
+  // Write the record before erasing any cleartext secrets.
+  if ( secrets ) {
+    esp_err_t	e;
+
+    if ( plain_size == 0 ) {
+      e = nvs_erase_key(GM.nvs, SECRETS_KEY);
+      if ( e == ESP_ERR_NVS_NOT_FOUND )
+        e = ESP_OK;
+    }
+    else {
+      size_t	sealed_size;
+      void *	sealed = gm_nonvolatile_seal(plain, plain_size, &sealed_size);
+
+      if ( sealed ) {
+        e = nvs_set_blob(GM.nvs, SECRETS_KEY, sealed, sealed_size);
+        free(sealed);
+      }
+      else
+        e = ESP_FAIL;
+    }
+    if ( e != ESP_OK ) {
+      err = e;
+      secrets = false;
+    }
+    mbedtls_platform_zeroize(plain, plain_size);
+    free(plain);
+  }
+
+  for ( size_t i = 0; i < NUMBER_OF_PARAMETERS; i++ ) {
+    esp_err_t	e = ESP_OK;
+
+    // A secret is in the record. Erase any cleartext copy, once the record is
+    // written.
+    if ( !dirty[i] || (gm_nonvolatile[i].secret && !secrets) )
+      continue;
+    if ( values[i].value && !gm_nonvolatile[i].secret )
+      e = write_value(i, &values[i]);
+    else {
+      e = nvs_erase_key(GM.nvs, gm_nonvolatile[i].name);
+      if ( e == ESP_ERR_NVS_NOT_FOUND )
+        e = ESP_OK;
+    }
+    if ( e != ESP_OK )
+      err = e;
+    free(values[i].value);
+  }
+
+  if ( err == ESP_OK )
+    err = nvs_commit(GM.nvs);
+  if ( err != ESP_OK )
+    GM_FAIL("Can't write non-volatile parameters: %s\n", esp_err_to_name(err));
+}
+
+// Runs in the select task, which mustn't wait for the flash.
+static void
+write_soon(void * data)
+{
+  gm_run(write_back, NULL, GM_SLOW);
+}
+
+// Change the cached value, and write it to NVS after a short delay. Call with the
+// lock held.
+static void
+store(int i, const char * value, const number_t * number)
+{
+  char * const copy = value ? strdup(value) : NULL;
+
+  if ( value && !copy ) {
+    GM_FAIL("Out of memory.\n");
+    return;
+  }
+  forget(i);
+  cache[i].value = copy;
+  if ( number )
+    cache[i].number = *number;
+  cache[i].dirty = true;
+
+  // Each change puts off the write, so that those that come together are written
+  // together.
+  gm_timer_cancel(write_soon, NULL);
+  gm_timer_add(write_soon, NULL, WRITE_DELAY);
+}
+
 void
 gm_nonvolatile_list(gm_nonvolatile_list_coroutine_t coroutine)
 {
   const gm_nonvolatile_t * p = gm_nonvolatile;
   char buffer[1024];
-  size_t buffer_size;
 
   while (p->type) {
-    buffer_size = sizeof(buffer);
-    esp_err_t err = nvs_get_str(GM.nvs, p->name, buffer, &buffer_size);
-    if (err != ESP_OK) {
+    const cached_t * const c = &cache[p - gm_nonvolatile];
+    bool set;
+
+    pthread_mutex_lock(&lock);
+    load();
+    set = c->value != NULL && strlen(c->value) < sizeof(buffer);
+    if ( set && !p->secret )
+      strcpy(buffer, c->value);
+    pthread_mutex_unlock(&lock);
+
+    if (!set) {
       *buffer = '\0';
       (*coroutine)(p->name, buffer, p->explanation, GM_NOT_SET);
     }
@@ -51,82 +551,255 @@ gm_nonvolatile_list(gm_nonvolatile_list_coroutine_t coroutine)
   }
 }
 
+// The name of a parameter, by its index in the table. Returns NULL past the end.
+const char *
+gm_nonvolatile_name(size_t index)
+{
+  if (index >= NUMBER_OF_PARAMETERS)
+    return NULL;
+  return gm_nonvolatile[index].name;
+}
+
 gm_nonvolatile_result_t
 gm_nonvolatile_get(const char * key, char * buffer, size_t buffer_size)
 {
-  const gm_nonvolatile_t * p = gm_nonvolatile;
-  while (p->type) {
-    if (strcmp(p->name, key) == 0)
-      break;
-    p++;
-  }
+  int i;
+  bool set;
 
-  if (!p->type) {
+  pthread_mutex_lock(&lock);
+  load();
+  if ((i = find(key)) < 0) {
+    pthread_mutex_unlock(&lock);
     return GM_NOT_IN_PARAMETER_TABLE;
   }
 
-  esp_err_t err = nvs_get_str(GM.nvs, key, buffer, &buffer_size);
+  // Like nvs_get_str(), a value that doesn't fit isn't returned.
+  set = cache[i].value != NULL && strlen(cache[i].value) < buffer_size;
+  if (set)
+    strcpy(buffer, cache[i].value);
+  pthread_mutex_unlock(&lock);
 
-  if (err) {
-    *buffer = '\0';
+  if (!set) {
+    if (buffer_size > 0)
+      *buffer = '\0';
     return GM_NOT_SET;
   }
 
-  if (p->secret)
+  if (gm_nonvolatile[i].secret)
     return GM_SECRET;
   else
     return GM_NORMAL;
 }
 
+// Set a parameter, if the value fits its type. Sets *index to the index of the
+// parameter in the table.
+static gm_nonvolatile_result_t
+set_value(const char * key, const char * value, int * index)
+{
+  number_t number = {};
+  int i;
+
+  pthread_mutex_lock(&lock);
+  load();
+  if ((i = find(key)) < 0) {
+    pthread_mutex_unlock(&lock);
+    return GM_NOT_IN_PARAMETER_TABLE;
+  }
+  if (!parse(i, value, &number)) {
+    pthread_mutex_unlock(&lock);
+    return GM_INVALID;
+  }
+  store(i, value, &number);
+  pthread_mutex_unlock(&lock);
+  *index = i;
+  return GM_NORMAL;
+}
+
 gm_nonvolatile_result_t
 gm_nonvolatile_set(const char * key, const char * value)
 {
-  const gm_nonvolatile_t * p = gm_nonvolatile;
-  while (p->type) {
-    if (strcmp(p->name, key) == 0)
-      break;
-    p++;
-  }
-  if (!p->type) {
-    return GM_NOT_IN_PARAMETER_TABLE;
+  int i;
+  const gm_nonvolatile_result_t result = set_value(key, value, &i);
+
+  if (result != GM_NORMAL)
+    return result;
+
+  if (gm_nonvolatile[i].call_after_set)
+    (gm_nonvolatile[i].call_after_set)();
+
+  return GM_NORMAL;
+}
+
+// Runs in the slow event loop.
+static void
+run_after_set(void * data)
+{
+  after_set_t * const a = (after_set_t *)data;
+
+  for (size_t h = 0; h < a->count; h++)
+    (*a->functions[h])();
+  free(a);
+}
+
+// Runs in the select task, which mustn't wait for the after-set functions.
+static void
+after_set_soon(void * data)
+{
+  gm_run(run_after_set, data, GM_SLOW);
+}
+
+// Set several parameters together. If any isn't in the table, or its value doesn't
+// fit its type, none are set, and *failed is its index in params. The changes are
+// written to NVS at once, with a single commit. Each distinct after-set function
+// is called once, so that setting the SSID and the WiFi password together
+// restarts WiFi once. They're called a moment later in the slow event loop, rather
+// than before this returns, so that a web handler that set the parameters can
+// finish its reply even if one of them restarts the web server.
+gm_nonvolatile_result_t
+gm_nonvolatile_set_batch(const gm_param_t * params, size_t count, size_t * failed)
+{
+  after_set_t * after;
+  number_t number;
+  int i;
+
+  pthread_mutex_lock(&lock);
+  load();
+  for (size_t n = 0; n < count; n++) {
+    gm_nonvolatile_result_t result = GM_NORMAL;
+
+    if ((i = find(params[n].name)) < 0)
+      result = GM_NOT_IN_PARAMETER_TABLE;
+    else if (!parse(i, params[n].value, &number))
+      result = GM_INVALID;
+    if (result != GM_NORMAL) {
+      pthread_mutex_unlock(&lock);
+      *failed = n;
+      return result;
+    }
   }
 
-  esp_err_t err = (nvs_set_str(GM.nvs, key, value));
-  if (err) {
-    ESP_ERROR_CHECK(err);
+  if ((after = calloc(1, sizeof(*after))) == NULL) {
+    pthread_mutex_unlock(&lock);
+    GM_FAIL("Out of memory.\n");
     return GM_ERROR;
   }
 
-  if (p->call_after_set)
-    (p->call_after_set)();
+  for (size_t n = 0; n < count; n++) {
+    size_t h;
+
+    i = find(params[n].name);
+    parse(i, params[n].value, &number);
+    store(i, params[n].value, &number);
+
+    for (h = 0; h < after->count; h++) {
+      if (after->functions[h] == gm_nonvolatile[i].call_after_set)
+        break;
+    }
+    if (h == after->count && gm_nonvolatile[i].call_after_set && after->count < COUNTOF(after->functions))
+      after->functions[after->count++] = gm_nonvolatile[i].call_after_set;
+  }
+  pthread_mutex_unlock(&lock);
+
+  // The batch is complete, so there's no need to wait for more changes.
+  gm_timer_cancel(write_soon, NULL);
+  gm_run(write_back, NULL, GM_SLOW);
+
+  if (after->count == 0)
+    free(after);
+  else if (gm_timer_add(after_set_soon, after, AFTER_SET_DELAY) != 0)
+    gm_run(run_after_set, after, GM_SLOW);
 
   return GM_NORMAL;
 }
 
+// Set a parameter without calling its after-set function, for code that acts on
+// the change itself.
 gm_nonvolatile_result_t
-gm_nonvolatile_erase(const char * key)
+gm_nonvolatile_store(const char * key, const char * value)
 {
-  const gm_nonvolatile_t * p = gm_nonvolatile;
-  while (p->type) {
-    if (strcmp(p->name, key) == 0)
-      break;
-    p++;
-  }
-  if (!p->type) {
-    return GM_NOT_IN_PARAMETER_TABLE;
+  int i;
+
+  return set_value(key, value, &i);
+}
+
+// Get a number from the cache. Returns GM_INVALID if the parameter isn't of the type.
+static gm_nonvolatile_result_t
+get_number(const char * key, gm_nonvolatile_type_t type, number_t * number)
+{
+  gm_nonvolatile_result_t result;
+  int i;
+
+  pthread_mutex_lock(&lock);
+  load();
+  if ((i = find(key)) < 0)
+    result = GM_NOT_IN_PARAMETER_TABLE;
+  else if (gm_nonvolatile[i].type != type)
+    result = GM_INVALID;
+  else if (cache[i].value == NULL)
+    result = GM_NOT_SET;
+  else {
+    *number = cache[i].number;
+    result = gm_nonvolatile[i].secret ? GM_SECRET : GM_NORMAL;
   }
+  pthread_mutex_unlock(&lock);
+  return result;
+}
 
-  esp_err_t err = (nvs_erase_key(GM.nvs, key));
+gm_nonvolatile_result_t
+gm_nonvolatile_get_float(const char * key, float * value)
+{
+  number_t number;
+  const gm_nonvolatile_result_t result = get_number(key, FLOAT, &number);
 
-  switch (err) {
-  case ESP_OK:
-    if (p->call_after_set)
-      (p->call_after_set)();
-    return GM_NORMAL;
-  case ESP_ERR_NVS_NOT_FOUND:
+  if (result == GM_NORMAL || result == GM_SECRET)
+    *value = number.f;
+  return result;
+}
+
+gm_nonvolatile_result_t
+gm_nonvolatile_get_int(const char * key, int32_t * value)
+{
+  number_t number;
+  const gm_nonvolatile_result_t result = get_number(key, INT, &number);
+
+  if (result == GM_NORMAL || result == GM_SECRET)
+    *value = number.i;
+  return result;
+}
+
+gm_nonvolatile_result_t
+gm_nonvolatile_set_float(const char * key, float value)
+{
+  char buffer[32];
+
+  snprintf(buffer, sizeof(buffer), "%.9g", (double)value);
+  return gm_nonvolatile_set(key, buffer);
+}
+
+gm_nonvolatile_result_t
+gm_nonvolatile_set_int(const char * key, int32_t value)
+{
+  char buffer[16];
+
+  snprintf(buffer, sizeof(buffer), "%ld", (long)value);
+  return gm_nonvolatile_set(key, buffer);
+}
+
+gm_nonvolatile_result_t
+gm_nonvolatile_erase(const char * key)
+{
+  int i;
+
+  pthread_mutex_lock(&lock);
+  load();
+  if ((i = find(key)) < 0 || cache[i].value == NULL) {
+    pthread_mutex_unlock(&lock);
     return GM_NOT_IN_PARAMETER_TABLE;
-  default:
-    ESP_ERROR_CHECK(err);
-    return GM_ERROR;
   }
+  store(i, NULL, NULL);
+  pthread_mutex_unlock(&lock);
+
+  if (gm_nonvolatile[i].call_after_set)
+    (gm_nonvolatile[i].call_after_set)();
+  return GM_NORMAL;
 }
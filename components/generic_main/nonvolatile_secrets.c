@@ -0,0 +1,146 @@
+// Sealing of the secret non-volatile parameters.
+//
+// The parameters marked secret are kept in NVS as one record, encrypted and
+// authenticated with AES-256-GCM, rather than as cleartext strings.
+//
+// This is obfuscation, not protection. The key is derived with HKDF-SHA256 from the
+// factory MAC address and a random salt that's stored with the record. The MAC
+// address isn't secret: the PHY calibration data that ESP-IDF keeps in the same
+// NVS partition contains it, and so does the device's name, which it announces on
+// the network. Anyone with a copy of the flash can derive the key and open the
+// record. What it does is keep the passwords from showing up as text in a dump of
+// the flash, or in a search of one.
+//
+// Real protection needs a key that isn't in the flash: a key in an eFuse block,
+// which can't be taken back once it's burned, or ESP-IDF's NVS encryption, whose
+// keys are only safe with flash encryption enabled. With flash encryption enabled,
+// this record is as safe as the rest of the flash.
+//
+// A sealed record is:
+//   version (1 byte), salt (16), nonce (12), ciphertext, tag (16).
+// The version and salt are authenticated with the ciphertext.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <esp_mac.h>
+#include <esp_random.h>
+#include <mbedtls/gcm.h>
+#include <mbedtls/md.h>
+#include <mbedtls/platform_util.h>
+#include "generic_main.h"
+
+#define SEAL_VERSION	1
+#define SALT_SIZE	16
+#define NONCE_SIZE	12
+#define TAG_SIZE	16
+#define KEY_SIZE	32
+#define HEADER_SIZE	(1 + SALT_SIZE + NONCE_SIZE)
+
+static const char	info[] = "generic_main nonvolatile secrets";
+
+// HKDF-SHA256, RFC 5869, for a single block of output.
+static void
+derive_key(const uint8_t * salt, uint8_t * key)
+{
+  const mbedtls_md_info_t * const	sha256 = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+  uint8_t				mac[6];
+  uint8_t				prk[KEY_SIZE];
+  uint8_t				expand[sizeof(info) - 1 + 1];
+
+  esp_efuse_mac_get_default(mac);
+  mbedtls_md_hmac(sha256, salt, SALT_SIZE, mac, sizeof(mac), prk);
+
+  memcpy(expand, info, sizeof(info) - 1);
+  expand[sizeof(info) - 1] = 1;
+  mbedtls_md_hmac(sha256, prk, sizeof(prk), expand, sizeof(expand), key);
+  mbedtls_platform_zeroize(prk, sizeof(prk));
+}
+
+// Encrypt plaintext into a newly allocated record. Returns NULL on failure.
+void *
+gm_nonvolatile_seal(const void * plain, size_t plain_size, size_t * sealed_size)
+{
+  mbedtls_gcm_context	gcm;
+  uint8_t		key[KEY_SIZE];
+  uint8_t *		sealed;
+  int			err;
+
+  if ( (sealed = malloc(HEADER_SIZE + plain_size + TAG_SIZE)) == NULL )
+    return NULL;
+
+  sealed[0] = SEAL_VERSION;
+  esp_fill_random(&sealed[1], SALT_SIZE + NONCE_SIZE);
+  derive_key(&sealed[1], key);
+
+  mbedtls_gcm_init(&gcm);
+  err = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, KEY_SIZE * 8);
+  if ( err == 0 )
+    err = mbedtls_gcm_crypt_and_tag(
+     &gcm,
+     MBEDTLS_GCM_ENCRYPT,
+     plain_size,
+     &sealed[1 + SALT_SIZE],
+     NONCE_SIZE,
+     sealed,
+     1 + SALT_SIZE,
+     plain,
+     &sealed[HEADER_SIZE],
+     TAG_SIZE,
+     &sealed[HEADER_SIZE + plain_size]);
+  mbedtls_gcm_free(&gcm);
+  mbedtls_platform_zeroize(key, sizeof(key));
+
+  if ( err != 0 ) {
+    GM_FAIL("Can't seal the secret parameters: %d\n", err);
+    free(sealed);
+    return NULL;
+  }
+  *sealed_size = HEADER_SIZE + plain_size + TAG_SIZE;
+  return sealed;
+}
+
+// Decrypt a record into newly allocated plaintext, with a null after it. Returns
+// NULL if it's not authentic.
+void *
+gm_nonvolatile_open(const void * sealed, size_t sealed_size, size_t * plain_size)
+{
+  const uint8_t * const	s = (const uint8_t *)sealed;
+  mbedtls_gcm_context	gcm;
+  uint8_t		key[KEY_SIZE];
+  uint8_t *		plain;
+  size_t		size;
+  int			err;
+
+  if ( sealed_size < HEADER_SIZE + TAG_SIZE || s[0] != SEAL_VERSION )
+    return NULL;
+  size = sealed_size - HEADER_SIZE - TAG_SIZE;
+  if ( (plain = malloc(size + 1)) == NULL )
+    return NULL;
+
+  derive_key(&s[1], key);
+  mbedtls_gcm_init(&gcm);
+  err = mbedtls_gcm_setkey(&gcm, MBEDTLS_CIPHER_ID_AES, key, KEY_SIZE * 8);
+  if ( err == 0 )
+    err = mbedtls_gcm_auth_decrypt(
+     &gcm,
+     size,
+     &s[1 + SALT_SIZE],
+     NONCE_SIZE,
+     s,
+     1 + SALT_SIZE,
+     &s[HEADER_SIZE + size],
+     TAG_SIZE,
+     &s[HEADER_SIZE],
+     plain);
+  mbedtls_gcm_free(&gcm);
+  mbedtls_platform_zeroize(key, sizeof(key));
+
+  if ( err != 0 ) {
+    mbedtls_platform_zeroize(plain, size);
+    free(plain);
+    return NULL;
+  }
+  plain[size] = '\0';
+  *plain_size = size;
+  return plain;
+}
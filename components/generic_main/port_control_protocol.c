@@ -2,7 +2,33 @@
 #include <sys/types.h>
 #include <lwip/sockets.h>
 #include <arpa/inet.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <esp_wifi.h>
 #include "generic_main.h"
+#include "upnp_igd.h"
+
+// Mappings are kept in a fixed pool, so that renewing them for days doesn't
+// allocate memory. Each is renewed at half its lifetime, with the same nonce, as
+// RFC 6887 says, and a request that isn't answered is retransmitted with a
+// doubling timeout until it is, even past the mapping's expiry, so that inbound
+// access comes back when the router does. One timer, for whichever mapping is due
+// next, drives them all. Everything that touches the pool runs in the select task.
+//
+// Each response carries the router's epoch, the seconds since it last lost its
+// mappings. If the epoch goes backward, or advances at a different rate from our
+// clock, the router has restarted, and every mapping is requested again.
+//
+// The granted mappings of each address family are linked, in the pool, from
+// GM.sta.ip4.port_mappings and GM.sta.ip6.port_mappings.
+//
+// Many routers speak only NAT-PMP, or only UPnP-IGD, rather than PCP. Until one
+// of them has answered, IPv4 requests are made with all three at once, and the
+// first to grant a mapping is used from then on. The answers of the others are
+// ignored, and so are their errors while the others might still succeed. The
+// protocol that won is kept in NVS for the access point, so that the next
+// connection to it goes straight to that protocol. If that doesn't answer, all
+// three are tried again. IPv6 mappings are only made with PCP.
 
 typedef struct _nat_pmp_or_pcp {
   uint8_t	version;
@@ -10,7 +36,7 @@ typedef struct _nat_pmp_or_pcp {
   uint8_t	reserved;
   uint8_t	result_code;
   union {
-    struct nat_pmp_packet {
+    union nat_pmp_packet {
       struct nat_pmp_request {
         uint16_t	internal_port;
         uint16_t	external_port;
@@ -22,6 +48,11 @@ typedef struct _nat_pmp_or_pcp {
         uint16_t	external_port;
         uint32_t	lifetime;
       } response;
+      // The response to NAT_PMP_ANNOUNCE, which is also multicast by the router.
+      struct nat_pmp_address {
+        uint32_t	epoch;
+        struct in_addr	external_address;
+      } address;
     } nat_pmp;
     struct pcp_packet {
       uint32_t	lifetime;
@@ -52,15 +83,11 @@ typedef struct _nat_pmp_or_pcp {
     } pcp;
   };
 } nat_pmp_or_pcp_t;
-typedef struct _last_request {
-  struct sockaddr_storage	address;
-  nat_pmp_or_pcp_t		packet;
-  struct timeval		time;
-  bool				valid;
-} last_request_t;
-
 const size_t map_packet_size = (size_t)&(((nat_pmp_or_pcp_t *)0)->pcp.mp.remote_peer_port);
 const size_t announce_packet_size = (size_t)&(((nat_pmp_or_pcp_t *)0)->pcp.mp);
+const size_t nat_pmp_request_size = (size_t)&(((nat_pmp_or_pcp_t *)0)->nat_pmp) + sizeof(struct nat_pmp_request);
+const size_t nat_pmp_response_size = (size_t)&(((nat_pmp_or_pcp_t *)0)->nat_pmp) + sizeof(struct nat_pmp_response);
+const size_t nat_pmp_address_size = (size_t)&(((nat_pmp_or_pcp_t *)0)->nat_pmp) + sizeof(struct nat_pmp_address);
 
 enum pcp_version {
   NAT_PMP = 0,
@@ -120,8 +147,52 @@ enum pcp_response_code {
   PCP_EXCESSIVE_REMOTE_PEERS = 13
 };
 
-static last_request_t	last_request_ipv4;
-static last_request_t	last_request_ipv6;
+#define MAX_MAPPINGS		8
+#define REQUESTED_LIFETIME	(24 * 60 * 60)	// Seconds.
+#define INITIAL_TIMEOUT		3000		// Milliseconds. RFC 6887 section 8.1.1.
+#define MAX_TIMEOUT		(1024 * 1000)
+#define MIN_ERROR_WAIT		30		// Seconds before retrying after a temporary error.
+#define MAX_ERROR_WAIT		(30 * 60)
+#define ANNOUNCE_DELAY		5000		// Milliseconds, the most to wait after an ANNOUNCE.
+#define FALLBACK_TIMEOUT	(4 * INITIAL_TIMEOUT)	// Before a remembered protocol is given up.
+#define UPNP_LIFETIME		(60 * 60)	// Seconds. UPnP has no epoch, so it's renewed more often.
+
+// The protocols that IPv4 mappings can be made with. These values are kept in NVS.
+enum mapping_protocol {
+  MAPPING_UNKNOWN = 0,
+  MAPPING_PCP = 1,
+  MAPPING_NAT_PMP = 2,
+  MAPPING_UPNP = 3
+};
+static const char * const	protocol_names[] = { "all protocols", "PCP", "NAT-PMP", "UPnP" };
+
+struct pcp_mapping {
+  gm_port_mapping_t	m;		// The public part, linked into GM.sta.
+  bool			in_use;
+  bool			active;		// The listener is running, so requests can be sent.
+  bool			granted;	// By the router, and not expired.
+  bool			outstanding;	// A request hasn't been answered.
+  gm_http_request_t *	upnp;		// An AddPortMapping that hasn't finished.
+  uint32_t		timeout;	// Milliseconds until the request is sent again.
+  int64_t		next;		// esp_timer_get_time() when a request is to be sent.
+  int64_t		expires;	// and when the mapping expires.
+};
+
+struct pcp_epoch {
+  bool		valid;
+  uint32_t	server;		// The router's epoch, in the last response.
+  int64_t	client;		// esp_timer_get_time() when it was received.
+};
+
+// These are only used in the select task.
+static struct pcp_mapping	mappings[MAX_MAPPINGS] = {};
+static struct pcp_epoch		epochs[2] = {};	// IPv4, IPv6.
+static uint8_t			protocol = MAPPING_UNKNOWN;	// For IPv4.
+static bool			protocol_confirmed = false;	// By an answer, since the listener started.
+static struct in_addr		nat_pmp_external = {};
+static struct in_addr		upnp_external = {};
+static bool			upnp_permanent = false;	// The router only takes leases of 0.
+
 static int		ipv4_unicast_sock = -1;
 static int		ipv4_multicast_sock = -1;
 static int		ipv6_unicast_sock = -1;
@@ -130,14 +201,12 @@ static int		ipv6_multicast_sock = -1;
 static int
 request_mapping_ipv4(gm_port_mapping_t * m)
 {
-  last_request_t *		r = &last_request_ipv4;
-  nat_pmp_or_pcp_t *		p = &r->packet;
+  nat_pmp_or_pcp_t		packet = {};
+  nat_pmp_or_pcp_t *		p = &packet;
+  struct sockaddr_in		address = {};
   socklen_t			send_address_size;
   ssize_t			send_result;
-  struct sockaddr_in * 		a4 = (struct sockaddr_in *)&r->address;
-
-  memset(r, '\0', sizeof(last_request_ipv4));
-  r->valid = true;
+  struct sockaddr_in * 		a4 = &address;
 
   send_address_size = sizeof(struct sockaddr_in);
   a4->sin_addr.s_addr = GM.sta.ip4.router.sin_addr.s_addr;
@@ -161,6 +230,9 @@ request_mapping_ipv4(gm_port_mapping_t * m)
   p->pcp.mp.internal_port = htons(m->internal_port);
   p->pcp.mp.external_port = htons(m->external_port);
   p->pcp.lifetime = htonl(m->lifetime);
+  // On renewal, ask for the address that was granted.
+  if ( !gm_all_zeroes(&m->external_address.s6_addr[12], 4) )
+    memcpy(&p->pcp.mp.external_address.s6_addr[12], &m->external_address.s6_addr[12], 4);
 
   // Send the packet to the gateway.
   send_result = sendto(
@@ -170,7 +242,6 @@ request_mapping_ipv4(gm_port_mapping_t * m)
    0,
    (const struct sockaddr *)a4,
    send_address_size);
-  gettimeofday(&r->time, 0);
 
   if ( send_result < map_packet_size ) {
     GM_FAIL("Send returned %d\n", send_result);
@@ -179,31 +250,17 @@ request_mapping_ipv4(gm_port_mapping_t * m)
   return 0;
 }
 
-int
-gm_port_control_protocol_request_mapping_ipv4()
-{
-  gm_port_mapping_t m = {};
-
-  esp_fill_random(&m.nonce, sizeof(m.nonce));
-  m.ipv6 = false;
-  m.tcp = true;
-  m.internal_port = m.external_port = 8080;
-  m.lifetime = 24 * 60 * 60;
-  return request_mapping_ipv4(&m);
-}
-
-int request_mapping_ipv6(gm_port_mapping_t * m)
+static int
+request_mapping_ipv6(gm_port_mapping_t * m)
 {
-  last_request_t *		r = &last_request_ipv6;
-  nat_pmp_or_pcp_t *		p = &r->packet;
+  nat_pmp_or_pcp_t		packet = {};
+  nat_pmp_or_pcp_t *		p = &packet;
+  struct sockaddr_in6		address = {};
   socklen_t			send_address_size;
   ssize_t			send_result;
-  struct sockaddr_in6 * 	a6 = (struct sockaddr_in6 *)&r->address;
+  struct sockaddr_in6 * 	a6 = &address;
   char				buffer[INET6_ADDRSTRLEN + 1];
 
-  memset(r, '\0', sizeof(last_request_ipv6));
-  r->valid = true;
-
   send_address_size = sizeof(struct sockaddr_in6);
   memcpy(a6->sin6_addr.s6_addr, GM.sta.ip6.router.sin6_addr.s6_addr, sizeof(a6->sin6_addr.s6_addr));
   a6->sin6_family = AF_INET6;
@@ -219,7 +276,8 @@ int request_mapping_ipv6(gm_port_mapping_t * m)
   p->pcp.lifetime = htonl(24 * 60 * 60);
   memcpy(p->pcp.mp.nonce, m->nonce, sizeof(m->nonce));
   p->pcp.mp.protocol = m->tcp ? PCP_TCP : PCP_UDP;
-  // memcpy(p->pcp.mp.external_address.s6_addr, GM.sta.ip6.pub.sin6_addr.s6_addr, sizeof(p->pcp.mp.external_address.s6_addr));
+  // On renewal, ask for the address that was granted.
+  memcpy(p->pcp.mp.external_address.s6_addr, m->external_address.s6_addr, sizeof(p->pcp.mp.external_address.s6_addr));
   p->pcp.mp.internal_port = htons(m->internal_port);
   p->pcp.mp.external_port = htons(m->external_port);
   p->pcp.lifetime = htonl(m->lifetime);
@@ -232,7 +290,6 @@ int request_mapping_ipv6(gm_port_mapping_t * m)
    0,
    (const struct sockaddr *)a6,
    send_address_size);
-  gettimeofday(&r->time, 0);
 
   if ( send_result < map_packet_size ) {
     GM_FAIL("Send returned %d\n", send_result);
@@ -241,44 +298,562 @@ int request_mapping_ipv6(gm_port_mapping_t * m)
   return 0;
 }
 
+// NAT-PMP, RFC 6886, has no nonce. The response is matched by the protocol and
+// the internal port.
+static int
+request_mapping_nat_pmp(gm_port_mapping_t * m)
+{
+  nat_pmp_or_pcp_t		packet = {};
+  nat_pmp_or_pcp_t *		p = &packet;
+  struct sockaddr_in		address = {};
+  ssize_t			send_result;
+
+  address.sin_addr.s_addr = GM.sta.ip4.router.sin_addr.s_addr;
+  address.sin_family = AF_INET;
+  address.sin_port = htons(PCP_PORT);
+
+  p->version = NAT_PMP;
+  p->opcode = m->tcp ? NAT_PMP_MAP_TCP : NAT_PMP_MAP_UDP;
+  p->nat_pmp.request.internal_port = htons(m->internal_port);
+  p->nat_pmp.request.external_port = htons(m->external_port);
+  p->nat_pmp.request.lifetime = htonl(m->lifetime);
+
+  send_result = sendto(
+   ipv4_unicast_sock,
+   p,
+   nat_pmp_request_size,
+   0,
+   (const struct sockaddr *)&address,
+   sizeof(address));
+
+  if ( send_result < nat_pmp_request_size ) {
+    GM_FAIL("Send returned %d\n", send_result);
+    return -1;
+  }
+  return 0;
+}
+
+// NAT-PMP doesn't give the external address with a mapping. It's asked for
+// separately.
+static void
+request_nat_pmp_address(void)
+{
+  const uint8_t		request[2] = { NAT_PMP, NAT_PMP_ANNOUNCE };
+  struct sockaddr_in	address = {};
+
+  if ( ipv4_unicast_sock < 0 )
+    return;
+
+  address.sin_addr.s_addr = GM.sta.ip4.router.sin_addr.s_addr;
+  address.sin_family = AF_INET;
+  address.sin_port = htons(PCP_PORT);
+  sendto(ipv4_unicast_sock, request, sizeof(request), 0, (const struct sockaddr *)&address, sizeof(address));
+}
+
+// The protocol is remembered for each access point, in a key made of "pmp" and its
+// MAC address. Returns false if the station isn't connected.
+static bool
+protocol_key(char * key, size_t size)
+{
+  wifi_ap_record_t ap;
+
+  if ( esp_wifi_sta_get_ap_info(&ap) != ESP_OK )
+    return false;
+
+  snprintf(
+   key,
+   size,
+   "pmp%02x%02x%02x%02x%02x%02x",
+   ap.bssid[0],
+   ap.bssid[1],
+   ap.bssid[2],
+   ap.bssid[3],
+   ap.bssid[4],
+   ap.bssid[5]);
+  return true;
+}
+
+static void
+load_protocol(void)
+{
+  char		key[16];
+  uint8_t	value;
+
+  protocol = MAPPING_UNKNOWN;
+  protocol_confirmed = false;
+  if ( protocol_key(key, sizeof(key)) && nvs_get_u8(GM.nvs, key, &value) == ESP_OK && value <= MAPPING_UPNP )
+    protocol = value;
+}
+
+// A protocol granted a mapping. Use it from now on, and remember it for this
+// access point.
+static void
+choose(uint8_t p)
+{
+  char		key[16];
+  uint8_t	value;
+
+  if ( protocol_confirmed )
+    return;
+
+  if ( protocol != p )
+    gm_printf("Port mapping: The router speaks %s.\n", protocol_names[p]);
+  protocol = p;
+  protocol_confirmed = true;
+
+  if ( protocol_key(key, sizeof(key))
+   && (nvs_get_u8(GM.nvs, key, &value) != ESP_OK || value != p) ) {
+    if ( nvs_set_u8(GM.nvs, key, p) != ESP_OK || nvs_commit(GM.nvs) != ESP_OK )
+      GM_WARN_ONCE("Port mapping: Can't save the protocol in NVS.\n");
+  }
+
+  if ( p == MAPPING_NAT_PMP )
+    request_nat_pmp_address();
+}
+
+// Whether to act on an answer from an IPv4 protocol. Until one has granted a
+// mapping, they all are.
+static bool
+accepted(uint8_t p)
+{
+  return !protocol_confirmed || protocol == p;
+}
+
+// Whether the router's epoch is known to be for this protocol. It's only tracked
+// for the one in use, as a router's PCP and NAT-PMP servers may count separately.
+static bool
+speaks(bool ipv6, uint8_t p)
+{
+  return ipv6 ? p == MAPPING_PCP : protocol_confirmed && protocol == p;
+}
+
+// Link the granted mappings of an address family from GM.sta.
+static void
+relink(bool ipv6)
+{
+  gm_port_mapping_t * *	link = ipv6 ? &GM.sta.ip6.port_mappings : &GM.sta.ip4.port_mappings;
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    struct pcp_mapping * const pm = &mappings[i];
+
+    if ( pm->in_use && pm->granted && pm->m.ipv6 == ipv6 ) {
+      *link = &pm->m;
+      link = &pm->m.next;
+    }
+  }
+  *link = NULL;
+}
+
+static void	tick(void * data);
+
+// Set the timer for whichever mapping is due next.
+static void
+schedule(void)
+{
+  const int64_t	now = esp_timer_get_time();
+  int64_t	next = INT64_MAX;
+
+  gm_timer_cancel(tick, 0);
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    const struct pcp_mapping * const pm = &mappings[i];
+
+    if ( !pm->in_use || !pm->active )
+      continue;
+    if ( pm->next < next )
+      next = pm->next;
+    if ( pm->granted && pm->expires < next )
+      next = pm->expires;
+  }
+  if ( next == INT64_MAX )
+    return;
+
+  next = next > now ? (next - now) / 1000 + 1 : 0;
+  if ( next > REQUESTED_LIFETIME * 1000LL )
+    next = REQUESTED_LIFETIME * 1000LL;
+  if ( gm_timer_add(tick, 0, (uint32_t)next) != 0 )
+    GM_WARN_ONCE("PCP: Out of timers. Mappings won't be renewed.\n");
+}
+
+static void
+transmit(struct pcp_mapping * pm)
+{
+  if ( pm->m.ipv6 ) {
+    if ( ipv6_unicast_sock >= 0 )
+      request_mapping_ipv6(&pm->m);
+    return;
+  }
+  if ( ipv4_unicast_sock < 0 )
+    return;
+
+  if ( protocol == MAPPING_UNKNOWN || protocol == MAPPING_PCP )
+    request_mapping_ipv4(&pm->m);
+  if ( protocol == MAPPING_UNKNOWN || protocol == MAPPING_NAT_PMP )
+    request_mapping_nat_pmp(&pm->m);
+  if ( protocol == MAPPING_UNKNOWN || protocol == MAPPING_UPNP ) {
+    // The HTTP client times out an AddPortMapping itself, so one isn't repeated
+    // while it's in flight. Until the router has been found, it's looked for.
+    if ( !upnp_igd_ready() )
+      upnp_igd_discover();
+    else if ( pm->upnp == NULL )
+      pm->upnp = upnp_igd_map(&pm->m, upnp_permanent ? 0 : UPNP_LIFETIME, pm);
+  }
+}
+
+// Runs in the select task, from a timer. Expire mappings, and send the requests
+// that are due.
+static void
+tick(void * data)
+{
+  const int64_t now = esp_timer_get_time();
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    struct pcp_mapping * const pm = &mappings[i];
+
+    if ( !pm->in_use || !pm->active )
+      continue;
+
+    if ( pm->granted && now >= pm->expires ) {
+      gm_printf("PCP: The %s mapping of port %u expired.\n", pm->m.ipv6 ? "IPv6" : "IPv4", (unsigned int)pm->m.internal_port);
+      pm->granted = false;
+      relink(pm->m.ipv6);
+    }
+
+    if ( now >= pm->next ) {
+      if ( pm->outstanding ) {
+        pm->timeout *= 2;
+        if ( pm->timeout > MAX_TIMEOUT )
+          pm->timeout = MAX_TIMEOUT;
+        // The protocol that worked with this router before doesn't answer now.
+        if ( !pm->m.ipv6 && !protocol_confirmed && protocol != MAPPING_UNKNOWN && pm->timeout >= FALLBACK_TIMEOUT ) {
+          gm_printf("Port mapping: %s doesn't answer. Trying all protocols.\n", protocol_names[protocol]);
+          protocol = MAPPING_UNKNOWN;
+        }
+      }
+      else {
+        pm->outstanding = true;
+        pm->timeout = INITIAL_TIMEOUT;
+      }
+      transmit(pm);
+      pm->next = now + pm->timeout * 1000LL;
+    }
+  }
+  schedule();
+}
+
+// Request every mapping of an address family again, after up to delay milliseconds.
+static void
+remap(bool ipv6, uint32_t delay)
+{
+  const int64_t when = esp_timer_get_time() + (delay ? esp_random() % delay : 0) * 1000LL;
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    struct pcp_mapping * const pm = &mappings[i];
+
+    if ( pm->in_use && pm->m.ipv6 == ipv6 ) {
+      pm->active = true;
+      pm->outstanding = false;
+      pm->next = when;
+    }
+  }
+  schedule();
+}
+
+// Check the router's epoch, RFC 6887 section 8.5. Returns true if the router
+// has lost its mappings since the last response.
+static bool
+epoch_lost(bool ipv6, uint32_t server)
+{
+  struct pcp_epoch * const	e = &epochs[ipv6];
+  const int64_t			now = esp_timer_get_time();
+  bool				lost = false;
+
+  if ( e->valid ) {
+    const int64_t client_delta = (now - e->client) / 1000000;
+    const int64_t server_delta = (int64_t)server - e->server;
+
+    lost = server + 1 < e->server
+     || client_delta + 2 < server_delta - server_delta / 16
+     || server_delta + 2 < client_delta - client_delta / 16;
+  }
+  e->valid = true;
+  e->server = server;
+  e->client = now;
+  return lost;
+}
+
+static struct pcp_mapping *
+find_mapping(bool ipv6, bool tcp, uint16_t internal_port)
+{
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    struct pcp_mapping * const pm = &mappings[i];
+
+    if ( pm->in_use && pm->m.ipv6 == ipv6 && pm->m.tcp == tcp && pm->m.internal_port == internal_port )
+      return pm;
+  }
+  return NULL;
+}
+
+// Map a port, and keep it mapped. If it's already mapped, it's renewed now.
+// external_port is only a suggestion, 0 lets the router choose. Call from the
+// select task. Returns -1 if there's no room for another mapping.
+int
+gm_port_control_protocol_map(bool ipv6, bool tcp, uint16_t internal_port, uint16_t external_port)
+{
+  struct pcp_mapping *	pm = find_mapping(ipv6, tcp, internal_port);
+
+  if ( pm == NULL ) {
+    for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+      if ( !mappings[i].in_use ) {
+        pm = &mappings[i];
+        break;
+      }
+    }
+    if ( pm == NULL ) {
+      gm_printf("PCP: No room for another mapping.\n");
+      return -1;
+    }
+    memset(pm, '\0', sizeof(*pm));
+    esp_fill_random(pm->m.nonce, sizeof(pm->m.nonce));
+    pm->m.ipv6 = ipv6;
+    pm->m.tcp = tcp;
+    pm->m.internal_port = internal_port;
+    pm->m.external_port = external_port;
+    pm->m.lifetime = REQUESTED_LIFETIME;
+    pm->in_use = true;
+    pm->active = (ipv6 ? ipv6_unicast_sock : ipv4_unicast_sock) >= 0;
+  }
+  // A request that's already outstanding carries on with its retransmissions.
+  if ( !pm->outstanding )
+    pm->next = esp_timer_get_time();
+  schedule();
+  return 0;
+}
+
+// Copy the mappings in the pool, for warm_boot.c. For those that are granted,
+// lifetime is the seconds from granted_time that they're good for. Those that
+// aren't have no granted_time. Call from the select task. Returns the number copied.
+int
+gm_port_control_protocol_mappings(gm_port_mapping_t * m, int size)
+{
+  const int64_t	now = esp_timer_get_time();
+  int		count = 0;
+
+  for ( int i = 0; i < MAX_MAPPINGS && count < size; i++ ) {
+    const struct pcp_mapping * const pm = &mappings[i];
+
+    if ( !pm->in_use )
+      continue;
+    m[count] = pm->m;
+    if ( pm->granted ) {
+      gettimeofday(&m[count].granted_time, 0);
+      m[count].lifetime = pm->expires > now ? (pm->expires - now) / 1000000 : 0;
+    }
+    else
+      memset(&m[count].granted_time, '\0', sizeof(m[count].granted_time));
+    count++;
+  }
+  return count;
+}
+
+// Whether the HTTPS port may be forwarded from the Internet. The web interface has
+// no authentication, so it's only done if the public_https parameter is 1.
+static bool
+https_is_public(void)
+{
+  int32_t	value = 0;
+
+  return gm_nonvolatile_get_int("public_https", &value) == GM_NORMAL && value != 0;
+}
+
+// Put a mapping from before a reboot back in the pool, with its nonce, so that the
+// router renews it rather than making another. If it has remaining seconds, it's
+// taken as granted until the router says otherwise. It's requested when the
+// listener starts. Call from the select task.
+void
+gm_port_control_protocol_restore(const gm_port_mapping_t * m, uint32_t remaining)
+{
+  struct pcp_mapping *	pm = find_mapping(m->ipv6, m->tcp, m->internal_port);
+  const int64_t		now = esp_timer_get_time();
+
+  // Forwarding HTTPS may have been turned off since the mapping was made.
+  if ( m->tcp && m->internal_port == GM_HTTPS_PORT && !https_is_public() )
+    return;
+
+  if ( pm == NULL ) {
+    if ( gm_port_control_protocol_map(m->ipv6, m->tcp, m->internal_port, m->external_port) != 0 )
+      return;
+    pm = find_mapping(m->ipv6, m->tcp, m->internal_port);
+    memcpy(pm->m.nonce, m->nonce, sizeof(pm->m.nonce));
+  }
+  if ( pm->granted || memcmp(pm->m.nonce, m->nonce, sizeof(pm->m.nonce)) != 0 )
+    return;
+
+  pm->m.external_port = m->external_port;
+  pm->m.external_address = m->external_address;
+  if ( remaining > 0 ) {
+    pm->m.granted_time = m->granted_time;
+    pm->m.epoch = m->epoch;
+    pm->granted = true;
+    pm->expires = now + remaining * 1000000LL;
+    relink(pm->m.ipv6);
+  }
+  schedule();
+}
+
+// Runs in the select task.
+static void
+request_https(void * data)
+{
+  gm_port_control_protocol_map(data != 0, true, GM_HTTPS_PORT, GM_HTTPS_PORT);
+}
+
+// Returns -1 if the HTTPS port isn't to be forwarded.
+int
+gm_port_control_protocol_request_mapping_ipv4()
+{
+  if ( !https_is_public() )
+    return -1;
+  gm_run(request_https, (void *)0, GM_FAST);
+  return 0;
+}
+
 int
 gm_port_control_protocol_request_mapping_ipv6()
 {
-  gm_port_mapping_t m = {};
+  if ( !https_is_public() )
+    return -1;
+  gm_run(request_https, (void *)1, GM_FAST);
+  return 0;
+}
+
+// Temporary errors of PCP, RFC 6887 section 7.4, and of NAT-PMP. The router
+// expects them to go away. After the others, the mapping is given up.
+static bool
+temporary_error(uint8_t version, uint8_t result_code)
+{
+  if ( version == NAT_PMP )
+    return result_code == NAT_PMP_NETWORK_FAILURE || result_code == NAT_PMP_OUT_OF_RESOURCES;
+
+  switch ( result_code ) {
+  case PCP_NETWORK_FAILURE:
+  case PCP_NO_RESOURCES:
+  case PCP_USER_EX_QUOTA:
+  case PCP_CANNOT_PROVIDE_EXTERNAL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// The router refused a mapping. After a temporary error, it's asked again in wait
+// seconds, within bounds.
+static void
+refused(struct pcp_mapping * pm, bool temporary, uint32_t wait)
+{
+  pm->outstanding = false;
+  if ( !temporary ) {
+    pm->in_use = false;
+    pm->granted = false;
+    relink(pm->m.ipv6);
+  }
+  else {
+    if ( wait < MIN_ERROR_WAIT )
+      wait = MIN_ERROR_WAIT;
+    if ( wait > MAX_ERROR_WAIT )
+      wait = MAX_ERROR_WAIT;
+    pm->next = esp_timer_get_time() + wait * 1000000LL;
+  }
+  schedule();
+}
+
+// The router granted a mapping, with any of the protocols. It's renewed at half
+// the lifetime.
+static void
+granted(struct pcp_mapping * pm, uint32_t lifetime, uint32_t epoch, uint16_t external_port, const struct in6_addr * external_address)
+{
+  const int64_t	now = esp_timer_get_time();
+  char		buffer[INET6_ADDRSTRLEN + 1];
+
+  gettimeofday(&pm->m.granted_time, 0);
+  pm->m.epoch = epoch;
+  pm->m.external_port = external_port;
+  memcpy(pm->m.external_address.s6_addr, external_address->s6_addr, sizeof(pm->m.external_address.s6_addr));
+  pm->outstanding = false;
+  pm->granted = lifetime > 0;
+  pm->expires = now + lifetime * 1000000LL;
+  pm->next = now + (lifetime / 2) * 1000000LL;
+  relink(pm->m.ipv6);
+  schedule();
+  gm_warm_boot_changed();
+
+  memset(buffer, '\0', sizeof(buffer));
+  if ( pm->m.ipv6 )
+    inet_ntop(AF_INET6, external_address->s6_addr, buffer, sizeof(buffer));
+  else
+    inet_ntop(AF_INET, &external_address->s6_addr[12], buffer, sizeof(buffer));
+  ; // gm_printf("Router public mapping address: %s port: %d\n", buffer, external_port);
+  gm_web_socket_publish(pm->m.ipv6 ? "pcp_ipv6" : "pcp_ipv4", "%s port %d", buffer, external_port);
+}
 
-  esp_fill_random(&m.nonce, sizeof(m.nonce));
-  m.ipv6 = true;
-  m.tcp = true;
-  m.internal_port = m.external_port = 8080;
-  m.lifetime = 24 * 60 * 60;
-  return request_mapping_ipv6(&m);
+// An IPv4 address, as PCP carries it.
+static void
+mapped_ipv4(struct in6_addr * a, const struct in_addr * a4)
+{
+  memset(a, '\0', sizeof(*a));
+  a->s6_addr[10] = 0xff;
+  a->s6_addr[11] = 0xff;
+  memcpy(&a->s6_addr[12], &a4->s_addr, 4);
 }
 
+// The router sends an ANNOUNCE when it restarts. The mappings are requested again
+// after a random delay, so that every host on the network doesn't ask at once.
 static void
 decode_pcp_announce(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct sockaddr_storage * address)
 {
-  ; // gm_printf("Received PCP Announce\n");
+  const bool ipv6 = address->ss_family == AF_INET6;
+
+  if ( message_size < announce_packet_size || p->result_code != PCP_SUCCESS )
+    return;
+
+  if ( (speaks(ipv6, MAPPING_PCP) && epoch_lost(ipv6, ntohl(p->pcp.response.epoch))) || multicast )
+    remap(ipv6, ANNOUNCE_DELAY);
 }
 
 static void
 decode_pcp_map(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct sockaddr_storage * address)
 {
-  // FIX: Manage re-authorization of existing mappings. Reject responses that are too
-  // long after the request.
-  last_request_t *	last;
-  gm_port_mapping_t	m = {};
-  gm_port_mapping_t * *	mp;
+  struct pcp_mapping *	pm;
+  const bool		ipv6 = address->ss_family == AF_INET6;
+  const uint32_t	lifetime = ntohl(p->pcp.lifetime);
   esp_ip6_addr_t	esp_addr;
   esp_ip6_addr_type_t	ipv6_type;
-  char			buffer[INET6_ADDRSTRLEN + 1];
 
-  switch ( address->ss_family ) {
-  case AF_INET:
-    last = &last_request_ipv4;
-    break;
-  case AF_INET6:
-    last = &last_request_ipv6;
+  pm = find_mapping(ipv6, p->pcp.mp.protocol == PCP_TCP, ntohs(p->pcp.mp.internal_port));
+  if ( pm == NULL || memcmp(p->pcp.mp.nonce, pm->m.nonce, sizeof(pm->m.nonce)) != 0 ) {
+    GM_FAIL("Received nonce isn't equal to transmitted one.\n");
+    return;
+  }
+  // A duplicate, or a response that was retransmitted.
+  if ( !pm->outstanding )
+    return;
+  if ( !ipv6 && !accepted(MAPPING_PCP) )
+    return;
+
+  if ( p->result_code != PCP_SUCCESS ) {
+    GM_FAIL("PCP received result code: %d.\n", p->result_code);
+    // Another protocol may yet grant it.
+    if ( !ipv6 && !protocol_confirmed )
+      return;
+    // Let the router choose, next time.
+    if ( p->result_code == PCP_CANNOT_PROVIDE_EXTERNAL ) {
+      pm->m.external_port = 0;
+      memset(&pm->m.external_address, '\0', sizeof(pm->m.external_address));
+    }
+    refused(pm, temporary_error(PORT_MAPPING_PROTOCOL, p->result_code), lifetime);
+    return;
+  }
 
+  if ( ipv6 ) {
     // esp-idf has its own IPv6 address structure.
     memset(&esp_addr, '\0', sizeof(esp_addr));
     memcpy(esp_addr.addr, p->pcp.mp.external_address.s6_addr, sizeof(esp_addr.addr));
@@ -290,58 +865,176 @@ decode_pcp_map(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struc
       ; // GM_WARN_ONCE("Warning: The router responded to a PCP map request with a useless mapping to an IPv6 %s address, instead of a global address. This is probably a MiniUPnPd bug.\n", GM.ipv6_address_types[ipv6_type]);
       return;
     }
-    break;
-  default:
-    return;
   }
+  else
+    choose(MAPPING_PCP);
 
-  if ( memcmp(p->pcp.mp.nonce, last->packet.pcp.mp.nonce, sizeof(p->pcp.mp.nonce)) < 0 ) {
-    GM_FAIL("Received nonce isn't equal to transmitted one.\n");
+  // If the router has restarted, the other mappings are gone too.
+  if ( epoch_lost(ipv6, ntohl(p->pcp.response.epoch)) ) {
+    gm_printf("PCP: The %s router lost its mappings. Mapping again.\n", ipv6 ? "IPv6" : "IPv4");
+    remap(ipv6, 0);
+  }
+
+  granted(pm, lifetime, ntohl(p->pcp.response.epoch), ntohs(p->pcp.mp.external_port), &p->pcp.mp.external_address);
+}
+
+static void
+decode_pcp_peer(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct sockaddr_storage * address)
+{
+  ; // gm_printf("Received PCP Peer\n");
+}
+
+// The external address, in answer to request_nat_pmp_address(), or multicast by
+// the router when it restarts or the address changes.
+static void
+decode_nat_pmp_address(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast)
+{
+  if ( message_size < nat_pmp_address_size || p->result_code != NAT_PMP_SUCCESS )
+    return;
+
+  if ( !speaks(false, MAPPING_NAT_PMP) ) {
+    if ( multicast )
+      remap(false, ANNOUNCE_DELAY);
     return;
   }
-  if ( p->result_code != PCP_SUCCESS ) {
-    GM_FAIL("PCP received result code: %d.\n", p->result_code);
+
+  if ( epoch_lost(false, ntohl(p->nat_pmp.address.epoch)) || multicast )
+    remap(false, ANNOUNCE_DELAY);
+
+  if ( nat_pmp_external.s_addr != p->nat_pmp.address.external_address.s_addr ) {
+    char buffer[INET_ADDRSTRLEN];
+
+    nat_pmp_external = p->nat_pmp.address.external_address;
+    inet_ntop(AF_INET, &nat_pmp_external, buffer, sizeof(buffer));
+    for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+      struct pcp_mapping * const pm = &mappings[i];
+
+      if ( pm->in_use && !pm->m.ipv6 ) {
+        mapped_ipv4(&pm->m.external_address, &nat_pmp_external);
+        if ( pm->granted )
+          gm_web_socket_publish("pcp_ipv4", "%s port %d", buffer, pm->m.external_port);
+      }
+    }
+  }
+}
+
+static void
+decode_nat_pmp_map(nat_pmp_or_pcp_t * p, ssize_t message_size)
+{
+  struct pcp_mapping *	pm;
+  struct in6_addr	external_address;
+  const uint32_t	lifetime = ntohl(p->nat_pmp.response.lifetime);
+
+  pm = find_mapping(false, (p->opcode & 0x7f) == NAT_PMP_MAP_TCP, ntohs(p->nat_pmp.response.internal_port));
+  if ( pm == NULL || !pm->outstanding || !accepted(MAPPING_NAT_PMP) )
     return;
+
+  // The result code has 16 bits in NAT-PMP. The high byte is always zero.
+  if ( p->reserved != 0 || p->result_code != NAT_PMP_SUCCESS ) {
+    GM_FAIL("NAT-PMP received result code: %d.\n", (p->reserved << 8) | p->result_code);
+    if ( !protocol_confirmed )
+      return;
+    refused(pm, p->reserved == 0 && temporary_error(NAT_PMP, p->result_code), MIN_ERROR_WAIT);
+    return;
+  }
+
+  choose(MAPPING_NAT_PMP);
+  if ( epoch_lost(false, ntohl(p->nat_pmp.response.epoch)) ) {
+    gm_printf("NAT-PMP: The router lost its mappings. Mapping again.\n");
+    remap(false, 0);
   }
-  if ( p->opcode != (last->packet.opcode | 0x80) ) {
-    GM_FAIL("Received opcode: %x.\n", p->opcode);
+
+  mapped_ipv4(&external_address, &nat_pmp_external);
+  granted(pm, lifetime, ntohl(p->nat_pmp.response.epoch), ntohs(p->nat_pmp.response.external_port), &external_address);
+}
+
+static void
+decode_nat_pmp(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct sockaddr_storage * address)
+{
+  if ( address->ss_family != AF_INET || !(p->opcode & 0x80) )
     return;
+
+  switch ( p->opcode & 0x7f ) {
+  case NAT_PMP_ANNOUNCE:
+    decode_nat_pmp_address(p, message_size, multicast);
+    break;
+  case NAT_PMP_MAP_UDP:
+  case NAT_PMP_MAP_TCP:
+    if ( multicast )
+      return;
+    if ( message_size < nat_pmp_response_size ) {
+      GM_FAIL("Receive packet too small for NAT-PMP: %d\n", message_size);
+      return;
+    }
+    decode_nat_pmp_map(p, message_size);
+    break;
   }
+}
 
-  memset(&m, '\0', sizeof(m));
-  gettimeofday(&m.granted_time, 0);
-  memcpy(m.nonce, p->pcp.mp.nonce, sizeof(m.nonce));
-  m.epoch = p->pcp.response.epoch;
-  m.ipv6 = address->ss_family == AF_INET6;
-  m.tcp = p->pcp.mp.protocol == PCP_TCP;
-  m.internal_port = ntohs(p->pcp.mp.internal_port);
-  m.external_port = ntohs(p->pcp.mp.external_port);
-  m.lifetime = ntohl(p->pcp.lifetime);
-  memcpy(m.external_address.s6_addr, p->pcp.mp.external_address.s6_addr, sizeof(m.external_address.s6_addr));
+// Runs in the select task, when the UPnP router has been found.
+void
+upnp_igd_found(const struct in_addr * external_address)
+{
+  const int64_t now = esp_timer_get_time();
 
-  memset(buffer, '\0', sizeof(buffer));
-  if ( address->ss_family == AF_INET6 )
-    inet_ntop(AF_INET6, p->pcp.mp.external_address.s6_addr, buffer, sizeof(buffer));
-  else
-    inet_ntop(AF_INET, &p->pcp.mp.external_address.s6_addr[12], buffer, sizeof(buffer));
-  ; // gm_printf("Router public mapping address: %s port: %d\n", buffer, m.external_port);
-  if ( m.ipv6 )
-    mp = &GM.sta.ip6.port_mappings;
-  else
-    mp = &GM.sta.ip4.port_mappings;
-  while ( *mp != 0 )
-    mp = &((*mp)->next);
-  if ( mp ) {
-    gm_port_mapping_t * n = malloc(sizeof(*n));
-    memcpy(n, &m, sizeof(*n));
-    *mp = n;
+  upnp_external = *external_address;
+  if ( !accepted(MAPPING_UPNP) )
+    return;
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    struct pcp_mapping * const pm = &mappings[i];
+
+    if ( pm->in_use && pm->active && pm->outstanding && !pm->m.ipv6 )
+      pm->next = now;
   }
+  schedule();
 }
 
-static void
-decode_pcp_peer(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct sockaddr_storage * address)
+// Runs in the select task, when an AddPortMapping has finished.
+void
+upnp_igd_mapped(gm_http_request_t * request, int error, void * context)
 {
-  ; // gm_printf("Received PCP Peer\n");
+  struct pcp_mapping * const	pm = (struct pcp_mapping *)context;
+  struct in6_addr		external_address;
+
+  // It was cancelled, and the slot may have been used again.
+  if ( pm->upnp != request )
+    return;
+  pm->upnp = NULL;
+  if ( !pm->in_use || !pm->active || !pm->outstanding || !accepted(MAPPING_UPNP) )
+    return;
+
+  switch ( error ) {
+  case 0:
+    break;
+  case UPNP_NO_ANSWER:
+    // It will be sent again.
+    return;
+  case UPNP_ONLY_PERMANENT_LEASES_SUPPORTED:
+    // The router answered, so this is a new request rather than a retransmission.
+    upnp_permanent = true;
+    pm->outstanding = false;
+    pm->next = esp_timer_get_time();
+    schedule();
+    return;
+  case UPNP_CONFLICT_IN_MAPPING_ENTRY:
+    // Another host has the external port. Try one at random.
+    pm->m.external_port = 1024 + esp_random() % (65536 - 1024);
+    pm->outstanding = false;
+    pm->next = esp_timer_get_time();
+    schedule();
+    return;
+  default:
+    gm_printf("UPnP: AddPortMapping of port %u failed, error %d.\n", (unsigned int)pm->m.internal_port, error);
+    if ( protocol_confirmed )
+      refused(pm, false, 0);
+    return;
+  }
+
+  choose(MAPPING_UPNP);
+  mapped_ipv4(&external_address, &upnp_external);
+  // With a permanent lease, this is when it's checked that the router still has it.
+  granted(pm, UPNP_LIFETIME, 0, pm->m.external_port ? pm->m.external_port : pm->m.internal_port, &external_address);
 }
 
 void
@@ -350,8 +1043,6 @@ decode_packet(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct
   bool		response;
   uint16_t	port;
 
-  // FIX: This assumes all messages are PCP, it should handle NAT-PMP correctly.
-
   switch ( address->ss_family ) {
   case AF_INET:
     port = htons(((struct sockaddr_in *)address)->sin_port);
@@ -380,9 +1071,24 @@ decode_packet(nat_pmp_or_pcp_t * p, ssize_t message_size, bool multicast, struct
     break;
   }
 
-
   response = p->opcode & 0x80;
-  
+
+  // While the protocols are tried at once, the router answers the ones that it
+  // doesn't speak with this. The others are still waited for.
+  if ( response && p->reserved == 0 && p->result_code == PCP_UNSUPP_VERSION )
+    return;
+
+  switch ( p->version ) {
+  case NAT_PMP:
+    decode_nat_pmp(p, message_size, multicast, address);
+    return;
+  case PORT_MAPPING_PROTOCOL:
+    break;
+  default:
+    GM_FAIL("Unrecognized version %d\n", p->version);
+    return;
+  }
+
   switch ( p->opcode & 0x7f ) {
   case PCP_ANNOUNCE:
     decode_pcp_announce(p, message_size, multicast, address);
@@ -454,7 +1160,7 @@ incoming_packet(int fd, void * data, bool readable, bool writable, bool exceptio
 
 
     // Data is set to 1 for multicast, 0 for unicast.
-    decode_packet(&packet, message_size, (int)data != 0, &address);
+    decode_packet(&packet, message_size, data != 0, &address);
   }
 }
 
@@ -582,11 +1288,55 @@ start_unicast_listener_ipv6(void)
   gm_fd_register(ipv6_unicast_sock, incoming_packet, (void *)0, true, false, true, 0);
 }
 
+// Runs in the select task. Request the mappings that were made before the
+// listener was last stopped. For IPv4, with the protocol that worked with this
+// access point before, if there is one.
+static void
+start_mappings(void * data)
+{
+  if ( data == 0 ) {
+    load_protocol();
+    nat_pmp_external.s_addr = 0;
+    upnp_external.s_addr = 0;
+    upnp_permanent = false;
+  }
+  remap(data != 0, 0);
+}
+
+// Runs in the select task. The mappings are kept, so that they can be requested
+// again when the listener starts, but are no longer granted.
+static void
+stop_mappings(void * data)
+{
+  const bool ipv6 = data != 0;
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    struct pcp_mapping * const pm = &mappings[i];
+
+    if ( pm->in_use && pm->m.ipv6 == ipv6 ) {
+      gm_http_request_t * const r = pm->upnp;
+
+      pm->active = false;
+      pm->granted = false;
+      pm->outstanding = false;
+      pm->upnp = NULL;
+      if ( r )
+        gm_http_cancel(r);
+    }
+  }
+  if ( !ipv6 )
+    upnp_igd_stop();
+  epochs[ipv6].valid = false;
+  relink(ipv6);
+  schedule();
+}
+
 void
 gm_port_control_protocol_start_listener_ipv4(void)
 {
   start_unicast_listener_ipv4();
   start_multicast_listener_ipv4();
+  gm_run(start_mappings, (void *)0, GM_FAST);
 }
 
 void
@@ -594,6 +1344,7 @@ gm_port_control_protocol_start_listener_ipv6(void)
 {
   start_unicast_listener_ipv6();
   start_multicast_listener_ipv6();
+  gm_run(start_mappings, (void *)1, GM_FAST);
 }
 
 void
@@ -609,6 +1360,7 @@ gm_port_control_protocol_stop_listener_ipv4(void)
     close(ipv4_multicast_sock);
     ipv4_multicast_sock = -1;
   }
+  gm_run(stop_mappings, (void *)0, GM_FAST);
 }
 
 void
@@ -624,4 +1376,44 @@ gm_port_control_protocol_stop_listener_ipv6(void)
     close(ipv6_multicast_sock);
     ipv6_multicast_sock = -1;
   }
+  gm_run(stop_mappings, (void *)1, GM_FAST);
+}
+
+void
+gm_port_control_protocol_report(void)
+{
+  const int64_t now = esp_timer_get_time();
+
+  gm_printf(
+   "IPv4 mappings are made with %s%s.\n",
+   protocol_names[protocol],
+   protocol != MAPPING_UNKNOWN && !protocol_confirmed ? ", which worked with this access point before" : "");
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    const struct pcp_mapping * const	pm = &mappings[i];
+    char				buffer[INET6_ADDRSTRLEN];
+
+    if ( !pm->in_use )
+      continue;
+
+    gm_printf("%s %s port %u: ", pm->m.ipv6 ? "IPv6" : "IPv4", pm->m.tcp ? "TCP" : "UDP", (unsigned int)pm->m.internal_port);
+    if ( pm->granted ) {
+      if ( pm->m.ipv6 )
+        inet_ntop(AF_INET6, pm->m.external_address.s6_addr, buffer, sizeof(buffer));
+      else
+        inet_ntop(AF_INET, &pm->m.external_address.s6_addr[12], buffer, sizeof(buffer));
+      gm_printf(
+       "mapped to %s port %u, expires in %lld s",
+       buffer,
+       (unsigned int)pm->m.external_port,
+       (long long)(pm->expires - now) / 1000000);
+    }
+    else
+      gm_printf("not mapped");
+    if ( !pm->active )
+      gm_printf(", the listener is stopped.\n");
+    else if ( pm->outstanding )
+      gm_printf(", requesting.\n");
+    else
+      gm_printf(", next request in %lld s.\n", (long long)(pm->next - now) / 1000000);
+  }
 }
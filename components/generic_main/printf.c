@@ -27,14 +27,29 @@ gm_fail(const char * function, const char * file, int line, const char * pattern
   va_end(args);
 }
 
+// The text is also copied to the log stream, for browsers watching /log.
 int
 gm_vprintf(const char * pattern, va_list args)
 {
-  int length;
+  char		buffer[256];
+  int		length;
+  va_list	copy;
+
+  va_copy(copy, args);
+  length = vsnprintf(buffer, sizeof(buffer), pattern, copy);
+  va_end(copy);
+
   pthread_mutex_lock(&GM.console_print_mutex);
-  length = vfprintf(GM.log_file_pointer, pattern, args);
+  if ( length >= 0 && length < sizeof(buffer) )
+    fwrite(buffer, 1, length, GM.log_file_pointer);
+  else
+    length = vfprintf(GM.log_file_pointer, pattern, args);
   fflush(GM.log_file_pointer);
   pthread_mutex_unlock(&GM.console_print_mutex);
+  // The log stream has its own lock. It's called without the console lock, because
+  // it may fail, and gm_fail() takes the console lock.
+  if ( length > 0 )
+    gm_log_stream_write(buffer, length < sizeof(buffer) ? length : sizeof(buffer) - 1);
   return length;
 }
 
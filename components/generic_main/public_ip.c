@@ -1,15 +1,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <cJSON.h>
 #include <sys/random.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_timer.h>
 #include "generic_main.h"
+#include "json_extract.h"
 #include <sys/socket.h>
 
 // Sites that return your external IP in JSON with { "ip": "address string" }
 // and don't have a problem being called by robots, or a fee.
-// Try to be fair to them all and fault-tolerant by randomly calling one from
-// a list, and retrying another randomly-selected one as necessary.
+//
+// Several of them are asked at once, with the asynchronous HTTP client, and the
+// first good answer wins, so one slow or dead site doesn't hold up the lookup.
+// The sites with the best record of success and speed are asked first, plus one
+// other chosen at random, so that every site's record stays current, and the
+// load is spread among them.
+//
+// If the first answer isn't the address we got last time, it isn't trusted
+// until a second site agrees, since one site could be wrong. If they never agree,
+// the first answer is used.
 const char * const urls[] = {
   "https://api.myip.com/",
   "https://api.my-ip.io/ip.json",
@@ -19,32 +30,228 @@ const char * const urls[] = {
 };
 const size_t number_of_entries = (sizeof(urls) / sizeof(*urls));
 
-static int gm_public_ipv4_internal(const char * url, char * data, size_t size)
+#define RACE_WIDTH	3
+#define TIMEOUT		20 // Seconds.
+
+struct _race;
+
+typedef struct _entry {
+  struct _race *	race;
+  gm_http_request_t *	request;
+  int			provider;
+  int64_t		start;
+  bool			finished;
+  gm_json_extractor_t	json;
+  gm_json_field_t	field;
+  char			answer[INET6_ADDRSTRLEN];
+} entry_t;
+
+typedef struct _race {
+  SemaphoreHandle_t	semaphore;
+  int			references;
+  int			outstanding;
+  bool			decided;
+  char			result[INET6_ADDRSTRLEN];
+  entry_t		entries[RACE_WIDTH];
+} race_t;
+
+// These are only used in the select task.
+static gm_choice_statistics_t	statistics[COUNTOF(urls)] = {};
+static uint32_t			wins[COUNTOF(urls)] = {};
+static char			last_answer[INET6_ADDRSTRLEN] = "";
+
+static void
+release(race_t * race)
 {
-  char	buffer[1024];
-  int	return_value = -1;
+  if ( __atomic_sub_fetch(&race->references, 1, __ATOMIC_ACQ_REL) == 0 ) {
+    vSemaphoreDelete(race->semaphore);
+    free(race);
+  }
+}
 
-  int status = gm_web_get(url, buffer, sizeof(buffer));
-  if (status == 200) {
-    struct cJSON * json = cJSON_Parse(buffer);
-    if (json) {
-      struct cJSON * ip_json = cJSON_GetObjectItemCaseSensitive(json, "ip");
-      if (cJSON_IsString(ip_json) && ip_json->valuestring) {
-        strncpy(data, ip_json->valuestring, size - 1);
-        data[size - 1] = '\0';
-        return_value = 0;
+// Choose the sites for a race. An untried site is taken to answer in half a
+// second.
+static void
+choose(int * chosen)
+{
+  gm_choose_best(statistics, COUNTOF(urls), 500, 100, chosen, RACE_WIDTH);
+}
+
+static bool
+valid_address(const char * s)
+{
+  struct in6_addr	address;
+
+  return inet_pton(AF_INET, s, &address) == 1 || inet_pton(AF_INET6, s, &address) == 1;
+}
+
+static void
+decide(race_t * race, const char * answer)
+{
+  race->decided = true;
+  if ( answer ) {
+    strcpy(race->result, answer);
+    strcpy(last_answer, answer);
+  }
+
+  // Cancelling a request calls its done callback, which releases the race. Hold
+  // a reference until the loop is over.
+  __atomic_add_fetch(&race->references, 1, __ATOMIC_ACQ_REL);
+  for ( int i = 0; i < RACE_WIDTH; i++ ) {
+    entry_t * const e = &race->entries[i];
+
+    if ( !e->finished && e->request )
+      gm_http_cancel(e->request);
+  }
+  xSemaphoreGive(race->semaphore);
+  release(race);
+}
+
+static void
+evaluate(race_t * race)
+{
+  const char * first = NULL;
+
+  for ( int i = 0; i < RACE_WIDTH; i++ ) {
+    const entry_t * const e = &race->entries[i];
+
+    if ( !e->finished || e->answer[0] == '\0' )
+      continue;
+
+    if ( first == NULL )
+      first = e->answer;
+
+    if ( last_answer[0] == '\0' || strcmp(e->answer, last_answer) == 0 ) {
+      wins[e->provider]++;
+      decide(race, e->answer);
+      return;
+    }
+    for ( int j = i + 1; j < RACE_WIDTH; j++ ) {
+      const entry_t * const other = &race->entries[j];
+
+      if ( other->finished && strcmp(other->answer, e->answer) == 0 ) {
+        wins[e->provider]++;
+        decide(race, e->answer);
+        return;
       }
-      cJSON_Delete(json);
     }
   }
-  return return_value;
+  if ( race->outstanding == 0 )
+    decide(race, first);
+}
+
+static ssize_t
+body(gm_http_request_t * request, const char * data, size_t size, void * context)
+{
+  entry_t * const	e = (entry_t *)context;
+
+  // The response is parsed as it arrives. If it isn't JSON, give up on it.
+  if ( gm_json_extract(&e->json, data, size) != 0 )
+    return -1;
+  return size;
+}
+
+static void
+done(gm_http_request_t * request, int status, void * context)
+{
+  entry_t * const		e = (entry_t *)context;
+  race_t * const		race = e->race;
+  gm_choice_statistics_t * const	s = &statistics[e->provider];
+  const uint32_t		latency = (esp_timer_get_time() - e->start) / 1000;
+
+  e->finished = true;
+  e->request = NULL;
+  race->outstanding--;
+
+  if ( status == 200
+   && gm_json_extract_end(&e->json) == 1
+   && valid_address(e->answer) ) {
+    s->attempts++;
+    s->successes++;
+    s->average_latency = s->average_latency ? (s->average_latency * 3 + latency) / 4 : latency;
+  }
+  else {
+    e->answer[0] = '\0';
+    // A request that was cancelled because another site won isn't held against its site.
+    if ( !race->decided )
+      s->attempts++;
+  }
+
+  if ( !race->decided )
+    evaluate(race);
+
+  release(race);
+}
+
+// Runs in the select task.
+static void
+start_race(void * data)
+{
+  race_t * const	race = (race_t *)data;
+  int			chosen[RACE_WIDTH];
+
+  choose(chosen);
+  race->outstanding = RACE_WIDTH;
+
+  for ( int i = 0; i < RACE_WIDTH; i++ ) {
+    entry_t * const e = &race->entries[i];
+
+    e->race = race;
+    e->provider = chosen[i];
+    e->start = esp_timer_get_time();
+    e->field.path = "ip";
+    e->field.value = e->answer;
+    e->field.size = sizeof(e->answer);
+    gm_json_extract_begin(&e->json, &e->field, 1);
+    if ( (e->request = gm_http_get(urls[e->provider], body, done, e)) == NULL ) {
+      e->finished = true;
+      race->outstanding--;
+      release(race);
+    }
+  }
+  if ( race->outstanding == 0 && !race->decided )
+    decide(race, NULL);
 }
 
 int gm_public_ipv4(char * data, size_t size)
 {
-  for (int tries = 0; tries < (number_of_entries * 2); tries++) {
-    if (gm_public_ipv4_internal(urls[gm_choose_one(number_of_entries)], data, size) == 0)
-      return 0;
+  race_t *	race = calloc(1, sizeof(*race));
+  int		result = -1;
+
+  if ( race == NULL )
+    return -1;
+
+  if ( (race->semaphore = xSemaphoreCreateBinary()) == NULL ) {
+    free(race);
+    return -1;
+  }
+  // One for each request, and one for this task.
+  race->references = RACE_WIDTH + 1;
+  gm_run(start_race, race, GM_FAST);
+
+  if ( xSemaphoreTake(race->semaphore, pdMS_TO_TICKS(TIMEOUT * 1000)) == pdTRUE
+   && race->result[0] != '\0' ) {
+    strncpy(data, race->result, size - 1);
+    data[size - 1] = '\0';
+    result = 0;
+  }
+  release(race);
+  return result;
+}
+
+void
+gm_public_ipv4_report(void)
+{
+  gm_printf("Attempts Successes Wins Latency(ms) Site\n");
+  for ( int i = 0; i < COUNTOF(urls); i++ ) {
+    const gm_choice_statistics_t * const s = &statistics[i];
+
+    gm_printf(
+     "%8u %9u %4u %11u %s\n",
+     (unsigned int)s->attempts,
+     (unsigned int)s->successes,
+     (unsigned int)wins[i],
+     (unsigned int)s->average_latency,
+     urls[i]);
   }
-  return -1;
 }
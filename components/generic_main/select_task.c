@@ -26,6 +26,7 @@
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 #include "generic_main.h"
 
 #define NUMBER_OF_FDS	100
@@ -48,9 +49,61 @@ struct timer_task {
   void *		data;
 };
 
+static pthread_mutex_t	timer_lock = PTHREAD_MUTEX_INITIALIZER;
 static int		timer_task_limit;
 struct timer_task	timer_tasks[NUMBER_OF_TIMER_TASKS] = {};
 
+// Run a procedure in the context of the select task after the given number of
+// milliseconds. It must not block. Returns -1 if there's no room for another timer.
+int
+gm_timer_add(gm_run_t procedure, void * d, uint32_t milliseconds)
+{
+  struct timeval	now;
+  struct timeval	delay;
+  int			i;
+
+  gettimeofday(&now, 0);
+  delay.tv_sec = milliseconds / 1000;
+  delay.tv_usec = (milliseconds % 1000) * 1000;
+
+  pthread_mutex_lock(&timer_lock);
+  for ( i = 0; i < NUMBER_OF_TIMER_TASKS; i++ ) {
+    if ( timer_tasks[i].procedure == 0 )
+      break;
+  }
+  if ( i >= NUMBER_OF_TIMER_TASKS ) {
+    pthread_mutex_unlock(&timer_lock);
+    GM_FAIL("No room for another timer.\n");
+    return -1;
+  }
+  timeradd(&now, &delay, &timer_tasks[i].when);
+  timer_tasks[i].procedure = procedure;
+  timer_tasks[i].data = d;
+  if ( timer_task_limit < i + 1 )
+    timer_task_limit = i + 1;
+  pthread_mutex_unlock(&timer_lock);
+
+  if ( in_select )
+    gm_select_wakeup();
+  return 0;
+}
+
+// Cancel the timers for a procedure and data that were added with gm_timer_add().
+void
+gm_timer_cancel(gm_run_t procedure, void * d)
+{
+  pthread_mutex_lock(&timer_lock);
+  for ( int i = 0; i < timer_task_limit; i++ ) {
+    struct timer_task * t = &timer_tasks[i];
+    if ( t->procedure == procedure && t->data == d ) {
+      timerclear(&t->when);
+      t->procedure = 0;
+      t->data = 0;
+    }
+  }
+  pthread_mutex_unlock(&timer_lock);
+}
+
 void
 gm_fd_register(int fd, gm_fd_handler_t handler, void * d, bool readable, bool writable, bool exception, uint32_t seconds) {
   int limit = fd + 1;
@@ -164,23 +217,34 @@ select_task(void * param)
         }
       }
     }
+    pthread_mutex_lock(&timer_lock);
     for ( unsigned int i = 0; i < timer_task_limit; i++ ) {
       struct timer_task * t = &timer_tasks[i];
       if ( t->procedure ) {
-        if ( timercmp(&t->when, &now, >) ) {
-          (t->procedure)(t->data);
+        if ( !timercmp(&t->when, &now, >) ) {
+          gm_run_t	procedure = t->procedure;
+          void *	d = t->data;
+
+          // Clear the timer and drop the lock before calling the procedure, which
+          // may add another timer.
           timerclear(&t->when);
           t->procedure = 0;
           t->data = 0;
+          pthread_mutex_unlock(&timer_lock);
+          (procedure)(d);
+          pthread_mutex_lock(&timer_lock);
+          // Time passed while it ran. Poll, and then look at the timers again.
+          timerclear(&min_time);
         }
         else {
-          timersub(&now, &t->when, &when);
+          timersub(&t->when, &now, &when);
 
           if ( timercmp(&when, &min_time, <) )
             min_time = when;
         }
       }
     }
+    pthread_mutex_unlock(&timer_lock);
 
     number_of_set_fds = select(fd_limit, &read_now, &write_now, &exception_now, &min_time);
     in_select = false;
@@ -1,8 +1,13 @@
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <lwip/sockets.h>
-#include <netdb.h>
+#include <esp_timer.h>
 #include "generic_main.h"
+#include "stun.h"
 
 // The STUN RFC 8489 requires attributes connected with authentication, and requires
 // knowledge of the cleartext password on the server to calculate the MESSAGE-INTEGRITY
@@ -19,113 +24,67 @@
 // MESSAGE-INTEGRITY, MESSAGE-INTEGRITY-SHA256m because a server that doesn't have
 // any password data could not authenticate them. It sends FINGERPRINT, and it could
 // send REALM, although the REALM information would be arbitrary and probably useless.
+//
+// Messages are encoded and decoded by the codec in stun_codec.c, which TURN shares.
+
+// Binding requests are sent to several servers at once, from one socket, and the
+// responses are matched to the requests by their transaction IDs. The first good
+// response decides the public address, so the lookup takes one round trip to the
+// fastest server rather than a series of tries with long timeouts. The servers
+// with the best record of answering, and answering quickly, are asked, plus one
+// other at random, so that every server's record stays current.
+//
+// The other responses are waited for a little longer, to see whether the servers
+// agree. If they see this host at different public ports or addresses, the NAT
+// maps each destination separately, which is what's called symmetric NAT. That
+// defeats hole punching, and is reported by gm_stun_report().
+//
+// Requests are retransmitted with a doubling timeout, as RFC 8489 says, to the
+// servers that haven't answered.
 
-// Standard port number for STUN;
-// static const uint16_t stun_port = 3478;
-
-// Magic number used in all STUN packets.
-// Warning: This assumes the CPU is little-endian.
-static const uint32_t stun_magic = 0x42a41221; // 0x2112a442 in network byte order.
-
-// The FINGERPRINT data is XOR-ed with this:
-// static const char fingerprint_xor[] = "STUN";
-
-// stun_message_class bits are interleaved into the type field.
-// Where c is the message class and m is the method:
-// htons(((c & 0x1) << 4) | ((c & 0x2) << 8) | (m & 0xf))
-enum stun_message_class {
-  STUN_REQUEST = 0,
-  STUN_INDICATION = 1,
-  STUN_RESPONSE = 2,
-  STUN_ERROR = 3
-};
-
-// stun_methods are the low 4 bits of the type field, but there's only one of them
-// defined.
-enum stun_methods {
-  STUN_BINDING = 1
-};
-
-enum stun_attributes {
-  MAPPED_ADDRESS = 1,
-  USERNAME = 6,
-  MESSAGE_INTEGRITY = 8,
-  ERROR_CODE = 9,
-  UNKNOWN_ATTRIBUTES = 0x0a,
-  REALM = 0x14,
-  NONCE = 0x15,
-  XOR_MAPPED_ADDRESS = 0x20,
-  SOFTWARE = 0x8022,
-  ALTERNATE_SERVER = 0x8023,
-  FINGERPRINT = 0x8028,
-  MESSAGE_INTEGRITY_SHA256 = 0x1c,
-  PASSWORD_ALGORITHM = 0x1d,
-  USERHASH = 0x1e,
-  PASSWORD_ALGORITHMS = 0x8002,
-  ALTERNATE_DOMAIN = 0x8003
-};
-
-struct stun_message {
-  uint16_t type; // First two bits must be zero. Message type and class interleaved.
-  uint16_t length; // Does not include the 20-byte header size. Always a multiple of 4.
-  uint32_t magic_cookie; // Always stun_magic.
-  uint32_t transaction_id[3]; // Fill with random, should be same on replies.
-  uint8_t  attributes[]; // Variable length attributes, always padded to 32-bit boundary.
-};
-
-struct stun_attribute {
-  uint16_t type;
-  uint16_t length; // Length of the value part of the attribute, before padding.
-  union {
-    struct {
-      uint8_t	must_be_zero;
-      uint8_t	family; // 1 = ipv4, 2 = ipv6.
-      uint16_t	port;
-      union {
-        uint32_t ipv4;
-        struct in6_addr ipv6;
-      };
-    } mapped_address;
-    struct {
-      uint16_t	must_be_zero;
-      uint8_t	class; // Class is the low 3 bits, high bits must be zero.
-      uint8_t	number; // Error code consistent with HTTP and SIP.
-      char	phrase[]; // Variable-length UTF-8 error message.
-    } error_code;
-    struct {
-      uint16_t types[4];
-    } unknown_attributes;
-    struct {
-      uint8_t hash[20];
-    } message_integrity;
-    struct {
-      uint8_t hash[32];
-    } message_integrity_sha256;
-    struct {
-      uint8_t hash[32];
-    } userhash;
-    struct {
-      uint8_t hash[32];
-    } fingerprint;
-  } value;
-};
+#define PARALLEL		3	// Servers asked at once.
+#define TRANSMISSIONS		4	// Of each request, before giving up.
+#define INITIAL_TIMEOUT		500	// Milliseconds. Doubled after each transmission.
+#define CONSENSUS_WAIT		500	// Milliseconds to wait for more answers after the first.
+#define MAX_SERVERS		6	// At least the size of the larger server table.
 
 struct stun_server {
   const char *	host;
   uint16_t	port;
 };
 
-typedef void (*gm_stun_after_t)(bool success, bool ipv6, struct sockaddr * address);
+typedef enum _stun_mapping {
+  MAPPING_UNKNOWN = 0,
+  MAPPING_CONSISTENT,	// Every server saw the same public address and port.
+  MAPPING_SYMMETRIC	// Different servers saw different ones.
+} stun_mapping_t;
+
+struct stun_run;
+
+struct stun_probe {
+  struct stun_run *		run;
+  int				server;
+  bool				resolved;
+  bool				responded;
+  int				transmissions;
+  int64_t			sent; // esp_timer_get_time() of the first transmission.
+  uint32_t			transaction_id[3];
+  struct sockaddr_storage	server_address;
+  struct sockaddr_storage	mapped;
+};
 
 struct stun_run {
   struct sockaddr *	address;
-  unsigned int		tries;
   bool			ipv6;
+  bool			answered;
+  bool			stopped;
+  int			references; // The run, and each name lookup.
+  int			fd;
+  int			round;
   gm_stun_after_t	after;
+  struct stun_probe	probes[PARALLEL];
 };
 
-static void stun_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
-
 static const struct stun_server ipv4_servers[] = {
   { "stun.ooma.com", 3478 },
   // { "stun.3cx.com", 3478 },
@@ -147,347 +106,720 @@ static const struct stun_server ipv6_servers[] = {
 };
 static const size_t	ipv6_table_count = sizeof(ipv6_servers) / sizeof(*ipv6_servers);
 
-static int		stun_sock = -1;
+// These are only used in the select task.
+// Requests, responses and round-trip times.
+static gm_choice_statistics_t	statistics[2][MAX_SERVERS] = {};
+static uint32_t			last_rtt[2][MAX_SERVERS] = {};
+static stun_mapping_t		mapping[2] = {};
+static struct stun_run *	runs[2] = {}; // One for IPv4, one for IPv6.
 
-static void
-decode_mapped_address(struct stun_attribute * a, struct sockaddr * address)
+static void	stun_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout);
+static void	retransmit(void * data);
+
+// A binding request, with FINGERPRINT so that the server can tell it from other
+// protocols on the same port.
+static int
+binding_request(uint8_t * buffer, size_t size, const uint32_t * transaction_id)
 {
-  if ( a->value.mapped_address.family == 1 ) {
-    struct sockaddr_in * in = (struct sockaddr_in *)address;
-    memset(in, '\0', sizeof(*in));
-    in->sin_family = AF_INET;
-    in->sin_port = a->value.mapped_address.port;
-    in->sin_addr.s_addr = a->value.mapped_address.ipv4;
+  stun_encoder_t e;
+
+  stun_encode_begin(&e, buffer, size, STUN_REQUEST, STUN_BINDING, transaction_id);
+  stun_encode_fingerprint(&e);
+  return stun_encode_end(&e);
+}
+
+// Get the public address from a decoded binding response. Returns -1 if it's an
+// error response, or isn't usable.
+static int
+binding_response(const stun_decoded_t * d, struct sockaddr_storage * mapped)
+{
+  if ( d->method != STUN_BINDING )
+    return -1;
+
+  if ( d->message_class == STUN_ERROR ) {
+    gm_printf("STUN: Error %d: %.*s\n", d->error_code, (int)d->reason.length, (const char *)d->reason.value);
+    return -1;
   }
-  else {
-    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)address;
-    memset(in6, '\0', sizeof(*in6));
-    in6->sin6_family = AF_INET6;
-    in6->sin6_port = a->value.mapped_address.port;
-    memcpy(&in6->sin6_addr.s6_addr, a->value.mapped_address.ipv6.s6_addr, sizeof(in6->sin6_addr.s6_addr));
+  if ( d->message_class != STUN_RESPONSE )
+    return -1;
+
+  // Comprehension-required attributes that aren't understood make it a failure.
+  if ( d->number_of_unknown > 0 ) {
+    gm_printf("STUN: Unknown attribute 0x%x.\n", (unsigned int)d->unknown[0]);
+    return -1;
+  }
+  if ( !stun_has(d, K_XOR_MAPPED_ADDRESS) && !stun_has(d, K_MAPPED_ADDRESS) ) {
+    gm_printf("STUN: message didn't include an address.\n");
+    return -1;
   }
+  *mapped = d->mapped_address;
+  return 0;
 }
 
-static void
-decode_error_code(struct stun_attribute * a)
+static const struct stun_server *
+server_table(bool ipv6, size_t * count)
 {
-  gm_printf("STUN: Received error code.\n");
+  if ( ipv6 ) {
+    *count = ipv6_table_count;
+    return ipv6_servers;
+  }
+  *count = ipv4_table_count;
+  return ipv4_servers;
 }
 
-static void
-decode_unknown_attributes(struct stun_attribute * a)
+// Choose the servers to ask. An untried server is taken to answer in 200 ms.
+// Returns the number chosen.
+static int
+choose(bool ipv6, int * chosen)
 {
-  gm_printf("STUN: Unknown attribute.\n");
+  size_t count;
+
+  server_table(ipv6, &count);
+  return gm_choose_best(statistics[ipv6], count, 200, 50, chosen, PARALLEL);
 }
 
-static void
-decode_xor_mapped_address(struct stun_attribute * a, struct stun_message * message, struct sockaddr * address)
+static bool
+same_mapping(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
 {
-  if ( a->value.mapped_address.family == 1 ) {
-    fflush(stderr);
-    sleep(1);
-    struct sockaddr_in * in = (struct sockaddr_in *)address;
-    memset(in, '\0', sizeof(*in));
-    in->sin_family = AF_INET;
-    in->sin_port = a->value.mapped_address.port ^ ((stun_magic >> 16) & 0xffff);
-    in->sin_addr.s_addr = a->value.mapped_address.ipv4 ^ stun_magic;
+  if ( a->ss_family != b->ss_family )
+    return false;
+
+  if ( a->ss_family == AF_INET6 ) {
+    const struct sockaddr_in6 * const a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 * const b6 = (const struct sockaddr_in6 *)b;
+
+    return a6->sin6_port == b6->sin6_port
+     && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
   }
   else {
-    struct sockaddr_in6 * in6 = (struct sockaddr_in6 *)address;
-    memset(in6, '\0', sizeof(*in6));
-    in6->sin6_family = AF_INET6;
-    uint32_t *	out = (uint32_t *)&in6->sin6_addr.s6_addr;
-    uint32_t *	in = (uint32_t *)&a->value.mapped_address.ipv6.s6_addr;
-    for ( int i = 0; i < 4; i++ ) {
-      out[i] = in[i] ^ stun_magic;
-    }
+    const struct sockaddr_in * const a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in * const b4 = (const struct sockaddr_in *)b;
+
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
   }
 }
 
 static void
-decode_software(struct stun_attribute * a)
+release(struct stun_run * run)
 {
-  // gm_printf("Software: ");
-  // fwrite((char *)&a->value, 1, ntohs(a->length), stderr);
-  // gm_printf("\n");
+  if ( --run->references == 0 )
+    free(run);
 }
 
+// End the run, and decide whether the servers agreed on the mapping.
 static void
-decode_alternate_server(struct stun_attribute * a)
+finish(struct stun_run * run)
 {
-  // gm_printf("Alternate Server: ");
-  // fwrite((char *)&a->value, 1, ntohs(a->length), stderr);
-  // gm_printf("\n");
+  const struct stun_probe *	first = NULL;
+  int				responses = 0;
+  bool				symmetric = false;
+
+  if ( run->stopped )
+    return;
+  run->stopped = true;
+
+  gm_timer_cancel(retransmit, run);
+  if ( run->fd >= 0 ) {
+    gm_fd_unregister(run->fd);
+    close(run->fd);
+    run->fd = -1;
+  }
+  if ( runs[run->ipv6] == run )
+    runs[run->ipv6] = NULL;
+
+  for ( int i = 0; i < PARALLEL; i++ ) {
+    const struct stun_probe * const p = &run->probes[i];
+
+    if ( !p->responded )
+      continue;
+
+    responses++;
+    if ( first == NULL )
+      first = p;
+    else if ( !same_mapping(&first->mapped, &p->mapped) )
+      symmetric = true;
+  }
+
+  if ( responses >= 2 ) {
+    mapping[run->ipv6] = symmetric ? MAPPING_SYMMETRIC : MAPPING_CONSISTENT;
+    gm_web_socket_publish(run->ipv6 ? "stun_ipv6_nat" : "stun_ipv4_nat", "%s", symmetric ? "symmetric" : "consistent");
+    if ( symmetric )
+      GM_WARN_ONCE("STUN: Servers see different %s public addresses or ports. The NAT is symmetric.\n", run->ipv6 ? "IPv6" : "IPv4");
+  }
+
+  if ( !run->answered && run->after )
+    (run->after)(false, run->ipv6, run->address);
+
+  release(run);
 }
 
 static void
-decode_fingerprint(struct stun_attribute * a)
+send_probe(struct stun_run * run, struct stun_probe * p)
 {
+  uint8_t		buffer[STUN_HEADER_SIZE + 8];
+  const int		length = binding_request(buffer, sizeof(buffer), p->transaction_id);
+  const int64_t		now = esp_timer_get_time();
+
+  if ( p->transmissions++ == 0 ) {
+    p->sent = now;
+    statistics[run->ipv6][p->server].attempts++;
+  }
+
+  // FIX: Handle address unreachable.
+  sendto(
+   run->fd,
+   buffer,
+   length,
+   0,
+   (const struct sockaddr *)&p->server_address,
+   p->server_address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
 }
 
-struct addrinfo *
-get_address(const char * host, uint16_t port, bool ipv6)
+// True if every server that was asked has answered, so there's nothing to wait for.
+static bool
+all_responded(const struct stun_run * run)
 {
-  struct addrinfo *		send_address = 0;
-  struct addrinfo		hints = {};
-  char				port_string[6];
+  if ( run->references > 1 )
+    return false; // Names are still being looked up.
 
-  // Only return the address family that is requested in hints->ai_family.
-  hints.ai_flags = AI_ADDRCONFIG;
+  for ( int i = 0; i < PARALLEL; i++ ) {
+    if ( run->probes[i].resolved && !run->probes[i].responded )
+      return false;
+  }
+  return true;
+}
 
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_protocol = IPPROTO_UDP;
-  if ( ipv6 )
-    hints.ai_family = AF_INET6;
-  else
-    hints.ai_family = AF_INET;
+// Runs in the select task, from a timer. Send again to the servers that haven't
+// answered, or end the run.
+static void
+retransmit(void * data)
+{
+  struct stun_run * const run = (struct stun_run *)data;
 
-  snprintf(port_string, sizeof(port_string), "%d", port);
-  int gai_result =  getaddrinfo(host, port_string, &hints, &send_address);
+  if ( run->answered || run->round >= TRANSMISSIONS ) {
+    finish(run);
+    return;
+  }
 
-  if ( gai_result != 0 )
-    return 0;
+  for ( int i = 0; i < PARALLEL; i++ ) {
+    struct stun_probe * const p = &run->probes[i];
 
-  return send_address;
+    if ( p->resolved && !p->responded )
+      send_probe(run, p);
+  }
+  if ( gm_timer_add(retransmit, run, INITIAL_TIMEOUT << run->round) != 0 ) {
+    finish(run);
+    return;
+  }
+  run->round++;
 }
 
-static int
-send_stun_request(bool ipv6)
+// Runs in the select task, when a server's name has been looked up.
+static void
+stun_resolved(const struct sockaddr_storage * addresses, size_t count, void * context)
 {
-  uint32_t send_buffer[128] = {};
-  struct stun_message *	const	send_packet = (struct stun_message *)send_buffer; 
-  struct addrinfo *		send_address;
-  ssize_t			send_result;
-  unsigned			int message_class = STUN_REQUEST;
-  unsigned			int method = STUN_BINDING;
-  const struct stun_server *	servers;
-  size_t			count;
-  const struct stun_server *	server;
-
-  if ( ipv6 ) {
-    servers = ipv6_servers;
-    count = ipv6_table_count;
-  }
-  else {
-    servers = ipv4_servers;
-    count = ipv4_table_count;
+  struct stun_probe * const	p = (struct stun_probe *)context;
+  struct stun_run * const	run = p->run;
+
+  if ( !run->stopped && count > 0 ) {
+    if ( run->fd < 0 ) {
+      if ( (run->fd = socket(run->ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ) {
+        gm_printf("STUN: Can't get socket: %s\n", strerror(errno));
+        finish(run);
+        release(run);
+        return;
+      }
+      fcntl(run->fd, F_SETFL, fcntl(run->fd, F_GETFL, 0) | O_NONBLOCK);
+      gm_fd_register(run->fd, stun_receive, run, true, false, false, 0);
+    }
+    p->server_address = addresses[0];
+    p->resolved = true;
+    esp_fill_random(p->transaction_id, sizeof(p->transaction_id));
+    send_probe(run, p);
+
+    // The first request sent starts the retransmission timer.
+    if ( run->round == 0 ) {
+      run->round = 1;
+      if ( gm_timer_add(retransmit, run, INITIAL_TIMEOUT) != 0 )
+        finish(run);
+    }
   }
 
-  server = &servers[gm_choose_one(count)];
+  // If no server could be looked up, there's nothing to wait for.
+  if ( !run->stopped && run->references == 2 && run->round == 0 )
+    finish(run);
 
-  if ( (send_address = get_address(server->host, server->port, ipv6)) == 0 )
-    return -1;
+  release(run);
+}
+
+static void
+stun_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  struct stun_run * const	run = (struct stun_run *)data;
 
-  if ( stun_sock >= 0 )
-    close(stun_sock);
+  for ( ; ; ) {
+    uint8_t		buffer[1024];
+    stun_decoded_t	d;
+    struct stun_probe *	p = NULL;
+    const ssize_t	size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
 
-  stun_sock = socket(send_address->ai_family, SOCK_DGRAM, send_address->ai_protocol);
-  if ( stun_sock < 0 ) {
-    gm_printf("STUN: Can't get socket: %s\n", strerror(errno));
-    return -1;
+    if ( size < 0 )
+      return;
+
+    if ( stun_decode(buffer, size, &d) != 0 )
+      continue;
+
+    for ( int i = 0; i < PARALLEL; i++ ) {
+      struct stun_probe * const candidate = &run->probes[i];
+
+      if ( candidate->resolved
+       && !candidate->responded
+       && memcmp(candidate->transaction_id, d.transaction_id, sizeof(d.transaction_id)) == 0 )
+        p = candidate;
+    }
+    if ( p == NULL )
+      continue;
+
+    if ( binding_response(&d, &p->mapped) != 0 ) {
+      // Don't ask this server again.
+      p->resolved = false;
+    }
+    else {
+      gm_choice_statistics_t * const	s = &statistics[run->ipv6][p->server];
+      uint32_t * const			rtt = &last_rtt[run->ipv6][p->server];
+
+      p->responded = true;
+      s->successes++;
+      // The round-trip time is only known if the request wasn't retransmitted.
+      if ( p->transmissions == 1 ) {
+        *rtt = (esp_timer_get_time() - p->sent) / 1000;
+        s->average_latency = s->average_latency ? (s->average_latency * 3 + *rtt) / 4 : *rtt;
+      }
+
+      if ( !run->answered ) {
+        run->answered = true;
+        memcpy(run->address, &p->mapped, run->ipv6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+        if ( run->after )
+          (run->after)(true, run->ipv6, run->address);
+
+        // Wait a little for the other servers, to see if they agree.
+        gm_timer_cancel(retransmit, run);
+        if ( gm_timer_add(retransmit, run, CONSENSUS_WAIT) != 0 ) {
+          finish(run);
+          return;
+        }
+      }
+    }
+    if ( all_responded(run) ) {
+      finish(run);
+      return;
+    }
   }
+}
 
-  send_packet->magic_cookie = stun_magic;
-  send_packet->type = htons(((message_class & 0x1) << 4) | ((message_class & 0x2) << 8) | (method & 0xf));
-  esp_fill_random(send_packet->transaction_id, sizeof(send_packet->transaction_id));
+// Runs in the select task.
+static void
+stun_start(void * data)
+{
+  struct stun_run * const	run = (struct stun_run *)data;
+  int				chosen[PARALLEL];
+  const int			count = choose(run->ipv6, chosen);
+  size_t			table_count;
+  const struct stun_server *	servers = server_table(run->ipv6, &table_count);
+
+  // A new run replaces the last one for the same address family.
+  if ( runs[run->ipv6] )
+    finish(runs[run->ipv6]);
+  runs[run->ipv6] = run;
+
+  for ( int i = 0; i < count; i++ ) {
+    struct stun_probe * const		p = &run->probes[i];
+    const struct stun_server * const	server = &servers[chosen[i]];
+
+    p->run = run;
+    p->server = chosen[i];
+    run->references++;
+    if ( gm_dns_resolve(server->host, server->port, run->ipv6 ? AF_INET6 : AF_INET, stun_resolved, p) != 0 )
+      run->references--;
+  }
 
-  send_result = sendto(
-   stun_sock,
-   send_packet,
-   send_packet->length + 20,
-   0,
-   send_address->ai_addr,
-   send_address->ai_addrlen);
+  if ( run->references == 1 )
+    finish(run);
+}
 
-  freeaddrinfo(send_address);
+int gm_stun(bool ipv6, struct sockaddr * address, gm_stun_after_t after)
+{
+  struct stun_run * run = calloc(1, sizeof(struct stun_run));
 
-  if ( send_result < (send_packet->length + 20) ) {
-    ; // gm_printf("STUN: Send error: %d %s.\n", send_result, strerror(errno));
-    close(stun_sock);
-    stun_sock = -1;
+  if ( run == 0 ) {
+    gm_printf("STUN: malloc failed");
     return -1;
   }
-  return stun_sock;
+    
+  run->ipv6 = ipv6;
+  run->address = address;
+  run->after = after;
+  run->fd = -1;
+  run->references = 1;
+
+  gm_run(stun_start, run, GM_FAST);
+
+  return 0;
 }
 
-static int
-process_received_packet(struct stun_message * receive_packet, struct sockaddr * address, ssize_t receive_result)
+// NAT keepalive and public address change detection.
+//
+// Once the public address is known, a binding request is sent now and then from a
+// socket that's kept open, to one server. That keeps the NAT's binding for the
+// socket from expiring, and each response says whether the public address has
+// changed. When it has, a GM_PUBLIC_ADDRESS_CHANGED event is posted, so that
+// dynamic DNS and the port mappings are updated, and not otherwise.
+//
+// The interval adapts to how long the NAT keeps an idle binding. If the socket's
+// mapped port is the same after an interval, the binding lasted at least that long.
+// If it changed, the binding expired sooner. The interval is searched between those
+// bounds, and then kept at the longest one that the binding is known to survive,
+// so that there's as little traffic as the NAT allows.
+
+#define KEEPALIVE_INITIAL	(25 * 1000)	// Milliseconds.
+#define KEEPALIVE_MIN		(10 * 1000)
+#define KEEPALIVE_MAX		(10 * 60 * 1000)
+#define KEEPALIVE_RESOLUTION	(15 * 1000)	// The search ends when the bounds are this close.
+#define KEEPALIVE_RETRY		1000		// Before a request that wasn't answered is sent again.
+#define KEEPALIVE_TRIES		3		// Before trying another server.
+
+struct stun_keepalive {
+  bool				active;
+  bool				ipv6;
+  bool				resolved;
+  bool				resolving;
+  bool				have_binding;
+  int				fd;
+  int				server;
+  int				tries;
+  uint32_t			interval;	// Milliseconds until the next request.
+  uint32_t			tested;		// The idle time before the request in flight.
+  uint32_t			survived;	// The longest idle time the binding survived, or 0.
+  uint32_t			expired;	// The shortest idle time the binding didn't, or 0.
+  uint32_t			transaction_id[3];
+  struct sockaddr_storage	server_address;
+  struct sockaddr_storage	binding;	// The socket's public address and port.
+  struct sockaddr_storage	public_address;
+};
+
+// Only used in the select task.
+static struct stun_keepalive	keepalives[2] = {}; // One for IPv4, one for IPv6.
+
+static void	keepalive_retry(void * data);
+static void	keepalive_send(void * data);
+
+static bool
+same_address(const struct sockaddr_storage * a, const struct sockaddr_storage * b)
 {
-  bool				got_xor_mapped_address = false;
-  bool				got_an_address = false;
-  struct stun_attribute * attribute = (struct stun_attribute *)receive_packet->attributes;
-  uint16_t attribute_size = ntohs(receive_packet->length);
-  if ( attribute_size < (receive_result - 20) ) {
-    gm_printf("STUN: packet was truncated.\n");
-    return -1;
+  if ( a->ss_family != b->ss_family )
+    return false;
+
+  if ( a->ss_family == AF_INET6 )
+    return memcmp(&((const struct sockaddr_in6 *)a)->sin6_addr, &((const struct sockaddr_in6 *)b)->sin6_addr, sizeof(struct in6_addr)) == 0;
+  else
+    return ((const struct sockaddr_in *)a)->sin_addr.s_addr == ((const struct sockaddr_in *)b)->sin_addr.s_addr;
+}
+
+static void
+keepalive_close(struct stun_keepalive * k)
+{
+  gm_timer_cancel(keepalive_send, k);
+  gm_timer_cancel(keepalive_retry, k);
+  if ( k->fd >= 0 ) {
+    gm_fd_unregister(k->fd);
+    close(k->fd);
+    k->fd = -1;
   }
-  
-  while ( attribute_size > 0 ) {
-    uint16_t type = ntohs(attribute->type);
-    uint16_t length = ntohs(attribute->length);
-    if ( length == 0 || length >= 768 ) {
-      gm_printf("STUN: attribute length %d is invalid.\n", length);
+  // A new socket gets a new binding, which isn't comparable with the old one.
+  k->have_binding = false;
+  k->tested = 0;
+}
+
+static void
+keepalive_schedule(struct stun_keepalive * k, uint32_t milliseconds)
+{
+  if ( gm_timer_add(keepalive_send, k, milliseconds) != 0 )
+    keepalive_close(k);
+}
+
+// Set the next interval from what's known about the binding lifetime.
+static void
+keepalive_adapt(struct stun_keepalive * k)
+{
+  uint32_t	interval;
+
+  if ( k->expired == 0 )
+    interval = k->survived ? k->survived * 2 : KEEPALIVE_INITIAL;
+  else if ( k->survived == 0 )
+    interval = k->expired / 2;
+  else if ( k->expired - k->survived > KEEPALIVE_RESOLUTION )
+    interval = (k->survived + k->expired) / 2;
+  else
+    interval = k->survived;
+
+  if ( interval < KEEPALIVE_MIN )
+    interval = KEEPALIVE_MIN;
+  if ( interval > KEEPALIVE_MAX )
+    interval = KEEPALIVE_MAX;
+  k->interval = interval;
+}
+
+static void
+keepalive_response(struct stun_keepalive * k, const struct sockaddr_storage * mapped)
+{
+  // A change of the public address says nothing about how long bindings last.
+  if ( k->have_binding && k->tested > 0 && same_address(&k->binding, mapped) ) {
+    if ( same_mapping(&k->binding, mapped) ) {
+      if ( k->tested > k->survived )
+        k->survived = k->tested;
     }
-    switch ( type ) {
-    case MAPPED_ADDRESS:
-      if ( !got_xor_mapped_address ) {
-        got_an_address = true;
-        decode_mapped_address(attribute, address);
-      }
-      break;
-    case ERROR_CODE:
-      decode_error_code(attribute);
-      return -1;
-      break;
-    case UNKNOWN_ATTRIBUTES:
-      decode_unknown_attributes(attribute);
-      break;
-    case XOR_MAPPED_ADDRESS:
-      got_an_address = true;
-      got_xor_mapped_address = true;
-      decode_xor_mapped_address(attribute, receive_packet, address);
-      break;
-    case SOFTWARE:
-      decode_software(attribute);
-      break;
-    case ALTERNATE_SERVER:
-      decode_alternate_server(attribute);
-      break;
-    case FINGERPRINT:
-      decode_fingerprint(attribute);
-      break;
-    default:
-      break;
+    else {
+      if ( k->expired == 0 || k->tested < k->expired )
+        k->expired = k->tested;
+      // The NAT has changed its mind, if the binding once survived longer.
+      if ( k->survived >= k->expired )
+        k->survived = 0;
     }
-    uint16_t odd = length & 3;
-    unsigned int increment = length + 4;
+  }
+  k->binding = *mapped;
+  k->have_binding = true;
+
+  if ( !same_address(&k->public_address, mapped) ) {
+    gm_public_address_event_t	event = {};
+    char			buffer[INET6_ADDRSTRLEN];
+
+    k->public_address = *mapped;
+    event.ipv6 = k->ipv6;
+    event.address = *mapped;
+    if ( k->ipv6 )
+      inet_ntop(AF_INET6, &((struct sockaddr_in6 *)mapped)->sin6_addr, buffer, sizeof(buffer));
+    else
+      inet_ntop(AF_INET, &((struct sockaddr_in *)mapped)->sin_addr, buffer, sizeof(buffer));
+    gm_printf("STUN: The public %s address changed to %s.\n", k->ipv6 ? "IPv6" : "IPv4", buffer);
+    esp_event_post(GM_EVENT, GM_PUBLIC_ADDRESS_CHANGED, &event, sizeof(event), 0);
+  }
 
-    // Pad strings to 32-bit boundaries.
-    if ( odd )
-      increment += (4 - odd);
+  keepalive_adapt(k);
+  k->tested = k->interval;
+  keepalive_schedule(k, k->interval);
+}
 
-    if ( increment > attribute_size ) {
-      gm_printf("STUN: Attribute size mismatch.\n");
-      return -1;
+static void
+keepalive_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  struct stun_keepalive * const	k = (struct stun_keepalive *)data;
+
+  for ( ; ; ) {
+    uint8_t			buffer[1024];
+    stun_decoded_t		d;
+    struct sockaddr_storage	mapped = {};
+    const ssize_t		size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+
+    if ( size < 0 )
+      return;
+
+    if ( stun_decode(buffer, size, &d) != 0
+     || k->tries == 0
+     || memcmp(k->transaction_id, d.transaction_id, sizeof(d.transaction_id)) != 0 )
+      continue;
+
+    k->tries = 0;
+    gm_timer_cancel(keepalive_retry, k);
+    if ( binding_response(&d, &mapped) != 0 ) {
+      keepalive_schedule(k, k->interval);
+      continue;
     }
-    attribute = (struct stun_attribute *)((uint8_t *)attribute + increment);
-    attribute_size -= increment;
-  }
-  if ( got_an_address )
-    return 0;
-  else {
-    gm_printf("STUN: message didn't include an address.\n");
-    return -1;
+    keepalive_response(k, &mapped);
   }
 }
 
-int receive_stun_response(int sock, struct sockaddr * address)
+static void
+keepalive_transmit(struct stun_keepalive * k)
 {
-  uint32_t receive_buffer[256] = {};
-  struct stun_message *	const	receive_packet = (struct stun_message *)receive_buffer; 
-  ssize_t			receive_result;
-  struct timeval		timeout = { 3, 0 };
-  int result;
-
-  setsockopt (sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout,
-	    sizeof (timeout));
-
-  receive_result = recvfrom(
-   sock,
-   receive_packet,
-   sizeof(receive_buffer),
+  uint8_t	buffer[STUN_HEADER_SIZE + 8];
+  const int	length = binding_request(buffer, sizeof(buffer), k->transaction_id);
+
+  k->tries++;
+  sendto(
+   k->fd,
+   buffer,
+   length,
    0,
-   0,
-   0);
+   (const struct sockaddr *)&k->server_address,
+   k->server_address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
 
-  if ( receive_result < 22 ) {
-    gm_fd_unregister(sock);
-    close(sock);
-    stun_sock = -1;
-    return -1;
+  if ( gm_timer_add(keepalive_retry, k, KEEPALIVE_RETRY) != 0 )
+    keepalive_close(k);
+}
+
+// Runs in the select task, from a timer, when a request wasn't answered.
+static void
+keepalive_retry(void * data)
+{
+  struct stun_keepalive * const	k = (struct stun_keepalive *)data;
+  size_t			count;
+
+  if ( k->tries < KEEPALIVE_TRIES ) {
+    keepalive_transmit(k);
+    return;
   }
 
-  result = process_received_packet(receive_packet, address, receive_result);
-  gm_fd_unregister(sock);
-  close(sock);
-  stun_sock = -1;
-  return result;
+  // The server has stopped answering. Start over with another one.
+  server_table(k->ipv6, &count);
+  k->server = (k->server + 1) % count;
+  k->resolved = false;
+  k->tries = 0;
+  keepalive_close(k);
+  keepalive_schedule(k, KEEPALIVE_MIN);
 }
 
+// Runs in the select task, when the server's name has been looked up.
 static void
-stun_send(void * data)
+keepalive_resolved(const struct sockaddr_storage * addresses, size_t count, void * context)
 {
-  struct stun_run * run = (struct stun_run *)data;
-  int	sock;
+  struct stun_keepalive * const	k = (struct stun_keepalive *)context;
 
-  // FIX: Handle address unreachable.
-  if ( (sock = send_stun_request(run->ipv6)) < 0 )
+  k->resolving = false;
+  if ( !k->active )
     return;
 
-  gm_fd_register(sock, stun_receive, run, true, false, true, 5);
+  if ( count == 0 ) {
+    size_t table_count;
+
+    server_table(k->ipv6, &table_count);
+    k->server = (k->server + 1) % table_count;
+    keepalive_schedule(k, KEEPALIVE_MIN);
+    return;
+  }
+  k->server_address = addresses[0];
+  k->resolved = true;
+  keepalive_send(k);
 }
 
+// Runs in the select task, from a timer.
 static void
-stun_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+keepalive_send(void * data)
 {
-  struct stun_run * run = (struct stun_run *)data;
+  struct stun_keepalive * const	k = (struct stun_keepalive *)data;
 
+  if ( !k->resolved ) {
+    size_t				count;
+    const struct stun_server * const	servers = server_table(k->ipv6, &count);
+    const struct stun_server * const	server = &servers[k->server];
 
-  if ( readable ) {
-    int status = receive_stun_response(fd, run->address);
-
-    if ( status == 0 ) {
-      gm_fd_unregister(fd);
-      close(fd);
-      stun_sock = -1;
-      if ( run->after )
-        (run->after)(true, run->ipv6, run->address);
-      free(run);
+    // A lookup left over from before a stop will carry on from here.
+    if ( k->resolving )
       return;
-    }
-  }
-  if ( timeout || exception ) {
-    gm_fd_unregister(fd);
-    close(fd);
-    stun_sock = -1;
-  }
-  if ( run->tries >= 5 ) {
-    if ( run->after )
-      (run->after)(false, run->ipv6, run->address);
-    free(run);
+    if ( gm_dns_resolve(server->host, server->port, k->ipv6 ? AF_INET6 : AF_INET, keepalive_resolved, k) == 0 )
+      k->resolving = true;
+    else
+      keepalive_schedule(k, KEEPALIVE_MIN);
     return;
   }
 
-  run->tries++;
+  if ( k->fd < 0 ) {
+    if ( (k->fd = socket(k->ipv6 ? AF_INET6 : AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ) {
+      gm_printf("STUN: Can't get socket: %s\n", strerror(errno));
+      keepalive_schedule(k, k->interval);
+      return;
+    }
+    fcntl(k->fd, F_SETFL, fcntl(k->fd, F_GETFL, 0) | O_NONBLOCK);
+    gm_fd_register(k->fd, keepalive_receive, k, true, false, false, 0);
+  }
 
-  gm_run(stun_send, run, GM_FAST);
+  esp_fill_random(k->transaction_id, sizeof(k->transaction_id));
+  k->tries = 0;
+  keepalive_transmit(k);
 }
 
-int gm_stun(bool ipv6, struct sockaddr * address, gm_stun_after_t after)
+// Keep the NAT binding alive, and watch for changes of the public address, which
+// is now the one given. Call from the select task.
+void
+gm_stun_keepalive(bool ipv6, const struct sockaddr * address)
 {
-  struct stun_run * run = malloc(sizeof(struct stun_run));
+  struct stun_keepalive * const	k = &keepalives[ipv6];
+  int				chosen[PARALLEL];
 
-  if ( run == 0 ) {
-    gm_printf("STUN: malloc failed");
-    return -1;
-  }
-    
-  run->ipv6 = ipv6;
-  run->address = address;
-  run->tries = 0;
-  run->after = after;
+  memcpy(&k->public_address, address, ipv6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+  if ( k->active )
+    return;
 
-  gm_run(stun_send, run, GM_FAST);
+  k->active = true;
+  k->ipv6 = ipv6;
+  k->fd = -1;
+  k->resolved = false;
+  k->have_binding = false;
+  k->tested = 0;
+  k->interval = KEEPALIVE_INITIAL;
+  // Start with the server that has done best.
+  choose(ipv6, chosen);
+  k->server = chosen[0];
+  keepalive_send(k);
+}
 
-  return 0;
+static void
+keepalive_stop(struct stun_keepalive * k)
+{
+  if ( !k->active )
+    return;
+
+  k->active = false;
+  keepalive_close(k);
+}
+
+static void
+stop(void * data)
+{
+  for ( int i = 0; i < 2; i++ ) {
+    if ( runs[i] )
+      finish(runs[i]);
+    keepalive_stop(&keepalives[i]);
+  }
 }
 
 void
 gm_stun_stop()
 {
-  if ( stun_sock >= 0 ) {
-    gm_fd_unregister(stun_sock);
-    close(stun_sock);
-    stun_sock = -1;
+  gm_run(stop, 0, GM_FAST);
+}
+
+void
+gm_stun_report(void)
+{
+  static const char * const mappings[] = { "unknown", "consistent", "symmetric" };
+
+  for ( int ipv6 = 0; ipv6 < 2; ipv6++ ) {
+    size_t				count;
+    const struct stun_server * const	servers = server_table(ipv6, &count);
+    const struct stun_keepalive * const	k = &keepalives[ipv6];
+
+    gm_printf("%s NAT mapping: %s\n", ipv6 ? "IPv6" : "IPv4", mappings[mapping[ipv6]]);
+    if ( k->active ) {
+      gm_printf(
+       "Keepalive every %u s. Bindings last at least %u s",
+       (unsigned int)(k->interval / 1000),
+       (unsigned int)(k->survived / 1000));
+      if ( k->expired )
+        gm_printf(", less than %u s", (unsigned int)(k->expired / 1000));
+      gm_printf(".\n");
+    }
+    gm_printf("Requests Responses RTT(ms) Last(ms) Server\n");
+    for ( int i = 0; i < count; i++ ) {
+      const gm_choice_statistics_t * const s = &statistics[ipv6][i];
+
+      gm_printf(
+       "%8u %9u %7u %8u %s:%u\n",
+       (unsigned int)s->attempts,
+       (unsigned int)s->successes,
+       (unsigned int)s->average_latency,
+       (unsigned int)last_rtt[ipv6][i],
+       servers[i].host,
+       (unsigned int)servers[i].port);
+    }
   }
 }
@@ -0,0 +1,155 @@
+// STUN message codec, shared by the STUN and TURN clients.
+//
+// stun_decode() checks a message from the network against a table of the
+// attributes that are understood, and decodes them into a stun_decoded_t. It
+// doesn't overlay structures on the packet, and every length is checked before
+// it's used, so any packet from the open internet is safe to give it. Strings and
+// data in the result point into the packet, rather than being copied.
+//
+// stun_encode_*() build a message in a caller's buffer. They can't write past the
+// end of it: if the message doesn't fit, stun_encode_end() returns -1.
+//
+// This doesn't depend on ESP-IDF, so that it can be benchmarked and fuzzed on the
+// host.
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#define STUN_MAGIC		0x2112a442
+#define STUN_HEADER_SIZE	20
+#define STUN_MAX_UNKNOWN	4
+
+enum stun_message_class {
+  STUN_REQUEST = 0,
+  STUN_INDICATION = 1,
+  STUN_RESPONSE = 2,
+  STUN_ERROR = 3
+};
+
+// STUN defines only BINDING, the rest are TURN (RFC 8656).
+enum stun_methods {
+  STUN_BINDING = 1,
+  TURN_ALLOCATE = 3,
+  TURN_REFRESH = 4,
+  TURN_SEND = 6,
+  TURN_DATA = 7,
+  TURN_CREATE_PERMISSION = 8,
+  TURN_CHANNEL_BIND = 9
+};
+
+enum stun_attributes {
+  MAPPED_ADDRESS = 1,
+  USERNAME = 6,
+  MESSAGE_INTEGRITY = 8,
+  ERROR_CODE = 9,
+  UNKNOWN_ATTRIBUTES = 0x0a,
+  REALM = 0x14,
+  NONCE = 0x15,
+  XOR_MAPPED_ADDRESS = 0x20,
+  SOFTWARE = 0x8022,
+  ALTERNATE_SERVER = 0x8023,
+  FINGERPRINT = 0x8028,
+  MESSAGE_INTEGRITY_SHA256 = 0x1c,
+  PASSWORD_ALGORITHM = 0x1d,
+  USERHASH = 0x1e,
+  PASSWORD_ALGORITHMS = 0x8002,
+  ALTERNATE_DOMAIN = 0x8003,
+  // TURN
+  CHANNEL_NUMBER = 0x0c,
+  LIFETIME = 0x0d,
+  XOR_PEER_ADDRESS = 0x12,
+  DATA = 0x13,
+  XOR_RELAYED_ADDRESS = 0x16,
+  REQUESTED_ADDRESS_FAMILY = 0x17,
+  EVEN_PORT = 0x18,
+  REQUESTED_TRANSPORT = 0x19,
+  DONT_FRAGMENT = 0x1a,
+  RESERVATION_TOKEN = 0x22,
+  ADDITIONAL_ADDRESS_FAMILY = 0x8000,
+  ADDRESS_ERROR_CODE = 0x8001,
+  ICMP = 0x8004
+};
+
+// The attributes that stun_decode() understands. Each is a bit of
+// stun_decoded_t.present, which is tested with stun_has().
+enum stun_known_attribute {
+  K_MAPPED_ADDRESS = 0,
+  K_XOR_MAPPED_ADDRESS,
+  K_XOR_RELAYED_ADDRESS,
+  K_XOR_PEER_ADDRESS,
+  K_ALTERNATE_SERVER,
+  K_ERROR_CODE,
+  K_UNKNOWN_ATTRIBUTES,
+  K_USERNAME,
+  K_REALM,
+  K_NONCE,
+  K_SOFTWARE,
+  K_DATA,
+  K_LIFETIME,
+  K_CHANNEL_NUMBER,
+  K_MESSAGE_INTEGRITY,
+  K_MESSAGE_INTEGRITY_SHA256,
+  K_FINGERPRINT,
+  K_IGNORED,	// Understood, checked, and not decoded.
+  K_COUNT
+};
+
+typedef struct _stun_bytes {
+  const uint8_t *	value;	// In the packet. Strings aren't NUL-terminated.
+  uint16_t		length;
+} stun_bytes_t;
+
+typedef struct _stun_decoded {
+  unsigned int			message_class;
+  unsigned int			method;
+  uint32_t			transaction_id[3];
+  uint32_t			present;
+  // XOR-MAPPED-ADDRESS, or MAPPED-ADDRESS from an old server that doesn't send it.
+  struct sockaddr_storage	mapped_address;
+  struct sockaddr_storage	relayed_address;
+  struct sockaddr_storage	peer_address;
+  struct sockaddr_storage	alternate_server;
+  int				error_code;	// 300 to 699.
+  stun_bytes_t			reason;		// Of the error code.
+  stun_bytes_t			username;
+  stun_bytes_t			realm;
+  stun_bytes_t			nonce;
+  stun_bytes_t			software;
+  stun_bytes_t			data;
+  uint32_t			lifetime;
+  uint16_t			channel_number;
+  size_t			message_integrity;	// Offset in the message, for checking it.
+  size_t			message_integrity_sha256;
+  // Comprehension-required attributes that aren't understood. A response that has
+  // them must be treated as a failure, RFC 8489 section 7.3.3.
+  int				number_of_unknown;
+  uint16_t			unknown[STUN_MAX_UNKNOWN];
+  const char *			error;	// Why stun_decode() rejected the message.
+} stun_decoded_t;
+
+typedef struct _stun_encoder {
+  uint8_t *	buffer;
+  size_t	size;
+  size_t	length;
+  bool		overflow;
+} stun_encoder_t;
+
+static inline bool
+stun_has(const stun_decoded_t * d, enum stun_known_attribute a)
+{
+  return (d->present >> a) & 1;
+}
+
+extern uint32_t	stun_crc32(const uint8_t * data, size_t size);
+extern int	stun_decode(const uint8_t * message, size_t size, stun_decoded_t * d);
+extern void	stun_encode_attribute(stun_encoder_t * e, uint16_t type, const void * value, size_t length);
+extern void	stun_encode_begin(stun_encoder_t * e, void * buffer, size_t size, unsigned int message_class, unsigned int method, const uint32_t * transaction_id);
+extern int	stun_encode_end(stun_encoder_t * e);
+extern void	stun_encode_fingerprint(stun_encoder_t * e);
+extern size_t	stun_encode_integrity_begin(stun_encoder_t * e);
+extern void	stun_encode_string(stun_encoder_t * e, uint16_t type, const char * s);
+extern void	stun_encode_u32(stun_encoder_t * e, uint16_t type, uint32_t value);
+extern void	stun_encode_xor_address(stun_encoder_t * e, uint16_t type, const struct sockaddr * address);
@@ -0,0 +1,443 @@
+// Table-driven STUN message codec. See stun.h.
+//
+// Each attribute type that's understood has a rule, which gives the format of its
+// value, the lengths that are valid for it, and where in stun_decoded_t it's
+// decoded to. The rules are found by indexing arrays with the attribute type,
+// since the types are in two small, sparse ranges.
+//
+// The checks follow RFC 8489 and RFC 8656:
+//   The header must have the magic cookie, the first two bits zero, and a length
+//   that's a multiple of 4 and is the size of the rest of the packet.
+//   Each attribute must fit in the message, and have a valid length for its type.
+//   Addresses must be IPv4 or IPv6, with the matching length.
+//   Only the first of duplicate attributes is used.
+//   Attributes after MESSAGE-INTEGRITY are ignored, except for
+//   MESSAGE-INTEGRITY-SHA256 and FINGERPRINT.
+//   Nothing may follow FINGERPRINT, and its CRC must be correct.
+//
+#include <string.h>
+#include <arpa/inet.h>
+#include "stun.h"
+
+#define FINGERPRINT_XOR	0x5354554e	// "STUN"
+
+enum format {
+  ADDRESS,
+  XOR_ADDRESS,
+  U32,
+  CHANNEL,
+  BYTES,
+  ERROR,
+  INTEGRITY,
+  CHECK_FINGERPRINT,
+  IGNORE
+};
+
+struct rule {
+  uint8_t	format;
+  uint8_t	known;		// enum stun_known_attribute.
+  uint16_t	min_length;
+  uint16_t	max_length;
+  uint16_t	offset;		// Of the destination in stun_decoded_t.
+};
+
+#define D(field)	offsetof(stun_decoded_t, field)
+
+// Indexed by enum stun_known_attribute. K_IGNORED is shared by the attributes that
+// are checked and not decoded.
+static const struct rule rules[K_COUNT] = {
+  [K_MAPPED_ADDRESS] =		{ ADDRESS,		K_MAPPED_ADDRESS,		8, 20,		D(mapped_address) },
+  [K_XOR_MAPPED_ADDRESS] =	{ XOR_ADDRESS,		K_XOR_MAPPED_ADDRESS,		8, 20,		D(mapped_address) },
+  [K_XOR_RELAYED_ADDRESS] =	{ XOR_ADDRESS,		K_XOR_RELAYED_ADDRESS,		8, 20,		D(relayed_address) },
+  [K_XOR_PEER_ADDRESS] =	{ XOR_ADDRESS,		K_XOR_PEER_ADDRESS,		8, 20,		D(peer_address) },
+  [K_ALTERNATE_SERVER] =	{ ADDRESS,		K_ALTERNATE_SERVER,		8, 20,		D(alternate_server) },
+  [K_ERROR_CODE] =		{ ERROR,		K_ERROR_CODE,			4, 4 + 763,	D(error_code) },
+  [K_UNKNOWN_ATTRIBUTES] =	{ IGNORE,		K_UNKNOWN_ATTRIBUTES,		0, 64,		0 },
+  [K_USERNAME] =		{ BYTES,		K_USERNAME,			1, 513,		D(username) },
+  [K_REALM] =			{ BYTES,		K_REALM,			1, 763,		D(realm) },
+  [K_NONCE] =			{ BYTES,		K_NONCE,			1, 763,		D(nonce) },
+  [K_SOFTWARE] =		{ BYTES,		K_SOFTWARE,			0, 763,		D(software) },
+  [K_DATA] =			{ BYTES,		K_DATA,				0, 0xffff,	D(data) },
+  [K_LIFETIME] =		{ U32,			K_LIFETIME,			4, 4,		D(lifetime) },
+  [K_CHANNEL_NUMBER] =		{ CHANNEL,		K_CHANNEL_NUMBER,		4, 4,		D(channel_number) },
+  [K_MESSAGE_INTEGRITY] =	{ INTEGRITY,		K_MESSAGE_INTEGRITY,		20, 20,		D(message_integrity) },
+  [K_MESSAGE_INTEGRITY_SHA256] = { INTEGRITY,		K_MESSAGE_INTEGRITY_SHA256,	16, 32,		D(message_integrity_sha256) },
+  [K_FINGERPRINT] =		{ CHECK_FINGERPRINT,	K_FINGERPRINT,			4, 4,		0 },
+  [K_IGNORED] =			{ IGNORE,		K_IGNORED,			0, 763,		0 },
+};
+
+// Rule index + 1 for attribute types 0 to 0x2f, and 0x8000 to 0x802f. 0 means the
+// type isn't understood.
+static const uint8_t low_types[0x30] = {
+  [MAPPED_ADDRESS] =		K_MAPPED_ADDRESS + 1,
+  [USERNAME] =			K_USERNAME + 1,
+  [MESSAGE_INTEGRITY] =		K_MESSAGE_INTEGRITY + 1,
+  [ERROR_CODE] =		K_ERROR_CODE + 1,
+  [UNKNOWN_ATTRIBUTES] =	K_UNKNOWN_ATTRIBUTES + 1,
+  [CHANNEL_NUMBER] =		K_CHANNEL_NUMBER + 1,
+  [LIFETIME] =			K_LIFETIME + 1,
+  [XOR_PEER_ADDRESS] =		K_XOR_PEER_ADDRESS + 1,
+  [DATA] =			K_DATA + 1,
+  [REALM] =			K_REALM + 1,
+  [NONCE] =			K_NONCE + 1,
+  [XOR_RELAYED_ADDRESS] =	K_XOR_RELAYED_ADDRESS + 1,
+  [REQUESTED_ADDRESS_FAMILY] =	K_IGNORED + 1,
+  [EVEN_PORT] =			K_IGNORED + 1,
+  [REQUESTED_TRANSPORT] =	K_IGNORED + 1,
+  [DONT_FRAGMENT] =		K_IGNORED + 1,
+  [MESSAGE_INTEGRITY_SHA256] =	K_MESSAGE_INTEGRITY_SHA256 + 1,
+  [PASSWORD_ALGORITHM] =	K_IGNORED + 1,
+  [USERHASH] =			K_IGNORED + 1,
+  [XOR_MAPPED_ADDRESS] =	K_XOR_MAPPED_ADDRESS + 1,
+  [RESERVATION_TOKEN] =		K_IGNORED + 1,
+};
+
+static const uint8_t high_types[0x30] = {
+  [ADDITIONAL_ADDRESS_FAMILY - 0x8000] =	K_IGNORED + 1,
+  [ADDRESS_ERROR_CODE - 0x8000] =		K_IGNORED + 1,
+  [PASSWORD_ALGORITHMS - 0x8000] =		K_IGNORED + 1,
+  [ALTERNATE_DOMAIN - 0x8000] =			K_IGNORED + 1,
+  [ICMP - 0x8000] =				K_IGNORED + 1,
+  [SOFTWARE - 0x8000] =				K_SOFTWARE + 1,
+  [ALTERNATE_SERVER - 0x8000] =			K_ALTERNATE_SERVER + 1,
+  [FINGERPRINT - 0x8000] =			K_FINGERPRINT + 1,
+};
+
+// CRC-32, as in ISO 3309 and zlib, four bits at a time so that the table is small.
+static const uint32_t crc_table[16] = {
+  0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac,
+  0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+  0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+  0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c
+};
+
+uint32_t
+stun_crc32(const uint8_t * data, size_t size)
+{
+  uint32_t crc = 0xffffffff;
+
+  for ( size_t i = 0; i < size; i++ ) {
+    crc ^= data[i];
+    crc = (crc >> 4) ^ crc_table[crc & 0xf];
+    crc = (crc >> 4) ^ crc_table[crc & 0xf];
+  }
+  return ~crc;
+}
+
+static inline uint16_t
+get16(const uint8_t * p)
+{
+  return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t
+get32(const uint8_t * p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void
+put16(uint8_t * p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static inline void
+put32(uint8_t * p, uint32_t v)
+{
+  put16(p, v >> 16);
+  put16(&p[2], v & 0xffff);
+}
+
+static const struct rule *
+find_rule(uint16_t type)
+{
+  unsigned int index = 0;
+
+  if ( type < sizeof(low_types) )
+    index = low_types[type];
+  else if ( type >= 0x8000 && type < 0x8000 + sizeof(high_types) )
+    index = high_types[type - 0x8000];
+
+  return index ? &rules[index - 1] : NULL;
+}
+
+// MAPPED-ADDRESS and friends. The XOR forms are XOR-ed with the magic cookie, and
+// an IPv6 address is also XOR-ed with the transaction ID, which follows the cookie.
+static int
+decode_address(const uint8_t * message, const uint8_t * value, size_t length, bool xor, struct sockaddr_storage * address)
+{
+  const uint8_t	family = value[1];
+  uint16_t	port = get16(&value[2]);
+
+  if ( xor )
+    port ^= STUN_MAGIC >> 16;
+
+  memset(address, '\0', sizeof(*address));
+  if ( family == 1 && length == 8 ) {
+    struct sockaddr_in * const in = (struct sockaddr_in *)address;
+
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+    memcpy(&in->sin_addr, &value[4], 4);
+    if ( xor ) {
+      uint8_t * const a = (uint8_t *)&in->sin_addr;
+
+      for ( int i = 0; i < 4; i++ )
+        a[i] ^= message[4 + i];
+    }
+    return 0;
+  }
+  else if ( family == 2 && length == 20 ) {
+    struct sockaddr_in6 * const in6 = (struct sockaddr_in6 *)address;
+
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    memcpy(&in6->sin6_addr, &value[4], 16);
+    if ( xor ) {
+      uint8_t * const a = (uint8_t *)&in6->sin6_addr;
+
+      for ( int i = 0; i < 16; i++ )
+        a[i] ^= message[4 + i];
+    }
+    return 0;
+  }
+  return -1;
+}
+
+static int
+reject(stun_decoded_t * d, const char * error)
+{
+  d->error = error;
+  return -1;
+}
+
+// Decode a message. Returns 0, or -1 with the reason in d->error.
+int
+stun_decode(const uint8_t * message, size_t size, stun_decoded_t * d)
+{
+  size_t	offset = STUN_HEADER_SIZE;
+  size_t	end;
+  uint16_t	type;
+
+  memset(d, '\0', sizeof(*d));
+
+  if ( size < STUN_HEADER_SIZE )
+    return reject(d, "shorter than the header");
+  if ( (message[0] & 0xc0) != 0 || get32(&message[4]) != STUN_MAGIC )
+    return reject(d, "not STUN");
+  end = STUN_HEADER_SIZE + get16(&message[2]);
+  if ( (end & 3) != 0 || end != size )
+    return reject(d, "length doesn't match the packet");
+
+  type = get16(message);
+  d->message_class = ((type >> 4) & 1) | ((type >> 7) & 2);
+  d->method = (type & 0xf) | ((type >> 1) & 0x70) | ((type >> 2) & 0xf80);
+  memcpy(d->transaction_id, &message[8], sizeof(d->transaction_id));
+
+  while ( offset < end ) {
+    const uint8_t * const	value = &message[offset + 4];
+    const struct rule *		r;
+    uint16_t			attribute;
+    size_t			length;
+
+    if ( offset + 4 > end )
+      return reject(d, "attribute header is truncated");
+    attribute = get16(&message[offset]);
+    length = get16(&message[offset + 2]);
+    // The message length is a multiple of 4, so the padding fits if the value does.
+    if ( offset + 4 + length > end )
+      return reject(d, "attribute is longer than the message");
+    if ( stun_has(d, K_FINGERPRINT) )
+      return reject(d, "attribute after FINGERPRINT");
+
+    r = find_rule(attribute);
+    if ( (d->present & (1 << K_MESSAGE_INTEGRITY | 1 << K_MESSAGE_INTEGRITY_SHA256))
+     && (r == NULL || (r->known != K_MESSAGE_INTEGRITY_SHA256 && r->known != K_FINGERPRINT)) ) {
+      // Not covered by MESSAGE-INTEGRITY.
+    }
+    else if ( r == NULL ) {
+      if ( attribute < 0x8000 && d->number_of_unknown < STUN_MAX_UNKNOWN )
+        d->unknown[d->number_of_unknown++] = attribute;
+    }
+    else if ( stun_has(d, r->known) && r->known != K_IGNORED ) {
+      // Only the first of duplicates is used.
+    }
+    else {
+      void * const destination = (uint8_t *)d + r->offset;
+
+      if ( length < r->min_length || length > r->max_length )
+        return reject(d, "attribute has an invalid length");
+
+      switch ( r->format ) {
+      case ADDRESS:
+      case XOR_ADDRESS:
+        // XOR-MAPPED-ADDRESS wins over MAPPED-ADDRESS, whichever comes first.
+        if ( r->known == K_MAPPED_ADDRESS && stun_has(d, K_XOR_MAPPED_ADDRESS) )
+          break;
+        if ( decode_address(message, value, length, r->format == XOR_ADDRESS, destination) != 0 )
+          return reject(d, "invalid address");
+        break;
+      case U32:
+        *(uint32_t *)destination = get32(value);
+        break;
+      case CHANNEL:
+        // The low 16 bits are reserved.
+        *(uint16_t *)destination = get16(value);
+        if ( d->channel_number < 0x4000 || d->channel_number > 0x4fff )
+          return reject(d, "invalid channel number");
+        break;
+      case BYTES:
+        ((stun_bytes_t *)destination)->value = value;
+        ((stun_bytes_t *)destination)->length = length;
+        break;
+      case ERROR:
+        // 21 reserved bits, then a class of 3 to 6 and a number of 0 to 99.
+        if ( value[0] != 0 || value[1] != 0 || (value[2] & 0xf8) != 0
+         || value[2] < 3 || value[2] > 6 || value[3] > 99 )
+          return reject(d, "invalid error code");
+        d->error_code = value[2] * 100 + value[3];
+        d->reason.value = &value[4];
+        d->reason.length = length - 4;
+        break;
+      case INTEGRITY:
+        if ( (length & 3) != 0 )
+          return reject(d, "attribute has an invalid length");
+        *(size_t *)destination = offset;
+        break;
+      case CHECK_FINGERPRINT:
+        if ( (stun_crc32(message, offset) ^ FINGERPRINT_XOR) != get32(value) )
+          return reject(d, "FINGERPRINT doesn't match");
+        break;
+      case IGNORE:
+        break;
+      }
+      d->present |= 1 << r->known;
+    }
+    offset += 4 + ((length + 3) & ~3);
+  }
+  return 0;
+}
+
+void
+stun_encode_begin(stun_encoder_t * e, void * buffer, size_t size, unsigned int message_class, unsigned int method, const uint32_t * transaction_id)
+{
+  // The class bits are interleaved with the method bits.
+  const uint16_t type = (method & 0xf)
+   | ((method & 0x70) << 1)
+   | ((method & 0xf80) << 2)
+   | ((message_class & 1) << 4)
+   | ((message_class & 2) << 7);
+
+  e->buffer = (uint8_t *)buffer;
+  e->size = size;
+  e->length = STUN_HEADER_SIZE;
+  e->overflow = size < STUN_HEADER_SIZE;
+  if ( e->overflow )
+    return;
+
+  put16(e->buffer, type);
+  put16(&e->buffer[2], 0);
+  put32(&e->buffer[4], STUN_MAGIC);
+  memcpy(&e->buffer[8], transaction_id, 12);
+}
+
+// Append an attribute, padded to a 32-bit boundary, and update the message length.
+void
+stun_encode_attribute(stun_encoder_t * e, uint16_t type, const void * value, size_t length)
+{
+  const size_t padded = (length + 3) & ~3;
+
+  if ( e->overflow || length > 0xffff || e->length + 4 + padded > e->size || e->length + 4 + padded - STUN_HEADER_SIZE > 0xffff ) {
+    e->overflow = true;
+    return;
+  }
+  put16(&e->buffer[e->length], type);
+  put16(&e->buffer[e->length + 2], length);
+  if ( length > 0 )
+    memcpy(&e->buffer[e->length + 4], value, length);
+  memset(&e->buffer[e->length + 4 + length], '\0', padded - length);
+  e->length += 4 + padded;
+  put16(&e->buffer[2], e->length - STUN_HEADER_SIZE);
+}
+
+void
+stun_encode_string(stun_encoder_t * e, uint16_t type, const char * s)
+{
+  stun_encode_attribute(e, type, s, strlen(s));
+}
+
+void
+stun_encode_u32(stun_encoder_t * e, uint16_t type, uint32_t value)
+{
+  uint8_t bytes[4];
+
+  put32(bytes, value);
+  stun_encode_attribute(e, type, bytes, sizeof(bytes));
+}
+
+void
+stun_encode_xor_address(stun_encoder_t * e, uint16_t type, const struct sockaddr * address)
+{
+  uint8_t	value[20] = {};
+  size_t	length;
+  uint16_t	port;
+
+  if ( e->overflow )
+    return;
+
+  if ( address->sa_family == AF_INET6 ) {
+    const struct sockaddr_in6 * const in6 = (const struct sockaddr_in6 *)address;
+
+    value[1] = 2;
+    port = ntohs(in6->sin6_port);
+    memcpy(&value[4], &in6->sin6_addr, 16);
+    length = 20;
+  }
+  else {
+    const struct sockaddr_in * const in = (const struct sockaddr_in *)address;
+
+    value[1] = 1;
+    port = ntohs(in->sin_port);
+    memcpy(&value[4], &in->sin_addr, 4);
+    length = 8;
+  }
+  put16(&value[2], port ^ (STUN_MAGIC >> 16));
+  // The magic cookie and the transaction ID are bytes 4 to 19 of the header.
+  for ( size_t i = 4; i < length; i++ )
+    value[i] ^= e->buffer[i];
+
+  stun_encode_attribute(e, type, value, length);
+}
+
+// Set the message length to cover a MESSAGE-INTEGRITY attribute that's about to
+// be added, as the HMAC requires. Returns the number of bytes to hash.
+size_t
+stun_encode_integrity_begin(stun_encoder_t * e)
+{
+  if ( e->overflow )
+    return 0;
+  put16(&e->buffer[2], e->length - STUN_HEADER_SIZE + 4 + 20);
+  return e->length;
+}
+
+// FINGERPRINT must be the last attribute.
+void
+stun_encode_fingerprint(stun_encoder_t * e)
+{
+  uint8_t value[4];
+
+  if ( e->overflow )
+    return;
+  put16(&e->buffer[2], e->length - STUN_HEADER_SIZE + 8);
+  put32(value, stun_crc32(e->buffer, e->length) ^ FINGERPRINT_XOR);
+  stun_encode_attribute(e, FINGERPRINT, value, sizeof(value));
+}
+
+// Returns the length of the message, or -1 if it didn't fit.
+int
+stun_encode_end(stun_encoder_t * e)
+{
+  return e->overflow ? -1 : (int)e->length;
+}
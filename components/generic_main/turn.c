@@ -0,0 +1,871 @@
+// TURN client, RFC 8656.
+//
+// When PCP can't open a port in the NAT, and hole punching won't work because the
+// NAT is symmetric or is a carrier-grade NAT that we can't reach, a TURN server
+// relays packets for this host. This allocates one relayed address on a server,
+// over UDP, and keeps the allocation, its permissions, and its channels refreshed.
+// Everything here runs in the select task.
+//
+// Relayed data is carried in ChannelData messages, which have a 4-byte header,
+// rather than in Send and Data indications, which have 36 bytes or more of STUN
+// header and attributes. Each peer is bound to a channel before data is sent to it.
+// Received data is handed to the consumer where it lies in the receive buffer, and
+// data to be sent is gathered by sendmsg() from the consumer's buffer and the
+// header, so the data isn't copied here on either path.
+//
+// Messages are encoded and decoded by the STUN codec in stun_codec.c. Requests
+// carry FINGERPRINT, and ALLOCATE carries SOFTWARE, as RFC 8656 recommends.
+//
+// The server will require the long-term credential mechanism: the first ALLOCATE
+// is answered with error 401 and a REALM and NONCE, and every request after that
+// carries USERNAME, REALM, NONCE, and MESSAGE-INTEGRITY. The key is an MD5 of
+// username:realm:password. The password isn't processed with SASLprep, so it
+// should be ASCII.
+//
+// Only one request is in flight at a time. When there isn't one, schedule() sends
+// whichever refresh is due, or sets a timer for the next one. That keeps the
+// retransmission state to one request, and there's seldom more than one due.
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <lwip/sockets.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <mbedtls/md.h>
+#include "generic_main.h"
+#include "stun.h"
+
+#define MAX_PEERS		8
+#define FIRST_CHANNEL		0x4000
+#define TRANSMISSIONS		5	// Of each request, before giving up on the server.
+#define INITIAL_TIMEOUT		500	// Milliseconds. Doubled after each transmission.
+#define AUTHENTICATION_TRIES	3	// 401 and 438 answers to one request, before giving up.
+#define REQUESTED_LIFETIME	600	// Seconds.
+#define PERMISSION_REFRESH	(4 * 60)	// Seconds. Permissions last 5 minutes.
+#define CHANNEL_REFRESH		(9 * 60)	// Seconds. Channel bindings last 10 minutes.
+#define BUFFER_SIZE		1500
+
+typedef enum _turn_state {
+  TURN_RESOLVING = 0,
+  TURN_ALLOCATING,
+  TURN_ALLOCATED
+} turn_state_t;
+
+struct turn_peer {
+  bool				in_use;
+  bool				bound;		// The channel is bound.
+  int64_t			refresh;	// esp_timer_get_time() when the channel must be bound again.
+  struct sockaddr_storage	address;
+};
+
+struct turn_allocation {
+  turn_state_t			state;
+  bool				resolving;	// A name lookup is in progress.
+  bool				discarded;	// Free this when the lookup is done.
+  int				fd;
+  char				server[64];
+  uint16_t			port;
+  char				username[64];
+  char				password[64];
+  char				realm[128];
+  char				nonce[128];
+  uint8_t			key[16];
+  int				authentication_tries;
+  struct sockaddr_storage	server_address;
+  struct sockaddr_storage	relayed;
+  struct sockaddr_storage	mapped;
+  uint32_t			lifetime;		// Seconds, as granted by the server.
+  int64_t			allocation_refresh;	// esp_timer_get_time() when a REFRESH is due.
+  int64_t			permission_refresh;	// and a CREATE_PERMISSION.
+  gm_turn_after_t		after;
+  gm_turn_receive_t		receive;
+  void *			context;
+  // The request in flight. With the sizes of the strings above and MAX_PEERS, the
+  // largest request fits.
+  bool				busy;
+  uint16_t			method;
+  uint32_t			transaction_id[3];
+  int				peer;		// Of a CHANNEL_BIND.
+  int				transmissions;
+  size_t			request_size;	// 0 if the request didn't fit.
+  uint32_t			request[192];
+  struct turn_peer		peers[MAX_PEERS];
+  uint32_t			buffer[BUFFER_SIZE / sizeof(uint32_t)];
+};
+
+typedef struct _turn_statistics {
+  uint32_t	requests;
+  uint32_t	retransmissions;
+  uint32_t	errors;
+  uint32_t	packets_sent;
+  uint32_t	packets_received;
+  uint32_t	packets_dropped;
+  uint64_t	bytes_sent;
+  uint64_t	bytes_received;
+} turn_statistics_t;
+
+// These are only used in the select task.
+static struct turn_allocation *	allocation = NULL;
+static turn_statistics_t	statistics = {};
+
+static void	retransmit(void * data);
+static void	tick(void * data);
+
+static const char *
+method_name(uint16_t method)
+{
+  switch ( method ) {
+  case TURN_ALLOCATE:
+    return "ALLOCATE";
+  case TURN_REFRESH:
+    return "REFRESH";
+  case TURN_CREATE_PERMISSION:
+    return "CREATE_PERMISSION";
+  case TURN_CHANNEL_BIND:
+    return "CHANNEL_BIND";
+  default:
+    return "?";
+  }
+}
+
+static socklen_t
+address_size(const struct sockaddr_storage * address)
+{
+  return address->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+}
+
+static bool
+same_peer(const struct sockaddr_storage * a, const struct sockaddr * b)
+{
+  if ( a->ss_family != b->sa_family )
+    return false;
+
+  if ( a->ss_family == AF_INET6 ) {
+    const struct sockaddr_in6 * const a6 = (const struct sockaddr_in6 *)a;
+    const struct sockaddr_in6 * const b6 = (const struct sockaddr_in6 *)b;
+
+    return a6->sin6_port == b6->sin6_port
+     && memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(a6->sin6_addr)) == 0;
+  }
+  else {
+    const struct sockaddr_in * const a4 = (const struct sockaddr_in *)a;
+    const struct sockaddr_in * const b4 = (const struct sockaddr_in *)b;
+
+    return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
+  }
+}
+
+static void
+print_address(const char * label, const struct sockaddr_storage * address)
+{
+  char	buffer[INET6_ADDRSTRLEN];
+
+  if ( address->ss_family == AF_INET6 )
+    inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)address)->sin6_addr, buffer, sizeof(buffer));
+  else
+    inet_ntop(AF_INET, &((const struct sockaddr_in *)address)->sin_addr, buffer, sizeof(buffer));
+  gm_printf(
+   "%s%s port %u\n",
+   label,
+   buffer,
+   (unsigned int)ntohs(((const struct sockaddr_in *)address)->sin_port));
+}
+
+// Start a new request, with a new transaction ID, in a->request.
+static void
+begin_request(struct turn_allocation * a, stun_encoder_t * e, uint16_t method)
+{
+  esp_fill_random(a->transaction_id, sizeof(a->transaction_id));
+  a->method = method;
+  stun_encode_begin(e, a->request, sizeof(a->request), STUN_REQUEST, method, a->transaction_id);
+}
+
+static void
+hmac(const struct turn_allocation * a, const uint8_t * data, size_t size, uint8_t * hash)
+{
+  mbedtls_md_hmac(
+   mbedtls_md_info_from_type(MBEDTLS_MD_SHA1),
+   a->key,
+   sizeof(a->key),
+   data,
+   size,
+   hash);
+}
+
+// Check the MESSAGE-INTEGRITY at offset in a received message. The HMAC-SHA1 is of
+// the message up to the attribute, with the length in the header covering the
+// attribute, as RFC 8489 says.
+static bool
+check_integrity(const struct turn_allocation * a, uint8_t * message, size_t offset)
+{
+  const uint8_t	length[2] = { message[2], message[3] };
+  uint8_t	hash[20];
+
+  message[2] = (offset - STUN_HEADER_SIZE + 24) >> 8;
+  message[3] = (offset - STUN_HEADER_SIZE + 24) & 0xff;
+  hmac(a, message, offset, hash);
+  message[2] = length[0];
+  message[3] = length[1];
+  return memcmp(hash, &message[offset + 4], sizeof(hash)) == 0;
+}
+
+// Add the long-term credentials, once the server has told us its realm, and the
+// FINGERPRINT, and set the size of the request. MESSAGE-INTEGRITY must be the last
+// attribute but FINGERPRINT.
+static void
+end_request(struct turn_allocation * a, stun_encoder_t * e)
+{
+  int	length;
+
+  if ( a->realm[0] != '\0' ) {
+    uint8_t hash[20];
+
+    stun_encode_string(e, USERNAME, a->username);
+    stun_encode_string(e, REALM, a->realm);
+    stun_encode_string(e, NONCE, a->nonce);
+    hmac(a, e->buffer, stun_encode_integrity_begin(e), hash);
+    stun_encode_attribute(e, MESSAGE_INTEGRITY, hash, sizeof(hash));
+  }
+  stun_encode_fingerprint(e);
+
+  if ( (length = stun_encode_end(e)) < 0 ) {
+    GM_WARN_ONCE("TURN: The request is too large for its buffer.\n");
+    length = 0;
+  }
+  a->request_size = length;
+}
+
+static void
+make_key(struct turn_allocation * a)
+{
+  char		text[sizeof(a->username) + sizeof(a->realm) + sizeof(a->password) + 2];
+  const int	length = snprintf(text, sizeof(text), "%s:%s:%s", a->username, a->realm, a->password);
+
+  mbedtls_md(mbedtls_md_info_from_type(MBEDTLS_MD_MD5), (const uint8_t *)text, length, a->key);
+  memset(text, '\0', sizeof(text));
+}
+
+static void
+build_request(struct turn_allocation * a, uint16_t method, int peer)
+{
+  stun_encoder_t e;
+
+  begin_request(a, &e, method);
+
+  switch ( method ) {
+  case TURN_ALLOCATE:
+    // UDP, in the high byte.
+    stun_encode_u32(&e, REQUESTED_TRANSPORT, 17 << 24);
+    stun_encode_u32(&e, LIFETIME, REQUESTED_LIFETIME);
+    stun_encode_string(&e, SOFTWARE, GM.application_name ? GM.application_name : "generic_main");
+    break;
+  case TURN_REFRESH:
+    stun_encode_u32(&e, LIFETIME, REQUESTED_LIFETIME);
+    break;
+  case TURN_CREATE_PERMISSION:
+    // One request refreshes the permissions of every peer.
+    for ( int i = 0; i < MAX_PEERS; i++ ) {
+      if ( a->peers[i].in_use )
+        stun_encode_xor_address(&e, XOR_PEER_ADDRESS, (const struct sockaddr *)&a->peers[i].address);
+    }
+    break;
+  case TURN_CHANNEL_BIND:
+    // The channel number is in the high 16 bits, the rest is reserved.
+    stun_encode_u32(&e, CHANNEL_NUMBER, (FIRST_CHANNEL + peer) << 16);
+    stun_encode_xor_address(&e, XOR_PEER_ADDRESS, (const struct sockaddr *)&a->peers[peer].address);
+    break;
+  }
+  end_request(a, &e);
+  a->peer = peer;
+  a->transmissions = 0;
+  a->busy = true;
+}
+
+static void
+discard(struct turn_allocation * a)
+{
+  gm_timer_cancel(retransmit, a);
+  gm_timer_cancel(tick, a);
+  if ( a->fd >= 0 ) {
+    gm_fd_unregister(a->fd);
+    close(a->fd);
+    a->fd = -1;
+  }
+  if ( allocation == a )
+    allocation = NULL;
+
+  // The name lookup holds a pointer to this.
+  if ( a->resolving )
+    a->discarded = true;
+  else {
+    memset(a->password, '\0', sizeof(a->password));
+    memset(a->key, '\0', sizeof(a->key));
+    free(a);
+  }
+}
+
+// Give up on the allocation, and tell the consumer.
+static void
+fail(struct turn_allocation * a)
+{
+  const gm_turn_after_t	after = a->after;
+  void * const		context = a->context;
+
+  discard(a);
+  if ( after )
+    (after)(false, NULL, context);
+}
+
+static void
+transmit(struct turn_allocation * a)
+{
+  const uint32_t timeout = INITIAL_TIMEOUT << a->transmissions;
+
+  if ( a->request_size == 0 ) {
+    fail(a);
+    return;
+  }
+  if ( a->transmissions == 0 )
+    statistics.requests++;
+  else
+    statistics.retransmissions++;
+  a->transmissions++;
+
+  sendto(
+   a->fd,
+   a->request,
+   a->request_size,
+   0,
+   (const struct sockaddr *)&a->server_address,
+   address_size(&a->server_address));
+
+  if ( gm_timer_add(retransmit, a, timeout) != 0 ) {
+    GM_WARN_ONCE("TURN: Out of timers.\n");
+    fail(a);
+  }
+}
+
+// Runs in the select task, from a timer, when a request wasn't answered.
+static void
+retransmit(void * data)
+{
+  struct turn_allocation * const a = (struct turn_allocation *)data;
+
+  if ( a->transmissions < TRANSMISSIONS ) {
+    transmit(a);
+    return;
+  }
+  gm_printf("TURN: %s didn't answer %s.\n", a->server, method_name(a->method));
+  fail(a);
+}
+
+// Refresh a little before the allocation would expire.
+static int64_t
+refresh_time(uint32_t lifetime)
+{
+  const uint32_t seconds = lifetime > 120 ? lifetime - 60 : lifetime / 2;
+
+  return esp_timer_get_time() + (int64_t)seconds * 1000000;
+}
+
+// Send the next request that's due, or set a timer for when one will be.
+static void
+schedule(struct turn_allocation * a)
+{
+  const int64_t	now = esp_timer_get_time();
+  int64_t	next;
+  bool		have_peers = false;
+
+  gm_timer_cancel(tick, a);
+  if ( a->busy || a->state == TURN_RESOLVING )
+    return;
+
+  if ( a->state == TURN_ALLOCATING ) {
+    build_request(a, TURN_ALLOCATE, -1);
+    transmit(a);
+    return;
+  }
+
+  if ( now >= a->allocation_refresh ) {
+    build_request(a, TURN_REFRESH, -1);
+    transmit(a);
+    return;
+  }
+  next = a->allocation_refresh;
+
+  for ( int i = 0; i < MAX_PEERS; i++ ) {
+    const struct turn_peer * const p = &a->peers[i];
+
+    if ( !p->in_use )
+      continue;
+    have_peers = true;
+    if ( now >= p->refresh ) {
+      build_request(a, TURN_CHANNEL_BIND, i);
+      transmit(a);
+      return;
+    }
+    if ( p->refresh < next )
+      next = p->refresh;
+  }
+
+  if ( have_peers ) {
+    if ( now >= a->permission_refresh ) {
+      build_request(a, TURN_CREATE_PERMISSION, -1);
+      transmit(a);
+      return;
+    }
+    if ( a->permission_refresh < next )
+      next = a->permission_refresh;
+  }
+
+  if ( gm_timer_add(tick, a, (next - now) / 1000 + 1) != 0 ) {
+    GM_WARN_ONCE("TURN: Out of timers.\n");
+    fail(a);
+  }
+}
+
+// Runs in the select task, from a timer, when a refresh is due.
+static void
+tick(void * data)
+{
+  schedule((struct turn_allocation *)data);
+}
+
+static void
+deliver(struct turn_allocation * a, const struct sockaddr_storage * peer, uint8_t * data, size_t size)
+{
+  statistics.packets_received++;
+  statistics.bytes_received += size;
+  if ( a->receive )
+    (a->receive)((const struct sockaddr *)peer, data, size, a->context);
+}
+
+static void
+channel_data(struct turn_allocation * a, uint8_t * buffer, size_t size)
+{
+  const unsigned int	channel = (buffer[0] << 8) | buffer[1];
+  const size_t		length = (buffer[2] << 8) | buffer[3];
+  const unsigned int	index = channel - FIRST_CHANNEL;
+
+  if ( index >= MAX_PEERS || !a->peers[index].bound || length + 4 > size ) {
+    statistics.packets_dropped++;
+    return;
+  }
+  deliver(a, &a->peers[index].address, &buffer[4], length);
+}
+
+static void
+data_indication(struct turn_allocation * a, const stun_decoded_t * d)
+{
+  // The server sends these for peers that have a permission but not a channel.
+  if ( !stun_has(d, K_XOR_PEER_ADDRESS) || !stun_has(d, K_DATA) ) {
+    statistics.packets_dropped++;
+    return;
+  }
+  // The data is in the receive buffer, which the consumer may use.
+  deliver(a, &d->peer_address, (uint8_t *)d->data.value, d->data.length);
+}
+
+static void
+copy_string(char * to, size_t to_size, const stun_bytes_t * from)
+{
+  size_t length = from->length;
+
+  if ( length >= to_size )
+    length = to_size - 1;
+  memcpy(to, from->value, length);
+  to[length] = '\0';
+}
+
+static void
+error_response(struct turn_allocation * a, const stun_decoded_t * d)
+{
+  statistics.errors++;
+
+  // Unauthorized, or Stale Nonce. Send the request again with the new credentials.
+  if ( (d->error_code == 401 || d->error_code == 438)
+   && stun_has(d, K_NONCE)
+   && (stun_has(d, K_REALM) || a->realm[0] != '\0')
+   && a->authentication_tries++ < AUTHENTICATION_TRIES ) {
+    if ( stun_has(d, K_REALM) )
+      copy_string(a->realm, sizeof(a->realm), &d->realm);
+    copy_string(a->nonce, sizeof(a->nonce), &d->nonce);
+    make_key(a);
+    build_request(a, a->method, a->peer);
+    transmit(a);
+    return;
+  }
+
+  // Allocation Mismatch: the server has forgotten the allocation. Start over.
+  if ( d->error_code == 437 && a->method != TURN_ALLOCATE ) {
+    gm_printf("TURN: %s lost the allocation. Allocating again.\n", a->server);
+    a->state = TURN_ALLOCATING;
+    for ( int i = 0; i < MAX_PEERS; i++ ) {
+      a->peers[i].bound = false;
+      a->peers[i].refresh = 0;
+    }
+    schedule(a);
+    return;
+  }
+
+  gm_printf("TURN: %s failed with error %d.\n", method_name(a->method), d->error_code);
+  switch ( a->method ) {
+  case TURN_ALLOCATE:
+  case TURN_REFRESH:
+    fail(a);
+    return;
+  case TURN_CHANNEL_BIND:
+    a->peers[a->peer].in_use = false;
+    a->peers[a->peer].bound = false;
+    break;
+  case TURN_CREATE_PERMISSION:
+    a->permission_refresh = esp_timer_get_time() + 60 * 1000000LL;
+    break;
+  }
+  schedule(a);
+}
+
+static void
+response(struct turn_allocation * a, uint8_t * message, const stun_decoded_t * d)
+{
+  const int64_t	now = esp_timer_get_time();
+  bool		success = d->message_class == STUN_RESPONSE;
+
+  if ( d->method != a->method || (!success && d->message_class != STUN_ERROR) )
+    return;
+
+  // Once there are credentials, a success response without a good MESSAGE-INTEGRITY
+  // isn't from the server, and is ignored. The request will be retransmitted.
+  if ( success && a->realm[0] != '\0' ) {
+    if ( !stun_has(d, K_MESSAGE_INTEGRITY) || !check_integrity(a, message, d->message_integrity) )
+      return;
+  }
+
+  gm_timer_cancel(retransmit, a);
+  a->busy = false;
+
+  // A response with comprehension-required attributes that aren't understood is a
+  // failure.
+  if ( success && d->number_of_unknown > 0 ) {
+    gm_printf("TURN: %s response has unknown attribute 0x%x.\n", method_name(a->method), (unsigned int)d->unknown[0]);
+    success = false;
+  }
+
+  if ( !success ) {
+    error_response(a, d);
+    return;
+  }
+  a->authentication_tries = 0;
+
+  switch ( a->method ) {
+  case TURN_ALLOCATE:
+    if ( !stun_has(d, K_XOR_RELAYED_ADDRESS) ) {
+      gm_printf("TURN: ALLOCATE response didn't include the relayed address.\n");
+      fail(a);
+      return;
+    }
+    a->state = TURN_ALLOCATED;
+    a->relayed = d->relayed_address;
+    if ( stun_has(d, K_XOR_MAPPED_ADDRESS) )
+      a->mapped = d->mapped_address;
+    a->lifetime = stun_has(d, K_LIFETIME) ? d->lifetime : REQUESTED_LIFETIME;
+    a->allocation_refresh = refresh_time(a->lifetime);
+    print_address("TURN: Relayed address ", &a->relayed);
+    if ( a->after )
+      (a->after)(true, (const struct sockaddr *)&a->relayed, a->context);
+    break;
+  case TURN_REFRESH:
+    if ( stun_has(d, K_LIFETIME) )
+      a->lifetime = d->lifetime;
+    a->allocation_refresh = refresh_time(a->lifetime);
+    break;
+  case TURN_CREATE_PERMISSION:
+    a->permission_refresh = now + PERMISSION_REFRESH * 1000000LL;
+    break;
+  case TURN_CHANNEL_BIND:
+    a->peers[a->peer].bound = true;
+    a->peers[a->peer].refresh = now + CHANNEL_REFRESH * 1000000LL;
+    break;
+  }
+  schedule(a);
+}
+
+static void
+turn_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  struct turn_allocation * const	a = (struct turn_allocation *)data;
+  uint8_t * const			buffer = (uint8_t *)a->buffer;
+
+  for ( ; ; ) {
+    struct sockaddr_storage	from;
+    socklen_t			from_size = sizeof(from);
+    const ssize_t		size = recvfrom(fd, buffer, sizeof(a->buffer), MSG_DONTWAIT, (struct sockaddr *)&from, &from_size);
+    stun_decoded_t		d;
+
+    if ( size < 0 )
+      return;
+
+    // The socket isn't connected, so anyone could send to it. Only the TURN server
+    // may, or a forged ChannelData message could be injected into a peer's stream.
+    if ( !same_peer(&a->server_address, (const struct sockaddr *)&from) )
+      continue;
+
+    // ChannelData messages start with a channel number, 0x4000 to 0x7fff. STUN
+    // messages start with two zero bits.
+    if ( size >= 4 && (buffer[0] & 0xc0) == 0x40 ) {
+      channel_data(a, buffer, size);
+      continue;
+    }
+
+    if ( stun_decode(buffer, size, &d) != 0 )
+      continue;
+
+    if ( d.message_class == STUN_INDICATION && d.method == TURN_DATA ) {
+      data_indication(a, &d);
+      continue;
+    }
+
+    if ( !a->busy || memcmp(d.transaction_id, a->transaction_id, sizeof(a->transaction_id)) != 0 )
+      continue;
+
+    response(a, buffer, &d);
+    // The allocation may have failed, and been freed.
+    if ( allocation != a )
+      return;
+  }
+}
+
+// Runs in the select task, when the server's name has been looked up.
+static void
+turn_resolved(const struct sockaddr_storage * addresses, size_t count, void * context)
+{
+  struct turn_allocation * const a = (struct turn_allocation *)context;
+
+  a->resolving = false;
+  if ( a->discarded ) {
+    discard(a);
+    return;
+  }
+
+  if ( count == 0 ) {
+    gm_printf("TURN: Can't look up %s.\n", a->server);
+    fail(a);
+    return;
+  }
+  a->server_address = addresses[0];
+
+  if ( (a->fd = socket(a->server_address.ss_family, SOCK_DGRAM, IPPROTO_UDP)) < 0 ) {
+    gm_printf("TURN: Can't get socket: %s\n", strerror(errno));
+    fail(a);
+    return;
+  }
+  fcntl(a->fd, F_SETFL, fcntl(a->fd, F_GETFL, 0) | O_NONBLOCK);
+  gm_fd_register(a->fd, turn_receive, a, true, false, false, 0);
+  a->state = TURN_ALLOCATING;
+  schedule(a);
+}
+
+// Release the allocation on the server, by refreshing it with a lifetime of zero.
+// This isn't retransmitted. If it's lost, the allocation expires.
+static void
+release(struct turn_allocation * a)
+{
+  if ( a->state == TURN_ALLOCATED ) {
+    stun_encoder_t e;
+
+    begin_request(a, &e, TURN_REFRESH);
+    stun_encode_u32(&e, LIFETIME, 0);
+    end_request(a, &e);
+    sendto(
+     a->fd,
+     a->request,
+     a->request_size,
+     0,
+     (const struct sockaddr *)&a->server_address,
+     address_size(&a->server_address));
+  }
+  discard(a);
+}
+
+// Runs in the select task.
+static void
+turn_start(void * data)
+{
+  struct turn_allocation * const a = (struct turn_allocation *)data;
+
+  // A new allocation replaces the old one.
+  if ( allocation )
+    release(allocation);
+  allocation = a;
+
+  a->resolving = true;
+  if ( gm_dns_resolve(a->server, a->port, AF_UNSPEC, turn_resolved, a) != 0 ) {
+    a->resolving = false;
+    fail(a);
+  }
+}
+
+// Runs in the select task.
+static void
+stop(void * data)
+{
+  if ( allocation )
+    release(allocation);
+}
+
+// Allocate a relayed address on a TURN server. after() is called in the select task
+// with the relayed address when the allocation is made, and with success false if
+// it fails or is later lost. receive() is called in the select task with the data
+// relayed from each peer. The data is in the receive buffer, and is only valid
+// during the call. A new allocation replaces the last one.
+int
+gm_turn_allocate(const char * server, uint16_t port, const char * username, const char * password, gm_turn_after_t after, gm_turn_receive_t receive, void * context)
+{
+  struct turn_allocation * const a = calloc(1, sizeof(*a));
+
+  if ( a == NULL ) {
+    gm_printf("TURN: malloc failed.\n");
+    return -1;
+  }
+  strlcpy(a->server, server, sizeof(a->server));
+  strlcpy(a->username, username, sizeof(a->username));
+  strlcpy(a->password, password, sizeof(a->password));
+  a->port = port ? port : 3478;
+  a->fd = -1;
+  a->peer = -1;
+  a->after = after;
+  a->receive = receive;
+  a->context = context;
+
+  gm_run(turn_start, a, GM_FAST);
+  return 0;
+}
+
+// Bind a channel to a peer, which also permits it to send to us through the relay.
+// Call from the select task. Returns -1 if there's no allocation, or too many peers.
+int
+gm_turn_peer(const struct sockaddr * peer)
+{
+  struct turn_allocation * const	a = allocation;
+  int					free_slot = -1;
+  bool					have_peers = false;
+
+  if ( a == NULL )
+    return -1;
+
+  for ( int i = 0; i < MAX_PEERS; i++ ) {
+    if ( a->peers[i].in_use ) {
+      if ( same_peer(&a->peers[i].address, peer) )
+        return 0;
+      have_peers = true;
+    }
+    else if ( free_slot < 0 )
+      free_slot = i;
+  }
+  if ( free_slot < 0 )
+    return -1;
+
+  struct turn_peer * const p = &a->peers[free_slot];
+
+  memset(p, '\0', sizeof(*p));
+  memcpy(&p->address, peer, peer->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+  p->in_use = true;
+  // The CHANNEL_BIND makes the first permission, so the next CREATE_PERMISSION
+  // isn't needed until it's time to refresh it.
+  if ( !have_peers )
+    a->permission_refresh = esp_timer_get_time() + PERMISSION_REFRESH * 1000000LL;
+  schedule(a);
+  return 0;
+}
+
+// Send data to a peer through the relay. The peer's channel must be bound, which
+// takes one round trip to the server after gm_turn_peer(). Call from the select task.
+int
+gm_turn_send(const struct sockaddr * peer, const void * data, size_t size)
+{
+  struct turn_allocation * const	a = allocation;
+  uint8_t				header[4];
+  struct iovec				iov[2];
+  struct msghdr				message = {};
+
+  if ( a == NULL || size > 0xffff )
+    return -1;
+
+  for ( int i = 0; i < MAX_PEERS; i++ ) {
+    const struct turn_peer * const p = &a->peers[i];
+
+    if ( !p->bound || !same_peer(&p->address, peer) )
+      continue;
+
+    // Over UDP, ChannelData doesn't need to be padded.
+    header[0] = (FIRST_CHANNEL + i) >> 8;
+    header[1] = (FIRST_CHANNEL + i) & 0xff;
+    header[2] = size >> 8;
+    header[3] = size & 0xff;
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = size;
+    message.msg_name = &a->server_address;
+    message.msg_namelen = address_size(&a->server_address);
+    message.msg_iov = iov;
+    message.msg_iovlen = 2;
+
+    if ( sendmsg(a->fd, &message, 0) < 0 )
+      return -1;
+    statistics.packets_sent++;
+    statistics.bytes_sent += size;
+    return 0;
+  }
+  return -1;
+}
+
+void
+gm_turn_release(void)
+{
+  gm_run(stop, 0, GM_FAST);
+}
+
+void
+gm_turn_report(void)
+{
+  static const char * const states[] = { "looking up the server", "allocating", "allocated" };
+  const struct turn_allocation * const a = allocation;
+
+  if ( a == NULL )
+    gm_printf("No TURN allocation.\n");
+  else {
+    gm_printf("Server %s port %u: %s.\n", a->server, (unsigned int)a->port, states[a->state]);
+    if ( a->state == TURN_ALLOCATED ) {
+      print_address("Relayed address ", &a->relayed);
+      if ( a->mapped.ss_family != 0 )
+        print_address("Mapped address ", &a->mapped);
+      gm_printf("Lifetime %u seconds.\n", (unsigned int)a->lifetime);
+    }
+    for ( int i = 0; i < MAX_PEERS; i++ ) {
+      const struct turn_peer * const p = &a->peers[i];
+      char label[32];
+
+      if ( !p->in_use )
+        continue;
+      snprintf(label, sizeof(label), "Channel 0x%x%s: ", FIRST_CHANNEL + i, p->bound ? "" : " (binding)");
+      print_address(label, &p->address);
+    }
+  }
+  gm_printf(
+   "Requests %u, retransmitted %u, errors %u.\n",
+   (unsigned int)statistics.requests,
+   (unsigned int)statistics.retransmissions,
+   (unsigned int)statistics.errors);
+  gm_printf(
+   "Relayed %u packets (%llu bytes) sent, %u packets (%llu bytes) received, %u dropped.\n",
+   (unsigned int)statistics.packets_sent,
+   (unsigned long long)statistics.bytes_sent,
+   (unsigned int)statistics.packets_received,
+   (unsigned long long)statistics.bytes_received,
+   (unsigned int)statistics.packets_dropped);
+}
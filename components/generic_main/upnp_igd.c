@@ -0,0 +1,475 @@
+// UPnP Internet Gateway Device client. See upnp_igd.h.
+//
+// Only the router's own answer to the SSDP search is accepted, as that is where the
+// mappings are needed. The device description is scanned as it arrives, in a small
+// window, for the first serviceType that's a WAN connection and the controlURL
+// that follows it, rather than being parsed as a whole. The SOAP responses are
+// short, and only their end is kept, which is where an error code is.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <lwip/sockets.h>
+#include <arpa/inet.h>
+#include "generic_main.h"
+#include "upnp_igd.h"
+
+#define SSDP_PORT	1900
+#define SEARCHES	3	// M-SEARCH is sent this many times, because UDP is unreliable.
+#define SEARCH_WAIT	2500	// Milliseconds between them. The search says MX: 2.
+#define XML_SIZE	512	// The most of the description that's looked at at once.
+#define SOAP_SIZE	1024	// The most of a SOAP response that's kept.
+
+typedef enum _upnp_state {
+  IDLE,
+  SEARCHING,
+  DESCRIBING,
+  ADDRESSING,
+  READY,
+  FAILED
+} upnp_state_t;
+
+// The response to a SOAP action.
+struct soap {
+  void *	context;
+  size_t	used;
+  char		body[SOAP_SIZE + 1];
+};
+
+static const char search[] =
+ "M-SEARCH * HTTP/1.1\r\n"
+ "HOST: 239.255.255.250:1900\r\n"
+ "MAN: \"ssdp:discover\"\r\n"
+ "MX: 2\r\n"
+ "ST: urn:schemas-upnp-org:device:InternetGatewayDevice:1\r\n"
+ "\r\n";
+
+static const char soap_headers[] =
+ "Content-Type: text/xml; charset=\"utf-8\"\r\n"
+ "SOAPAction: \"%s#%s\"\r\n";
+
+static const char envelope[] =
+ "<?xml version=\"1.0\"?>\r\n"
+ "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\""
+ " s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+ "<s:Body><u:%s xmlns:u=\"%s\">%s</u:%s></s:Body></s:Envelope>\r\n";
+
+static const char add_port_mapping[] =
+ "<NewRemoteHost></NewRemoteHost>"
+ "<NewExternalPort>%u</NewExternalPort>"
+ "<NewProtocol>%s</NewProtocol>"
+ "<NewInternalPort>%u</NewInternalPort>"
+ "<NewInternalClient>%s</NewInternalClient>"
+ "<NewEnabled>1</NewEnabled>"
+ "<NewPortMappingDescription>%s</NewPortMappingDescription>"
+ "<NewLeaseDuration>%u</NewLeaseDuration>";
+
+// These are only used in the select task.
+static upnp_state_t		state = IDLE;
+static int			ssdp_fd = -1;
+static int			searches = 0;
+static gm_http_request_t *	request = NULL;	// Of the description or the address.
+static char			location[128];	// Of the description.
+static char			service_type[64];
+static char			control_url[192];
+static bool			wan_service;	// The last serviceType was a WAN connection.
+static char			xml[XML_SIZE + 1];
+static size_t			xml_used;
+
+static void	search_again(void * data);
+
+static void
+close_ssdp(void)
+{
+  gm_timer_cancel(search_again, 0);
+  if ( ssdp_fd >= 0 ) {
+    gm_fd_unregister(ssdp_fd);
+    close(ssdp_fd);
+    ssdp_fd = -1;
+  }
+}
+
+static void
+fail(const char * why)
+{
+  gm_printf("UPnP: %s\n", why);
+  close_ssdp();
+  state = FAILED;
+}
+
+// Keep the end of the response.
+static ssize_t
+soap_body(gm_http_request_t * r, const char * data, size_t size, void * context)
+{
+  struct soap * const	s = (struct soap *)context;
+  const size_t		taken = size;
+
+  if ( size > SOAP_SIZE ) {
+    data += size - SOAP_SIZE;
+    size = SOAP_SIZE;
+  }
+  if ( s->used + size > SOAP_SIZE ) {
+    const size_t drop = s->used + size - SOAP_SIZE;
+
+    memmove(s->body, &s->body[drop], s->used - drop);
+    s->used -= drop;
+  }
+  memcpy(&s->body[s->used], data, size);
+  s->used += size;
+  s->body[s->used] = '\0';
+  return taken;
+}
+
+// The request body is built here, rather than on the stack. It's only used in the
+// select task, and is copied by gm_http_post().
+static gm_http_request_t *
+soap(const char * action, const char * arguments, gm_http_done_t done, void * context)
+{
+  static char		headers[192];
+  static char		content[1024];
+  struct soap *		s;
+  gm_http_request_t *	r;
+
+  if ( snprintf(headers, sizeof(headers), soap_headers, service_type, action) >= sizeof(headers)
+   ||  snprintf(content, sizeof(content), envelope, action, service_type, arguments, action) >= sizeof(content) )
+    return NULL;
+
+  if ( (s = calloc(1, sizeof(*s))) == NULL )
+    return NULL;
+  s->context = context;
+
+  if ( (r = gm_http_post(control_url, headers, content, soap_body, done, s)) == NULL )
+    free(s);
+  return r;
+}
+
+// Find an element in the response, by its name without a namespace prefix.
+// Returns NULL if it isn't there, or its value won't fit.
+static const char *
+element(struct soap * s, const char * name, char * buffer, size_t size)
+{
+  char		tag[40];
+  const char *	value;
+  size_t	length;
+
+  snprintf(tag, sizeof(tag), "<%s>", name);
+  if ( (value = strstr(s->body, tag)) == NULL )
+    return NULL;
+  value += strlen(tag);
+  if ( (length = strcspn(value, "<")) >= size || value[length] == '\0' )
+    return NULL;
+  memcpy(buffer, value, length);
+  buffer[length] = '\0';
+  return buffer;
+}
+
+// Returns 0 for success, the UPnP error code if there is one, or UPNP_NO_ANSWER.
+static int
+soap_result(struct soap * s, int status)
+{
+  char buffer[8];
+
+  if ( status == 200 )
+    return 0;
+  if ( status < 0 )
+    return UPNP_NO_ANSWER;
+  if ( element(s, "errorCode", buffer, sizeof(buffer)) )
+    return atoi(buffer);
+  return UPNP_ACTION_FAILED;
+}
+
+static void
+address_done(gm_http_request_t * r, int status, void * context)
+{
+  struct soap * const	s = (struct soap *)context;
+  struct in_addr	address = {};
+  char			buffer[INET_ADDRSTRLEN];
+
+  if ( r == request ) {
+    request = NULL;
+    // The mappings are still worth making without the external address.
+    if ( soap_result(s, status) == 0 && element(s, "NewExternalIPAddress", buffer, sizeof(buffer)) )
+      inet_pton(AF_INET, buffer, &address);
+    state = READY;
+    gm_printf("UPnP: The router's WAN connection is controlled at %s.\n", control_url);
+    upnp_igd_found(&address);
+  }
+  free(s);
+}
+
+// Take the control URL, which may be relative to the description's location.
+static bool
+set_control_url(const char * path)
+{
+  const char *	host = location + 7;
+  const int	origin = host + strcspn(host, "/") - location;
+  int		length;
+
+  if ( strncmp(path, "http://", 7) == 0 )
+    length = snprintf(control_url, sizeof(control_url), "%s", path);
+  else
+    length = snprintf(control_url, sizeof(control_url), "%.*s%s%s", origin, location, *path == '/' ? "" : "/", path);
+
+  if ( length >= sizeof(control_url) ) {
+    *control_url = '\0';
+    return false;
+  }
+  return true;
+}
+
+// Look for the first WAN connection service, and the control URL that follows it,
+// in what has arrived of the description. Whatever can't be part of an element
+// that's wanted is dropped from the buffer.
+static void
+scan(void)
+{
+  static const char	type_tag[] = "<serviceType>";
+  static const char	control_tag[] = "<controlURL>";
+  char *		start = xml;
+
+  while ( *control_url == '\0' ) {
+    char * const	type = strstr(start, type_tag);
+    char * const	control = strstr(start, control_tag);
+    const bool		is_type = type && (control == NULL || type < control);
+    char *		value;
+    char *		end;
+
+    if ( type == NULL && control == NULL ) {
+      // Keep enough that a tag that's split between deliveries is still found.
+      const size_t length = strlen(start);
+
+      if ( length >= sizeof(type_tag) )
+        start += length - (sizeof(type_tag) - 1);
+      break;
+    }
+    value = is_type ? type + sizeof(type_tag) - 1 : control + sizeof(control_tag) - 1;
+
+    if ( (end = strchr(value, '<')) == NULL ) {
+      // Wait for the rest of the value, unless it's too long to be of use.
+      if ( (is_type ? type : control) == xml && xml_used == XML_SIZE )
+        start = value;
+      else
+        start = is_type ? type : control;
+      break;
+    }
+    *end = '\0';
+
+    if ( is_type ) {
+      wan_service = (strstr(value, ":WANIPConnection:") || strstr(value, ":WANPPPConnection:"))
+       && strlen(value) < sizeof(service_type);
+      if ( wan_service )
+        strcpy(service_type, value);
+    }
+    else if ( wan_service )
+      wan_service = !set_control_url(value);
+
+    start = end + 1;
+  }
+
+  if ( *control_url != '\0' )
+    xml_used = 0;
+  else {
+    xml_used = strlen(start);
+    memmove(xml, start, xml_used);
+  }
+  xml[xml_used] = '\0';
+}
+
+static ssize_t
+description_body(gm_http_request_t * r, const char * data, size_t size, void * context)
+{
+  size_t taken = 0;
+
+  while ( taken < size ) {
+    size_t length = XML_SIZE - xml_used;
+
+    if ( length > size - taken )
+      length = size - taken;
+    memcpy(&xml[xml_used], &data[taken], length);
+    xml_used += length;
+    xml[xml_used] = '\0';
+    taken += length;
+    scan();
+  }
+  return size;
+}
+
+static void
+description_done(gm_http_request_t * r, int status, void * context)
+{
+  if ( r != request )
+    return;
+  request = NULL;
+
+  if ( status != 200 || *control_url == '\0' ) {
+    fail("The router's description has no WAN connection service.");
+    return;
+  }
+  state = ADDRESSING;
+  if ( (request = soap("GetExternalIPAddress", "", address_done, NULL)) == NULL )
+    fail("Can't send the request for the external address.");
+}
+
+static void
+ssdp_receive(int fd, void * data, bool readable, bool writable, bool exception, bool timeout)
+{
+  char			buffer[512];
+  struct sockaddr_in	address = {};
+  socklen_t		address_size = sizeof(address);
+  ssize_t		size;
+  char *		line;
+  char *		end;
+
+  if ( !readable )
+    return;
+
+  size = recvfrom(fd, buffer, sizeof(buffer) - 1, MSG_DONTWAIT, (struct sockaddr *)&address, &address_size);
+  if ( size <= 0 || state != SEARCHING )
+    return;
+  if ( address.sin_addr.s_addr != GM.sta.ip4.router.sin_addr.s_addr )
+    return;
+  buffer[size] = '\0';
+  if ( strncmp(buffer, "HTTP/1.1 200", 12) != 0 )
+    return;
+
+  for ( line = buffer; line != NULL && *line != '\0'; line = end ) {
+    if ( (end = strchr(line, '\n')) != NULL )
+      *end++ = '\0';
+    if ( strncasecmp(line, "LOCATION:", 9) == 0 ) {
+      const char *	value = line + 9;
+      size_t		length;
+
+      while ( *value == ' ' || *value == '\t' )
+        value++;
+      length = strcspn(value, "\r \t");
+      if ( length >= sizeof(location) || strncmp(value, "http://", 7) != 0 )
+        return;
+      memcpy(location, value, length);
+      location[length] = '\0';
+
+      close_ssdp();
+      state = DESCRIBING;
+      xml_used = 0;
+      wan_service = false;
+      *service_type = '\0';
+      *control_url = '\0';
+      if ( (request = gm_http_get(location, description_body, description_done, NULL)) == NULL )
+        fail("Can't fetch the router's description.");
+      return;
+    }
+  }
+}
+
+static void
+send_search(void)
+{
+  struct sockaddr_in address = {};
+
+  address.sin_family = AF_INET;
+  address.sin_port = htons(SSDP_PORT);
+  inet_pton(AF_INET, "239.255.255.250", &address.sin_addr);
+  sendto(ssdp_fd, search, sizeof(search) - 1, 0, (struct sockaddr *)&address, sizeof(address));
+}
+
+// Runs in the select task, from a timer.
+static void
+search_again(void * data)
+{
+  if ( ++searches > SEARCHES ) {
+    fail("No Internet Gateway Device answered.");
+    return;
+  }
+  send_search();
+  if ( gm_timer_add(search_again, 0, SEARCH_WAIT) != 0 )
+    GM_WARN_ONCE("UPnP: Out of timers.\n");
+}
+
+// Start looking for the router, if that hasn't been done since upnp_igd_stop().
+void
+upnp_igd_discover(void)
+{
+  struct sockaddr_in	address = {};
+  uint8_t		ttl = 2;
+
+  if ( state != IDLE )
+    return;
+
+  if ( (ssdp_fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0 ) {
+    fail("Can't open socket.");
+    return;
+  }
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = GM.sta.ip4.address.sin_addr.s_addr;
+  if ( bind(ssdp_fd, (struct sockaddr *)&address, sizeof(address)) < 0 ) {
+    fail("bind failed.");
+    return;
+  }
+  // Search on the station interface, even if the access point is up too.
+  setsockopt(ssdp_fd, IPPROTO_IP, IP_MULTICAST_IF, &address.sin_addr, sizeof(address.sin_addr));
+  setsockopt(ssdp_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+  gm_fd_register(ssdp_fd, ssdp_receive, NULL, true, false, false, 0);
+  state = SEARCHING;
+  searches = 0;
+  search_again(0);
+}
+
+static void
+map_done(gm_http_request_t * r, int status, void * context)
+{
+  struct soap * const	s = (struct soap *)context;
+  const int		result = soap_result(s, status);
+  void * const		c = s->context;
+
+  free(s);
+  upnp_igd_mapped(r, result, c);
+}
+
+// Map a port with the lease, in seconds, or 0 for a permanent one. context is
+// given to upnp_igd_mapped(). Returns NULL if the request couldn't be sent, and
+// then upnp_igd_mapped() won't be called.
+gm_http_request_t *
+upnp_igd_map(const gm_port_mapping_t * m, uint32_t lease, void * context)
+{
+  char	arguments[512];
+  char	client[INET_ADDRSTRLEN];
+
+  if ( state != READY )
+    return NULL;
+
+  inet_ntop(AF_INET, &GM.sta.ip4.address.sin_addr, client, sizeof(client));
+  if ( snprintf(
+   arguments,
+   sizeof(arguments),
+   add_port_mapping,
+   (unsigned int)(m->external_port ? m->external_port : m->internal_port),
+   m->tcp ? "TCP" : "UDP",
+   (unsigned int)m->internal_port,
+   client,
+   GM.application_name ? GM.application_name : "generic_main",
+   (unsigned int)lease) >= sizeof(arguments) )
+    return NULL;
+
+  return soap("AddPortMapping", arguments, map_done, context);
+}
+
+bool
+upnp_igd_ready(void)
+{
+  return state == READY;
+}
+
+// Forget the router, when the network goes down. Requests from upnp_igd_map()
+// aren't cancelled here, their callers hold them.
+void
+upnp_igd_stop(void)
+{
+  gm_http_request_t * const r = request;
+
+  close_ssdp();
+  request = NULL;
+  if ( r )
+    gm_http_cancel(r);
+  state = IDLE;
+}
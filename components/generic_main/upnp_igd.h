@@ -0,0 +1,29 @@
+// UPnP Internet Gateway Device client, for routers that speak neither PCP nor
+// NAT-PMP. port_control_protocol.c uses it as a third way to map IPv4 ports.
+//
+// upnp_igd_discover() multicasts an SSDP search, fetches the description of the
+// router that answers, finds its WANIPConnection or WANPPPConnection service, and
+// asks that for the external address. It then calls upnp_igd_found().
+// upnp_igd_map() sends an AddPortMapping action, and upnp_igd_mapped() is called
+// with the result. Everything here runs in the select task.
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "generic_main.h"
+
+// Errors from AddPortMapping that are handled, rather than giving up.
+enum upnp_igd_error {
+  UPNP_NO_ANSWER = -1,
+  UPNP_ACTION_FAILED = 501,
+  UPNP_CONFLICT_IN_MAPPING_ENTRY = 718,
+  UPNP_ONLY_PERMANENT_LEASES_SUPPORTED = 725
+};
+
+extern void			upnp_igd_discover(void);
+extern gm_http_request_t *	upnp_igd_map(const gm_port_mapping_t * m, uint32_t lease, void * context);
+extern bool			upnp_igd_ready(void);
+extern void			upnp_igd_stop(void);
+
+// These are implemented by the user of this module.
+extern void			upnp_igd_found(const struct in_addr * external_address);
+extern void			upnp_igd_mapped(gm_http_request_t * request, int error, void * context);
@@ -20,22 +20,27 @@ gm_uri_decode(const char * uri, char * buffer, size_t size)
   char * b = (char *)buffer;
 
   while ( *s ) {
+    // Leave room for the null.
+    if ( b >= &buffer[size - 1] ) {
+      *buffer = '\0';
+      return -1;
+    }
+
     if ( *s != '%' )
       *b++ = *s++;
     else {
       s++;
       
-      int first = hexit(*s++);
-      int second = hexit(*s++);
+      // Don't read past the end of a string that ends in the middle of an escape.
+      int first = hexit(*s);
+      int second = first < 0 ? -1 : hexit(s[1]);
       if ( first < 0 || second < 0 ) {
         *buffer = '\0';
         return -1;
       }
-      *b++ = (first * 10 + second) & 0xff;
+      s += 2;
+      *b++ = (first * 16 + second) & 0xff;
     }
-
-    if ( b > &buffer[size] )
-      return -1;
   }
   *b = '\0';
   return 0;
@@ -0,0 +1,279 @@
+// Network state that survives a reboot, so that reconnecting doesn't start from
+// nothing.
+//
+// After a reboot or brownout, the public addresses, the port mappings and what
+// dynamic DNS says are usually all the same as before. They are kept in NVS, for
+// the access point they were learned on. When the station connects to that access
+// point again, the public addresses are restored at once, and the port mappings are
+// put back in the pool with their old nonces, so that the router renews the same
+// mappings rather than making new ones. Those that haven't expired by the clock
+// are shown as mapped until the router answers. STUN and PCP run as always, and
+// correct anything that has changed.
+//
+// The access point's BSSID and channel are kept too, so that the station can
+// associate with it directly, rather than scanning every channel for the SSID.
+//
+// Dynamic DNS is only updated when the public address differs from the one it was
+// last told, so a reboot doesn't cost a round of DDNS requests, and an address
+// change while the device was down is still published. Changing any of the ddns_*
+// parameters forgets what it was told, so that the new settings are published.
+//
+// The state is written only when something that identifies it changes, not when a
+// mapping is renewed, to spare the flash. Gathering it runs in the select task,
+// and writing it in the slow event loop.
+//
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <esp_wifi.h>
+#include <nvs.h>
+#include "generic_main.h"
+
+#define WARM_BOOT_KEY		"warm_boot"
+#define WARM_BOOT_VERSION	2
+#define MAX_MAPPINGS		8
+#define TIME_IS_SET		1600000000	// Seconds. Earlier than this, SNTP hasn't run.
+
+typedef struct _warm_boot {
+  uint8_t		version;
+  uint8_t		bssid[6];	// Of the access point that the rest was learned on.
+  uint8_t		channel;
+  char			ssid[33];
+  struct sockaddr_in	ipv4;		// Public addresses.
+  struct sockaddr_in6	ipv6;
+  struct in_addr	ddns_ipv4;	// What dynamic DNS was last told.
+  struct in6_addr	ddns_ipv6;
+  uint8_t		mapping_count;
+  gm_port_mapping_t	mappings[MAX_MAPPINGS];
+} warm_boot_t;
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static warm_boot_t	state = {};	// The current state. Protected by lock.
+static warm_boot_t	saved = {};	// What's in NVS. Also protected by lock.
+static bool		loaded = false;
+
+// Whether two states differ in anything but what changes on every renewal.
+static bool
+differ(const warm_boot_t * a, const warm_boot_t * b)
+{
+  warm_boot_t	x = *a;
+  warm_boot_t	y = *b;
+
+  for ( int i = 0; i < MAX_MAPPINGS; i++ ) {
+    memset(&x.mappings[i].granted_time, '\0', sizeof(x.mappings[i].granted_time));
+    memset(&y.mappings[i].granted_time, '\0', sizeof(y.mappings[i].granted_time));
+    x.mappings[i].epoch = y.mappings[i].epoch = 0;
+    x.mappings[i].lifetime = y.mappings[i].lifetime = 0;
+  }
+  return memcmp(&x, &y, sizeof(x)) != 0;
+}
+
+static void
+load(void)
+{
+  size_t	size = sizeof(state);
+
+  if ( loaded )
+    return;
+  loaded = true;
+  if ( nvs_get_blob(GM.nvs, WARM_BOOT_KEY, &state, &size) != ESP_OK
+   || size != sizeof(state)
+   || state.version != WARM_BOOT_VERSION
+   || state.mapping_count > MAX_MAPPINGS )
+    memset(&state, '\0', sizeof(state));
+  state.version = WARM_BOOT_VERSION;
+  saved = state;
+}
+
+// Runs in the slow event loop.
+static void
+save(void * data)
+{
+  warm_boot_t	copy;
+  bool		changed;
+
+  pthread_mutex_lock(&lock);
+  copy = state;
+  changed = differ(&copy, &saved);
+  pthread_mutex_unlock(&lock);
+
+  if ( !changed )
+    return;
+  if ( nvs_set_blob(GM.nvs, WARM_BOOT_KEY, &copy, sizeof(copy)) != ESP_OK || nvs_commit(GM.nvs) != ESP_OK ) {
+    GM_WARN_ONCE("Warm boot: Can't save the network state in NVS.\n");
+    return;
+  }
+  pthread_mutex_lock(&lock);
+  saved = copy;
+  pthread_mutex_unlock(&lock);
+}
+
+// Runs in the select task, where the port mappings may be read.
+static void
+gather(void * data)
+{
+  bool	changed;
+
+  pthread_mutex_lock(&lock);
+  load();
+  if ( GM.sta.ip4.pub.sin_addr.s_addr != 0 )
+    state.ipv4 = GM.sta.ip4.pub;
+  if ( !gm_all_zeroes(GM.sta.ip6.pub.sin6_addr.s6_addr, sizeof(GM.sta.ip6.pub.sin6_addr.s6_addr)) )
+    state.ipv6 = GM.sta.ip6.pub;
+  memset(state.mappings, '\0', sizeof(state.mappings));
+  state.mapping_count = gm_port_control_protocol_mappings(state.mappings, MAX_MAPPINGS);
+  for ( int i = 0; i < state.mapping_count; i++ )
+    state.mappings[i].next = NULL;
+  changed = differ(&state, &saved);
+  pthread_mutex_unlock(&lock);
+
+  if ( changed )
+    gm_run(save, NULL, GM_SLOW);
+}
+
+// Runs in the select task.
+static void
+restore_mappings(void * data)
+{
+  warm_boot_t *	s = (warm_boot_t *)data;
+  struct timeval now;
+
+  gettimeofday(&now, 0);
+  for ( int i = 0; i < s->mapping_count; i++ ) {
+    const gm_port_mapping_t * const	m = &s->mappings[i];
+    uint32_t				remaining = 0;
+
+    // Without a clock that's been set, a mapping can't be known to be current.
+    if ( now.tv_sec > TIME_IS_SET
+     && m->granted_time.tv_sec > TIME_IS_SET
+     && m->granted_time.tv_sec + m->lifetime > now.tv_sec )
+      remaining = m->granted_time.tv_sec + m->lifetime - now.tv_sec;
+    gm_port_control_protocol_restore(m, remaining);
+  }
+  free(s);
+}
+
+// The station has associated with an access point. Remember it, and if it's the
+// one that the state was learned on, restore the state. Call from the event task.
+void
+gm_warm_boot_connected(void)
+{
+  wifi_ap_record_t	ap;
+  warm_boot_t *		copy;
+  char			buffer[INET6_ADDRSTRLEN + 1];
+
+  if ( esp_wifi_sta_get_ap_info(&ap) != ESP_OK )
+    return;
+
+  pthread_mutex_lock(&lock);
+  load();
+  state.channel = ap.primary;
+  memcpy(state.ssid, ap.ssid, sizeof(state.ssid) - 1);
+  if ( memcmp(state.bssid, ap.bssid, sizeof(state.bssid)) != 0 ) {
+    // Another network. What dynamic DNS was told is still true.
+    memcpy(state.bssid, ap.bssid, sizeof(state.bssid));
+    memset(&state.ipv4, '\0', sizeof(state.ipv4));
+    memset(&state.ipv6, '\0', sizeof(state.ipv6));
+    memset(state.mappings, '\0', sizeof(state.mappings));
+    state.mapping_count = 0;
+  }
+  if ( differ(&state, &saved) )
+    gm_run(save, NULL, GM_SLOW);
+
+  if ( state.ipv4.sin_addr.s_addr != 0 ) {
+    GM.sta.ip4.pub = state.ipv4;
+    inet_ntop(AF_INET, &state.ipv4.sin_addr, buffer, sizeof(buffer));
+    gm_web_socket_publish("public_ipv4", "%s", buffer);
+  }
+  if ( !gm_all_zeroes(state.ipv6.sin6_addr.s6_addr, sizeof(state.ipv6.sin6_addr.s6_addr)) ) {
+    GM.sta.ip6.pub = state.ipv6;
+    inet_ntop(AF_INET6, &state.ipv6.sin6_addr, buffer, sizeof(buffer));
+    gm_web_socket_publish("public_ipv6", "%s", buffer);
+  }
+  if ( state.mapping_count > 0 && (copy = malloc(sizeof(*copy))) != NULL ) {
+    *copy = state;
+    gm_run(restore_mappings, copy, GM_FAST);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+// The access point that the station last associated with, if its SSID is ssid.
+// Returns false if there is none.
+bool
+gm_warm_boot_access_point(const char * ssid, uint8_t bssid[6], uint8_t * channel)
+{
+  bool	found = false;
+
+  pthread_mutex_lock(&lock);
+  load();
+  if ( state.channel != 0 && strcmp(state.ssid, ssid) == 0 ) {
+    memcpy(bssid, state.bssid, sizeof(state.bssid));
+    *channel = state.channel;
+    found = true;
+  }
+  pthread_mutex_unlock(&lock);
+  return found;
+}
+
+// The public addresses or the port mappings may have changed. Call from any task.
+void
+gm_warm_boot_changed(void)
+{
+  gm_run(gather, NULL, GM_FAST);
+}
+
+// Whether dynamic DNS already has the public addresses.
+bool
+gm_warm_boot_ddns_current(void)
+{
+  bool	current = true;
+
+  pthread_mutex_lock(&lock);
+  load();
+  if ( GM.sta.ip4.pub.sin_addr.s_addr != 0 && GM.sta.ip4.pub.sin_addr.s_addr != state.ddns_ipv4.s_addr )
+    current = false;
+  if ( !gm_all_zeroes(GM.sta.ip6.pub.sin6_addr.s6_addr, sizeof(GM.sta.ip6.pub.sin6_addr.s6_addr))
+   && memcmp(&GM.sta.ip6.pub.sin6_addr, &state.ddns_ipv6, sizeof(state.ddns_ipv6)) != 0 )
+    current = false;
+  pthread_mutex_unlock(&lock);
+  return current;
+}
+
+// Runs in the slow event loop.
+static void
+republish(void * data)
+{
+  save(NULL);
+  if ( !gm_warm_boot_ddns_current() )
+    gm_ddns();
+}
+
+// The dynamic DNS settings have changed, so it can't be known to have the public
+// addresses. This is the after-set function of the ddns_* parameters.
+void
+gm_warm_boot_ddns_settings_changed(void)
+{
+  pthread_mutex_lock(&lock);
+  load();
+  memset(&state.ddns_ipv4, '\0', sizeof(state.ddns_ipv4));
+  memset(&state.ddns_ipv6, '\0', sizeof(state.ddns_ipv6));
+  pthread_mutex_unlock(&lock);
+  gm_run(republish, NULL, GM_SLOW);
+}
+
+// Dynamic DNS was told the public address. Call from the slow event loop, where
+// dynamic DNS runs.
+void
+gm_warm_boot_ddns_published(bool ipv6)
+{
+  pthread_mutex_lock(&lock);
+  load();
+  if ( ipv6 )
+    state.ddns_ipv6 = GM.sta.ip6.pub.sin6_addr;
+  else
+    state.ddns_ipv4 = GM.sta.ip4.pub.sin_addr;
+  pthread_mutex_unlock(&lock);
+  save(NULL);
+}
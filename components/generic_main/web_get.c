@@ -1,17 +1,45 @@
+// Fetch from web servers.
+//
+// Clients are kept in a small pool, one per origin (scheme, credentials, host and
+// port), so that repeated requests to the same site, like the public IP and
+// dynamic DNS providers, reuse the open connection rather than paying for DNS, a
+// TCP handshake, and a TLS handshake each time. Connections that are idle for
+// longer than IDLE_TIMEOUT are closed by a reaper in the select task, but their
+// clients are kept with the saved TLS session, so that the next connection to
+// that site resumes the session with a ticket rather than making a full handshake.
+//
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <esp_http_client.h>
 #include <esp_crt_bundle.h>
+#include <esp_timer.h>
 #include <esp_tls.h>
 #include "generic_main.h"
 
+#define NUMBER_OF_CONNECTIONS	4
+#define IDLE_TIMEOUT		(30 * 1000) // Milliseconds.
+
 struct user_data {
   char * data;
   size_t size;
   size_t index;
   gm_web_get_coroutine_t coroutine;
+  bool delivered; // Some of the body has been given to the caller.
 };
 
+typedef struct _connection {
+  char				origin[96];
+  esp_http_client_handle_t	client;
+  bool				busy;
+  bool				open;
+  int64_t			last_used;
+} connection_t;
+
+static pthread_mutex_t	lock = PTHREAD_MUTEX_INITIALIZER;
+static connection_t	connections[NUMBER_OF_CONNECTIONS] = {};
+static bool		reaper_scheduled = false;
+
 static esp_err_t event_handler(esp_http_client_event_t * event)
 {
   struct user_data * const user_data = (struct user_data *)event->user_data;
@@ -21,6 +49,7 @@ static esp_err_t event_handler(esp_http_client_event_t * event)
   default:
     break;
   case HTTP_EVENT_ON_DATA:
+    user_data->delivered = true;
 
     if (user_data->coroutine) {
       (*(user_data->coroutine))((const char *)event->data, event->data_len);
@@ -40,31 +69,197 @@ static esp_err_t event_handler(esp_http_client_event_t * event)
   return ESP_OK;
 }
 
-static int gm_web_get_internal(const char * url, struct user_data * user_data)
+// Get the part of the URL up to the path. Returns -1 if it won't fit.
+static int
+origin(const char * url, char * buffer, size_t size)
+{
+  const char *	s = strstr(url, "://");
+  size_t	length;
+
+  if ( s == NULL )
+    return -1;
+
+  s += 3;
+  length = (s - url) + strcspn(s, "/?#");
+  if ( length >= size )
+    return -1;
+
+  memcpy(buffer, url, length);
+  buffer[length] = '\0';
+  return 0;
+}
+
+static esp_http_client_handle_t
+new_client(const char * url)
 {
   esp_http_client_config_t config = {};
 
   config.url = url;
   config.event_handler = &event_handler;
   config.crt_bundle_attach = esp_crt_bundle_attach;
-  config.user_data = user_data;
+  // Keep the TLS session ticket, to resume the session when reconnecting.
+  config.save_client_session = true;
   // This doesn't seem to do anything if the basic authentication information isn't
   // in the URL, so it can be left on all of the time. It's used by ddns().
   config.auth_type = HTTP_AUTH_TYPE_BASIC;
 
-  esp_http_client_handle_t client = esp_http_client_init(&config);
+  return esp_http_client_init(&config);
+}
+
+// Runs in the select task. Close the connections that have been idle too long.
+static void
+reap(void * data)
+{
+  const int64_t	now = esp_timer_get_time();
+  bool		any_open = false;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CONNECTIONS; i++ ) {
+    connection_t * const c = &connections[i];
+
+    if ( c->busy || !c->open )
+      continue;
+
+    if ( now - c->last_used >= IDLE_TIMEOUT * 1000LL ) {
+      esp_http_client_close(c->client);
+      c->open = false;
+    }
+    else
+      any_open = true;
+  }
+  reaper_scheduled = any_open && gm_timer_add(reap, 0, IDLE_TIMEOUT) == 0;
+  pthread_mutex_unlock(&lock);
+}
+
+// Get the pooled client for the URL's origin, or make one. Returns NULL, with
+// *client set to an unpooled client, if all of the pool is busy.
+static connection_t *
+acquire(const char * url, esp_http_client_handle_t * client, bool * reused)
+{
+  char				o[sizeof(((connection_t *)0)->origin)];
+  connection_t *		c = NULL;
+  esp_http_client_handle_t	old = NULL;
+
+  *reused = false;
+  *client = NULL;
+
+  if ( origin(url, o, sizeof(o)) != 0 ) {
+    *client = new_client(url);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_CONNECTIONS; i++ ) {
+    if ( !connections[i].busy && connections[i].client && strcmp(connections[i].origin, o) == 0 ) {
+      c = &connections[i];
+      *reused = c->open;
+      break;
+    }
+  }
+  if ( c == NULL ) {
+    // Use an empty slot, or replace the least-recently used client.
+    for ( int i = 0; i < NUMBER_OF_CONNECTIONS; i++ ) {
+      connection_t * const candidate = &connections[i];
+
+      if ( candidate->busy )
+        continue;
+      if ( candidate->client == NULL ) {
+        c = candidate;
+        break;
+      }
+      if ( c == NULL || candidate->last_used < c->last_used )
+        c = candidate;
+    }
+    if ( c ) {
+      old = c->client;
+      c->client = NULL;
+      c->open = false;
+      strcpy(c->origin, o);
+    }
+  }
+  if ( c )
+    c->busy = true;
+  pthread_mutex_unlock(&lock);
+
+  if ( old )
+    esp_http_client_cleanup(old);
+
+  if ( c == NULL ) {
+    *client = new_client(url);
+    return NULL;
+  }
+
+  if ( c->client == NULL ) {
+    if ( (c->client = new_client(url)) == NULL ) {
+      pthread_mutex_lock(&lock);
+      c->busy = false;
+      pthread_mutex_unlock(&lock);
+      return NULL;
+    }
+  }
+  else
+    esp_http_client_set_url(c->client, url);
+
+  *client = c->client;
+  return c;
+}
+
+static void
+release(connection_t * c, bool ok)
+{
+  esp_http_client_handle_t	old = NULL;
+
+  pthread_mutex_lock(&lock);
+  if ( ok ) {
+    c->open = true;
+    c->last_used = esp_timer_get_time();
+    if ( !reaper_scheduled )
+      reaper_scheduled = gm_timer_add(reap, 0, IDLE_TIMEOUT) == 0;
+  }
+  else {
+    // The state of the connection isn't known. Start over next time.
+    old = c->client;
+    c->client = NULL;
+    c->open = false;
+    c->origin[0] = '\0';
+  }
+  c->busy = false;
+  pthread_mutex_unlock(&lock);
+
+  if ( old )
+    esp_http_client_cleanup(old);
+}
+
+static int gm_web_get_internal(const char * url, struct user_data * user_data)
+{
+  esp_http_client_handle_t	client;
+  bool				reused;
+  connection_t *		c = acquire(url, &client, &reused);
+  esp_err_t			err;
+  int				status = -1;
 
   if (client == NULL)
     return -1;
 
-  esp_err_t err = esp_http_client_perform(client);
+  esp_http_client_set_user_data(client, user_data);
+  err = esp_http_client_perform(client);
 
-  if (err) {
-    return -1;
+  if (err && reused && !user_data->delivered) {
+    // The server may have closed the kept-alive connection while it was idle.
+    // Try once more on a new connection. Not if any of the body has arrived,
+    // because a coroutine would be given it twice.
+    esp_http_client_close(client);
+    err = esp_http_client_perform(client);
   }
 
-  int status = esp_http_client_get_status_code(client);
-  esp_http_client_cleanup(client);
+  if (!err)
+    status = esp_http_client_get_status_code(client);
+
+  if (c)
+    release(c, !err);
+  else
+    esp_http_client_cleanup(client);
+
   return status;
 }
 
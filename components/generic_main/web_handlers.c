@@ -1,12 +1,46 @@
 #include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
 #include <esp_http_server.h>
+#include <esp_timer.h>
 #include "generic_main.h"
 
-static void * gm_web_request;
+// Handlers registered as asynchronous don't run in the HTTP server task. Their
+// requests are detached from the server with httpd_req_async_handler_begin() and
+// queued to a pool of worker tasks, so that a handler that waits upon NVS or an
+// outside web site doesn't hold up the other requests. The worker completes the
+// request when the handler returns.
+#define NUMBER_OF_WORKERS	2
+#define NUMBER_OF_JOBS		8
+#define DRAIN_TIMEOUT		5000	// Milliseconds.
+
+typedef struct _web_job {
+  httpd_req_t *			request;
+  const gm_web_handler_t *	handler;
+  gm_uri			uri;
+} web_job_t;
 
 static gm_web_handler_t * handlers[3] = {};
 static gm_web_handler_t * * last[3] = {&handlers[0], &handlers[1], &handlers[2]};
 
+// Each task that generates web pages has a context, with the request it is
+// responding to and the writer for the response. The HTTP and HTTPS server tasks
+// each take one of these the first time they ask. Workers keep theirs on their stacks.
+// Restarting the servers makes new server tasks, so stopping them hands the
+// contexts back.
+#define NUMBER_OF_SERVERS	2
+
+static gm_web_context_t	server_contexts[NUMBER_OF_SERVERS];
+static int		number_of_server_contexts = 0;
+static pthread_key_t	context_key;
+static QueueHandle_t	jobs = NULL;
+static int		jobs_in_flight = 0;	// Queued or running.
+static bool		draining = false;
+
 static esp_err_t
 run_post_handlers(httpd_req_t * req)
 {
@@ -31,9 +65,104 @@ run_put_handlers(httpd_req_t * req)
     return ESP_FAIL;
 }
 
+static void
+worker(void * parameter)
+{
+  gm_web_context_t	context = {};
+  web_job_t *		job;
+
+  pthread_setspecific(context_key, &context);
+
+  for ( ; ; ) {
+    if ( xQueueReceive(jobs, &job, portMAX_DELAY) != pdTRUE )
+      continue;
+
+    httpd_req_t * const req = job->request;
+
+    gm_web_set_request(req);
+    if ( (*(job->handler->handler))(req, &job->uri) != 0 ) {
+      // A synchronous handler's failure closes the connection. Do the same here.
+      httpd_sess_trigger_close(req->handle, httpd_req_to_sockfd(req));
+    }
+    context.request = 0;
+    context.template_current = 0;
+    httpd_req_async_handler_complete(req);
+    free(job);
+    __atomic_sub_fetch(&jobs_in_flight, 1, __ATOMIC_RELEASE);
+  }
+}
+
+static void
+start_workers(void)
+{
+  if ( jobs )
+    return;
+
+  pthread_key_create(&context_key, 0);
+  jobs = xQueueCreate(NUMBER_OF_JOBS, sizeof(web_job_t *));
+  for ( int i = 0; i < NUMBER_OF_WORKERS; i++ )
+    xTaskCreate(worker, "generic main: web worker", 8192, NULL, 4, NULL);
+}
+
+static int
+run_asynchronously(httpd_req_t * req, const gm_web_handler_t * h, const gm_uri * uri)
+{
+  web_job_t * job;
+
+  // Counted before draining is looked at, so that gm_web_handler_drain() either
+  // sees this job or this sees that it's draining.
+  __atomic_add_fetch(&jobs_in_flight, 1, __ATOMIC_SEQ_CST);
+  if ( __atomic_load_n(&draining, __ATOMIC_SEQ_CST) ) {
+    __atomic_sub_fetch(&jobs_in_flight, 1, __ATOMIC_RELEASE);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "The web server is restarting.");
+    return 0;
+  }
+
+  if ( (job = malloc(sizeof(*job))) == 0 ) {
+    __atomic_sub_fetch(&jobs_in_flight, 1, __ATOMIC_RELEASE);
+    return -1;
+  }
+
+  if ( httpd_req_async_handler_begin(req, &job->request) != ESP_OK ) {
+    __atomic_sub_fetch(&jobs_in_flight, 1, __ATOMIC_RELEASE);
+    free(job);
+    return -1;
+  }
+  job->handler = h;
+  memcpy(&job->uri, uri, sizeof(job->uri));
+
+  // The parameters point into the URI of the request, which gm_uri_parse() split in
+  // place. The detached request has its own copy of the URI, point into that.
+  for ( int i = 0; i < COUNTOF(job->uri.params); i++ ) {
+    gm_param_t * const p = &job->uri.params[i];
+    if ( p->name )
+      p->name = job->request->uri + (p->name - req->uri);
+    if ( p->value )
+      p->value = job->request->uri + (p->value - req->uri);
+  }
+
+  if ( xQueueSend(jobs, &job, 0) != pdTRUE ) {
+    // All of the workers are busy and the queue is full.
+    httpd_req_async_handler_complete(job->request);
+    free(job);
+    __atomic_sub_fetch(&jobs_in_flight, 1, __ATOMIC_RELEASE);
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Too many requests in progress.");
+    return 0;
+  }
+  return 0;
+}
+
 void
-gm_web_handler_install(httpd_handle_t server)
+gm_web_handler_install(httpd_handle_t server, bool secure)
 {
+  // The WebSocket and the log stream are registered first, because the server uses the first handler
+  // that matches, and the compressed filesystem's GET matches everything.
+  gm_web_socket_install(server);
+  // The log stream writes to its sockets directly from the select task, which
+  // can't be done under TLS. It's only available over plain HTTP.
+  if ( !secure )
+    gm_log_stream_install(server);
+
   // The GET method tries to match a file in the compressed ROM filesystem first.
   // If there is no match, it then tries the registered GET methods.
   gm_compressed_fs_web_handlers(server);
@@ -54,6 +183,7 @@ gm_web_handler_install(httpd_handle_t server)
   };
   httpd_register_uri_handler(server, &put);
 
+  start_workers();
 }
 
 int
@@ -62,13 +192,15 @@ gm_web_handler_run(httpd_req_t * req, const gm_uri * uri, gm_web_method method)
   const char * path = req->uri;
   const gm_web_handler_t * h = handlers[method];
 
-  gm_web_set_request(req);
-
   if ( *path == '/' )
     path++;
 
   while ( h ) {
     if ( strcmp(h->name, path) == 0 ) {
+      if ( h->asynchronous && jobs )
+        return run_asynchronously(req, h, uri);
+
+      gm_web_set_request(req);
       return (*(h->handler))(req, uri);
     }
     h = h->next;
@@ -76,28 +208,96 @@ gm_web_handler_run(httpd_req_t * req, const gm_uri * uri, gm_web_method method)
   return 1;
 }
 
+// Turn away new asynchronous requests, and wait for those that are queued or
+// running to complete, since their requests belong to the server. Call before the
+// servers are stopped. Not from a worker, which would wait for itself until the
+// time runs out.
+void
+gm_web_handler_drain(void)
+{
+  const int64_t start = esp_timer_get_time();
+
+  __atomic_store_n(&draining, true, __ATOMIC_SEQ_CST);
+  while ( __atomic_load_n(&jobs_in_flight, __ATOMIC_SEQ_CST) > 0 ) {
+    if ( esp_timer_get_time() - start > DRAIN_TIMEOUT * 1000LL ) {
+      GM_FAIL("Web handlers still running after %d ms.\n", DRAIN_TIMEOUT);
+      break;
+    }
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+// Call after the servers are stopped.
+void
+gm_web_handler_uninstall(void)
+{
+  memset(server_contexts, 0, sizeof(server_contexts));
+  __atomic_store_n(&number_of_server_contexts, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&draining, false, __ATOMIC_SEQ_CST);
+}
+
 void
 gm_web_handler_register(gm_web_handler_t * handler, gm_web_method method)
 {
   *last[method] = handler;
   last[method] = &(handler->next);
+  gm_boot_trace_constructor("web handler", handler->name);
+}
+
+gm_web_context_t *
+gm_web_context(void)
+{
+  gm_web_context_t * context = 0;
+
+  if ( jobs == NULL )
+    return &server_contexts[0];
+
+  if ( (context = (gm_web_context_t *)pthread_getspecific(context_key)) == NULL ) {
+    const int n = __atomic_fetch_add(&number_of_server_contexts, 1, __ATOMIC_RELAXED);
+
+    if ( n >= NUMBER_OF_SERVERS ) {
+      GM_FAIL("More web server tasks than contexts.\n");
+      abort();
+    }
+    context = &server_contexts[n];
+    pthread_setspecific(context_key, context);
+  }
+  return context;
 }
 
 void
-gm_web_set_request(void * context)
+gm_web_set_request(void * request)
 {
-  gm_web_request = context;
+  gm_web_context_t * const context = gm_web_context();
+
+  context->request = (httpd_req_t *)request;
+  if ( request )
+    gm_web_writer_begin(&context->writer, (httpd_req_t *)request, "text/html", 0, -1);
+}
+
+void
+gm_web_send_constant(const char * data, size_t size)
+{
+  gm_web_writer_constant(&gm_web_context()->writer, data, size);
 }
 
 void
 gm_web_send_to_client (const char *data, size_t size)
 {
-  httpd_resp_send_chunk((httpd_req_t *)gm_web_request, data, size);
+  gm_web_writer_copy(&gm_web_context()->writer, data, size);
+}
+
+int
+gm_web_vprintf(const char * pattern, va_list args)
+{
+  return gm_web_writer_vprintf(&gm_web_context()->writer, pattern, args);
 }
 
 void
 gm_web_finish(const char *data, size_t size)
 {
-  httpd_resp_send_chunk((httpd_req_t *)gm_web_request, "", 0);
-  gm_web_request = 0;
+  gm_web_context_t * const context = gm_web_context();
+
+  gm_web_writer_finish(&context->writer);
+  context->request = 0;
 }
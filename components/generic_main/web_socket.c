@@ -0,0 +1,287 @@
+// WebSocket push channel.
+//
+// Browsers connect to /ws and receive the live state of the system as small JSON
+// objects. Subsystems call gm_web_socket_publish() with a name and a value, for
+// example "frequency" or "public_ipv4". Only changed values are sent, as a delta
+// like {"ptt":"on"}. A client that connects gets the complete state first.
+//
+// A delta is encoded once, and the single buffer is sent to every WebSocket client
+// from the HTTP server task, so more operators watching the same rig don't add to
+// the encoding work, and the publisher doesn't wait upon slow clients.
+//
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+
+#define NUMBER_OF_VALUES	16
+#define NUMBER_OF_SERVERS	2 // HTTP and HTTPS.
+
+typedef struct _published_value {
+  char	name[24];
+  char	value[64];
+} published_value_t;
+
+struct _publication;
+
+// One HTTP server's share of a publication.
+typedef struct _delivery {
+  httpd_handle_t	server;
+  struct _publication *	publication;
+} delivery_t;
+
+typedef struct _publication {
+  int		references; // The number of deliveries not yet sent.
+  size_t	size;
+  int		fd; // -1 for all clients, otherwise the one client to send to.
+  delivery_t	deliveries[NUMBER_OF_SERVERS];
+  char		data[];
+} publication_t;
+
+static httpd_handle_t		servers[NUMBER_OF_SERVERS] = {};
+static pthread_mutex_t		lock = PTHREAD_MUTEX_INITIALIZER;
+static published_value_t	values[NUMBER_OF_VALUES] = {};
+
+// Copy a string into JSON, escaping the characters that must be escaped.
+// Returns the number of bytes written, not including the terminating null.
+static size_t
+json_string(char * out, size_t size, const char * s)
+{
+  size_t length = 0;
+
+  while ( *s && length + 3 < size ) {
+    const char c = *s++;
+
+    if ( c == '"' || c == '\\' ) {
+      out[length++] = '\\';
+      out[length++] = c;
+    }
+    else if ( (unsigned char)c >= ' ' )
+      out[length++] = c;
+  }
+  out[length] = '\0';
+  return length;
+}
+
+static void
+release(publication_t * p)
+{
+  if ( __atomic_sub_fetch(&p->references, 1, __ATOMIC_ACQ_REL) == 0 )
+    free(p);
+}
+
+// Runs in the task of the HTTP server that the delivery is for.
+static void
+send_publication(void * data)
+{
+  delivery_t *		d = (delivery_t *)data;
+  publication_t *	p = d->publication;
+  httpd_handle_t	server = d->server;
+  size_t		number_of_clients = CONFIG_LWIP_MAX_SOCKETS;
+  int			clients[CONFIG_LWIP_MAX_SOCKETS];
+  httpd_ws_frame_t	frame = {};
+
+  frame.type = HTTPD_WS_TYPE_TEXT;
+  frame.final = true;
+  frame.payload = (uint8_t *)p->data;
+  frame.len = p->size;
+
+  if ( p->fd >= 0 )
+    httpd_ws_send_frame_async(server, p->fd, &frame);
+  else if ( httpd_get_client_list(server, &number_of_clients, clients) == ESP_OK ) {
+    for ( size_t i = 0; i < number_of_clients; i++ ) {
+      if ( httpd_ws_get_fd_info(server, clients[i]) == HTTPD_WS_CLIENT_WEBSOCKET )
+        httpd_ws_send_frame_async(server, clients[i], &frame);
+    }
+  }
+  release(p);
+}
+
+// Queue a delivery of the publication to be sent from an HTTP server's task.
+static void
+queue_delivery(publication_t * p, int index, httpd_handle_t server)
+{
+  delivery_t * const d = &p->deliveries[index];
+
+  d->server = server;
+  d->publication = p;
+  if ( httpd_queue_work(server, send_publication, d) != ESP_OK )
+    release(p);
+}
+
+// Queue a publication to all of the HTTP servers. The one buffer is shared by them.
+static void
+queue(publication_t * p)
+{
+  httpd_handle_t	targets[NUMBER_OF_SERVERS];
+  int			count = 0;
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_SERVERS; i++ ) {
+    if ( servers[i] )
+      targets[count++] = servers[i];
+  }
+  pthread_mutex_unlock(&lock);
+
+  if ( count == 0 ) {
+    free(p);
+    return;
+  }
+  p->references = count;
+  for ( int i = 0; i < count; i++ )
+    queue_delivery(p, i, targets[i]);
+}
+
+// Encode all of the current values as one JSON object, for a new client.
+static publication_t *
+snapshot(int fd)
+{
+  publication_t * p = malloc(sizeof(*p) + NUMBER_OF_VALUES * (sizeof(published_value_t) * 2 + 6) + 3);
+  char *	out;
+  char *	start;
+
+  if ( p == 0 )
+    return 0;
+
+  p->fd = fd;
+  out = start = p->data;
+  *out++ = '{';
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_VALUES && values[i].name[0]; i++ ) {
+    if ( out - start > 1 )
+      *out++ = ',';
+    *out++ = '"';
+    out += json_string(out, sizeof(values[i].name) * 2, values[i].name);
+    *out++ = '"';
+    *out++ = ':';
+    *out++ = '"';
+    out += json_string(out, sizeof(values[i].value) * 2, values[i].value);
+    *out++ = '"';
+  }
+  pthread_mutex_unlock(&lock);
+
+  *out++ = '}';
+  *out = '\0';
+  p->size = out - start;
+  return p;
+}
+
+static esp_err_t
+web_socket_handler(httpd_req_t * req)
+{
+  httpd_ws_frame_t	frame = {};
+  uint8_t		buffer[128];
+
+  if ( req->method == HTTP_GET ) {
+    // The handshake is done, and this is a new client. Send it the complete state.
+    publication_t * p = snapshot(httpd_req_to_sockfd(req));
+    if ( p ) {
+      p->references = 1;
+      queue_delivery(p, 0, req->handle);
+    }
+    return ESP_OK;
+  }
+
+  // Clients don't send anything meaningful yet. Read and discard their frames.
+  if ( httpd_ws_recv_frame(req, &frame, 0) != ESP_OK )
+    return ESP_FAIL;
+
+  while ( frame.len > 0 ) {
+    size_t		length = frame.len;
+    httpd_ws_frame_t	f = {};
+
+    if ( length > sizeof(buffer) )
+      length = sizeof(buffer);
+    f.payload = buffer;
+    if ( httpd_ws_recv_frame(req, &f, length) != ESP_OK )
+      return ESP_FAIL;
+    frame.len -= length;
+  }
+  return ESP_OK;
+}
+
+// Publish a value to the WebSocket clients. It's only sent if it changed.
+// Names currently in use are "frequency", "mode", "ptt", "public_ipv4",
+// "public_ipv6", "pcp_ipv4", and "pcp_ipv6".
+void
+gm_web_socket_publish(const char * name, const char * pattern, ...)
+{
+  char			value[sizeof(((published_value_t *)0)->value)];
+  va_list		args;
+  publication_t *	p;
+  int			i;
+
+  va_start(args, pattern);
+  vsnprintf(value, sizeof(value), pattern, args);
+  va_end(args);
+
+  pthread_mutex_lock(&lock);
+  for ( i = 0; i < NUMBER_OF_VALUES && values[i].name[0]; i++ ) {
+    if ( strcmp(values[i].name, name) == 0 )
+      break;
+  }
+  if ( i >= NUMBER_OF_VALUES ) {
+    pthread_mutex_unlock(&lock);
+    GM_WARN_ONCE("gm_web_socket_publish(): No room for %s.\n", name);
+    return;
+  }
+  if ( values[i].name[0] && strcmp(values[i].value, value) == 0 ) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  strncpy(values[i].name, name, sizeof(values[i].name) - 1);
+  strncpy(values[i].value, value, sizeof(values[i].value) - 1);
+  pthread_mutex_unlock(&lock);
+
+  if ( (p = malloc(sizeof(*p) + (sizeof(published_value_t) * 2) + 8)) == 0 )
+    return;
+
+  char * out = p->data;
+  *out++ = '{';
+  *out++ = '"';
+  out += json_string(out, sizeof(values[i].name) * 2, name);
+  *out++ = '"';
+  *out++ = ':';
+  *out++ = '"';
+  out += json_string(out, sizeof(values[i].value) * 2, value);
+  *out++ = '"';
+  *out++ = '}';
+  *out = '\0';
+  p->size = out - p->data;
+  p->fd = -1;
+  queue(p);
+}
+
+void
+gm_web_socket_install(httpd_handle_t s)
+{
+  static const httpd_uri_t web_socket = {
+      .uri		= "/ws",
+      .method		= HTTP_GET,
+      .handler		= web_socket_handler,
+      .user_ctx		= NULL,
+      .is_websocket	= true
+  };
+  httpd_register_uri_handler(s, &web_socket);
+
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_SERVERS; i++ ) {
+    if ( servers[i] == NULL ) {
+      servers[i] = s;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void
+gm_web_socket_uninstall(void)
+{
+  pthread_mutex_lock(&lock);
+  for ( int i = 0; i < NUMBER_OF_SERVERS; i++ )
+    servers[i] = NULL;
+  pthread_mutex_unlock(&lock);
+}
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <esp_memory_utils.h>
 #include "generic_main.h"
 
 typedef struct tag {
@@ -15,27 +16,27 @@ typedef struct tag {
 static const char	document[] = "document";
 
 static tag_t		root = { };
-static tag_t *		current = &root;
 
 static void		emit(const char * pattern, ...);
 static void		fail(const char * pattern, ...);
 static void		finish_current_tag();
-static void		flush();
 void			html_text(const char * pattern, ...);
 
-static char	buffer[2048];
-static int	buf_index = 0;
-
+// Output goes to the web response writer, which sends it when a TCP send-buffer's
+// worth has accumulated. A pattern without any conversions doesn't need formatting,
+// and if it's a string constant in FLASH it's sent from where it is, without copying.
 static void
 emit_va(const char * pattern, va_list argument_pointer)
 {
-  size_t size = vsnprintf(&buffer[buf_index], sizeof(buffer) - buf_index, pattern, argument_pointer);
-  buf_index += size;
-  if ( buf_index >= sizeof(buffer) )
+  if ( strchr(pattern, '%') == 0 ) {
+    if ( esp_ptr_in_drom(pattern) )
+      gm_web_send_constant(pattern, strlen(pattern));
+    else
+      gm_web_send_to_client(pattern, strlen(pattern));
+    return;
+  }
+  if ( gm_web_vprintf(pattern, argument_pointer) != 0 )
     fail("output (probably text) too large for buffer.\n");
-
-  if ( buf_index > sizeof(buffer) / 2 )
-    flush();
 }
 
 static void
@@ -56,30 +57,38 @@ fail(const char * pattern, ...)
   va_end(argument_pointer);
 }
 
+// The tag being generated. Each task that generates web pages has its own, in its
+// web context, because asynchronous handlers run concurrently in worker tasks.
+static tag_t * *
+current_tag(void)
+{
+  gm_web_context_t * const context = gm_web_context();
+
+  if ( context->template_current == 0 )
+    context->template_current = &root;
+
+  return (tag_t * *)&context->template_current;
+}
+
 static void
 finish_current_tag()
 {
-  if ( current->open ) {
-    if ( current->nesting ) {
+  tag_t * * const current = current_tag();
+
+  if ( (*current)->open ) {
+    if ( (*current)->nesting ) {
       emit(">");
-      current->open = false;
+      (*current)->open = false;
     }
     else {
       emit(">"); // There is no "/>" in HTML 5.
-      tag_t * parent = current->parent;
-      free(current);
-      current = parent;
+      tag_t * parent = (*current)->parent;
+      free(*current);
+      *current = parent;
     }
   }
 }
 
-static void
-flush()
-{
-  gm_web_send_to_client(buffer, buf_index);
-  buf_index = 0;
-}
-
 static void *
 mem(size_t size)
 {
@@ -93,11 +102,13 @@ mem(size_t size)
 static void
 splice(tag_t * h)
 {
+  tag_t * * const current = current_tag();
+
   if ( root.name == 0 ) {
     root.name = document;
   }
-  h->parent = current;
-  current = h;
+  h->parent = *current;
+  *current = h;
 }
 
 void
@@ -118,7 +129,7 @@ html_attr(const char * name, const char * pattern, ...)
 {
   va_list argument_pointer;
 
-  if ( !current->open ) {
+  if ( !(*current_tag())->open ) {
     fail("attr() must be under the tag it applies to, before anything but another param().\n");
   }
   emit(" %s=\"", name);
@@ -141,16 +152,15 @@ html_end()
 {
   finish_current_tag(); // This changes current;
 
-  tag_t * const h = current;
+  tag_t * * const current = current_tag();
+  tag_t * const h = *current;
   if ( h->nesting ) {
     emit("</%s>", h->name); 
     tag_t * const parent = h->parent;
-    free(current);
-    current = parent;
-    if ( current == &root ) {
-      flush();
+    free(h);
+    *current = parent;
+    if ( *current == &root )
       gm_web_finish();
-    }
   }
   else {
     fail("end() called too many times (check for non-nesting tags).\n");
@@ -0,0 +1,368 @@
+// Web response writer.
+//
+// Collect the pieces of an HTTP response as an I/O vector, and send them to the
+// socket with one writev() when about a TCP send-buffer's worth has accumulated.
+// Constant fragments, like the files in the compressed filesystem, are pointed to
+// where they are in FLASH rather than being copied. Formatted pieces are written
+// into a scratch buffer, and adjacent ones are coalesced into a single I/O vector
+// entry.
+//
+// The writer sends its own status line and headers, so headers set with
+// httpd_resp_set_hdr() aren't used for a response sent with the writer. If the
+// length of the response is known in advance, it's sent with a Content-Length
+// header and no chunk framing. Otherwise, each flush is a single chunk of the
+// chunked transfer encoding, and the terminating chunk goes out with the last flush.
+//
+// There's no writev() for a TLS session. Its vectors are gathered into segment-sized
+// pieces, each of which becomes one TLS record, and sent through the HTTP server.
+//
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_http_server.h>
+#include <lwip/sockets.h>
+#include "generic_main.h"
+
+// Fragments smaller than this are copied into the scratch buffer rather than getting
+// their own I/O vector entry. It's cheaper for lwIP to copy a few bytes than to
+// walk another vector.
+static const size_t	smallest_constant = 64;
+
+// Flush when this much data is waiting. Sending more than the TCP send buffer at
+// once only blocks the sender until the window opens.
+static const size_t	flush_size = CONFIG_LWIP_TCP_SND_BUF_DEFAULT;
+
+static const char	chunk_end[] = "\r\n";
+static const char	last_chunk[] = "0\r\n\r\n";
+static const char	chunk_end_and_last_chunk[] = "\r\n0\r\n\r\n";
+
+gm_web_writer_statistics_t	gm_web_writer_statistics = {};
+
+// Gather buffer for TLS sessions, about one TCP segment.
+#define SECURE_GATHER_SIZE	1436
+
+static int
+send_secure(gm_web_writer_t * w, const char * data, size_t size)
+{
+  while ( size > 0 ) {
+    const int result = httpd_send(w->request, data, size);
+
+    if ( result <= 0 )
+      return -1;
+    gm_web_writer_statistics.sends++;
+    gm_web_writer_statistics.bytes += result;
+    data += result;
+    size -= result;
+  }
+  return 0;
+}
+
+static int
+send_vectors_secure(gm_web_writer_t * w, struct iovec * v, int count)
+{
+  char		gather[SECURE_GATHER_SIZE];
+  size_t	used = 0;
+
+  for ( ; count > 0; v++, count-- ) {
+    if ( v->iov_len > sizeof(gather) ) {
+      // Large fragments are sent from where they are.
+      if ( used > 0 && send_secure(w, gather, used) != 0 )
+        return -1;
+      used = 0;
+      if ( send_secure(w, v->iov_base, v->iov_len) != 0 )
+        return -1;
+      continue;
+    }
+    if ( used + v->iov_len > sizeof(gather) ) {
+      if ( send_secure(w, gather, used) != 0 )
+        return -1;
+      used = 0;
+    }
+    memcpy(&gather[used], v->iov_base, v->iov_len);
+    used += v->iov_len;
+  }
+  if ( used > 0 )
+    return send_secure(w, gather, used);
+  return 0;
+}
+
+static int
+send_vectors(gm_web_writer_t * w, struct iovec * v, int count)
+{
+  if ( w->secure )
+    return send_vectors_secure(w, v, count);
+
+  while ( count > 0 ) {
+    ssize_t result = lwip_writev(w->fd, v, count);
+
+    if ( result < 0 ) {
+      if ( errno == EINTR )
+        continue;
+      return -1;
+    }
+    gm_web_writer_statistics.sends++;
+    gm_web_writer_statistics.bytes += result;
+
+    // Advance past whatever was sent, in case the write was partial.
+    while ( count > 0 && result >= v->iov_len ) {
+      result -= v->iov_len;
+      v++;
+      count--;
+    }
+    if ( count > 0 ) {
+      v->iov_base = (char *)v->iov_base + result;
+      v->iov_len -= result;
+    }
+  }
+  return 0;
+}
+
+static int
+flush(gm_web_writer_t * w, bool last)
+{
+  size_t	count = w->count;
+  int		prefix_length = 0;
+
+  if ( w->failed )
+    return -1;
+
+  if ( w->pending == 0 && !last )
+    return 0;
+
+  if ( !w->headers_sent ) {
+    prefix_length = snprintf(
+     w->prefix,
+     sizeof(w->prefix),
+     "HTTP/1.1 %s\r\nContent-Type: %s\r\n",
+     w->status,
+     w->content_type);
+
+    if ( w->content_encoding )
+      prefix_length += snprintf(
+       &w->prefix[prefix_length],
+       sizeof(w->prefix) - prefix_length,
+       "Content-Encoding: %s\r\n",
+       w->content_encoding);
+
+    if ( w->chunked )
+      prefix_length += snprintf(
+       &w->prefix[prefix_length],
+       sizeof(w->prefix) - prefix_length,
+       "Transfer-Encoding: chunked\r\n\r\n");
+    else
+      prefix_length += snprintf(
+       &w->prefix[prefix_length],
+       sizeof(w->prefix) - prefix_length,
+       "Content-Length: %u\r\n\r\n",
+       (unsigned int)w->length);
+
+    w->headers_sent = true;
+    gm_web_writer_statistics.responses++;
+  }
+
+  if ( w->chunked ) {
+    // The chunk trailer goes in the vector that was reserved for it.
+    if ( w->pending > 0 ) {
+      prefix_length += snprintf(
+       &w->prefix[prefix_length],
+       sizeof(w->prefix) - prefix_length,
+       "%x\r\n",
+       (unsigned int)w->pending);
+
+      if ( last ) {
+        w->iov[count].iov_base = (void *)chunk_end_and_last_chunk;
+        w->iov[count++].iov_len = sizeof(chunk_end_and_last_chunk) - 1;
+      }
+      else {
+        w->iov[count].iov_base = (void *)chunk_end;
+        w->iov[count++].iov_len = sizeof(chunk_end) - 1;
+      }
+    }
+    else if ( last ) {
+      w->iov[count].iov_base = (void *)last_chunk;
+      w->iov[count++].iov_len = sizeof(last_chunk) - 1;
+    }
+  }
+
+  if ( prefix_length >= sizeof(w->prefix) ) {
+    GM_FAIL("Response header too large.\n");
+    w->failed = true;
+    return -1;
+  }
+
+  // The first vector is reserved for the prefix. Skip it if the prefix is empty.
+  struct iovec * v = w->iov;
+  v->iov_base = w->prefix;
+  v->iov_len = prefix_length;
+  if ( prefix_length == 0 ) {
+    v++;
+    count--;
+  }
+
+  int result = send_vectors(w, v, count);
+
+  w->count = 1;
+  w->pending = 0;
+  w->scratch_used = 0;
+
+  if ( result != 0 )
+    w->failed = true;
+
+  return result;
+}
+
+// True if there's no vector left for another fragment. One is kept for the chunk
+// trailer.
+static inline bool
+full(gm_web_writer_t * w)
+{
+  return w->count >= COUNTOF(w->iov) - 1;
+}
+
+static int
+append(gm_web_writer_t * w, const void * data, size_t size)
+{
+  w->iov[w->count].iov_base = (void *)data;
+  w->iov[w->count].iov_len = size;
+  w->count++;
+  w->pending += size;
+
+  if ( w->pending >= flush_size )
+    return flush(w, false);
+
+  return 0;
+}
+
+// Account for data that was placed in the scratch buffer, coalescing it with the
+// last vector if that was also in the scratch buffer. The caller has made sure that
+// there's a free vector.
+static int
+commit(gm_web_writer_t * w, size_t size)
+{
+  char * const		start = &w->scratch[w->scratch_used];
+  struct iovec * const	last = &w->iov[w->count - 1];
+
+  w->scratch_used += size;
+
+  if ( w->count > 1 && (char *)last->iov_base + last->iov_len == start ) {
+    last->iov_len += size;
+    w->pending += size;
+    if ( w->pending >= flush_size )
+      return flush(w, false);
+    return 0;
+  }
+  return append(w, start, size);
+}
+
+void
+gm_web_writer_begin(gm_web_writer_t * w, httpd_req_t * req, const char * content_type, const char * content_encoding, ssize_t length)
+{
+  memset(w, '\0', offsetof(gm_web_writer_t, iov));
+  w->request = req;
+  w->fd = httpd_req_to_sockfd(req);
+  // Only TLS sessions have a transport context.
+  w->secure = httpd_sess_get_transport_ctx(req->handle, w->fd) != NULL;
+  w->status = "200 OK";
+  w->content_type = content_type ? content_type : "text/html";
+  w->content_encoding = content_encoding;
+  w->chunked = length < 0;
+  w->length = length < 0 ? 0 : length;
+  w->count = 1;
+}
+
+// Add data that will remain valid until the writer is flushed, without copying it.
+// This is meant for data in FLASH. The caller is responsible for calling
+// gm_web_writer_flush() before transient data goes away.
+int
+gm_web_writer_constant(gm_web_writer_t * w, const void * data, size_t size)
+{
+  if ( size == 0 )
+    return 0;
+
+  if ( size < smallest_constant )
+    return gm_web_writer_copy(w, data, size);
+
+  if ( full(w) && flush(w, false) != 0 )
+    return -1;
+
+  return append(w, data, size);
+}
+
+int
+gm_web_writer_copy(gm_web_writer_t * w, const void * data, size_t size)
+{
+  while ( size > 0 ) {
+    size_t	length = size;
+
+    if ( length > sizeof(w->scratch) )
+      length = sizeof(w->scratch);
+
+    if ( length > sizeof(w->scratch) - w->scratch_used || full(w) ) {
+      if ( flush(w, false) != 0 )
+        return -1;
+    }
+
+    memcpy(&w->scratch[w->scratch_used], data, length);
+    if ( commit(w, length) != 0 )
+      return -1;
+
+    data = (const char *)data + length;
+    size -= length;
+  }
+  return 0;
+}
+
+int
+gm_web_writer_vprintf(gm_web_writer_t * w, const char * pattern, va_list args)
+{
+  size_t	available;
+  int		length;
+  va_list	copy;
+
+  if ( full(w) && flush(w, false) != 0 )
+    return -1;
+
+  available = sizeof(w->scratch) - w->scratch_used;
+  va_copy(copy, args);
+  length = vsnprintf(&w->scratch[w->scratch_used], available, pattern, copy);
+  va_end(copy);
+
+  if ( length < 0 )
+    return -1;
+
+  if ( length >= available ) {
+    if ( length >= sizeof(w->scratch) ) {
+      GM_FAIL("Output (probably text) too large for the web writer's buffer.\n");
+      return -1;
+    }
+    if ( flush(w, false) != 0 )
+      return -1;
+    vsnprintf(w->scratch, sizeof(w->scratch), pattern, args);
+  }
+  return commit(w, length);
+}
+
+int
+gm_web_writer_printf(gm_web_writer_t * w, const char * pattern, ...)
+{
+  int		result;
+  va_list	args;
+
+  va_start(args, pattern);
+  result = gm_web_writer_vprintf(w, pattern, args);
+  va_end(args);
+  return result;
+}
+
+int
+gm_web_writer_flush(gm_web_writer_t * w)
+{
+  return flush(w, false);
+}
+
+int
+gm_web_writer_finish(gm_web_writer_t * w)
+{
+  return flush(w, true);
+}
@@ -2,18 +2,36 @@
 //
 // Operate an HTTP and HTTPS web server. Maintain the SSL server certificates.
 //
+// The HTTPS server uses an ECDSA P-256 key, which the device generates the first
+// time it runs, along with a self-signed certificate. The certificate is kept in
+// NVS, and the key in the sealed record of secret parameters. An ECDSA handshake
+// is several times cheaper for the ESP32 than an RSA one. Clients that come back
+// resume their TLS session with a session ticket and skip the public-key
+// operations altogether, and connections are kept alive between requests.
+//
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <esp_http_server.h>
+#include <esp_https_server.h>
 #include <esp_log.h>
+#include <esp_random.h>
 #include <esp_sntp.h>
 #include <esp_timer.h>
 #include <inttypes.h>
+#include <mbedtls/pk.h>
+#include <mbedtls/ecp.h>
+#include <mbedtls/x509_crt.h>
 #include "generic_main.h"
 
-// extern const uint8_t servercert_pem[] asm("_binary_servercert_pem_start");
 static const char TASK_NAME[] = "web_server";
 static httpd_handle_t server = NULL;
+static httpd_handle_t secure_server = NULL;
+static char * certificate = NULL;
+static char * private_key = NULL;
+
+#define CERTIFICATE_SIZE	1024
+#define PRIVATE_KEY_SIZE	512
 
 static void time_was_synchronized(struct timeval * t)
 {
@@ -27,6 +45,147 @@ static void time_was_synchronized(struct timeval * t)
   GM.time_last_synchronized = esp_timer_get_time();
 }
 
+// Sessions of the plain server are closed here, so that the log stream can keep
+// the socket of one of its clients open until the select task has let go of it.
+static void
+close_session(httpd_handle_t hd, int fd)
+{
+  if ( !gm_log_stream_session_closing(fd) )
+    close(fd);
+}
+
+static int
+random_bytes(void * context, unsigned char * buffer, size_t size)
+{
+  esp_fill_random(buffer, size);
+  return 0;
+}
+
+// Generate an ECDSA P-256 key and a self-signed certificate for it, in PEM form.
+static int
+generate_certificate(char * cert, size_t cert_size, char * key, size_t key_size)
+{
+  mbedtls_pk_context	pk;
+  mbedtls_x509write_cert crt;
+  unsigned char		serial[16];
+  char			subject[sizeof(GM.unique_name) + 4];
+  int			result;
+
+  mbedtls_pk_init(&pk);
+  mbedtls_x509write_crt_init(&crt);
+
+  esp_fill_random(serial, sizeof(serial));
+  serial[0] &= 0x7f; // Serial numbers are positive.
+  snprintf(subject, sizeof(subject), "CN=%s", GM.unique_name);
+
+  if ( (result = mbedtls_pk_setup(&pk, mbedtls_pk_info_from_type(MBEDTLS_PK_ECKEY))) == 0
+   &&  (result = mbedtls_ecp_gen_key(MBEDTLS_ECP_DP_SECP256R1, mbedtls_pk_ec(pk), random_bytes, NULL)) == 0 ) {
+    mbedtls_x509write_crt_set_version(&crt, MBEDTLS_X509_CRT_VERSION_3);
+    mbedtls_x509write_crt_set_md_alg(&crt, MBEDTLS_MD_SHA256);
+    mbedtls_x509write_crt_set_subject_key(&crt, &pk);
+    mbedtls_x509write_crt_set_issuer_key(&crt, &pk);
+
+    // The certificate is its own authority, so that a client can trust it directly.
+    if ( (result = mbedtls_x509write_crt_set_subject_name(&crt, subject)) == 0
+     &&  (result = mbedtls_x509write_crt_set_issuer_name(&crt, subject)) == 0
+     &&  (result = mbedtls_x509write_crt_set_serial_raw(&crt, serial, sizeof(serial))) == 0
+     &&  (result = mbedtls_x509write_crt_set_validity(&crt, "20240101000000", "20491231235959")) == 0
+     &&  (result = mbedtls_x509write_crt_set_basic_constraints(&crt, 1, 0)) == 0
+     &&  (result = mbedtls_x509write_crt_pem(&crt, (unsigned char *)cert, cert_size, random_bytes, NULL)) == 0 )
+      result = mbedtls_pk_write_key_pem(&pk, (unsigned char *)key, key_size);
+  }
+
+  mbedtls_x509write_crt_free(&crt);
+  mbedtls_pk_free(&pk);
+  return result;
+}
+
+// Get the server certificate and its private key, generating them the first time.
+// They remain valid until the device restarts.
+int
+gm_tls_server_certificate(const char * * cert, const char * * key)
+{
+  size_t	cert_size = CERTIFICATE_SIZE;
+  size_t	key_size = PRIVATE_KEY_SIZE;
+
+  if ( certificate == NULL ) {
+    char * c = malloc(cert_size);
+    char * k = malloc(key_size);
+
+    if ( c == NULL || k == NULL ) {
+      free(c);
+      free(k);
+      return -1;
+    }
+
+    // The private key is a secret parameter, kept in the sealed record with the
+    // passwords. The certificate is public.
+    if ( nvs_get_str(GM.nvs, "tls_certificate", c, &cert_size) != ESP_OK
+     ||  gm_nonvolatile_get("tls_private_key", k, key_size) != GM_SECRET ) {
+      int	result;
+
+      gm_printf("Generating the ECDSA key and certificate for HTTPS.\n");
+      if ( (result = generate_certificate(c, CERTIFICATE_SIZE, k, PRIVATE_KEY_SIZE)) != 0 ) {
+        GM_FAIL("Certificate generation failed: -0x%x\n", -result);
+        free(c);
+        free(k);
+        return -1;
+      }
+      if ( nvs_set_str(GM.nvs, "tls_certificate", c) != ESP_OK
+       ||  nvs_commit(GM.nvs) != ESP_OK
+       ||  gm_nonvolatile_store("tls_private_key", k) != GM_NORMAL )
+        GM_FAIL("Couldn't save the HTTPS certificate. A new one will be made next time.\n");
+    }
+    certificate = c;
+    private_key = k;
+  }
+  *cert = certificate;
+  *key = private_key;
+  return 0;
+}
+
+static void
+start_secure_webserver(void)
+{
+  const char *		cert;
+  const char *		key;
+  httpd_ssl_config_t	config = HTTPD_SSL_CONFIG_DEFAULT();
+
+  if ( gm_tls_server_certificate(&cert, &key) != 0 )
+    return;
+
+  config.servercert = (const uint8_t *)cert;
+  config.servercert_len = strlen(cert) + 1;
+  config.prvtkey_pem = (const uint8_t *)key;
+  config.prvtkey_len = strlen(key) + 1;
+  config.transport_mode = HTTPD_SSL_TRANSPORT_SECURE;
+  config.port_secure = GM_HTTPS_PORT;
+  config.session_tickets = true;
+
+  // Each TLS session holds about 20K of buffers, so there are fewer of them than
+  // there are plain HTTP sessions. The least-recently-used one is closed to make
+  // room for a new client, which is cheap when that client resumes with a ticket.
+  config.httpd.max_open_sockets = 3;
+  config.httpd.lru_purge_enable = true;
+  config.httpd.ctrl_port = ESP_HTTPD_DEF_CTRL_PORT + 1;
+  config.httpd.uri_match_fn = httpd_uri_match_wildcard;
+  // Probe idle connections, so that the sessions of clients that went away
+  // without closing them are freed.
+  config.httpd.keep_alive_enable = true;
+  config.httpd.keep_alive_idle = 60;
+  config.httpd.keep_alive_interval = 10;
+  config.httpd.keep_alive_count = 3;
+
+  ESP_LOGI(TASK_NAME, "Starting secure server on port: '%d'", config.port_secure);
+  if (httpd_ssl_start(&secure_server, &config) == ESP_OK) {
+    gm_web_handler_install(secure_server, true);
+  }
+  else {
+    secure_server = NULL;
+    ESP_LOGI(TASK_NAME, "Error starting secure server!");
+  }
+}
+
 void start_webserver(void)
 {
   if (server)
@@ -48,24 +207,36 @@ void start_webserver(void)
   config.stack_size = 8192;
   config.uri_match_fn = httpd_uri_match_wildcard;
   config.lru_purge_enable = true;
+  // Leave sockets for the HTTPS server.
+  config.max_open_sockets = 5;
+  config.close_fn = close_session;
 
   // Start the httpd server
   ESP_LOGI(TASK_NAME, "Starting server on port: '%d'", config.server_port);
   if (httpd_start(&server, &config) == ESP_OK) {
-    gm_web_handler_install(server);
+    gm_web_handler_install(server, false);
   }
   else {
     server = NULL;
     ESP_LOGI(TASK_NAME, "Error starting server!");
   }
+
+  start_secure_webserver();
 }
 
 void stop_webserver()
 {
+  gm_web_handler_drain();
   if (server) {
     esp_sntp_stop();
     GM.time_last_synchronized = 0;
+    gm_web_socket_uninstall();
     httpd_stop(server);
     server = NULL;
   }
+  if (secure_server) {
+    httpd_ssl_stop(secure_server);
+    secure_server = NULL;
+  }
+  gm_web_handler_uninstall();
 }
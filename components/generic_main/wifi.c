@@ -30,6 +30,7 @@
 #include <arpa/inet.h>
 #include <lwip/sockets.h>
 #include <pthread.h>
+#include <esp_timer.h>
 #include "generic_main.h"
 
 enum EventBits {
@@ -47,6 +48,8 @@ static esp_event_handler_instance_t handler_ip_event_sta_got_ip4 = NULL;
 static esp_event_handler_instance_t handler_ip_event_got_ip6 = NULL;
 static esp_event_handler_instance_t handler_sc_event_got_ssid_pswd = NULL;
 static esp_event_handler_instance_t handler_sc_event_send_ack_done = NULL;
+static bool ipv6_started = false;
+static bool directed = false;	// Associating with the last access point, without a scan.
 
 extern void start_webserver(void);
 extern void stop_webserver();
@@ -86,6 +89,19 @@ gm_wifi_is_connected(void)
   return !!uxBits & CONNECTED_BIT;
 }
 
+// Runs in the slow event loop. Dynamic DNS is only told of an address that it
+// doesn't already have.
+static void
+update_dynamic_dns(void * data)
+{
+  if ( !gm_warm_boot_ddns_current() ) {
+    const int64_t start = esp_timer_get_time();
+
+    gm_ddns();
+    gm_boot_trace_phase("dynamic DNS", start);
+  }
+}
+
 static void after_stun(bool success, bool ipv6, struct sockaddr * address)
 {
   char	buffer[INET6_ADDRSTRLEN + 1];
@@ -97,13 +113,43 @@ static void after_stun(bool success, bool ipv6, struct sockaddr * address)
     else
       inet_ntop(AF_INET, &((struct sockaddr_in *)address)->sin_addr, buffer, sizeof(buffer));
    
+    gm_web_socket_publish(ipv6 ? "public_ipv6" : "public_ipv4", "%s", buffer);
+    gm_boot_trace_event("network", ipv6 ? "public IPv6 address" : "public IPv4 address");
     ; // gm_printf("Public address %s.\n", buffer);
+    // Keep the NAT binding open, and find out if the public address changes.
+    gm_stun_keepalive(ipv6, address);
+    // The address may have changed while the device was down.
+    gm_warm_boot_changed();
+    gm_run(update_dynamic_dns, 0, GM_SLOW);
   }
   else {
     ; // gm_printf("STUN for %s failed.\n", ipv6 ? "IPv6" : "IPv4");
   }
 }
 
+
+// The STUN keepalive found that the public address changed.
+static void
+public_address_changed(void * arg, esp_event_base_t event_base, int32_t event_id, void * event_data)
+{
+  const gm_public_address_event_t * const	event = (const gm_public_address_event_t *)event_data;
+  char						buffer[INET6_ADDRSTRLEN + 1];
+
+  if ( event->ipv6 ) {
+    memcpy(&GM.sta.ip6.pub, &event->address, sizeof(GM.sta.ip6.pub));
+    inet_ntop(AF_INET6, &GM.sta.ip6.pub.sin6_addr, buffer, sizeof(buffer));
+    gm_port_control_protocol_request_mapping_ipv6();
+  }
+  else {
+    memcpy(&GM.sta.ip4.pub, &event->address, sizeof(GM.sta.ip4.pub));
+    inet_ntop(AF_INET, &GM.sta.ip4.pub.sin_addr, buffer, sizeof(buffer));
+    gm_port_control_protocol_request_mapping_ipv4();
+  }
+  gm_web_socket_publish(event->ipv6 ? "public_ipv6" : "public_ipv4", "%s", buffer);
+  gm_warm_boot_changed();
+  gm_run(update_dynamic_dns, 0, GM_SLOW);
+}
+
 void
 gm_wifi_start(void)
 {
@@ -121,6 +167,7 @@ gm_wifi_start(void)
   // password.
   ESP_ERROR_CHECK( esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_START, &wifi_event_sta_start, NULL) );
   ESP_ERROR_CHECK( esp_event_handler_register(WIFI_EVENT, WIFI_EVENT_STA_DISCONNECTED, &wifi_event_sta_disconnected, NULL) );
+  ESP_ERROR_CHECK( esp_event_handler_register(GM_EVENT, GM_PUBLIC_ADDRESS_CHANGED, &public_address_changed, NULL) );
 
   ESP_ERROR_CHECK( esp_wifi_init(&cfg) );
   ESP_ERROR_CHECK( esp_wifi_set_mode(WIFI_MODE_STA) );
@@ -137,12 +184,10 @@ void wifi_event_sta_start(void* arg, esp_event_base_t event_base, int32_t event_
 {
   char ssid[33] = { 0 };
   char password[65] = { 0 };
-  size_t ssid_size = sizeof(ssid);
-  size_t password_size = sizeof(password);
   // wifi_scan_config_t config = {};
 
-  esp_err_t ssid_err = nvs_get_str(GM.nvs, "ssid", ssid, &ssid_size);
-  esp_err_t password_err = nvs_get_str(GM.nvs, "wifi_password", password, &password_size);
+  gm_nonvolatile_result_t ssid_result = gm_nonvolatile_get("ssid", ssid, sizeof(ssid));
+  gm_nonvolatile_result_t password_result = gm_nonvolatile_get("wifi_password", password, sizeof(password));
 
   // config.scan_type = WIFI_SCAN_TYPE_PASSIVE;
   // config.scan_type = WIFI_ALL_CHANNEL_SCAN;
@@ -151,8 +196,7 @@ void wifi_event_sta_start(void* arg, esp_event_base_t event_base, int32_t event_
   // config.scan_time.passive = 120;
   // esp_wifi_scan_start(&config, 0);
 
-  // ssid_size includes the terminating null.
-  if (ssid_err == ESP_OK && password_err == ESP_OK && ssid_size > 1)
+  if (ssid_result != GM_NOT_SET && password_result != GM_NOT_SET && ssid[0] != '\0')
     wifi_connect_to_ap(ssid, password);
   else {
     xTaskCreate(smart_config_task, TASK_NAME, 4096, NULL, 3, &smart_config_task_id);
@@ -164,6 +208,21 @@ void wifi_event_sta_start(void* arg, esp_event_base_t event_base, int32_t event_
 void wifi_event_sta_disconnected(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
 {
   EventBits_t uxBits;
+  wifi_config_t cfg;
+
+  // The last access point wasn't there, or wouldn't have us. Scan for the SSID.
+  if ( directed ) {
+    directed = false;
+    gm_boot_trace_event("network", "directed association failed");
+    if ( esp_wifi_get_config(WIFI_IF_STA, &cfg) == ESP_OK ) {
+      cfg.sta.bssid_set = false;
+      cfg.sta.channel = 0;
+      cfg.sta.scan_method = WIFI_ALL_CHANNEL_SCAN;
+      ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_set_config(WIFI_IF_STA, &cfg));
+      ESP_ERROR_CHECK_WITHOUT_ABORT(esp_wifi_connect());
+    }
+    return;
+  }
 
   uxBits = xEventGroupGetBits(wifi_events);
   if ( uxBits & CONNECTED_BIT ) {
@@ -174,11 +233,58 @@ void wifi_event_sta_disconnected(void* arg, esp_event_base_t event_base, int32_t
   }
 }
 
+// PCP for IPv6 needs the router's address, and the link-local address to give it
+// as the client's, so it and STUN wait for both the router advertisement and the
+// link-local address, whichever comes last. This runs in the select task.
+static void
+start_ipv6(void * data)
+{
+  if ( ipv6_started
+   || gm_all_zeroes(GM.sta.ip6.router.sin6_addr.s6_addr, sizeof(GM.sta.ip6.router.sin6_addr.s6_addr))
+   || gm_all_zeroes(GM.sta.ip6.link_local.sin6_addr.s6_addr, sizeof(GM.sta.ip6.link_local.sin6_addr.s6_addr)) )
+    return;
+
+  ipv6_started = true;
+  gm_port_control_protocol_start_listener_ipv6();
+  gm_port_control_protocol_request_mapping_ipv6();
+  gm_stun(true, (struct sockaddr *)&GM.sta.ip6.pub, after_stun);
+}
+
+// Merge the prefixes of an advertisement with those already known. A valid
+// lifetime of zero removes a prefix.
+static void
+merge_prefixes(gm_ipv6_prefix_t * known, const gm_ipv6_prefix_t * advertised, size_t count)
+{
+  for ( size_t i = 0; i < count && advertised[i].length > 0; i++ ) {
+    const gm_ipv6_prefix_t *	a = &advertised[i];
+    gm_ipv6_prefix_t *		slot = NULL;
+
+    for ( size_t j = 0; j < count; j++ ) {
+      if ( known[j].length == a->length && memcmp(&known[j].prefix, &a->prefix, sizeof(a->prefix)) == 0 ) {
+        slot = &known[j];
+        break;
+      }
+      if ( slot == NULL && known[j].length == 0 )
+        slot = &known[j];
+    }
+    if ( slot == NULL )
+      continue;
+    if ( a->valid_lifetime == 0 )
+      memset(slot, '\0', sizeof(*slot));
+    else
+      *slot = *a;
+  }
+}
+
+// This is called in the select task, when icmpv6.c gets a router advertisement.
 static void
-ipv6_router_advertisement_handler(struct sockaddr_in6 * address, uint16_t router_lifetime)
+ipv6_router_advertisement_handler(const struct sockaddr_in6 * address, const gm_ipv6_router_advertisement_t * ra)
 {
-  if ( !gm_all_zeroes(GM.sta.ip6.router.sin6_addr.s6_addr, sizeof(GM.sta.ip6.router.sin6_addr.s6_addr))
-   && memcmp(GM.sta.ip6.router.sin6_addr.s6_addr, address->sin6_addr.s6_addr, sizeof(address->sin6_addr.s6_addr)) != 0 ) {
+  struct gm_netif_ip6 * const	ip6 = &GM.sta.ip6;
+  const bool			known = !gm_all_zeroes(ip6->router.sin6_addr.s6_addr, sizeof(ip6->router.sin6_addr.s6_addr));
+
+  if ( known
+   && memcmp(ip6->router.sin6_addr.s6_addr, address->sin6_addr.s6_addr, sizeof(address->sin6_addr.s6_addr)) != 0 ) {
     static bool first_time = true;
     if ( first_time ) {
       ; // gm_printf("Received a router advertisement from more than one IPv6 router. Ignoring all but the first.\n");
@@ -186,17 +292,56 @@ ipv6_router_advertisement_handler(struct sockaddr_in6 * address, uint16_t router
     }
     return;
   }
-  memcpy(GM.sta.ip6.router.sin6_addr.s6_addr, address->sin6_addr.s6_addr, sizeof(address->sin6_addr.s6_addr));
-  GM.sta.ip6.router.sin6_family = AF_INET6;
-  GM.sta.ip6.router.sin6_port = 0;
+  // A router that isn't a default router isn't used.
+  if ( !known && ra->router_lifetime == 0 )
+    return;
+
+  memcpy(ip6->router.sin6_addr.s6_addr, address->sin6_addr.s6_addr, sizeof(address->sin6_addr.s6_addr));
+  ip6->router.sin6_family = AF_INET6;
+  ip6->router.sin6_port = 0;
+  ip6->router.sin6_scope_id = address->sin6_scope_id;
+
+  ip6->ra.router_lifetime = ra->router_lifetime;
+  ip6->ra.managed = ra->managed;
+  ip6->ra.other = ra->other;
+  if ( ra->mtu )
+    ip6->ra.mtu = ra->mtu;
+  merge_prefixes(ip6->ra.prefixes, ra->prefixes, sizeof(ra->prefixes) / sizeof(*ra->prefixes));
+  if ( !gm_all_zeroes(ra->dns, sizeof(ra->dns)) ) {
+    memcpy(ip6->ra.dns, ra->dns, sizeof(ip6->ra.dns));
+    ip6->ra.dns_lifetime = ra->dns_lifetime;
+  }
+
+  if ( !known ) {
+    char	buffer[INET6_ADDRSTRLEN + 1];
+
+    inet_ntop(AF_INET6, &address->sin6_addr, buffer, sizeof(buffer));
+    gm_boot_trace_event("network", "IPv6 router");
+    gm_printf("Got IPv6 router %s", buffer);
+    if ( ip6->ra.prefixes[0].length > 0 ) {
+      inet_ntop(AF_INET6, &ip6->ra.prefixes[0].prefix, buffer, sizeof(buffer));
+      gm_printf(", prefix %s/%d", buffer, ip6->ra.prefixes[0].length);
+    }
+    gm_printf("\n");
+  }
+  start_ipv6(NULL);
 }
 
 static void wifi_event_sta_connected_to_ap(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
-  
-  // Start the ICMPv6 listener as early as possible, so that we get the router
-  // advertisement that is solicited when the IPV6 interfaces are configured.
-  gm_icmpv6_start_listener_ipv6(ipv6_router_advertisement_handler);
+  gm_boot_trace_event("network", "WiFi associated");
+  directed = false;
+
+  // Start duplicate address detection of the link-local address first, as it takes
+  // longest, and DHCP is already running. Then forget the last network's router,
+  // and solicit this one's as early as possible.
   ESP_ERROR_CHECK_WITHOUT_ABORT(esp_netif_create_ip6_linklocal(GM.sta.esp_netif));
+  ipv6_started = false;
+  memset(&GM.sta.ip6.router, '\0', sizeof(GM.sta.ip6.router));
+  memset(&GM.sta.ip6.ra, '\0', sizeof(GM.sta.ip6.ra));
+  gm_icmpv6_start_listener_ipv6(ipv6_router_advertisement_handler);
+  // Put back the public addresses and port mappings, if this is the network they
+  // were learned on.
+  gm_warm_boot_connected();
   dhcp6_enable_stateful(GM.sta.esp_netif->lwip_netif);
   dhcp6_enable_stateless(GM.sta.esp_netif->lwip_netif);
 }
@@ -205,6 +350,9 @@ static void wifi_event_sta_connected_to_ap(void* arg, esp_event_base_t event_bas
 static void ip_event_sta_got_ip4(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
   ip_event_got_ip_t* event = (ip_event_got_ip_t*)event_data;
   char	buffer[INET6_ADDRSTRLEN + 1];
+  int64_t	start;
+
+  gm_boot_trace_event("network", "got IPv4");
 
   // Smartconfig waits on this bit, then prints a message.
   xEventGroupSetBits(wifi_events, CONNECTED_BIT);
@@ -226,7 +374,9 @@ static void ip_event_sta_got_ip4(void* arg, esp_event_base_t event_base, int32_t
   gm_stun(false, (struct sockaddr *)&GM.sta.ip4.pub, after_stun);
   gm_port_control_protocol_start_listener_ipv4();
   gm_port_control_protocol_request_mapping_ipv4();
+  start = esp_timer_get_time();
   start_webserver();
+  gm_boot_trace_phase("web server", start);
   gm_log_server_start();
 }
 
@@ -280,9 +430,7 @@ static void ip_event_got_ip6(void* arg, esp_event_base_t event_base, int32_t eve
     if (is_station) {
       // FIX: We may never get a link-local address on some systems.
       // Cope with it if we don't.
-      gm_port_control_protocol_start_listener_ipv6();
-      gm_port_control_protocol_request_mapping_ipv6();
-      gm_stun(true, (struct sockaddr *)&interface->ip6.pub, after_stun);
+      gm_run(start_ipv6, NULL, GM_FAST);
     }
     break;
   case ESP_IP6_ADDR_IS_SITE_LOCAL:
@@ -314,9 +462,9 @@ static void sc_event_got_ssid_pswd(void* arg, esp_event_base_t event_base,
     memcpy(wifi_config.sta.bssid, evt->bssid, sizeof(wifi_config.sta.bssid));
   }
 
-  ESP_ERROR_CHECK(nvs_set_str(GM.nvs, "ssid", (const char *)evt->ssid));
-  ESP_ERROR_CHECK(nvs_set_str(GM.nvs, "wifi_password", (const char *)evt->password));
-  ESP_ERROR_CHECK(nvs_commit(GM.nvs));
+  // Smart configuration connects by itself, so don't restart WiFi.
+  gm_nonvolatile_store("ssid", (const char *)evt->ssid);
+  gm_nonvolatile_store("wifi_password", (const char *)evt->password);
   ESP_ERROR_CHECK( esp_wifi_disconnect() );
   ESP_ERROR_CHECK( esp_wifi_set_config(WIFI_IF_STA, &wifi_config) );
   esp_wifi_connect();
@@ -404,29 +552,40 @@ static void wifi_connect_to_ap(const char * ssid, const char * password)
   else
     cfg.sta.threshold.authmode = WIFI_AUTH_WEP;
 
+  // Go straight to the access point that was last used, on its channel, rather
+  // than scanning every channel. If it isn't there, the disconnected event scans.
+  directed = gm_warm_boot_access_point(ssid, cfg.sta.bssid, &cfg.sta.channel);
+  cfg.sta.bssid_set = directed;
+  cfg.sta.scan_method = directed ? WIFI_FAST_SCAN : WIFI_ALL_CHANNEL_SCAN;
+
   ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
   ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &cfg));
 
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(
-   WIFI_EVENT,
-   WIFI_EVENT_STA_CONNECTED,
-   &wifi_event_sta_connected_to_ap,
-   NULL,
-   &handler_wifi_event_sta_connected_to_ap));
-
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(
-   IP_EVENT,
-   IP_EVENT_STA_GOT_IP,
-   &ip_event_sta_got_ip4,
-   NULL,
-   &handler_ip_event_sta_got_ip4));
-
-  ESP_ERROR_CHECK(esp_event_handler_instance_register(
-   IP_EVENT,
-   IP_EVENT_GOT_IP6,
-   &ip_event_got_ip6,
-   NULL,
-   &handler_ip_event_got_ip6));
+  // gm_wifi_restart() comes here again. Register each handler only once. Stopping
+  // smart configuration unregisters the IPv4 one.
+  if ( handler_wifi_event_sta_connected_to_ap == NULL )
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+     WIFI_EVENT,
+     WIFI_EVENT_STA_CONNECTED,
+     &wifi_event_sta_connected_to_ap,
+     NULL,
+     &handler_wifi_event_sta_connected_to_ap));
+
+  if ( handler_ip_event_sta_got_ip4 == NULL )
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+     IP_EVENT,
+     IP_EVENT_STA_GOT_IP,
+     &ip_event_sta_got_ip4,
+     NULL,
+     &handler_ip_event_sta_got_ip4));
+
+  if ( handler_ip_event_got_ip6 == NULL )
+    ESP_ERROR_CHECK(esp_event_handler_instance_register(
+     IP_EVENT,
+     IP_EVENT_GOT_IP6,
+     &ip_event_got_ip6,
+     NULL,
+     &handler_ip_event_got_ip6));
 
   ESP_ERROR_CHECK( esp_wifi_connect() );
 }
@@ -435,11 +594,9 @@ void gm_wifi_restart(void)
 {
   char ssid[33] = { 0 };
   char password[65] = { 0 };
-  size_t ssid_size = sizeof(ssid);
-  size_t password_size = sizeof(password);
 
-  esp_err_t ssid_err = nvs_get_str(GM.nvs, "ssid", ssid, &ssid_size);
-  esp_err_t password_err = nvs_get_str(GM.nvs, "wifi_password", password, &password_size);
+  gm_nonvolatile_result_t ssid_result = gm_nonvolatile_get("ssid", ssid, sizeof(ssid));
+  gm_nonvolatile_result_t password_result = gm_nonvolatile_get("wifi_password", password, sizeof(password));
 
   stop_smart_config_task(true);
   stop_webserver();
@@ -455,8 +612,7 @@ void gm_wifi_restart(void)
     gm_wifi_wait_until_disconnected();
   }
 
-  // ssid_size includes the terminating null.
-  if (ssid_err == ESP_OK && password_err == ESP_OK && ssid_size > 1 && password_size > 1) {
+  if (ssid_result != GM_NOT_SET && password_result != GM_NOT_SET && ssid[0] != '\0' && password[0] != '\0') {
     wifi_connect_to_ap(ssid, password);
   }
 }
@@ -0,0 +1,23 @@
+#include <esp_http_server.h>
+#include "generic_main.h"
+
+// The boot timeline as Chrome trace-event JSON. Save it and load it into
+// chrome://tracing or ui.perfetto.dev.
+static int
+boot_trace(httpd_req_t * req, const gm_uri * uri)
+{
+  gm_web_context()->writer.content_type = "application/json";
+  gm_boot_trace_json(gm_web_send_to_client);
+  gm_web_finish();
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "boot_trace",
+    .handler = boot_trace
+  };
+
+  gm_web_handler_register(&handler, GET);
+}
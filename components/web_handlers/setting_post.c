@@ -7,6 +7,8 @@ setting_post(httpd_req_t * req, const gm_uri * uri)
 {
   char		buffer[1024];
   gm_param_t	params[2] = {};
+  gm_param_t	setting;
+  size_t	failed;
   gm_nonvolatile_result_t result;
 
   int size = httpd_req_recv(req, buffer, sizeof(buffer) - 1);
@@ -24,7 +26,11 @@ setting_post(httpd_req_t * req, const gm_uri * uri)
 
   boilerplate("Setting %s", name)
 
-  result = gm_nonvolatile_set(name, value);
+  // As a batch of one, so that an after-set function that restarts the web server
+  // runs after this reply is finished.
+  setting.name = name;
+  setting.value = value;
+  result = gm_nonvolatile_set_batch(&setting, 1, &failed);
 
   switch ( result ) {
   case GM_NOT_SET:
@@ -34,6 +40,9 @@ setting_post(httpd_req_t * req, const gm_uri * uri)
   case GM_NOT_IN_PARAMETER_TABLE:
     text("%s is not in the non-volatile parameter table.", name);
     break;
+  case GM_INVALID:
+    text("That isn't a valid value for %s, not set.", name);
+    break;
   case GM_NORMAL:
     text("The value was set: %s=%s\n", name, value);
     break;
@@ -66,7 +75,9 @@ CONSTRUCTOR install(void)
 {
   static gm_web_handler_t handler = {
     .name = "setting",
-    .handler = setting_post
+    .handler = setting_post,
+    // Setting a parameter writes NVS, and may run its after-set function.
+    .asynchronous = true
   };
 
   gm_web_handler_register(&handler, POST);
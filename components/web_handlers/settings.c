@@ -61,7 +61,9 @@ CONSTRUCTOR install(void)
 {
   static gm_web_handler_t handler = {
     .name = "settings",
-    .handler = settings
+    .handler = settings,
+    // Listing the settings reads NVS.
+    .asynchronous = true
   };
 
   gm_web_handler_register(&handler, GET);
@@ -0,0 +1,236 @@
+// Set several parameters at once, from a form with a field for each, or from a
+// JSON object of names and values. They are set together with
+// gm_nonvolatile_set_batch(): either all of them or none, with one write to NVS,
+// and each after-set function runs once.
+//
+// A form gets a page in reply, and JSON gets {"result":"ok"} or an error. Names
+// that aren't parameters are an error either way, and nothing is set.
+//
+// Parameters that restart WiFi do it a moment after the reply.
+//
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <esp_http_server.h>
+#include "generic_main.h"
+#include "json_extract.h"
+#include "web_template.h"
+
+#define MAX_SETTINGS	16
+#define BODY_SIZE	2048
+#define VALUE_SIZE	256
+
+typedef struct _batch {
+  char		body[BODY_SIZE];
+  char		values[MAX_SETTINGS][VALUE_SIZE];
+  gm_param_t	params[MAX_SETTINGS];
+} batch_t;
+
+static int
+receive(httpd_req_t * req, char * buffer, size_t size)
+{
+  size_t	length = 0;
+
+  if ( req->content_len >= size )
+    return -1;
+
+  while ( length < req->content_len ) {
+    const int n = httpd_req_recv(req, &buffer[length], req->content_len - length);
+
+    if ( n == HTTPD_SOCK_ERR_TIMEOUT )
+      continue;
+    if ( n <= 0 )
+      return -1;
+    length += n;
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+// The object's members, which must all be parameters. Returns the number of them,
+// -1 if the JSON is malformed or a value is too long, or -2 if a member isn't a
+// parameter, or is there twice.
+static int
+from_json(batch_t * b, size_t length)
+{
+  gm_json_field_t	fields[MAX_SETTINGS] = {};
+  gm_json_extractor_t	x;
+  size_t		n;
+  int			count = 0;
+
+  for ( n = 0; n < MAX_SETTINGS && gm_nonvolatile_name(n) != NULL; n++ ) {
+    fields[n].path = gm_nonvolatile_name(n);
+    fields[n].value = b->values[n];
+    fields[n].size = VALUE_SIZE;
+  }
+
+  gm_json_extract_begin(&x, fields, n);
+  if ( gm_json_extract(&x, b->body, length) != 0 || gm_json_extract_end(&x) < 0 )
+    return -1;
+  if ( x.unmatched > 0 )
+    return -2;
+
+  for ( size_t i = 0; i < n; i++ ) {
+    if ( !fields[i].found )
+      continue;
+    // The extractor truncates what doesn't fit.
+    if ( strlen(fields[i].value) >= VALUE_SIZE - 1 )
+      return -1;
+    b->params[count].name = fields[i].path;
+    b->params[count].value = fields[i].value;
+    count++;
+  }
+  return count;
+}
+
+// Decode a name or value of a form in place. A form encodes a space as "+".
+static int
+form_decode(const char * s)
+{
+  char * const	t = (char *)s;
+  const size_t	size = strlen(t) + 1;
+
+  for ( char * c = t; *c; c++ ) {
+    if ( *c == '+' )
+      *c = ' ';
+  }
+  return gm_uri_decode(t, t, size);
+}
+
+// gm_param_parse() doesn't know how many params there's room for, so count the
+// fields first. They're decoded after they are split, so that an encoded "&" or
+// "=" doesn't split them.
+static int
+from_form(batch_t * b)
+{
+  int		count = 1;
+
+  for ( const char * s = b->body; *s; s++ ) {
+    if ( *s == '&' )
+      count++;
+  }
+  if ( count > MAX_SETTINGS || gm_param_parse(b->body, b->params, count) != 0 )
+    return -1;
+  for ( int i = 0; i < count; i++ ) {
+    if ( form_decode(b->params[i].name) != 0 || form_decode(b->params[i].value) != 0 )
+      return -1;
+  }
+  return count;
+}
+
+static void
+reply_json(const char * pattern, const char * name)
+{
+  char	buffer[128];
+  int	length;
+
+  gm_web_context()->writer.content_type = "application/json";
+  length = snprintf(buffer, sizeof(buffer), pattern, name ? name : "");
+  gm_web_send_to_client(buffer, length);
+  gm_web_finish(0, 0);
+}
+
+static int
+settings_post(httpd_req_t * req, const gm_uri * uri)
+{
+  batch_t *		b;
+  char			content_type[64] = "";
+  bool			json;
+  int			length;
+  int			count;
+  size_t		failed = 0;
+  gm_nonvolatile_result_t result;
+
+  if ( (b = calloc(1, sizeof(*b))) == NULL )
+    return -1;
+
+  httpd_req_get_hdr_value_str(req, "Content-Type", content_type, sizeof(content_type));
+  json = strncmp(content_type, "application/json", 16) == 0;
+
+  if ( (length = receive(req, b->body, sizeof(b->body))) < 0 ) {
+    free(b);
+    return -1;
+  }
+
+  if ( json )
+    count = from_json(b, length);
+  else
+    count = from_form(b);
+
+  if ( count <= 0 ) {
+    if ( json )
+      reply_json(count == -2 ? "{\"error\":\"not a parameter\"}\n" : "{\"error\":\"malformed\"}\n", NULL);
+    free(b);
+    return json ? 0 : -1;
+  }
+
+  result = gm_nonvolatile_set_batch(b->params, count, &failed);
+
+  if ( json ) {
+    switch ( result ) {
+    case GM_NORMAL:
+      reply_json("{\"result\":\"ok\"}\n", NULL);
+      break;
+    case GM_INVALID:
+      reply_json("{\"error\":\"invalid\",\"name\":\"%s\"}\n", b->params[failed].name);
+      break;
+    case GM_NOT_IN_PARAMETER_TABLE:
+      reply_json("{\"error\":\"not a parameter\"}\n", NULL);
+      break;
+    default:
+      reply_json("{\"error\":\"not set\"}\n", NULL);
+      break;
+    }
+    free(b);
+    return 0;
+  }
+
+  boilerplate("Settings")
+
+  switch ( result ) {
+  case GM_NORMAL:
+    text("%d values were set.", count);
+    break;
+  case GM_NOT_IN_PARAMETER_TABLE:
+    text("%s is not in the non-volatile parameter table. Nothing was set.", b->params[failed].name);
+    break;
+  case GM_INVALID:
+    text("That isn't a valid value for %s. Nothing was set.", b->params[failed].name);
+    break;
+  default:
+    text("Non-volatile memory error, not set.");
+    break;
+  }
+
+  ul
+    li
+      a
+      attr("href", "/");
+        text("Front page.");
+      end
+    end
+    li
+      a
+      attr("href", "/settings");
+        text("Settings.");
+      end
+    end
+  end
+
+  end_boilerplate
+
+  free(b);
+  return 0;
+}
+
+CONSTRUCTOR install(void)
+{
+  static gm_web_handler_t handler = {
+    .name = "settings",
+    .handler = settings_post,
+    // Setting parameters may run their after-set functions.
+    .asynchronous = true
+  };
+
+  gm_web_handler_register(&handler, POST);
+}